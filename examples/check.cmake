@@ -0,0 +1,89 @@
+# Run an example with eclang and compare what it prints, on stdout and
+# stderr together, and its exit status with the file of expected output.
+#
+#   cmake -DECLANG=path/to/eclang -DSCRIPT=example.ec -DEXPECTED=file
+#         [-DARGS=option;...] [-DCACHE=dir]
+#         [-DWORK=dir [-DSETUP=option;...] [-DRUN=file]
+#         [-DCC=compiler -DINCLUDE=dir -DRUNTIME=library [-DCFLAGS="flag ..."]]]
+#         -P check.cmake
+#
+# CACHE is emptied and made $XDG_CACHE_HOME, so eclang caches bytecode there
+# rather than in the user's cache. With WORK, the script is copied into that
+# directory and run from there, so what eclang writes beside it stays out of
+# the source tree. SETUP runs eclang on the copy first, which has to
+# succeed, and RUN is what the checked run runs in place of the script. With
+# CC, eclang --emit-c writes the script as C there, CC builds that against
+# the runtime, and the checked run runs the program it built.
+
+if(DEFINED CACHE)
+  file(REMOVE_RECURSE ${CACHE})
+  file(MAKE_DIRECTORY ${CACHE})
+  set(ENV{XDG_CACHE_HOME} ${CACHE})
+endif()
+
+set(directory .)
+if(DEFINED WORK)
+  file(REMOVE_RECURSE ${WORK})
+  file(MAKE_DIRECTORY ${WORK})
+  file(COPY ${SCRIPT} DESTINATION ${WORK})
+  get_filename_component(SCRIPT ${SCRIPT} NAME)
+  set(directory ${WORK})
+
+  if(DEFINED SETUP)
+    execute_process(
+      COMMAND ${ECLANG} ${SETUP} ${SCRIPT}
+      WORKING_DIRECTORY ${directory}
+      OUTPUT_VARIABLE output
+      ERROR_VARIABLE output
+      RESULT_VARIABLE status)
+    if(NOT status EQUAL 0)
+      message(FATAL_ERROR "Setting up with ${SETUP} failed:\n${output}")
+    endif()
+  endif()
+endif()
+
+if(DEFINED CC)
+  separate_arguments(CFLAGS)
+  execute_process(
+    COMMAND ${ECLANG} --emit-c ${ARGS} ${SCRIPT}
+    WORKING_DIRECTORY ${directory}
+    OUTPUT_FILE ${directory}/program.c
+    ERROR_VARIABLE output
+    RESULT_VARIABLE status)
+  if(NOT status EQUAL 0)
+    message(FATAL_ERROR "Emitting C for ${SCRIPT} failed:\n${output}")
+  endif()
+
+  execute_process(
+    COMMAND ${CC} -I${INCLUDE} program.c ${RUNTIME} ${CFLAGS} -o program
+    WORKING_DIRECTORY ${directory}
+    OUTPUT_VARIABLE output
+    ERROR_VARIABLE output
+    RESULT_VARIABLE status)
+  if(NOT status EQUAL 0)
+    message(FATAL_ERROR "Building the C for ${SCRIPT} failed:\n${output}")
+  endif()
+
+  set(RUN ${directory}/program)
+  set(command ${RUN})
+endif()
+
+if(NOT DEFINED RUN)
+  set(RUN ${SCRIPT})
+endif()
+if(NOT DEFINED command)
+  set(command ${ECLANG} ${ARGS} ${RUN})
+endif()
+
+execute_process(
+  COMMAND ${command}
+  WORKING_DIRECTORY ${directory}
+  OUTPUT_VARIABLE output
+  ERROR_VARIABLE output
+  RESULT_VARIABLE status)
+set(output "${output}exit ${status}\n")
+
+file(READ ${EXPECTED} expected)
+if(NOT output STREQUAL expected)
+  message(FATAL_ERROR "${RUN} printed\n${output}\nbut was expected to print\n${expected}")
+endif()
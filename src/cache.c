@@ -0,0 +1,417 @@
+#include "cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "compiler.h"
+#include "file.h"
+#include "memory.h"
+#include "vm.h"
+
+// A bytecode file is a header followed by a body. The header holds the
+// magic bytes, BYTECODE_VERSION, the last opcode, the compiler options, a
+// hash of the source and a checksum of the body. The body lists the global
+// names by slot, then the script's function with the functions it creates
+// nested inside it as constants. Numbers are little-endian throughout.
+//
+// Bump the version whenever this layout or the meaning of any instruction
+// changes; the last opcode only catches instructions being added.
+#define BYTECODE_VERSION 2
+#define NO_NAME 0xffffffffu
+
+static const uint8_t magic[4] = {'E', 'C', 'C', '\n'};
+
+typedef enum {
+  CONSTANT_NIL,
+  CONSTANT_FALSE,
+  CONSTANT_TRUE,
+  CONSTANT_NUMBER,
+  CONSTANT_STRING,
+  CONSTANT_FUNCTION,
+} ConstantTag;
+
+static uint64_t hashSource(const char* source) {
+  return hashBytes(HASH_START, (const uint8_t*)source, strlen(source));
+}
+
+typedef struct {
+  uint8_t* bytes;
+  size_t count;
+  size_t capacity;
+  bool failed;  // Something in the graph has no encoding.
+} Writer;
+
+static void writeBytes(Writer* writer, const void* bytes, size_t length) {
+  if (writer->capacity < writer->count + length) {
+    while (writer->capacity < writer->count + length) {
+      writer->capacity = writer->capacity < 256 ? 256 : writer->capacity * 2;
+    }
+    writer->bytes = realloc(writer->bytes, writer->capacity);
+    if (writer->bytes == NULL) exit(1);
+  }
+  memcpy(writer->bytes + writer->count, bytes, length);
+  writer->count += length;
+}
+
+static void writeU8(Writer* writer, uint8_t value) {
+  writeBytes(writer, &value, 1);
+}
+
+static void writeU32(Writer* writer, uint32_t value) {
+  uint8_t bytes[4];
+  for (int i = 0; i < 4; i++) bytes[i] = (value >> (i * 8)) & 0xff;
+  writeBytes(writer, bytes, 4);
+}
+
+static void writeU64(Writer* writer, uint64_t value) {
+  writeU32(writer, (uint32_t)value);
+  writeU32(writer, (uint32_t)(value >> 32));
+}
+
+static void writeString(Writer* writer, ObjString* string) {
+  if (string == NULL) {
+    writeU32(writer, NO_NAME);
+    return;
+  }
+  writeU32(writer, (uint32_t)string->length);
+  writeBytes(writer, string->chars, string->length);
+}
+
+static void writeFunction(Writer* writer, ObjFunction* function);
+
+static void writeConstant(Writer* writer, Value value) {
+  if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    writeU8(writer, CONSTANT_NUMBER);
+    writeU64(writer, bits);
+  } else if (IS_NIL(value)) {
+    writeU8(writer, CONSTANT_NIL);
+  } else if (IS_BOOL(value)) {
+    writeU8(writer, AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE);
+  } else if (IS_STRING(value)) {
+    writeU8(writer, CONSTANT_STRING);
+    writeString(writer, AS_STRING(value));
+  } else if (IS_OBJ(value) && OBJ_TYPE(value) == OBJ_FUNCTION) {
+    writeU8(writer, CONSTANT_FUNCTION);
+    writeFunction(writer, AS_FUNCTION(value));
+  } else {
+    writer->failed = true;
+  }
+}
+
+static void writeFunction(Writer* writer, ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  writeString(writer, function->name);
+  writeU32(writer, (uint32_t)function->arity);
+  writeU32(writer, (uint32_t)function->upvalueCount);
+  writeU32(writer, (uint32_t)function->maxSlots);
+
+  writeU32(writer, (uint32_t)chunk->count);
+  writeBytes(writer, chunk->code, chunk->count);
+  writeU32(writer, (uint32_t)chunk->lineCount);
+  for (int i = 0; i < chunk->lineCount; i++) {
+    writeU32(writer, (uint32_t)chunk->lines[i].offset);
+    writeU32(writer, (uint32_t)chunk->lines[i].location);
+  }
+
+  writeU32(writer, (uint32_t)chunk->inlineCount);
+  for (int i = 0; i < chunk->inlineCount; i++) {
+    InlineFrame* frame = &chunk->inlines[i];
+    writeU32(writer, (uint32_t)frame->line);
+    writeString(writer, frame->name);
+    writeU32(writer, (uint32_t)frame->caller);
+  }
+
+  writeU32(writer, (uint32_t)chunk->constants.count);
+  for (int i = 0; i < chunk->constants.count; i++) {
+    writeConstant(writer, chunk->constants.values[i]);
+  }
+}
+
+bool writeBytecode(ObjFunction* function, const char* source,
+                   const char* path) {
+  Writer body = {NULL, 0, 0, false};
+  writeU32(&body, (uint32_t)vm.globalNames.count);
+  for (int i = 0; i < vm.globalNames.count; i++) {
+    writeString(&body, AS_STRING(vm.globalNames.values[i]));
+  }
+  writeFunction(&body, function);
+
+  Writer header = {NULL, 0, 0, false};
+  writeBytes(&header, magic, sizeof(magic));
+  writeU32(&header, BYTECODE_VERSION);
+  writeU32(&header, OP_CALL_NATIVE);
+  writeU8(&header, (uint8_t)compilerOptions.optimizationLevel);
+  writeU8(&header, compilerOptions.registerOps);
+  writeU8(&header, compilerOptions.inlining);
+  writeU8(&header, 0);
+  writeU64(&header, hashSource(source));
+  writeU64(&header, hashBytes(HASH_START, body.bytes, body.count));
+  writeBytes(&header, body.bytes, body.count);
+
+  bool written = !body.failed &&
+                 writeFile(path, header.bytes, header.count);
+  free(header.bytes);
+  free(body.bytes);
+  return written;
+}
+
+typedef struct {
+  const uint8_t* bytes;
+  size_t length;
+  size_t position;
+  bool failed;  // Ran off the end or found something malformed.
+} Reader;
+
+static const uint8_t* readBytes(Reader* reader, size_t length) {
+  if (reader->failed || reader->length - reader->position < length) {
+    reader->failed = true;
+    return NULL;
+  }
+  const uint8_t* bytes = reader->bytes + reader->position;
+  reader->position += length;
+  return bytes;
+}
+
+static uint8_t readU8(Reader* reader) {
+  const uint8_t* bytes = readBytes(reader, 1);
+  return bytes == NULL ? 0 : bytes[0];
+}
+
+static uint32_t u32At(const uint8_t* bytes) {
+  return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) |
+         ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static uint32_t readU32(Reader* reader) {
+  const uint8_t* bytes = readBytes(reader, 4);
+  return bytes == NULL ? 0 : u32At(bytes);
+}
+
+static uint64_t readU64(Reader* reader) {
+  uint64_t low = readU32(reader);
+  return low | ((uint64_t)readU32(reader) << 32);
+}
+
+// A count that must fit in an int and in what is left of the file
+static int readCount(Reader* reader, size_t unit) {
+  uint32_t count = readU32(reader);
+  if (count > INT32_MAX ||
+      (size_t)count * unit > reader->length - reader->position) {
+    reader->failed = true;
+    return 0;
+  }
+  return (int)count;
+}
+
+static ObjString* readString(Reader* reader) {
+  uint32_t length = readU32(reader);
+  if (length == NO_NAME || length > INT32_MAX) return NULL;
+  const uint8_t* chars = readBytes(reader, length);
+  if (chars == NULL) return NULL;
+  return copyString((const char*)chars, (int)length);
+}
+
+static ObjFunction* readFunction(Reader* reader);
+
+static Value readConstant(Reader* reader) {
+  switch (readU8(reader)) {
+    case CONSTANT_NIL:
+      return NIL_VAL;
+    case CONSTANT_FALSE:
+      return FALSE_VAL;
+    case CONSTANT_TRUE:
+      return TRUE_VAL;
+    case CONSTANT_NUMBER: {
+      uint64_t bits = readU64(reader);
+      double number;
+      memcpy(&number, &bits, sizeof(number));
+      return NUMBER_VAL(number);
+    }
+    case CONSTANT_STRING: {
+      ObjString* string = readString(reader);
+      if (string == NULL) reader->failed = true;
+      return string == NULL ? NIL_VAL : OBJ_VAL(string);
+    }
+    case CONSTANT_FUNCTION: {
+      ObjFunction* function = readFunction(reader);
+      return function == NULL ? NIL_VAL : OBJ_VAL(function);
+    }
+    default:
+      reader->failed = true;
+      return NIL_VAL;
+  }
+}
+
+// Each function stays on the VM stack while it is filled in, so the objects
+// it refers to are reachable from it.
+static ObjFunction* readFunction(Reader* reader) {
+  ObjFunction* function = newFunction();
+  push(OBJ_VAL(function));
+  Chunk* chunk = &function->chunk;
+  function->name = readString(reader);
+  function->arity = (int)readU32(reader);
+  function->upvalueCount = (int)readU32(reader);
+  function->maxSlots = (int)readU32(reader);
+
+  int count = readCount(reader, 1);
+  const uint8_t* code = readBytes(reader, count);
+  int lineCount = readCount(reader, 8);
+  const uint8_t* lines = readBytes(reader, (size_t)lineCount * 8);
+  if (code != NULL && lines != NULL) {
+    // writeChunk() rebuilds the same runs, unless they were malformed.
+    int run = 0;
+    for (int i = 0; i < count; i++) {
+      if (run + 1 < lineCount && (int)u32At(&lines[(run + 1) * 8]) == i) run++;
+      writeChunk(chunk, code[i], (int)u32At(&lines[run * 8 + 4]));
+    }
+    if (chunk->lineCount != lineCount ||
+        (lineCount > 0 && u32At(lines) != 0)) {
+      reader->failed = true;
+    }
+  }
+
+  int inlineCount = readCount(reader, 12);
+  for (int i = 0; i < inlineCount && !reader->failed; i++) {
+    int line = (int)readU32(reader);
+    ObjString* name = readString(reader);
+    int caller = (int)readU32(reader);
+    if (name == NULL) reader->failed = true;
+    if (reader->failed) break;
+    addInlineFrame(chunk, line, name, caller);
+  }
+
+  int constantCount = readCount(reader, 1);
+  for (int i = 0; i < constantCount && !reader->failed; i++) {
+    Value constant = readConstant(reader);
+    if (!reader->failed) addConstant(chunk, constant);
+  }
+
+  pop();
+  return reader->failed ? NULL : function;
+}
+
+// Read the whole file, or return NULL if it cannot be read
+static uint8_t* readWholeFile(const char* path, size_t* length) {
+  // A directory opens, but its size is nothing to allocate.
+  struct stat info;
+  if (stat(path, &info) != 0 || !S_ISREG(info.st_mode)) return NULL;
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) return NULL;
+
+  uint8_t* bytes = NULL;
+  long size = -1;
+  if (fseek(file, 0L, SEEK_END) == 0) size = ftell(file);
+  if (size >= 0 && fseek(file, 0L, SEEK_SET) == 0) {
+    bytes = malloc(size > 0 ? (size_t)size : 1);
+    if (bytes == NULL) exit(1);
+    if (fread(bytes, 1, (size_t)size, file) != (size_t)size) {
+      free(bytes);
+      bytes = NULL;
+    }
+  }
+  fclose(file);
+  *length = (size_t)size;
+  return bytes;
+}
+
+// Check the header, leaving the reader at the start of the body
+static bool readHeader(Reader* reader, const char* source) {
+  const uint8_t* bytes = readBytes(reader, sizeof(magic));
+  if (bytes == NULL || memcmp(bytes, magic, sizeof(magic)) != 0) return false;
+  if (readU32(reader) != BYTECODE_VERSION) return false;
+  if (readU32(reader) != OP_CALL_NATIVE) return false;
+
+  int optimizationLevel = readU8(reader);
+  bool registerOps = readU8(reader) != 0;
+  bool inlining = readU8(reader) != 0;
+  readU8(reader);
+  uint64_t sourceHash = readU64(reader);
+  uint64_t checksum = readU64(reader);
+  if (reader->failed) return false;
+
+  // Code with calls inlined is wrong wherever inlining is turned off, as
+  // other code can rebind the globals it called through.
+  if (inlining && !compilerOptions.inlining) return false;
+  if (source != NULL &&
+      (sourceHash != hashSource(source) ||
+       optimizationLevel != compilerOptions.optimizationLevel ||
+       registerOps != compilerOptions.registerOps ||
+       inlining != compilerOptions.inlining)) {
+    return false;
+  }
+  return checksum == hashBytes(HASH_START,
+                               reader->bytes + reader->position,
+                               reader->length - reader->position);
+}
+
+ObjFunction* readBytecode(const char* path, const char* source) {
+  size_t length;
+  uint8_t* bytes = readWholeFile(path, &length);
+  if (bytes == NULL) return NULL;
+
+  Reader reader = {bytes, length, 0, false};
+  ObjFunction* function = NULL;
+  Value* stackTop = vm.stackTop;
+  if (readHeader(&reader, source)) {
+    // The code refers to globals by slot, so each must land where it was
+    // when the file was written.
+    int globalCount = readCount(&reader, 4);
+    for (int i = 0; i < globalCount && !reader.failed; i++) {
+      ObjString* name = readString(&reader);
+      if (name == NULL || globalSlot(name) != i) reader.failed = true;
+    }
+    if (!reader.failed) function = readFunction(&reader);
+    if (reader.position != reader.length) function = NULL;
+  }
+
+  vm.stackTop = stackTop;
+  free(bytes);
+  return function;
+}
+
+// Make the directory at path unless it is there already
+static bool makeDirectory(const char* path) {
+  return mkdir(path, 0700) == 0 || errno == EEXIST;
+}
+
+char* cachePath(const char* source) {
+  // A relative $XDG_CACHE_HOME is to be ignored, like an unset one.
+  const char* base = getenv("XDG_CACHE_HOME");
+  const char* cache = "";
+  if (base == NULL || base[0] != '/') {
+    base = getenv("HOME");
+    cache = "/.cache";
+    if (base == NULL || base[0] == '\0') return NULL;
+  }
+
+  size_t length = strlen(base) + strlen(cache) + 64;
+  char* path = malloc(length);
+  if (path == NULL) exit(1);
+  snprintf(path, length, "%s%s", base, cache);
+  bool made = makeDirectory(path);
+  snprintf(path, length, "%s%s/eclang", base, cache);
+  if (!made || !makeDirectory(path)) {
+    free(path);
+    return NULL;
+  }
+
+  snprintf(path, length, "%s%s/eclang/%016llx.ecc", base, cache,
+           (unsigned long long)hashSource(source));
+  return path;
+}
+
+bool isBytecodeFile(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) return false;
+  uint8_t bytes[sizeof(magic)];
+  bool matches = fread(bytes, 1, sizeof(magic), file) == sizeof(magic) &&
+                 memcmp(bytes, magic, sizeof(magic)) == 0;
+  fclose(file);
+  return matches;
+}
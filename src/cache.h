@@ -0,0 +1,28 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include "object.h"
+
+// Write a compiled script, and every function nested in it, to path as a
+// bytecode file, along with the global slots its code refers to. source is
+// what it was compiled from, which the file records a hash of. Returns false
+// if the file could not be written.
+bool writeBytecode(ObjFunction* function, const char* source,
+                   const char* path);
+
+// Load a script from a bytecode file written by writeBytecode(). When
+// source is not NULL, the file is only used if it was compiled from that
+// source with the current compiler options. Returns NULL if the file is
+// missing, stale or damaged, or was written by a different build.
+ObjFunction* readBytecode(const char* path, const char* source);
+
+// Where the bytecode compiled from source is cached: a file named for a hash
+// of the source in $XDG_CACHE_HOME/eclang, or ~/.cache/eclang, which is made
+// if need be. Returns NULL if there is no such directory and it cannot be
+// made; the caller frees the path.
+char* cachePath(const char* source);
+
+// Whether the file at path is a bytecode file rather than source.
+bool isBytecodeFile(const char* path);
+
+#endif
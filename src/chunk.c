@@ -1,5 +1,9 @@
+#include <stdlib.h>
+#include <string.h>
+
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "vm.h"
 
 // Initialize a new Chunk
@@ -8,17 +12,23 @@ void initChunk(Chunk* chunk) {
     chunk->capacity = 0;
     chunk->code = NULL;
     chunk->lines = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
     initValueArray(&chunk->constants);  // Initialize the value array for constants
+    chunk->inlines = NULL;
+    chunk->inlineCount = 0;
+    chunk->inlineCapacity = 0;
 }
 
 // Free the resources used by a Chunk
 void freeChunk(Chunk* chunk) {
     // Release memory allocated to code and lines
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY(LineRun, chunk->lines, chunk->lineCapacity);
 
     // Clean up the constants value array
     freeValueArray(&chunk->constants);
+    FREE_ARRAY(InlineFrame, chunk->inlines, chunk->inlineCapacity);
 
     // Re-initialize the chunk to a clean state
     initChunk(chunk);
@@ -31,15 +41,64 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = INCREASE_CAPACITY(oldCapacity);
         chunk->code = INCREASE_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = INCREASE_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
     }
 
-    // Store the byte and corresponding line number
+    // Store the byte, and start a new run if its line differs from the last
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
+    if (chunk->lineCount == 0 ||
+        chunk->lines[chunk->lineCount - 1].location != line) {
+        if (chunk->lineCapacity < chunk->lineCount + 1) {
+            int oldCapacity = chunk->lineCapacity;
+            chunk->lineCapacity = INCREASE_CAPACITY(oldCapacity);
+            chunk->lines = INCREASE_ARRAY(LineRun, chunk->lines, oldCapacity,
+                                          chunk->lineCapacity);
+        }
+        LineRun* run = &chunk->lines[chunk->lineCount++];
+        run->offset = chunk->count;
+        run->location = line;
+    }
     chunk->count++;
 }
 
+// Drop the chunk's code and lines, keeping its constants and inline frames,
+// so that it can be written again from the start
+void resetCode(Chunk* chunk) {
+    chunk->count = 0;
+    chunk->lineCount = 0;
+}
+
+// Return the location of the byte at offset
+int locationAt(Chunk* chunk, int offset) {
+    // The last run starting at or before offset.
+    int low = 0;
+    int high = chunk->lineCount - 1;
+    while (low < high) {
+        int middle = (low + high + 1) / 2;
+        if (chunk->lines[middle].offset <= offset) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return chunk->lines[low].location;
+}
+
+// Return the location of every byte of code, for passes that rewrite the
+// chunk and carry each byte's location along. The caller frees the array.
+int* chunkLocations(Chunk* chunk) {
+    int* locations = malloc(sizeof(int) * (chunk->count + 1));
+    if (locations == NULL) exit(1);
+    int run = 0;
+    for (int offset = 0; offset < chunk->count; offset++) {
+        if (run + 1 < chunk->lineCount &&
+            chunk->lines[run + 1].offset == offset) {
+            run++;
+        }
+        locations[offset] = chunk->lines[run].location;
+    }
+    return locations;
+}
+
 // Add a new constant to the Chunk
 int addConstant(Chunk* chunk, Value value) {
     // Temporarily store the value on the stack
@@ -52,3 +111,361 @@ int addConstant(Chunk* chunk, Value value) {
     // Return the index of the new constant
     return chunk->constants.count - 1;
 }
+
+// Add a frame for a line of an action inlined at caller, and return the
+// location that refers to it
+int addInlineFrame(Chunk* chunk, int line, ObjString* name, int caller) {
+    if (chunk->inlineCapacity < chunk->inlineCount + 1) {
+        // The name is only reachable from here once it is stored.
+        push(OBJ_VAL(name));
+        int oldCapacity = chunk->inlineCapacity;
+        chunk->inlineCapacity = INCREASE_CAPACITY(oldCapacity);
+        chunk->inlines = INCREASE_ARRAY(InlineFrame, chunk->inlines,
+                                        oldCapacity, chunk->inlineCapacity);
+        pop();
+    }
+
+    InlineFrame* frame = &chunk->inlines[chunk->inlineCount++];
+    frame->line = line;
+    frame->name = name;
+    frame->caller = caller;
+    return -chunk->inlineCount;
+}
+
+// The source line a location points at, inside whatever was inlined there
+int sourceLine(Chunk* chunk, int location) {
+    return location < 0 ? chunk->inlines[-1 - location].line : location;
+}
+
+// Return the size in bytes of the instruction at offset, operands included
+int instructionLength(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_ENCLOSING:
+        case OP_SET_ENCLOSING:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_METHOD:
+        case OP_CALL_NATIVE:
+            return 2;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_CONSTANT_LONG:
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_GET_UPVALUE_LONG:
+        case OP_SET_UPVALUE_LONG:
+        case OP_MOVE:
+        case OP_LOADK:
+        case OP_ADD_RR:
+        case OP_ADD_RK:
+        case OP_SUBTRACT_RR:
+        case OP_SUBTRACT_RK:
+        case OP_MULTIPLY_RR:
+        case OP_MULTIPLY_RK:
+        case OP_DIVIDE_RR:
+        case OP_DIVIDE_RK:
+        case OP_GREATER_RR:
+        case OP_GREATER_RK:
+        case OP_LESS_RR:
+        case OP_LESS_RK:
+            return 3;
+        case OP_ADD_RRR:
+        case OP_ADD_RRK:
+        case OP_SUBTRACT_RRR:
+        case OP_SUBTRACT_RRK:
+        case OP_MULTIPLY_RRR:
+        case OP_MULTIPLY_RRK:
+        case OP_DIVIDE_RRR:
+        case OP_DIVIDE_RRK:
+            return 4;
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_LOOP_LONG:
+            return 5;
+        case OP_CLOSURE: {
+            // The function constant is followed by an (isLocal, index) pair
+            // for each upvalue it captures.
+            ObjFunction* function =
+                AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + function->upvalueCount * 2;
+        }
+        case OP_CLOSURE_LONG: {
+            int constant = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+            return 3 + function->upvalueCount * 3;
+        }
+        default:
+            return 1;
+    }
+}
+
+// Return how many values the instruction at offset leaves on the stack,
+// relative to what it found there
+int stackEffect(Chunk* chunk, int offset) {
+    uint8_t* code = &chunk->code[offset];
+    switch (code[0]) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_GET_ENCLOSING:
+        case OP_CLOSURE:
+        case OP_CONSTANT_LONG:
+        case OP_GET_LOCAL_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_GET_UPVALUE_LONG:
+        case OP_CLOSURE_LONG:
+        case OP_ADD_RR:
+        case OP_ADD_RK:
+        case OP_SUBTRACT_RR:
+        case OP_SUBTRACT_RK:
+        case OP_MULTIPLY_RR:
+        case OP_MULTIPLY_RK:
+        case OP_DIVIDE_RR:
+        case OP_DIVIDE_RK:
+        case OP_GREATER_RR:
+        case OP_GREATER_RK:
+        case OP_LESS_RR:
+        case OP_LESS_RK:
+            return 1;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_DEFINE_GLOBAL_LONG:
+            return -1;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_NATIVE:
+            return -code[1];
+        default:
+            return 0;
+    }
+}
+
+// Return the stack depth before each instruction, walked the way the
+// compiler's stackSize() does from depth at the start. The caller frees the
+// array, which has an entry for the end of the code as well.
+int* stackDepths(Chunk* chunk, int depth) {
+    int* depths = malloc(sizeof(int) * (chunk->count + 1));
+    if (depths == NULL) exit(1);
+    for (int i = 0; i <= chunk->count; i++) depths[i] = -1;
+
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        if (depths[offset] >= 0) depth = depths[offset];
+        depths[offset] = depth;
+        depth += stackEffect(chunk, offset);
+
+        uint8_t op = chunk->code[offset];
+        if (op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_LONG ||
+            op == OP_JUMP_IF_FALSE_LONG) {
+            int target = jumpTarget(chunk, offset);
+            if (target <= chunk->count) depths[target] = depth;
+        }
+    }
+    return depths;
+}
+
+// Whether the instruction is one of the wide forms
+bool isWide(uint8_t instruction) {
+    return instruction >= OP_CONSTANT_LONG && instruction <= OP_CLOSURE_LONG;
+}
+
+// The constant, slot, global or upvalue an instruction names, read from
+// however many bytes its form gives it
+int indexOperand(uint8_t* code) {
+    return isWide(code[0]) ? (code[1] << 8) | code[2] : code[1];
+}
+
+// Return the offset the jump or loop at offset lands on
+int jumpTarget(Chunk* chunk, int offset) {
+    uint8_t* code = &chunk->code[offset];
+    switch (code[0]) {
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_LOOP_LONG: {
+            int distance = (int)(((uint32_t)code[1] << 24) | (code[2] << 16) |
+                                 (code[3] << 8) | code[4]);
+            return code[0] == OP_LOOP_LONG ? offset + 5 - distance
+                                           : offset + 5 + distance;
+        }
+        default: {
+            int distance = (code[1] << 8) | code[2];
+            return code[0] == OP_LOOP ? offset + 3 - distance
+                                      : offset + 3 + distance;
+        }
+    }
+}
+
+// Return the index of a constant equal to value, or -1 if there is none.
+// Numbers are compared bit for bit so that 0 and -0 stay apart.
+int findConstant(Chunk* chunk, Value value) {
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value constant = chunk->constants.values[i];
+        if (IS_NUMBER(constant) && IS_NUMBER(value)) {
+            double x = AS_NUMBER(constant);
+            double y = AS_NUMBER(value);
+            if (memcmp(&x, &y, sizeof(double)) == 0) return i;
+        } else if (!IS_NUMBER(constant) && !IS_NUMBER(value) &&
+                   valuesEqual(constant, value)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Whether the instruction is a jump or loop, of either width
+bool isJump(uint8_t instruction) {
+    return instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE ||
+           instruction == OP_LOOP || instruction == OP_JUMP_LONG ||
+           instruction == OP_JUMP_IF_FALSE_LONG || instruction == OP_LOOP_LONG;
+}
+
+// Return the wide form of a jump or loop
+uint8_t wideJump(uint8_t instruction) {
+    switch (instruction) {
+        case OP_JUMP:
+            return OP_JUMP_LONG;
+        case OP_JUMP_IF_FALSE:
+            return OP_JUMP_IF_FALSE_LONG;
+        case OP_LOOP:
+            return OP_LOOP_LONG;
+        default:
+            return instruction;
+    }
+}
+
+// Return the short form of a jump or loop
+uint8_t narrowJump(uint8_t instruction) {
+    switch (instruction) {
+        case OP_JUMP_LONG:
+            return OP_JUMP;
+        case OP_JUMP_IF_FALSE_LONG:
+            return OP_JUMP_IF_FALSE;
+        case OP_LOOP_LONG:
+            return OP_LOOP;
+        default:
+            return instruction;
+    }
+}
+
+// Make the wide jump or loop at code land on target, an offset in the same
+// code, the way rewriteCode() takes it
+void setJumpTarget(uint8_t* code, int target) {
+    code[1] = (target >> 24) & 0xff;
+    code[2] = (target >> 16) & 0xff;
+    code[3] = (target >> 8) & 0xff;
+    code[4] = target & 0xff;
+}
+
+static int jumpTargetOf(const uint8_t* code) {
+    return (int)(((uint32_t)code[1] << 24) | (code[2] << 16) | (code[3] << 8) |
+                 code[4]);
+}
+
+// Replace the chunk's code with count bytes of new code, locations giving
+// the location of each. Every jump and loop in it is in its wide form and
+// holds the offset it lands on, set with setJumpTarget(), instead of a
+// distance. Jumps take their short form where the distance fits: narrowing
+// one only brings code closer together, so the others that fit keep
+// fitting, and going over the code until nothing changes finds them all.
+// When moved is not NULL, it has room for count + 1 entries and receives
+// where each instruction of the new code, and its end, ended up.
+void rewriteCode(Chunk* chunk, const uint8_t* code, const int* locations,
+                 int count, int* moved) {
+    // Instruction lengths are read from the new code, with the constants
+    // the chunk already has.
+    Chunk view = *chunk;
+    view.code = (uint8_t*)code;
+    view.count = count;
+
+    int* offsets = malloc(sizeof(int) * (count + 1));
+    bool* narrow = calloc(count + 1, sizeof(bool));
+    if (offsets == NULL || narrow == NULL) exit(1);
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        int at = 0;
+        for (int offset = 0; offset < count;
+             offset += instructionLength(&view, offset)) {
+            offsets[offset] = at;
+            at += narrow[offset] ? 3 : instructionLength(&view, offset);
+        }
+        offsets[count] = at;
+
+        for (int offset = 0; offset < count;
+             offset += instructionLength(&view, offset)) {
+            uint8_t op = code[offset];
+            if (narrow[offset] || !isJump(op)) continue;
+            int end = offsets[offset] + 3;
+            int target = offsets[jumpTargetOf(&code[offset])];
+            int distance = op == OP_LOOP_LONG ? end - target : target - end;
+            if (distance <= UINT16_MAX) narrow[offset] = changed = true;
+        }
+    }
+
+    resetCode(chunk);
+    for (int offset = 0; offset < count;) {
+        int length = instructionLength(&view, offset);
+        if (isJump(code[offset])) {
+            uint8_t op = narrow[offset] ? narrowJump(code[offset])
+                                        : code[offset];
+            int line = locations[offset];
+            int target = offsets[jumpTargetOf(&code[offset])];
+            int end = chunk->count + (isWide(op) ? 5 : 3);
+            int distance = op == OP_LOOP || op == OP_LOOP_LONG ? end - target
+                                                               : target - end;
+            writeChunk(chunk, op, line);
+            if (isWide(op)) {
+                writeChunk(chunk, (distance >> 24) & 0xff, line);
+                writeChunk(chunk, (distance >> 16) & 0xff, line);
+            }
+            writeChunk(chunk, (distance >> 8) & 0xff, line);
+            writeChunk(chunk, distance & 0xff, line);
+        } else {
+            for (int i = 0; i < length; i++) {
+                writeChunk(chunk, code[offset + i], locations[offset + i]);
+            }
+        }
+        offset += length;
+    }
+
+    if (moved != NULL) {
+        for (int offset = 0; offset < count;
+             offset += instructionLength(&view, offset)) {
+            moved[offset] = offsets[offset];
+        }
+        moved[count] = offsets[count];
+    }
+    free(offsets);
+    free(narrow);
+}
@@ -17,6 +17,10 @@ typedef enum {
   OP_SET_GLOBAL,
   OP_GET_UPVALUE,
   OP_SET_UPVALUE,
+  // A local of the frame below, for a closure that only its defining
+  // function calls directly.
+  OP_GET_ENCLOSING,
+  OP_SET_ENCLOSING,
   OP_GET_PROPERTY,
   OP_SET_PROPERTY,
   OP_GET_SUPER,
@@ -34,6 +38,7 @@ typedef enum {
   OP_JUMP_IF_FALSE,
   OP_LOOP,
   OP_CALL,
+  OP_TAIL_CALL,  // A call whose result the function returns.
   OP_INVOKE,
   OP_SUPER_INVOKE,
   OP_CLOSURE,
@@ -41,20 +46,109 @@ typedef enum {
   OP_RETURN,
 //  OP_CLASS,
   OP_INHERIT,
-  OP_METHOD
+  OP_METHOD,
+  // Wide forms, emitted only where an operand does not fit the short one.
+  // Their constant, slot and upvalue indexes take two bytes and their jump
+  // distances four, high byte first. OP_CLOSURE_LONG also widens the index
+  // of each capture, which follows its isLocal byte.
+  OP_CONSTANT_LONG,
+  OP_GET_LOCAL_LONG,
+  OP_SET_LOCAL_LONG,
+  OP_GET_GLOBAL_LONG,
+  OP_DEFINE_GLOBAL_LONG,
+  OP_SET_GLOBAL_LONG,
+  OP_GET_UPVALUE_LONG,
+  OP_SET_UPVALUE_LONG,
+  OP_JUMP_LONG,
+  OP_JUMP_IF_FALSE_LONG,
+  OP_LOOP_LONG,
+  OP_CLOSURE_LONG,
+  // Register forms, emitted only when compilerOptions.registerOps is set.
+  // R operands index the frame's slots and K operands its constants; the
+  // two-operand forms push their result, the three-address ones store it
+  // into the slot named by their first operand.
+  OP_MOVE,
+  OP_LOADK,
+  OP_ADD_RR,
+  OP_ADD_RK,
+  OP_SUBTRACT_RR,
+  OP_SUBTRACT_RK,
+  OP_MULTIPLY_RR,
+  OP_MULTIPLY_RK,
+  OP_DIVIDE_RR,
+  OP_DIVIDE_RK,
+  OP_GREATER_RR,
+  OP_GREATER_RK,
+  OP_LESS_RR,
+  OP_LESS_RK,
+  OP_ADD_RRR,
+  OP_ADD_RRK,
+  OP_SUBTRACT_RRR,
+  OP_SUBTRACT_RRK,
+  OP_MULTIPLY_RRR,
+  OP_MULTIPLY_RRK,
+  OP_DIVIDE_RRR,
+  OP_DIVIDE_RRK,
+  // Quickened forms. run() rewrites a generic instruction into one of these
+  // after seeing its operand types, and back again when the guard fails.
+  OP_ADD_NUM,
+  OP_ADD_STR,
+  OP_SUBTRACT_NUM,
+  OP_MULTIPLY_NUM,
+  OP_DIVIDE_NUM,
+  OP_GREATER_NUM,
+  OP_LESS_NUM,
+  OP_CALL_NATIVE,  // An OP_CALL whose callee was a native.
 } OpCode;
 
+// Where code copied in from an inlined action came from
+typedef struct {
+  int line;         // Line in the inlined action.
+  ObjString* name;  // Its name, for stack traces.
+  int caller;       // Location of the call it replaced.
+} InlineFrame;
+
+// The bytes from offset up to the next run's offset share one location:
+// their source line, or -1 - i for code inlined at inlines[i].
+typedef struct {
+  int offset;
+  int location;
+} LineRun;
+
 typedef struct {
   int count;
   int capacity;
   uint8_t* code;
-  int* lines;
+  LineRun* lines;  // Ascending by offset, a new run only where it changes.
+  int lineCount;
+  int lineCapacity;
   ValueArray constants;
+  InlineFrame* inlines;
+  int inlineCount;
+  int inlineCapacity;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
+void resetCode(Chunk* chunk);
+int locationAt(Chunk* chunk, int offset);
+int* chunkLocations(Chunk* chunk);
 int addConstant(Chunk* chunk, Value value);
+int addInlineFrame(Chunk* chunk, int line, ObjString* name, int caller);
+int sourceLine(Chunk* chunk, int location);
+int instructionLength(Chunk* chunk, int offset);
+int stackEffect(Chunk* chunk, int offset);
+int* stackDepths(Chunk* chunk, int depth);
+bool isWide(uint8_t instruction);
+int indexOperand(uint8_t* code);
+int jumpTarget(Chunk* chunk, int offset);
+int findConstant(Chunk* chunk, Value value);
+bool isJump(uint8_t instruction);
+uint8_t wideJump(uint8_t instruction);
+uint8_t narrowJump(uint8_t instruction);
+void setJumpTarget(uint8_t* code, int target);
+void rewriteCode(Chunk* chunk, const uint8_t* code, const int* locations,
+                 int count, int* moved);
 
 #endif
@@ -7,6 +7,18 @@
 
 #define NAN_BOXING
 
+// Dispatch run() through a table of label addresses where the compiler
+// supports it; define NO_COMPUTED_GOTO to force the portable switch.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// Compile hot functions to x86-64 machine code; define NO_JIT to keep
+// everything in the interpreter.
+#if defined(__x86_64__) && !defined(_WIN32) && !defined(NO_JIT)
+#define BASELINE_JIT
+#endif
+
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_TRACE_EXECUTION
 
@@ -14,5 +26,6 @@
 // #define DEBUG_LOG_GC
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
 
 #endif
@@ -4,13 +4,14 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "debug.h"
+#include "escape.h"
+#include "inliner.h"
+#include "ir.h"
 #include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
 
-#ifdef DEBUG_PRINT_CODE
-#include "debug.h"
-#endif
-
 typedef struct {
   Token current;
   Token previous;
@@ -47,7 +48,7 @@ typedef struct {
 } Local;
 
 typedef struct {
-  uint8_t index;
+  uint16_t index;
   bool isLocal;
 } Upvalue;
 
@@ -62,15 +63,28 @@ typedef struct Compiler {
   ObjFunction* function;
   FunctionType type;
 
-  Local locals[UINT8_COUNT];
+  Local* locals;
   int localCount;
-  Upvalue upvalues[UINT8_COUNT];
+  int localCapacity;
+  Upvalue* upvalues;  // As many as function->upvalueCount.
+  int upvalueCapacity;
   int scopeDepth;
+
+  int fusable[2];  // Starts of the last two instructions register forms may absorb.
+  int lastLabel;   // Highest offset that a jump or loop lands on.
+  int lastCall;    // Offset of the most recent OP_CALL, or -1.
+  int lastLoad;    // Offset of the most recent global or local read, or -1.
 } Compiler;
 
 
 Parser parser;
 Compiler* current = NULL;
+#ifdef DEBUG_PRINT_CODE
+CompilerOptions compilerOptions = {false, 1, true, true};
+#else
+CompilerOptions compilerOptions = {false, 1, true, false};
+#endif
+CallSites callSites;  // Calls the inliner may replace once parsing is done.
 
 // Get a pointer to the current Chunk in the parsing process
 static Chunk* currentChunk() { return &current->function->chunk; }
@@ -145,23 +159,130 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
   emitByte(byte2);
 }
 
+// Mark the current offset as a loop start and return it
+static int markLoopStart() {
+  current->lastLabel = currentChunk()->count;
+  return current->lastLabel;
+}
+
+// Remember that a fusable instruction is about to be emitted at the current offset
+static void noteFusable() {
+  current->fusable[0] = current->fusable[1];
+  current->fusable[1] = currentChunk()->count;
+}
+
+// Length in bytes of an instruction the register forms can absorb
+static int fusableLength(uint8_t instruction) {
+  switch (instruction) {
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_CONSTANT:
+      return 2;
+    case OP_ADD_RR:
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RR:
+    case OP_SUBTRACT_RK:
+    case OP_MULTIPLY_RR:
+    case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RR:
+    case OP_DIVIDE_RK:
+    case OP_GREATER_RR:
+    case OP_GREATER_RK:
+    case OP_LESS_RR:
+    case OP_LESS_RK:
+      return 3;
+    default:
+      return 0;
+  }
+}
+
+// Check that the last two noted instructions sit back to back at the end of
+// the chunk with no jump landing between them, and return their offsets
+static bool lastFusablePair(int* first, int* second) {
+  if (!compilerOptions.registerOps) return false;
+
+  Chunk* chunk = currentChunk();
+  int a = current->fusable[0];
+  int b = current->fusable[1];
+  if (a < 0 || b < 0 || a < current->lastLabel) return false;
+  if (a + fusableLength(chunk->code[a]) != b) return false;
+  if (b + fusableLength(chunk->code[b]) != chunk->count) return false;
+
+  *first = a;
+  *second = b;
+  return true;
+}
+
+// Replace the instructions from the given offset to the end of the chunk
+static void rewindTo(int offset) {
+  currentChunk()->count = offset;
+  current->fusable[0] = -1;
+  current->fusable[1] = -1;
+}
+
+// Emit the four bytes of a wide jump's distance
+static void emitDistance(int distance) {
+  emitByte((distance >> 24) & 0xff);
+  emitByte((distance >> 16) & 0xff);
+  emitByte((distance >> 8) & 0xff);
+  emitByte(distance & 0xff);
+}
+
 // Emit a loop bytecode instruction with the offset from the loop start
 static void emitLoop(int loopStart) {
-  emitByte(OP_LOOP);
-
-  int offset = currentChunk()->count - loopStart + 2;
-  if (offset > UINT16_MAX) error("Loop body too large.");
+  int offset = currentChunk()->count - loopStart + 3;
+  if (offset <= UINT16_MAX) {
+    emitByte(OP_LOOP);
+    emitByte((offset >> 8) & 0xff);
+    emitByte(offset & 0xff);
+    return;
+  }
 
-  emitByte((offset >> 8) & 0xff);
-  emitByte(offset & 0xff);
+  emitByte(OP_LOOP_LONG);
+  emitDistance(offset + 2);
 }
 
-// Emit a jump instruction and return the offset for later patching
+// Emit a jump instruction and return the offset for later patching. How far
+// it goes is not known yet, so it starts out in its wide form and
+// narrowJumps() shortens it once the function is done if it fits.
 static int emitJump(uint8_t instruction) {
-  emitByte(instruction);
-  emitByte(0xff);
-  emitByte(0xff);
-  return currentChunk()->count - 2;
+  emitByte(instruction == OP_JUMP ? OP_JUMP_LONG : OP_JUMP_IF_FALSE_LONG);
+  emitDistance(-1);
+  return currentChunk()->count - 4;
+}
+
+// The wide form of an instruction naming a constant, slot or upvalue
+static uint8_t wideForm(uint8_t instruction) {
+  switch (instruction) {
+    case OP_CONSTANT:
+      return OP_CONSTANT_LONG;
+    case OP_GET_LOCAL:
+      return OP_GET_LOCAL_LONG;
+    case OP_SET_LOCAL:
+      return OP_SET_LOCAL_LONG;
+    case OP_GET_GLOBAL:
+      return OP_GET_GLOBAL_LONG;
+    case OP_DEFINE_GLOBAL:
+      return OP_DEFINE_GLOBAL_LONG;
+    case OP_SET_GLOBAL:
+      return OP_SET_GLOBAL_LONG;
+    case OP_GET_UPVALUE:
+      return OP_GET_UPVALUE_LONG;
+    default:
+      return OP_SET_UPVALUE_LONG;
+  }
+}
+
+// Emit an instruction with its index operand, in the wide form only if the
+// index does not fit in a byte
+static void emitIndexed(uint8_t instruction, int index) {
+  if (index <= UINT8_MAX) {
+    emitBytes(instruction, (uint8_t)index);
+    return;
+  }
+
+  emitByte(wideForm(instruction));
+  emitBytes((index >> 8) & 0xff, index & 0xff);
 }
 
 // Emit bytecode instructions for returning a value from a function
@@ -178,31 +299,44 @@ static void emitReturn() {
 }
 
 // Create a constant in the current chunk and return its index
-static uint8_t makeConstant(Value value) {
+static int makeConstant(Value value) {
   int constant = addConstant(currentChunk(), value);
-  if (constant > UINT8_MAX) {
+  if (constant > UINT16_MAX) {
     error("Too many constants in one chunk.");
     return 0;
   }
 
-  return (uint8_t)constant;
+  return constant;
 }
 
 // Emit bytecode instructions for loading a constant onto the stack
 static void emitConstant(Value value) {
-  emitBytes(OP_CONSTANT, makeConstant(value));
+  int constant = makeConstant(value);
+  if (constant <= UINT8_MAX) noteFusable();
+  emitIndexed(OP_CONSTANT, constant);
 }
 
 // Patch a previously emitted jump instruction with the correct offset
 static void patchJump(int offset) {
-  // -2 to adjust for the bytecode for the jump offset itself.
-  int jump = currentChunk()->count - offset - 2;
-  if (jump > UINT16_MAX) {
-    error("Too much code to jump over.");
-  }
+  // -4 to adjust for the bytecode for the jump offset itself.
+  int jump = currentChunk()->count - offset - 4;
+  uint8_t* code = &currentChunk()->code[offset];
+  code[0] = (jump >> 24) & 0xff;
+  code[1] = (jump >> 16) & 0xff;
+  code[2] = (jump >> 8) & 0xff;
+  code[3] = jump & 0xff;
+  current->lastLabel = currentChunk()->count;
+}
 
-  currentChunk()->code[offset] = (jump >> 8) & 0xff;
-  currentChunk()->code[offset + 1] = jump & 0xff;
+// Make room for another local in the current compiler and return it
+static Local* pushLocal() {
+  if (current->localCapacity < current->localCount + 1) {
+    int oldCapacity = current->localCapacity;
+    current->localCapacity = INCREASE_CAPACITY(oldCapacity);
+    current->locals = INCREASE_ARRAY(Local, current->locals, oldCapacity,
+                                     current->localCapacity);
+  }
+  return &current->locals[current->localCount++];
 }
 
 // Initialize a new compiler with the given function type
@@ -211,8 +345,17 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
   compiler->enclosing = current;
   compiler->function = NULL;
   compiler->type = type;
+  compiler->locals = NULL;
   compiler->localCount = 0;
+  compiler->localCapacity = 0;
+  compiler->upvalues = NULL;
+  compiler->upvalueCapacity = 0;
   compiler->scopeDepth = 0;
+  compiler->fusable[0] = -1;
+  compiler->fusable[1] = -1;
+  compiler->lastLabel = 0;
+  compiler->lastCall = -1;
+  compiler->lastLoad = -1;
   compiler->function = newFunction();
   current = compiler;
 
@@ -223,7 +366,7 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
   }
 
   // Create and initialize the "this" local variable
-  Local* local = &current->locals[current->localCount++];
+  Local* local = pushLocal();
   local->depth = 0;
   local->isCaptured = false;
   if (type != TYPE_FUNCTION) {
@@ -235,26 +378,127 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
   }
 }
 
+// Find the deepest the function's stack window gets, counting the callee and
+// its arguments. Every jump but OP_LOOP goes forward, so walking the code in
+// order reaches each jump target after all the jumps that land on it.
+static int stackSize(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  int* targets = malloc(sizeof(int) * (chunk->count + 1));
+  if (targets == NULL) exit(1);
+  for (int i = 0; i <= chunk->count; i++) targets[i] = -1;
+
+  int depth = function->arity + 1;
+  int maxDepth = depth;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (targets[offset] >= 0) depth = targets[offset];
+    depth += stackEffect(chunk, offset);
+    if (depth > maxDepth) maxDepth = depth;
+
+    uint8_t op = chunk->code[offset];
+    if (op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_LONG ||
+        op == OP_JUMP_IF_FALSE_LONG) {
+      int target = jumpTarget(chunk, offset);
+      if (target <= chunk->count) targets[target] = depth;
+    }
+  }
+
+  free(targets);
+  return maxDepth;
+}
+
+// Give the function's jumps their short form where the distance fits,
+// moving its call sites along with its code
+static void narrowJumps(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  int* offsets = malloc(sizeof(int) * (chunk->count + 1));
+  uint8_t* code = malloc(sizeof(uint8_t) * (chunk->count * 2 + 1));
+  int* lines = malloc(sizeof(int) * (chunk->count * 2 + 1));
+  int* locations = chunkLocations(chunk);
+  if (offsets == NULL || code == NULL || lines == NULL) exit(1);
+
+  // rewriteCode() takes every jump wide, holding its target.
+  int count = 0;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    offsets[offset] = count;
+    if (isJump(chunk->code[offset])) {
+      code[count] = wideJump(chunk->code[offset]);
+      for (int i = 0; i < 5; i++) lines[count + i] = locations[offset];
+      count += 5;
+      continue;
+    }
+    for (int i = 0; i < instructionLength(chunk, offset); i++) {
+      lines[count] = locations[offset + i];
+      code[count++] = chunk->code[offset + i];
+    }
+  }
+  offsets[chunk->count] = count;
+
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (!isJump(chunk->code[offset])) continue;
+    setJumpTarget(&code[offsets[offset]], offsets[jumpTarget(chunk, offset)]);
+  }
+
+  int* moved = malloc(sizeof(int) * (count + 1));
+  if (moved == NULL) exit(1);
+  rewriteCode(chunk, code, lines, count, moved);
+
+  for (int i = 0; i < callSites.count; i++) {
+    CallSite* site = &callSites.sites[i];
+    if (site->caller != function) continue;
+    site->load = moved[offsets[site->load]];
+    site->call = moved[offsets[site->call]];
+  }
+  free(moved);
+  free(code);
+  free(lines);
+  free(locations);
+  free(offsets);
+}
+
 // Finalize the current compiler and emit the return bytecode
 static ObjFunction* endCompiler() {
   emitReturn();
   ObjFunction* function = current->function;
-
-#ifdef DEBUG_PRINT_CODE
-  // Print the bytecode if no errors occurred
-  if (!parser.hadError) {
-    char* displayName =
-        function->name != NULL ? function->name->chars : "<script>";
-    disassembleChunk(currentChunk(), displayName);
-  }
-#endif
-
+  // After an error the code is thrown away, and may not hang together.
+  if (!parser.hadError) narrowJumps(function);
+  FREE_ARRAY(Local, current->locals, current->localCapacity);
 
   // Set the current compiler to its enclosing one
   current = current->enclosing;
   return function;
 }
 
+// Optimize a parsed function and the ones nested in it, and size their
+// stack windows
+static void finishFunction(ObjFunction* function) {
+  ValueArray* constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    Value constant = constants->values[i];
+    if (IS_OBJ(constant) && OBJ_TYPE(constant) == OBJ_FUNCTION) {
+      finishFunction(AS_FUNCTION(constant));
+    }
+  }
+
+  if (compilerOptions.optimizationLevel >= 1) {
+    optimizeChunk(&function->chunk);
+    // The middle end lowers into plain stack code; tidy up after it.
+    if (compilerOptions.optimizationLevel >= 2 &&
+        optimizeFunction(function)) {
+      optimizeChunk(&function->chunk);
+    }
+  }
+  function->maxSlots = stackSize(function);
+
+  if (compilerOptions.printCode) {
+    char* displayName =
+        function->name != NULL ? function->name->chars : "<script>";
+    disassembleChunk(&function->chunk, displayName);
+  }
+}
+
 // Begin a new scope in the compiler
 static void beginScope() { current->scopeDepth++; }
 
@@ -282,10 +526,21 @@ static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
 
 // Helper function to create a constant for an identifier
-static uint8_t identifierConstant(Token* name) {
+static int identifierConstant(Token* name) {
   return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
+// Resolve a global variable to its slot in the VM's global array
+static int globalVariable(Token* name) {
+  int slot = globalSlot(copyString(name->start, name->length));
+  if (slot > UINT16_MAX) {
+    error("Too many global variables.");
+    return 0;
+  }
+
+  return slot;
+}
+
 // Check if two identifiers are equal
 static bool identifiersEqual(Token* a, Token* b) {
   if (a->length != b->length) return false;
@@ -308,7 +563,7 @@ static int resolveLocal(Compiler* compiler, Token* name) {
 }
 
 // Add an upvalue to the current compiler
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Compiler* compiler, int index, bool isLocal) {
   int upvalueCount = compiler->function->upvalueCount;
 
   for (int i = 0; i < upvalueCount; i++) {
@@ -318,13 +573,19 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
     }
   }
 
-  if (upvalueCount == UINT8_COUNT) {
+  if (upvalueCount == UINT16_COUNT) {
     error("Too many closure variables in function.");
     return 0;
   }
 
+  if (compiler->upvalueCapacity < upvalueCount + 1) {
+    int oldCapacity = compiler->upvalueCapacity;
+    compiler->upvalueCapacity = INCREASE_CAPACITY(oldCapacity);
+    compiler->upvalues = INCREASE_ARRAY(Upvalue, compiler->upvalues,
+                                        oldCapacity, compiler->upvalueCapacity);
+  }
   compiler->upvalues[upvalueCount].isLocal = isLocal;
-  compiler->upvalues[upvalueCount].index = index;
+  compiler->upvalues[upvalueCount].index = (uint16_t)index;
   return compiler->function->upvalueCount++;
 }
 
@@ -335,12 +596,12 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
   int local = resolveLocal(compiler->enclosing, name);
   if (local != -1) {
     compiler->enclosing->locals[local].isCaptured = true;
-    return addUpvalue(compiler, (uint8_t)local, true);
+    return addUpvalue(compiler, local, true);
   }
 
   int upvalue = resolveUpvalue(compiler->enclosing, name);
   if (upvalue != -1) {
-    return addUpvalue(compiler, (uint8_t)upvalue, false);
+    return addUpvalue(compiler, upvalue, false);
   }
 
   return -1;
@@ -348,12 +609,12 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
 
 // Add a local variable to the current compiler
 static void addLocal(Token name) {
-  if (current->localCount == UINT8_COUNT) {
+  if (current->localCount == UINT16_COUNT) {
     error("Too many local variables in function.");
     return;
   }
 
-  Local* local = &current->locals[current->localCount++];
+  Local* local = pushLocal();
   local->name = name;
   local->depth = -1;
   local->isCaptured = false;
@@ -377,14 +638,14 @@ static void declareVariable() {
   addLocal(*name);
 }
 
-// Parse a variable and return its constant index
-static uint8_t parseVariable(const char* errorMessage) {
+// Parse a variable and return its global slot
+static int parseVariable(const char* errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
 
   declareVariable();
   if (current->scopeDepth > 0) return 0;
 
-  return identifierConstant(&parser.previous);
+  return globalVariable(&parser.previous);
 }
 
 // Mark the current local variable as initialized
@@ -394,13 +655,13 @@ static void markInitialized() {
 }
 
 // Define a variable in the current compiler
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
   if (current->scopeDepth > 0) {
     markInitialized();
     return;
   }
 
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitIndexed(OP_DEFINE_GLOBAL, global);
 }
 
 // Parse a list of arguments and return the count
@@ -429,6 +690,89 @@ static void and_(bool canAssign) {
   patchJump(endJump);
 }
 
+// Emit a binary operator, folding local and constant operands into its
+// register form when register ops are enabled
+static void emitBinary(OpCode op, OpCode registerOp, OpCode constantOp) {
+  int left, right;
+  if (lastFusablePair(&left, &right) &&
+      currentChunk()->code[left] == OP_GET_LOCAL) {
+    Chunk* chunk = currentChunk();
+    uint8_t rightOp = chunk->code[right];
+    uint8_t a = chunk->code[left + 1];
+    uint8_t b = chunk->code[right + 1];
+    if (rightOp == OP_GET_LOCAL || rightOp == OP_CONSTANT) {
+      rewindTo(left);
+      noteFusable();
+      emitByte(rightOp == OP_GET_LOCAL ? registerOp : constantOp);
+      emitBytes(a, b);
+      return;
+    }
+  }
+
+  emitByte(op);
+}
+
+// Emit the pop that ends an expression statement, turning a trailing store
+// to a local into a three-address register instruction when possible
+static void emitPop() {
+  int value, store;
+  if (lastFusablePair(&value, &store) &&
+      currentChunk()->code[store] == OP_SET_LOCAL) {
+    Chunk* chunk = currentChunk();
+    uint8_t valueOp = chunk->code[value];
+    uint8_t dest = chunk->code[store + 1];
+    uint8_t a = chunk->code[value + 1];
+    uint8_t b = chunk->code[value + 2];
+
+    OpCode registerOp;
+    switch (valueOp) {
+      case OP_GET_LOCAL:
+        registerOp = OP_MOVE;
+        break;
+      case OP_CONSTANT:
+        registerOp = OP_LOADK;
+        break;
+      case OP_ADD_RR:
+        registerOp = OP_ADD_RRR;
+        break;
+      case OP_ADD_RK:
+        registerOp = OP_ADD_RRK;
+        break;
+      case OP_SUBTRACT_RR:
+        registerOp = OP_SUBTRACT_RRR;
+        break;
+      case OP_SUBTRACT_RK:
+        registerOp = OP_SUBTRACT_RRK;
+        break;
+      case OP_MULTIPLY_RR:
+        registerOp = OP_MULTIPLY_RRR;
+        break;
+      case OP_MULTIPLY_RK:
+        registerOp = OP_MULTIPLY_RRK;
+        break;
+      case OP_DIVIDE_RR:
+        registerOp = OP_DIVIDE_RRR;
+        break;
+      case OP_DIVIDE_RK:
+        registerOp = OP_DIVIDE_RRK;
+        break;
+      default:
+        registerOp = OP_POP;
+        break;
+    }
+
+    if (registerOp != OP_POP) {
+      rewindTo(value);
+      emitBytes(registerOp, dest);
+      emitByte(a);
+      if (fusableLength(valueOp) == 3) emitByte(b);
+      return;
+    }
+  }
+
+  emitByte(OP_POP);
+}
+
 // Parse a binary expression
 static void binary(bool canAssign) {
   // Get the operator type and its parsing rule
@@ -447,28 +791,28 @@ static void binary(bool canAssign) {
       emitByte(OP_EQUAL);
       break;
     case TOKEN_GREATER:
-      emitByte(OP_GREATER);
+      emitBinary(OP_GREATER, OP_GREATER_RR, OP_GREATER_RK);
       break;
     case TOKEN_GREATER_EQUAL:
       emitBytes(OP_LESS, OP_NOT);
       break;
     case TOKEN_LESS:
-      emitByte(OP_LESS);
+      emitBinary(OP_LESS, OP_LESS_RR, OP_LESS_RK);
       break;
     case TOKEN_LESS_EQUAL:
       emitBytes(OP_GREATER, OP_NOT);
       break;
     case TOKEN_PLUS:
-      emitByte(OP_ADD);
+      emitBinary(OP_ADD, OP_ADD_RR, OP_ADD_RK);
       break;
     case TOKEN_MINUS:
-      emitByte(OP_SUBTRACT);
+      emitBinary(OP_SUBTRACT, OP_SUBTRACT_RR, OP_SUBTRACT_RK);
       break;
     case TOKEN_STAR:
-      emitByte(OP_MULTIPLY);
+      emitBinary(OP_MULTIPLY, OP_MULTIPLY_RR, OP_MULTIPLY_RK);
       break;
     case TOKEN_SLASH:
-      emitByte(OP_DIVIDE);
+      emitBinary(OP_DIVIDE, OP_DIVIDE_RR, OP_DIVIDE_RK);
       break;
     default:
       return;  // Unreachable.
@@ -477,27 +821,38 @@ static void binary(bool canAssign) {
 
 // Parse a function or method call
 static void call(bool canAssign) {
+  // A variable read just before, with no jump landing after it, is the
+  // callee.
+  int load = currentChunk()->count - 2;
+  bool direct = current->lastLoad == load && current->lastLabel <= load;
+
   uint8_t argCount = argumentList();
+  current->lastCall = currentChunk()->count;
+  if (direct) {
+    writeCallSite(&callSites, current->function, load, current->lastCall);
+  }
   emitBytes(OP_CALL, argCount);
 }
 
 // Parse property access using dot notation
 static void dot(bool canAssign) {
   consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-  uint8_t name = identifierConstant(&parser.previous);
+  int name = identifierConstant(&parser.previous);
+  // Property instructions have no wide forms.
+  if (name > UINT8_MAX) error("Too many constants in one chunk.");
 
   if (canAssign && match(TOKEN_EQUAL)) {
     // Property assignment
     expression();
-    emitBytes(OP_SET_PROPERTY, name);
+    emitBytes(OP_SET_PROPERTY, (uint8_t)name);
   } else if (match(TOKEN_LEFT_PAREN)) {
     // Method call
     uint8_t argCount = argumentList();
-    emitBytes(OP_INVOKE, name);
+    emitBytes(OP_INVOKE, (uint8_t)name);
     emitByte(argCount);
   } else {
     // Property access
-    emitBytes(OP_GET_PROPERTY, name);
+    emitBytes(OP_GET_PROPERTY, (uint8_t)name);
   }
 }
 
@@ -562,7 +917,7 @@ static void namedVariable(Token name, bool canAssign) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
-    arg = identifierConstant(&name);
+    arg = globalVariable(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
   }
@@ -570,9 +925,12 @@ static void namedVariable(Token name, bool canAssign) {
   // Emit bytecode for variable access or assignment
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(setOp, (uint8_t)arg);
+    if (setOp == OP_SET_LOCAL && arg <= UINT8_MAX) noteFusable();
+    emitIndexed(setOp, arg);
   } else {
-    emitBytes(getOp, (uint8_t)arg);
+    if (getOp == OP_GET_LOCAL && arg <= UINT8_MAX) noteFusable();
+    if (getOp != OP_GET_UPVALUE) current->lastLoad = currentChunk()->count;
+    emitIndexed(getOp, arg);
   }
 }
 
@@ -704,7 +1062,7 @@ static void function(FunctionType type) {
       if (current->function->arity > 255) {
         errorAtCurrent("Can't have more than 255 parameters.");
       }
-      uint8_t constant = parseVariable("Expect parameter name.");
+      int constant = parseVariable("Expect parameter name.");
       defineVariable(constant);
     } while (match(TOKEN_COMMA));
   }
@@ -716,18 +1074,31 @@ static void function(FunctionType type) {
 
   // End compilation and emit bytecode for closure
   ObjFunction* function = endCompiler();
-  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+  int constant = makeConstant(OBJ_VAL(function));
+  bool wide = constant > UINT8_MAX;
+  for (int i = 0; i < function->upvalueCount; i++) {
+    if (compiler.upvalues[i].index > UINT8_MAX) wide = true;
+  }
 
   // Emit information about captured variables for the closure
+  if (wide) {
+    emitByte(OP_CLOSURE_LONG);
+    emitBytes((constant >> 8) & 0xff, constant & 0xff);
+  } else {
+    emitBytes(OP_CLOSURE, (uint8_t)constant);
+  }
   for (int i = 0; i < function->upvalueCount; i++) {
     emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-    emitByte(compiler.upvalues[i].index);
+    int index = compiler.upvalues[i].index;
+    if (wide) emitByte((index >> 8) & 0xff);
+    emitByte(index & 0xff);
   }
+  FREE_ARRAY(Upvalue, compiler.upvalues, compiler.upvalueCapacity);
 }
 
 // Declare a function
 static void funDeclaration() {
-  uint8_t global = parseVariable("Expect function name.");
+  int global = parseVariable("Expect function name.");
   markInitialized();
   function(TYPE_FUNCTION);
   defineVariable(global);
@@ -735,7 +1106,7 @@ static void funDeclaration() {
 
 // Declare a variable
 static void varDeclaration() {
-  uint8_t global = parseVariable("Expect variable name.");
+  int global = parseVariable("Expect variable name.");
 
   // Check if there is an initializer (assignment)
   if (match(TOKEN_EQUAL)) {
@@ -752,7 +1123,7 @@ static void varDeclaration() {
 static void expressionStatement() {
   expression();
   consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-  emitByte(OP_POP); // Discard the result of the expression
+  emitPop(); // Discard the result of the expression
 }
 
 // Process a for loop statement
@@ -770,7 +1141,7 @@ static void forStatement() {
   }
 
   // Parse condition
-  int loopStart = currentChunk()->count;
+  int loopStart = markLoopStart();
   int exitJump = -1;
   if (!match(TOKEN_SEMICOLON)) {
     expression();
@@ -784,9 +1155,9 @@ static void forStatement() {
   // Parse increment (if any)
   if (!match(TOKEN_RIGHT_PAREN)) {
     int bodyJump = emitJump(OP_JUMP);
-    int incrementStart = currentChunk()->count;
+    int incrementStart = markLoopStart();
     expression();
-    emitByte(OP_POP);
+    emitPop();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
     // Emit loop and patch jumps
@@ -855,13 +1226,21 @@ static void returnStatement() {
 
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+    // A call ending the expression, with no jump landing after it, is in
+    // tail position. The OP_RETURN stays for callees that are not closures.
+    int call = current->lastCall;
+    if (call >= 0 && call + 2 == currentChunk()->count &&
+        current->lastLabel <= call) {
+      currentChunk()->code[call] = OP_TAIL_CALL;
+    }
     emitByte(OP_RETURN);
   }
 }
 
 // Process a while loop statement
 static void whileStatement() {
-  int loopStart = currentChunk()->count;
+  int loopStart = markLoopStart();
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
@@ -947,6 +1326,7 @@ ObjFunction* compile(const char* source) {
 
   parser.hadError = false;
   parser.panicMode = false;
+  initCallSites(&callSites);
 
   advance();
 
@@ -956,6 +1336,18 @@ ObjFunction* compile(const char* source) {
   }
 
   ObjFunction* function = endCompiler();
+  if (!parser.hadError) {
+    // Only the whole program shows which globals are never reassigned, so
+    // inlining, and the passes that should see its result, wait for it.
+    push(OBJ_VAL(function));
+    if (compilerOptions.optimizationLevel >= 1) {
+      eliminateUpvalues(function, &callSites);
+      if (compilerOptions.inlining) inlineCalls(function, &callSites);
+    }
+    finishFunction(function);
+    pop();
+  }
+  freeCallSites(&callSites);
   return parser.hadError ? NULL : function;
 }
 
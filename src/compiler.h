@@ -4,6 +4,21 @@
 #include "object.h"
 #include "vm.h"
 
+typedef struct {
+  bool registerOps;  // Fuse local and constant operands into register forms.
+  // 0 emits the code as parsed, 1 adds inlining of small actions, frame
+  // access for closures that never escape and the peephole pass over each
+  // chunk, and 2 the SSA middle end in ir.c as well.
+  int optimizationLevel;
+  // Inlining needs the whole program at once; the REPL, where a later line
+  // may reassign any global, turns it off.
+  bool inlining;
+  // Print each function's bytecode once it is finished.
+  bool printCode;
+} CompilerOptions;
+
+extern CompilerOptions compilerOptions;
+
 ObjFunction* compile(const char* source);
 void markCompilerRoots();
 
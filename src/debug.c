@@ -3,6 +3,7 @@
 #include <stdio.h>
 
 #include "object.h"
+#include "vm.h"
 
 void disassembleChunk(Chunk* chunk, const char* name) {
   printf("== %s ==\n", name);
@@ -13,11 +14,19 @@ void disassembleChunk(Chunk* chunk, const char* name) {
 }
 
 static int constantInstruction(const char* name, Chunk* chunk, int offset) {
-  uint8_t constant = chunk->code[offset + 1];
+  int constant = indexOperand(&chunk->code[offset]);
   printf("%-16s %4d '", name, constant);
   printValue(chunk->constants.values[constant]);
   printf("'\n");
-  return offset + 2;
+  return offset + instructionLength(chunk, offset);
+}
+
+static int globalInstruction(const char* name, Chunk* chunk, int offset) {
+  int slot = indexOperand(&chunk->code[offset]);
+  printf("%-16s %4d '", name, slot);
+  printValue(vm.globalNames.values[slot]);
+  printf("'\n");
+  return offset + instructionLength(chunk, offset);
 }
 
 static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
@@ -35,25 +44,39 @@ static int simpleInstruction(const char* name, int offset) {
 }
 
 static int byteInstruction(const char* name, Chunk* chunk, int offset) {
-  uint8_t slot = chunk->code[offset + 1];
+  int slot = indexOperand(&chunk->code[offset]);
   printf("%-16s %4d\n", name, slot);
-  return offset + 2;
+  return offset + instructionLength(chunk, offset);
 }
 
-static int jumpInstruction(const char* name, int sign, Chunk* chunk,
-                           int offset) {
-  uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
-  jump |= chunk->code[offset + 2];
-  printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
-  return offset + 3;
+static int jumpInstruction(const char* name, Chunk* chunk, int offset) {
+  printf("%-16s %4d -> %d\n", name, offset, jumpTarget(chunk, offset));
+  return offset + instructionLength(chunk, offset);
+}
+
+static int registerInstruction(const char* name, Chunk* chunk, int offset,
+                               int operands, bool lastIsConstant) {
+  printf("%-16s", name);
+  for (int i = 0; i < operands; i++) {
+    bool isConstant = lastIsConstant && i == operands - 1;
+    printf(" %c%d", isConstant ? 'k' : 'r', chunk->code[offset + 1 + i]);
+  }
+  if (lastIsConstant) {
+    printf(" '");
+    printValue(chunk->constants.values[chunk->code[offset + operands]]);
+    printf("'");
+  }
+  printf("\n");
+  return offset + 1 + operands;
 }
 
 int disassembleInstruction(Chunk* chunk, int offset) {
   printf("%04d ", offset);
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+  int location = locationAt(chunk, offset);
+  if (offset > 0 && location == locationAt(chunk, offset - 1)) {
     printf("   | ");
   } else {
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", sourceLine(chunk, location));
   }
 
   uint8_t instruction = chunk->code[offset];
@@ -73,15 +96,19 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_SET_LOCAL:
       return byteInstruction("OP_SET_LOCAL", chunk, offset);
     case OP_GET_GLOBAL:
-      return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+      return globalInstruction("OP_GET_GLOBAL", chunk, offset);
     case OP_DEFINE_GLOBAL:
-      return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+      return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-      return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+      return globalInstruction("OP_SET_GLOBAL", chunk, offset);
     case OP_GET_UPVALUE:
       return byteInstruction("OP_GET_UPVALUE", chunk, offset);
     case OP_SET_UPVALUE:
       return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+    case OP_GET_ENCLOSING:
+      return byteInstruction("OP_GET_ENCLOSING", chunk, offset);
+    case OP_SET_ENCLOSING:
+      return byteInstruction("OP_SET_ENCLOSING", chunk, offset);
     case OP_GET_PROPERTY:
       return constantInstruction("OP_GET_PROPERTY", chunk, offset);
     case OP_SET_PROPERTY:
@@ -109,29 +136,35 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_PRINT:
       return simpleInstruction("OP_PRINT", offset);
     case OP_JUMP:
-      return jumpInstruction("OP_JUMP", 1, chunk, offset);
+      return jumpInstruction("OP_JUMP", chunk, offset);
     case OP_JUMP_IF_FALSE:
-      return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+      return jumpInstruction("OP_JUMP_IF_FALSE", chunk, offset);
     case OP_LOOP:
-      return jumpInstruction("OP_LOOP", -1, chunk, offset);
+      return jumpInstruction("OP_LOOP", chunk, offset);
     case OP_CALL:
       return byteInstruction("OP_CALL", chunk, offset);
+    case OP_TAIL_CALL:
+      return byteInstruction("OP_TAIL_CALL", chunk, offset);
     case OP_INVOKE:
       return invokeInstruction("OP_INVOKE", chunk, offset);
     case OP_SUPER_INVOKE:
       return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
-    case OP_CLOSURE: {
-      offset++;
-      uint8_t constant = chunk->code[offset++];
-      printf("%-16s %4d ", "OP_CLOSURE", constant);
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG: {
+      bool wide = instruction == OP_CLOSURE_LONG;
+      int constant = indexOperand(&chunk->code[offset]);
+      offset += wide ? 3 : 2;
+      printf("%-16s %4d ", wide ? "OP_CLOSURE_LONG" : "OP_CLOSURE", constant);
       printValue(chunk->constants.values[constant]);
       printf("\n");
 
       ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
       for (int j = 0; j < function->upvalueCount; j++) {
+        int start = offset;
         int isLocal = chunk->code[offset++];
         int index = chunk->code[offset++];
-        printf("%04d      |                     %s %d\n", offset - 2,
+        if (wide) index = (index << 8) | chunk->code[offset++];
+        printf("%04d      |                     %s %d\n", start,
                isLocal ? "local" : "upvalue", index);
       }
 
@@ -141,6 +174,88 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return simpleInstruction("OP_CLOSE_UPVALUE", offset);
     case OP_RETURN:
       return simpleInstruction("OP_RETURN", offset);
+    case OP_CONSTANT_LONG:
+      return constantInstruction("OP_CONSTANT_LONG", chunk, offset);
+    case OP_GET_LOCAL_LONG:
+      return byteInstruction("OP_GET_LOCAL_LONG", chunk, offset);
+    case OP_SET_LOCAL_LONG:
+      return byteInstruction("OP_SET_LOCAL_LONG", chunk, offset);
+    case OP_GET_GLOBAL_LONG:
+      return globalInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
+    case OP_DEFINE_GLOBAL_LONG:
+      return globalInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+    case OP_SET_GLOBAL_LONG:
+      return globalInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
+    case OP_GET_UPVALUE_LONG:
+      return byteInstruction("OP_GET_UPVALUE_LONG", chunk, offset);
+    case OP_SET_UPVALUE_LONG:
+      return byteInstruction("OP_SET_UPVALUE_LONG", chunk, offset);
+    case OP_JUMP_LONG:
+      return jumpInstruction("OP_JUMP_LONG", chunk, offset);
+    case OP_JUMP_IF_FALSE_LONG:
+      return jumpInstruction("OP_JUMP_IF_FALSE_LONG", chunk, offset);
+    case OP_LOOP_LONG:
+      return jumpInstruction("OP_LOOP_LONG", chunk, offset);
+    case OP_MOVE:
+      return registerInstruction("OP_MOVE", chunk, offset, 2, false);
+    case OP_LOADK:
+      return registerInstruction("OP_LOADK", chunk, offset, 2, true);
+    case OP_ADD_RR:
+      return registerInstruction("OP_ADD_RR", chunk, offset, 2, false);
+    case OP_ADD_RK:
+      return registerInstruction("OP_ADD_RK", chunk, offset, 2, true);
+    case OP_SUBTRACT_RR:
+      return registerInstruction("OP_SUBTRACT_RR", chunk, offset, 2, false);
+    case OP_SUBTRACT_RK:
+      return registerInstruction("OP_SUBTRACT_RK", chunk, offset, 2, true);
+    case OP_MULTIPLY_RR:
+      return registerInstruction("OP_MULTIPLY_RR", chunk, offset, 2, false);
+    case OP_MULTIPLY_RK:
+      return registerInstruction("OP_MULTIPLY_RK", chunk, offset, 2, true);
+    case OP_DIVIDE_RR:
+      return registerInstruction("OP_DIVIDE_RR", chunk, offset, 2, false);
+    case OP_DIVIDE_RK:
+      return registerInstruction("OP_DIVIDE_RK", chunk, offset, 2, true);
+    case OP_GREATER_RR:
+      return registerInstruction("OP_GREATER_RR", chunk, offset, 2, false);
+    case OP_GREATER_RK:
+      return registerInstruction("OP_GREATER_RK", chunk, offset, 2, true);
+    case OP_LESS_RR:
+      return registerInstruction("OP_LESS_RR", chunk, offset, 2, false);
+    case OP_LESS_RK:
+      return registerInstruction("OP_LESS_RK", chunk, offset, 2, true);
+    case OP_ADD_RRR:
+      return registerInstruction("OP_ADD_RRR", chunk, offset, 3, false);
+    case OP_ADD_RRK:
+      return registerInstruction("OP_ADD_RRK", chunk, offset, 3, true);
+    case OP_SUBTRACT_RRR:
+      return registerInstruction("OP_SUBTRACT_RRR", chunk, offset, 3, false);
+    case OP_SUBTRACT_RRK:
+      return registerInstruction("OP_SUBTRACT_RRK", chunk, offset, 3, true);
+    case OP_MULTIPLY_RRR:
+      return registerInstruction("OP_MULTIPLY_RRR", chunk, offset, 3, false);
+    case OP_MULTIPLY_RRK:
+      return registerInstruction("OP_MULTIPLY_RRK", chunk, offset, 3, true);
+    case OP_DIVIDE_RRR:
+      return registerInstruction("OP_DIVIDE_RRR", chunk, offset, 3, false);
+    case OP_DIVIDE_RRK:
+      return registerInstruction("OP_DIVIDE_RRK", chunk, offset, 3, true);
+    case OP_ADD_NUM:
+      return simpleInstruction("OP_ADD_NUM", offset);
+    case OP_ADD_STR:
+      return simpleInstruction("OP_ADD_STR", offset);
+    case OP_SUBTRACT_NUM:
+      return simpleInstruction("OP_SUBTRACT_NUM", offset);
+    case OP_MULTIPLY_NUM:
+      return simpleInstruction("OP_MULTIPLY_NUM", offset);
+    case OP_DIVIDE_NUM:
+      return simpleInstruction("OP_DIVIDE_NUM", offset);
+    case OP_GREATER_NUM:
+      return simpleInstruction("OP_GREATER_NUM", offset);
+    case OP_LESS_NUM:
+      return simpleInstruction("OP_LESS_NUM", offset);
+    case OP_CALL_NATIVE:
+      return byteInstruction("OP_CALL_NATIVE", chunk, offset);
     default:
       printf("Unknown opcode %d\n", instruction);
       return offset + 1;
@@ -0,0 +1,891 @@
+#include "emitc.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "memory.h"
+
+// Lowering of a compiled program to a C translation unit.
+//
+// Every function becomes a C function entered with the CallFrame the VM
+// pushed for it. Jumps become gotos between labels on their targets, and
+// because the depth of the value stack at each instruction is fixed, every
+// stack position becomes its own C variable. Values only go back to the VM
+// stack before something that can allocate or call, so the collector and
+// callees see exactly what the interpreter would have pushed. Locals
+// captured by closures stay on the VM stack, where their upvalues point.
+//
+// The program keeps each function's bytecode and line table so runtime
+// errors report lines as usual, and any function using an instruction not
+// handled here is left to the interpreter.
+
+#define DEPTH_UNKNOWN -1
+
+typedef struct {
+  ObjFunction** functions;  // Post-order, so the script comes last.
+  int count;
+  int capacity;
+} Program;
+
+typedef struct {
+  FILE* out;
+  ObjFunction* function;
+  int index;
+  int* depths;     // Stack depth before each instruction, or DEPTH_UNKNOWN.
+  bool* labels;    // Offsets that are jump targets.
+  bool* captured;  // Slots that must live on the VM stack.
+  int maxDepth;
+} FunctionEmitter;
+
+static void collectFunctions(Program* program, ObjFunction* function) {
+  ValueArray* constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (IS_OBJ(constants->values[i]) &&
+        OBJ_TYPE(constants->values[i]) == OBJ_FUNCTION) {
+      collectFunctions(program, AS_FUNCTION(constants->values[i]));
+    }
+  }
+
+  if (program->capacity < program->count + 1) {
+    program->capacity = program->capacity < 8 ? 8 : program->capacity * 2;
+    program->functions = realloc(program->functions,
+                                 sizeof(ObjFunction*) * program->capacity);
+    if (program->functions == NULL) exit(1);
+  }
+  program->functions[program->count++] = function;
+}
+
+static int functionIndex(Program* program, ObjFunction* function) {
+  for (int i = 0; i < program->count; i++) {
+    if (program->functions[i] == function) return i;
+  }
+  return -1;
+}
+
+static void emitString(FILE* out, const char* chars, int length) {
+  fputc('"', out);
+  for (int i = 0; i < length; i++) {
+    unsigned char c = (unsigned char)chars[i];
+    if (c == '"' || c == '\\' || c == '?') {
+      fprintf(out, "\\%c", c);
+    } else if (c < ' ' || c >= 0x7f) {
+      fprintf(out, "\\%03o", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+static void emitNumber(FILE* out, double number) {
+  if (isnan(number)) {
+    fprintf(out, "NUMBER_VAL(NAN)");
+  } else if (isinf(number)) {
+    fprintf(out, "NUMBER_VAL(%sINFINITY)", number < 0 ? "-" : "");
+  } else {
+    fprintf(out, "NUMBER_VAL(%a)", number);
+  }
+}
+
+static uint8_t genericOp(uint8_t instruction) {
+  switch (instruction) {
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+      return OP_ADD;
+    case OP_SUBTRACT_NUM:
+      return OP_SUBTRACT;
+    case OP_MULTIPLY_NUM:
+      return OP_MULTIPLY;
+    case OP_DIVIDE_NUM:
+      return OP_DIVIDE;
+    case OP_GREATER_NUM:
+      return OP_GREATER;
+    case OP_LESS_NUM:
+      return OP_LESS;
+    default:
+      return instruction;
+  }
+}
+
+static const char* binaryOperator(uint8_t op) {
+  switch (op) {
+    case OP_ADD:
+    case OP_ADD_RR:
+    case OP_ADD_RK:
+    case OP_ADD_RRR:
+    case OP_ADD_RRK:
+      return "+";
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_RR:
+    case OP_SUBTRACT_RK:
+    case OP_SUBTRACT_RRR:
+    case OP_SUBTRACT_RRK:
+      return "-";
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_RR:
+    case OP_MULTIPLY_RK:
+    case OP_MULTIPLY_RRR:
+    case OP_MULTIPLY_RRK:
+      return "*";
+    case OP_DIVIDE:
+    case OP_DIVIDE_RR:
+    case OP_DIVIDE_RK:
+    case OP_DIVIDE_RRR:
+    case OP_DIVIDE_RRK:
+      return "/";
+    case OP_GREATER:
+    case OP_GREATER_RR:
+    case OP_GREATER_RK:
+      return ">";
+    default:
+      return "<";
+  }
+}
+
+static bool isRegisterOp(uint8_t instruction) {
+  return instruction >= OP_ADD_RR && instruction <= OP_DIVIDE_RRK;
+}
+
+// Stack effect of an instruction, or false if it is not handled here
+static bool effectOf(Chunk* chunk, int offset, int* effect) {
+  uint8_t* ip = &chunk->code[offset];
+  switch (genericOp(ip[0])) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_GET_ENCLOSING:
+    case OP_CLOSURE:
+    case OP_CONSTANT_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_GET_UPVALUE_LONG:
+      *effect = 1;
+      return true;
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+      *effect = -1;
+      return true;
+    case OP_SET_LOCAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_UPVALUE:
+    case OP_SET_ENCLOSING:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_RETURN:
+    case OP_MOVE:
+    case OP_LOADK:
+    case OP_SET_GLOBAL_LONG:
+    case OP_SET_UPVALUE_LONG:
+    case OP_JUMP_LONG:
+    case OP_JUMP_IF_FALSE_LONG:
+    case OP_LOOP_LONG:
+      *effect = 0;
+      return true;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      *effect = -ip[1];
+      return true;
+    default:
+      if (!isRegisterOp(ip[0])) return false;
+      *effect = instructionLength(chunk, offset) == 4 ? 0 : 1;
+      return true;
+  }
+}
+
+// Propagate stack depths through the function's control flow, marking jump
+// targets and captured slots along the way
+static bool analyze(FunctionEmitter* emitter) {
+  Chunk* chunk = &emitter->function->chunk;
+  int* worklist = malloc(sizeof(int) * (chunk->count + 1));
+  if (worklist == NULL) exit(1);
+  int pending = 0;
+
+  emitter->depths[0] = emitter->function->arity + 1;
+  emitter->maxDepth = emitter->depths[0];
+  worklist[pending++] = 0;
+  emitter->captured[0] = true;
+
+  bool supported = true;
+  while (supported && pending > 0) {
+    int offset = worklist[--pending];
+    int depth = emitter->depths[offset];
+    uint8_t* ip = &chunk->code[offset];
+    int effect;
+    if (!effectOf(chunk, offset, &effect)) {
+      supported = false;
+      break;
+    }
+
+    int after = depth + effect;
+    if (after > emitter->maxDepth) emitter->maxDepth = after;
+    if (isRegisterOp(ip[0]) && depth + 1 > emitter->maxDepth) {
+      emitter->maxDepth = depth + 1;  // String operands are pushed.
+    }
+
+    if (ip[0] == OP_CLOSURE) {
+      ObjFunction* closure = AS_FUNCTION(chunk->constants.values[ip[1]]);
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        if (ip[2 + i * 2]) emitter->captured[ip[3 + i * 2]] = true;
+      }
+      // So are the slots it reaches into while this frame calls it.
+      Chunk* body = &closure->chunk;
+      for (int i = 0; i < body->count; i += instructionLength(body, i)) {
+        if (body->code[i] == OP_GET_ENCLOSING ||
+            body->code[i] == OP_SET_ENCLOSING) {
+          emitter->captured[body->code[i + 1]] = true;
+        }
+      }
+    }
+
+    int successors[2];
+    int successorCount = 0;
+    bool jumps = false;
+    switch (ip[0]) {
+      case OP_JUMP:
+      case OP_LOOP:
+      case OP_JUMP_LONG:
+      case OP_LOOP_LONG:
+        successors[successorCount++] = jumpTarget(chunk, offset);
+        jumps = true;
+        break;
+      case OP_JUMP_IF_FALSE:
+      case OP_JUMP_IF_FALSE_LONG:
+        successors[successorCount++] = jumpTarget(chunk, offset);
+        successors[successorCount++] =
+            offset + instructionLength(chunk, offset);
+        jumps = true;
+        break;
+      case OP_RETURN:
+        break;
+      default:
+        successors[successorCount++] =
+            offset + instructionLength(chunk, offset);
+        break;
+    }
+
+    for (int i = 0; i < successorCount; i++) {
+      int next = successors[i];
+      if (next >= chunk->count) {
+        supported = false;
+        break;
+      }
+      if (jumps && i == 0) emitter->labels[next] = true;
+      if (emitter->depths[next] == DEPTH_UNKNOWN) {
+        emitter->depths[next] = after;
+        worklist[pending++] = next;
+      } else if (emitter->depths[next] != after) {
+        supported = false;
+      }
+    }
+  }
+
+  free(worklist);
+  return supported;
+}
+
+// The C lvalue holding stack position slot
+static void slot(FunctionEmitter* emitter, int index) {
+  if (emitter->captured[index]) {
+    fprintf(emitter->out, "slots[%d]", index);
+  } else {
+    fprintf(emitter->out, "r%d", index);
+  }
+}
+
+// Write the stack positions below depth back to the VM stack
+static void sync(FunctionEmitter* emitter, int depth) {
+  fprintf(emitter->out, "  ");
+  for (int i = 0; i < depth; i++) {
+    if (emitter->captured[i]) continue;
+    fprintf(emitter->out, "slots[%d] = r%d; ", i, i);
+  }
+  fprintf(emitter->out, "vm.stackTop = slots + %d;\n", depth);
+}
+
+// Copy stack position index back from the VM stack after a call
+static void reload(FunctionEmitter* emitter, int index) {
+  if (emitter->captured[index]) return;
+  fprintf(emitter->out, "  r%d = slots[%d];\n", index, index);
+}
+
+static void emitError(FunctionEmitter* emitter, int next, const char* message) {
+  fprintf(emitter->out, "RUNTIME_ERROR(%d, \"%s\");", next, message);
+}
+
+static void emitGlobalCheck(FunctionEmitter* emitter, int global, int next) {
+  ObjString* name = AS_STRING(vm.globalNames.values[global]);
+  fprintf(emitter->out,
+          "  if (IS_UNDEFINED(vm.globalValues.values[%d])) "
+          "RUNTIME_ERROR(%d, \"Undefined variable '%%s'.\", ",
+          global, next);
+  emitString(emitter->out, name->chars, name->length);
+  fprintf(emitter->out, ");\n");
+}
+
+// Emit the C for op applied to the values named a and b, storing into
+// position dest; depth is where string operands may be pushed
+static void emitArithmetic(FunctionEmitter* emitter, uint8_t op,
+                           void (*operandA)(FunctionEmitter*, int), int a,
+                           void (*operandB)(FunctionEmitter*, int), int b,
+                           int dest, int depth, int next) {
+  FILE* out = emitter->out;
+  bool add = op == OP_ADD || (op >= OP_ADD_RR && op <= OP_ADD_RK) ||
+             op == OP_ADD_RRR || op == OP_ADD_RRK;
+  bool compare = op == OP_GREATER || op == OP_LESS ||
+                 (op >= OP_GREATER_RR && op <= OP_LESS_RK);
+
+  fprintf(out, "  if (IS_NUMBER(");
+  operandA(emitter, a);
+  fprintf(out, ") && IS_NUMBER(");
+  operandB(emitter, b);
+  fprintf(out, ")) {\n    ");
+  slot(emitter, dest);
+  fprintf(out, " = %s(AS_NUMBER(", compare ? "BOOL_VAL" : "NUMBER_VAL");
+  operandA(emitter, a);
+  fprintf(out, ") %s AS_NUMBER(", binaryOperator(op));
+  operandB(emitter, b);
+  fprintf(out, "));\n  }");
+
+  if (add) {
+    fprintf(out, " else if (IS_STRING(");
+    operandA(emitter, a);
+    fprintf(out, ") && IS_STRING(");
+    operandB(emitter, b);
+    fprintf(out, ")) {\n  ");
+    sync(emitter, depth);
+    fprintf(out, "    push(");
+    operandA(emitter, a);
+    fprintf(out, ");\n    push(");
+    operandB(emitter, b);
+    fprintf(out, ");\n    concatenate();\n    ");
+    slot(emitter, dest);
+    fprintf(out, " = pop();\n  } else {\n    ");
+    emitError(emitter, next, "Operands must be two numbers or two strings.");
+  } else {
+    fprintf(out, " else {\n    ");
+    emitError(emitter, next, "Operands must be numbers.");
+  }
+  fprintf(out, "\n  }\n");
+}
+
+static void constantOperand(FunctionEmitter* emitter, int index) {
+  fprintf(emitter->out, "constants[%d]", index);
+}
+
+static bool emitInstruction(FunctionEmitter* emitter, Program* program,
+                            int offset) {
+  FILE* out = emitter->out;
+  Chunk* chunk = &emitter->function->chunk;
+  uint8_t* ip = &chunk->code[offset];
+  int depth = emitter->depths[offset];
+  int next = offset + instructionLength(chunk, offset);
+
+  if (emitter->labels[offset]) fprintf(out, "L%d:\n", offset);
+
+  switch (genericOp(ip[0])) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG: {
+      Value constant = chunk->constants.values[indexOperand(ip)];
+      fprintf(out, "  ");
+      slot(emitter, depth);
+      fprintf(out, " = ");
+      if (IS_NUMBER(constant)) {
+        emitNumber(out, AS_NUMBER(constant));
+      } else {
+        fprintf(out, "constants[%d]", indexOperand(ip));
+      }
+      fprintf(out, ";\n");
+      return true;
+    }
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      fprintf(out, "  ");
+      slot(emitter, depth);
+      fprintf(out, " = %s;\n",
+              ip[0] == OP_NIL ? "NIL_VAL"
+                              : ip[0] == OP_TRUE ? "TRUE_VAL" : "FALSE_VAL");
+      return true;
+    case OP_POP:
+      return true;
+    case OP_GET_LOCAL:
+      fprintf(out, "  ");
+      slot(emitter, depth);
+      fprintf(out, " = ");
+      slot(emitter, ip[1]);
+      fprintf(out, ";\n");
+      return true;
+    case OP_SET_LOCAL:
+      fprintf(out, "  ");
+      slot(emitter, ip[1]);
+      fprintf(out, " = ");
+      slot(emitter, depth - 1);
+      fprintf(out, ";\n");
+      return true;
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:
+      emitGlobalCheck(emitter, indexOperand(ip), next);
+      fprintf(out, "  ");
+      slot(emitter, depth);
+      fprintf(out, " = vm.globalValues.values[%d];\n", indexOperand(ip));
+      return true;
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG:
+      fprintf(out, "  snapshotBarrier(vm.globalValues.values[%d]);\n",
+              indexOperand(ip));
+      fprintf(out, "  vm.globalValues.values[%d] = ", indexOperand(ip));
+      slot(emitter, depth - 1);
+      fprintf(out, ";\n");
+      return true;
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG:
+      emitGlobalCheck(emitter, indexOperand(ip), next);
+      fprintf(out, "  snapshotBarrier(vm.globalValues.values[%d]);\n",
+              indexOperand(ip));
+      fprintf(out, "  vm.globalValues.values[%d] = ", indexOperand(ip));
+      slot(emitter, depth - 1);
+      fprintf(out, ";\n");
+      return true;
+    case OP_GET_UPVALUE:
+    case OP_GET_UPVALUE_LONG:
+      fprintf(out, "  ");
+      slot(emitter, depth);
+      fprintf(out, " = *frame->closure->upvalues[%d]->location;\n",
+              indexOperand(ip));
+      return true;
+    case OP_SET_UPVALUE:
+    case OP_SET_UPVALUE_LONG:
+      fprintf(out,
+              "  {\n    ObjUpvalue* upvalue = frame->closure->upvalues[%d];\n",
+              indexOperand(ip));
+      fprintf(out, "    snapshotBarrier(*upvalue->location);\n"
+                   "    STORE_FIELD(*upvalue->location, ");
+      slot(emitter, depth - 1);
+      fprintf(out, ");\n    writeBarrier((Obj*)upvalue, *upvalue->location);\n"
+                   "  }\n");
+      return true;
+    case OP_GET_ENCLOSING:
+      fprintf(out, "  ");
+      slot(emitter, depth);
+      fprintf(out, " = vm.frames[vm.frameCount - 2]->slots[%d];\n", ip[1]);
+      return true;
+    case OP_SET_ENCLOSING:
+      fprintf(out, "  vm.frames[vm.frameCount - 2]->slots[%d] = ", ip[1]);
+      slot(emitter, depth - 1);
+      fprintf(out, ";\n");
+      return true;
+    case OP_EQUAL:
+      fprintf(out, "  ");
+      slot(emitter, depth - 2);
+      fprintf(out, " = BOOL_VAL(valuesEqual(");
+      slot(emitter, depth - 2);
+      fprintf(out, ", ");
+      slot(emitter, depth - 1);
+      fprintf(out, "));\n");
+      return true;
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      emitArithmetic(emitter, genericOp(ip[0]), slot, depth - 2, slot,
+                     depth - 1, depth - 2, depth, next);
+      return true;
+    case OP_NOT:
+      fprintf(out, "  ");
+      slot(emitter, depth - 1);
+      fprintf(out, " = BOOL_VAL(isFalsy(");
+      slot(emitter, depth - 1);
+      fprintf(out, "));\n");
+      return true;
+    case OP_NEGATE:
+      fprintf(out, "  if (!IS_NUMBER(");
+      slot(emitter, depth - 1);
+      fprintf(out, ")) ");
+      emitError(emitter, next, "Operand must be a number.");
+      fprintf(out, "\n  ");
+      slot(emitter, depth - 1);
+      fprintf(out, " = NUMBER_VAL(-AS_NUMBER(");
+      slot(emitter, depth - 1);
+      fprintf(out, "));\n");
+      return true;
+    case OP_PRINT:
+      fprintf(out, "  printValue(");
+      slot(emitter, depth - 1);
+      fprintf(out, ");\n  printf(\"\\n\");\n");
+      return true;
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_JUMP_LONG:
+    case OP_LOOP_LONG:
+      fprintf(out, "  goto L%d;\n", jumpTarget(chunk, offset));
+      return true;
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_LONG:
+      fprintf(out, "  if (isFalsy(");
+      slot(emitter, depth - 1);
+      fprintf(out, ")) goto L%d;\n", jumpTarget(chunk, offset));
+      return true;
+    case OP_CALL:
+      sync(emitter, depth);
+      fprintf(out, "  frame->ip = code + %d;\n", next);
+      fprintf(out, "  if (!callFromC(%d)) return BODY_ERROR;\n", ip[1]);
+      fprintf(out, "  slots = frame->slots;\n");  // The stack may have grown.
+      reload(emitter, depth - 1 - ip[1]);
+      return true;
+    case OP_TAIL_CALL:
+      sync(emitter, depth);
+      fprintf(out, "  frame->ip = code + %d;\n", next);
+      fprintf(out, "  {\n    Value callee = slots[%d];\n", depth - 1 - ip[1]);
+      fprintf(out, "    if (!tailCallValue(callee, %d)) return BODY_ERROR;\n",
+              ip[1]);
+      fprintf(out, "    if (IS_CLOSURE(callee)) return BODY_TAIL_CALL;\n  }\n");
+      fprintf(out, "  slots = frame->slots;\n");
+      reload(emitter, depth - 1 - ip[1]);
+      return true;
+    case OP_CLOSURE: {
+      ObjFunction* function = AS_FUNCTION(chunk->constants.values[ip[1]]);
+      sync(emitter, depth);
+      fprintf(out, "  {\n    ObjClosure* closure = closureFor(functions[%d]);\n",
+              functionIndex(program, function));
+      fprintf(out, "    push(OBJ_VAL(closure));\n");
+      for (int i = 0; i < function->upvalueCount; i++) {
+        uint8_t isLocal = ip[2 + i * 2];
+        uint8_t index = ip[3 + i * 2];
+        if (isLocal) {
+          fprintf(out,
+                  "    STORE_FIELD(closure->upvalues[%d], "
+                  "captureUpvalue(slots + %d));\n",
+                  i, index);
+        } else {
+          fprintf(out,
+                  "    STORE_FIELD(closure->upvalues[%d], "
+                  "frame->closure->upvalues[%d]);\n",
+                  i, index);
+        }
+        fprintf(out,
+                "    writeBarrier((Obj*)closure, "
+                "OBJ_VAL(closure->upvalues[%d]));\n",
+                i);
+      }
+      fprintf(out, "  }\n");
+      reload(emitter, depth);
+      return true;
+    }
+    case OP_CLOSE_UPVALUE:
+      fprintf(out, "  closeUpvalues(slots + %d);\n", depth - 1);
+      return true;
+    case OP_RETURN:
+      fprintf(out, "  {\n    Value result = ");
+      slot(emitter, depth - 1);
+      fprintf(out, ";\n    closeUpvalues(slots);\n    vm.frameCount--;\n");
+      fprintf(out, "    vm.stackTop = slots;\n    push(result);\n");
+      fprintf(out, "    return BODY_RETURNED;\n  }\n");
+      return true;
+    case OP_MOVE:
+      fprintf(out, "  ");
+      slot(emitter, ip[1]);
+      fprintf(out, " = ");
+      slot(emitter, ip[2]);
+      fprintf(out, ";\n");
+      return true;
+    case OP_LOADK:
+      fprintf(out, "  ");
+      slot(emitter, ip[1]);
+      fprintf(out, " = constants[%d];\n", ip[2]);
+      return true;
+    default: {
+      bool storesResult = next - offset == 4;
+      uint8_t* operands = storesResult ? ip + 2 : ip + 1;
+      bool constant = (ip[0] - OP_ADD_RR) % 2 == 1;
+      if (ip[0] >= OP_ADD_RRR) constant = (ip[0] - OP_ADD_RRR) % 2 == 1;
+      emitArithmetic(emitter, ip[0], slot, operands[0],
+                     constant ? constantOperand : slot, operands[1],
+                     storesResult ? ip[1] : depth, depth, next);
+      return true;
+    }
+  }
+}
+
+static void emitBody(FunctionEmitter* emitter, Program* program) {
+  FILE* out = emitter->out;
+  Chunk* chunk = &emitter->function->chunk;
+
+  fprintf(out, "static int body%d(CallFrame* frame) {\n", emitter->index);
+  fprintf(out, "  Value* slots = frame->slots;\n");
+  fprintf(out, "  Value* constants = "
+               "frame->closure->function->chunk.constants.values;\n");
+  fprintf(out, "  uint8_t* code = frame->closure->function->chunk.code;\n");
+  fprintf(out, "  (void)constants;\n  (void)code;\n");
+  for (int i = 1; i < emitter->maxDepth; i++) {
+    if (emitter->captured[i]) continue;
+    if (i <= emitter->function->arity) {
+      fprintf(out, "  Value r%d = slots[%d];\n", i, i);
+    } else {
+      fprintf(out, "  Value r%d = NIL_VAL;\n", i);
+    }
+  }
+  fprintf(out, "\n");
+
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (emitter->depths[offset] == DEPTH_UNKNOWN) continue;  // Unreachable.
+    emitInstruction(emitter, program, offset);
+  }
+  fprintf(out, "}\n\n");
+}
+
+static void emitPrelude(FILE* out, const char* path) {
+  fprintf(out, "// Generated by eclang --emit-c from %s.\n", path);
+  fprintf(out,
+          "// Build with the runtime: every file in src/ but main.c, or the\n"
+          "// eclang_runtime library from CMake.\n\n"
+          "#include <math.h>\n"
+          "#include <stdio.h>\n"
+          "#include <stdlib.h>\n"
+          "#include <string.h>\n\n"
+          "#include \"chunk.h\"\n"
+          "#include \"memory.h\"\n"
+          "#include \"object.h\"\n"
+          "#include \"value.h\"\n"
+          "#include \"vm.h\"\n\n"
+          "// What a body did with its frame\n"
+          "#define BODY_RETURNED 0\n"
+          "#define BODY_ERROR 1\n"
+          "#define BODY_TAIL_CALL 2  // Handed it to a tail-called closure.\n\n"
+          "typedef int (*Body)(CallFrame* frame);\n\n"
+          "#define RUNTIME_ERROR(next, ...)    \\\n"
+          "  do {                            \\\n"
+          "    frame->ip = code + (next);    \\\n"
+          "    runtimeError(__VA_ARGS__);    \\\n"
+          "    return BODY_ERROR;            \\\n"
+          "  } while (false)\n\n"
+          "// Run a frame through C bodies for as long as it has one. Tail calls\n"
+          "// come back here instead of nesting.\n"
+          "static bool runBodies(CallFrame* frame) {\n"
+          "  for (;;) {\n"
+          "    Body body = (Body)frame->closure->function->aotCode;\n"
+          "    if (body == NULL) return run(vm.frameCount - 1) == INTERPRET_OK;\n"
+          "    int status = body(frame);\n"
+          "    if (status != BODY_TAIL_CALL) return status == BODY_RETURNED;\n"
+          "  }\n"
+          "}\n\n"
+          "// Run the frame on top of the VM to completion, in the interpreter once\n"
+          "// bodies have nested as deep as the C stack allows\n"
+          "static bool runFrame() {\n"
+          "  if (!nativeStackHasRoom()) return run(vm.frameCount - 1) == INTERPRET_OK;\n"
+          "  return runBodies(vm.frames[vm.frameCount - 1]);\n"
+          "}\n\n"
+          "static bool callFromC(int argCount) {\n"
+          "  int frameCount = vm.frameCount;\n"
+          "  if (!callValue(vm.stackTop[-1 - argCount], argCount)) "
+          "return false;\n"
+          "  return vm.frameCount == frameCount || runFrame();\n"
+          "}\n\n");
+}
+
+static void emitLoader(FILE* out, Program* program, bool* compiled) {
+  for (int i = 0; i < program->count; i++) {
+    Chunk* chunk = &program->functions[i]->chunk;
+    fprintf(out, "static const uint8_t code%d[] = {", i);
+    for (int j = 0; j < chunk->count; j++) {
+      fprintf(out, "%s%d", j % 16 == 0 ? "\n  " : " ", chunk->code[j]);
+      if (j + 1 < chunk->count) fputc(',', out);
+    }
+    fprintf(out, "\n};\n");
+    fprintf(out, "static const LineRun lines%d[] = {", i);
+    for (int j = 0; j < chunk->lineCount; j++) {
+      fprintf(out, "%s{%d, %d}", j % 8 == 0 ? "\n  " : " ",
+              chunk->lines[j].offset, chunk->lines[j].location);
+      if (j + 1 < chunk->lineCount) fputc(',', out);
+    }
+    fprintf(out, "\n};\n\n");
+  }
+
+  fprintf(out,
+          "// Rebuild a function object. It stays on the VM stack, out of the\n"
+          "// collector's reach, until the whole program is loaded.\n"
+          "static ObjFunction* loadFunction(const uint8_t* code, "
+          "const LineRun* lines,\n"
+          "                                 int lineCount, int count, "
+          "int arity,\n"
+          "                                 int upvalueCount, int maxSlots, "
+          "const char* name,\n"
+          "                                 Body body) {\n"
+          "  ObjFunction* function = newFunction();\n"
+          "  push(OBJ_VAL(function));\n"
+          "  function->arity = arity;\n"
+          "  function->upvalueCount = upvalueCount;\n"
+          "  function->maxSlots = maxSlots;\n"
+          "  function->aotCode = (void*)body;\n"
+          "  if (name != NULL) {\n"
+          "    function->name = copyString(name, (int)strlen(name));\n"
+          "  }\n"
+          "  int run = 0;\n"
+          "  for (int i = 0; i < count; i++) {\n"
+          "    if (run + 1 < lineCount && lines[run + 1].offset == i) run++;\n"
+          "    writeChunk(&function->chunk, code[i], lines[run].location);\n"
+          "  }\n"
+          "  return function;\n"
+          "}\n\n");
+
+  fprintf(out, "static ObjFunction* loadProgram() {\n");
+  fprintf(out, "  static const char* globals[] = {");
+  for (int i = 0; i < vm.globalNames.count; i++) {
+    ObjString* name = AS_STRING(vm.globalNames.values[i]);
+    fprintf(out, "\n    ");
+    emitString(out, name->chars, name->length);
+    fputc(',', out);
+  }
+  fprintf(out, "\n  };\n");
+  fprintf(out,
+          "  for (int i = 0; i < (int)(sizeof(globals) / sizeof(globals[0]));"
+          " i++) {\n"
+          "    ObjString* name = copyString(globals[i], "
+          "(int)strlen(globals[i]));\n"
+          "    if (globalSlot(name) != i) {\n"
+          "      fprintf(stderr, \"Global '%%s' does not match its slot.\\n\","
+          " globals[i]);\n"
+          "      exit(70);\n"
+          "    }\n"
+          "  }\n\n");
+
+  for (int i = 0; i < program->count; i++) {
+    ObjFunction* function = program->functions[i];
+    fprintf(out,
+            "  functions[%d] = loadFunction(code%d, lines%d, %d, %d, %d, %d, "
+            "%d, ",
+            i, i, i, function->chunk.lineCount, function->chunk.count,
+            function->arity, function->upvalueCount, function->maxSlots);
+    if (function->name == NULL) {
+      fprintf(out, "NULL");
+    } else {
+      emitString(out, function->name->chars, function->name->length);
+    }
+    if (compiled[i]) {
+      fprintf(out, ", body%d);\n", i);
+    } else {
+      fprintf(out, ", NULL);\n");
+    }
+
+    ValueArray* constants = &function->chunk.constants;
+    for (int j = 0; j < constants->count; j++) {
+      Value value = constants->values[j];
+      fprintf(out, "  addConstant(&functions[%d]->chunk, ", i);
+      if (IS_NUMBER(value)) {
+        emitNumber(out, AS_NUMBER(value));
+      } else if (IS_STRING(value)) {
+        fprintf(out, "OBJ_VAL(copyString(");
+        emitString(out, AS_STRING(value)->chars, AS_STRING(value)->length);
+        fprintf(out, ", %d))", AS_STRING(value)->length);
+      } else if (IS_OBJ(value) && OBJ_TYPE(value) == OBJ_FUNCTION) {
+        fprintf(out, "OBJ_VAL(functions[%d])",
+                functionIndex(program, AS_FUNCTION(value)));
+      } else if (IS_BOOL(value)) {
+        fprintf(out, AS_BOOL(value) ? "TRUE_VAL" : "FALSE_VAL");
+      } else {
+        fprintf(out, "NIL_VAL");
+      }
+      fprintf(out, ");\n");
+    }
+
+    Chunk* chunk = &function->chunk;
+    for (int j = 0; j < chunk->inlineCount; j++) {
+      InlineFrame* frame = &chunk->inlines[j];
+      fprintf(out, "  addInlineFrame(&functions[%d]->chunk, %d, copyString(",
+              i, frame->line);
+      emitString(out, frame->name->chars, frame->name->length);
+      fprintf(out, ", %d), %d);\n", frame->name->length, frame->caller);
+    }
+  }
+
+  fprintf(out, "\n  vm.stackTop -= %d;\n", program->count);
+  fprintf(out, "  return functions[%d];\n}\n\n", program->count - 1);
+}
+
+static void emitMain(FILE* out) {
+  fprintf(out,
+          "int main(int argc, const char* argv[]) {\n"
+          "  initVM();\n"
+          "  ObjFunction* script = loadProgram();\n"
+          "  push(OBJ_VAL(script));\n"
+          "  ObjClosure* closure = newClosure(script);\n"
+          "  pop();\n"
+          "  push(OBJ_VAL(closure));\n"
+          "  callValue(OBJ_VAL(closure), 0);\n"
+          "  bool ok = runFrame();\n"
+          "  freeVM();\n"
+          "  return ok ? 0 : 70;\n"
+          "}\n");
+}
+
+bool emitC(const char* source, const char* path, FILE* out) {
+  ObjFunction* script = compile(source);
+  if (script == NULL) return false;
+
+  Program program = {NULL, 0, 0};
+  collectFunctions(&program, script);
+  FunctionEmitter* emitters = malloc(sizeof(FunctionEmitter) * program.count);
+  bool* compiled = malloc(sizeof(bool) * program.count);
+  if (emitters == NULL || compiled == NULL) exit(1);
+
+  for (int i = 0; i < program.count; i++) {
+    FunctionEmitter* emitter = &emitters[i];
+    int count = program.functions[i]->chunk.count;
+    emitter->out = out;
+    emitter->function = program.functions[i];
+    emitter->index = i;
+    emitter->depths = malloc(sizeof(int) * count);
+    emitter->labels = calloc(count, sizeof(bool));
+    emitter->captured = calloc(UINT8_COUNT + 1, sizeof(bool));
+    if (emitter->depths == NULL || emitter->labels == NULL ||
+        emitter->captured == NULL) {
+      exit(1);
+    }
+    for (int j = 0; j < count; j++) emitter->depths[j] = DEPTH_UNKNOWN;
+    compiled[i] = analyze(emitter) && emitter->maxDepth <= UINT8_COUNT;
+  }
+
+  emitPrelude(out, path);
+  fprintf(out, "static ObjFunction* functions[%d];\n\n", program.count);
+  for (int i = 0; i < program.count; i++) {
+    if (compiled[i]) {
+      fprintf(out, "static int body%d(CallFrame* frame);\n", i);
+    }
+  }
+  fprintf(out, "\n");
+
+  for (int i = 0; i < program.count; i++) {
+    if (compiled[i]) emitBody(&emitters[i], &program);
+    free(emitters[i].depths);
+    free(emitters[i].labels);
+    free(emitters[i].captured);
+  }
+
+  emitLoader(out, &program, compiled);
+  emitMain(out);
+
+  free(emitters);
+  free(compiled);
+  free(program.functions);
+  return true;
+}
@@ -0,0 +1,12 @@
+#ifndef _EMITC_H_
+#define _EMITC_H_
+
+#include <stdio.h>
+
+#include "common.h"
+
+// Compile source and write it to out as a C program that runs it on the
+// VM's runtime. Returns false on a compile error.
+bool emitC(const char* source, const char* path, FILE* out);
+
+#endif
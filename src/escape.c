@@ -0,0 +1,287 @@
+#include "escape.h"
+
+#include <stdlib.h>
+
+#include "memory.h"
+
+static bool isFunction(Value value) {
+  return IS_OBJ(value) && OBJ_TYPE(value) == OBJ_FUNCTION;
+}
+
+// The pass works on byte operands throughout, so code needing any wide form
+// is left as it is.
+static bool hasWide(Chunk* chunk) {
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (isWide(chunk->code[offset])) return true;
+  }
+  return false;
+}
+
+static bool capturesLocal(Chunk* chunk, int offset, int slot) {
+  uint8_t* ip = &chunk->code[offset];
+  ObjFunction* function = AS_FUNCTION(chunk->constants.values[ip[1]]);
+  for (int i = 0; i < function->upvalueCount; i++) {
+    if (ip[2 + i * 2] && ip[3 + i * 2] == slot) return true;
+  }
+  return false;
+}
+
+// Whether a register-form instruction names the slot. Constant operands are
+// looked at too, which only ever errs towards keeping an upvalue.
+static bool registerUse(Chunk* chunk, int offset, int slot) {
+  uint8_t* ip = &chunk->code[offset];
+  if (ip[0] < OP_MOVE || ip[0] > OP_DIVIDE_RRK) return false;
+  for (int i = 1; i < instructionLength(chunk, offset); i++) {
+    if (ip[i] == slot) return true;
+  }
+  return false;
+}
+
+// Find where the local holding the closure created at offset goes out of
+// scope, or return -1 if the closure can get anywhere else: every read of
+// the local must be the callee of a call, nothing may store over it or
+// capture it, and its scope must end by popping it.
+static int scopeEnd(Chunk* chunk, int* depths, int* calls, int offset) {
+  int slot = depths[offset];
+  // One capturing itself would call itself from its own frame.
+  if (capturesLocal(chunk, offset, slot)) return -1;
+
+  for (int i = offset + instructionLength(chunk, offset); i < chunk->count;
+       i += instructionLength(chunk, i)) {
+    uint8_t* ip = &chunk->code[i];
+    if (depths[i] + stackEffect(chunk, i) <= slot) {
+      bool popped = ip[0] == OP_POP || ip[0] == OP_CLOSE_UPVALUE;
+      return popped && depths[i] == slot + 1 ? i : -1;
+    }
+
+    switch (ip[0]) {
+      case OP_GET_LOCAL:
+        if (ip[1] == slot && calls[i] < 0) return -1;
+        break;
+      case OP_SET_LOCAL:
+        if (ip[1] == slot) return -1;
+        break;
+      case OP_RETURN:
+        if (depths[i] == slot + 1) return -1;
+        break;
+      case OP_CLOSURE:
+        if (capturesLocal(chunk, i, slot)) return -1;
+        break;
+      default:
+        if (registerUse(chunk, i, slot)) return -1;
+        break;
+    }
+  }
+  return chunk->count;
+}
+
+// Turn the closure's upvalues on locals of the defining frame into
+// OP_GET_ENCLOSING and OP_SET_ENCLOSING, except those its own closures
+// capture in turn, and number the rest afresh. pairs holds its (isLocal,
+// index) operands; keep is set for those that stay. Return how many do, or
+// -1 if there was nothing to turn.
+static int convert(ObjFunction* closure, uint8_t* pairs, bool* keep) {
+  Chunk* chunk = &closure->chunk;
+  bool recaptured[UINT8_COUNT] = {false};
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t* ip = &chunk->code[offset];
+    if (ip[0] != OP_CLOSURE) continue;
+    ObjFunction* inner = AS_FUNCTION(chunk->constants.values[ip[1]]);
+    for (int i = 0; i < inner->upvalueCount; i++) {
+      if (!ip[2 + i * 2]) recaptured[ip[3 + i * 2]] = true;
+    }
+  }
+
+  uint8_t numbers[UINT8_COUNT];
+  int kept = 0;
+  for (int i = 0; i < closure->upvalueCount; i++) {
+    keep[i] = !pairs[i * 2] || recaptured[i];
+    if (keep[i]) numbers[i] = (uint8_t)kept++;
+  }
+  if (kept == closure->upvalueCount) return -1;
+
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t* ip = &chunk->code[offset];
+    switch (ip[0]) {
+      case OP_GET_UPVALUE:
+      case OP_SET_UPVALUE:
+        if (keep[ip[1]]) {
+          ip[1] = numbers[ip[1]];
+        } else {
+          ip[0] = ip[0] == OP_GET_UPVALUE ? OP_GET_ENCLOSING
+                                          : OP_SET_ENCLOSING;
+          ip[1] = pairs[ip[1] * 2 + 1];
+        }
+        break;
+      case OP_CLOSURE: {
+        ObjFunction* inner = AS_FUNCTION(chunk->constants.values[ip[1]]);
+        for (int i = 0; i < inner->upvalueCount; i++) {
+          if (!ip[2 + i * 2]) ip[3 + i * 2] = numbers[ip[3 + i * 2]];
+        }
+        break;
+      }
+    }
+  }
+  return kept;
+}
+
+// Close up the gaps left by dropped capture operands, moving jumps and the
+// function's call sites along with the code. The kept counts only take
+// effect once the old code has been read, since instructionLength() reads
+// them.
+static void compact(ObjFunction* function, bool* dropped, ObjFunction** shrunk,
+                    int* counts, int shrunkCount, CallSites* sites) {
+  Chunk* chunk = &function->chunk;
+  int* offsets = malloc(sizeof(int) * (chunk->count + 1));
+  uint8_t* code = malloc(sizeof(uint8_t) * (chunk->count * 2 + 1));
+  int* lines = malloc(sizeof(int) * (chunk->count * 2 + 1));
+  int* locations = chunkLocations(chunk);
+  if (offsets == NULL || code == NULL || lines == NULL) exit(1);
+
+  // Jumps go in wide, holding their targets, for rewriteCode() to encode.
+  int count = 0;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    offsets[offset] = count;
+    uint8_t* ip = &chunk->code[offset];
+    if (isJump(ip[0])) {
+      for (int i = 0; i < 5; i++) lines[count + i] = locations[offset];
+      code[count] = wideJump(ip[0]);
+      count += 5;
+      continue;
+    }
+    for (int i = 0; i < instructionLength(chunk, offset); i++) {
+      if (dropped[offset + i]) continue;
+      lines[count] = locations[offset + i];
+      code[count++] = ip[i];
+    }
+  }
+  offsets[chunk->count] = count;
+
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (!isJump(chunk->code[offset])) continue;
+    setJumpTarget(&code[offsets[offset]], offsets[jumpTarget(chunk, offset)]);
+  }
+
+  for (int i = 0; i < shrunkCount; i++) shrunk[i]->upvalueCount = counts[i];
+  int* moved = malloc(sizeof(int) * (count + 1));
+  if (moved == NULL) exit(1);
+  rewriteCode(chunk, code, lines, count, moved);
+
+  for (int i = 0; i < sites->count; i++) {
+    CallSite* site = &sites->sites[i];
+    if (site->caller != function) continue;
+    site->load = moved[offsets[site->load]];
+    site->call = moved[offsets[site->call]];
+  }
+  free(moved);
+  free(code);
+  free(lines);
+  free(locations);
+  free(offsets);
+}
+
+// With fewer captures, some locals are no longer captured by anything and
+// can simply be popped at the end of their scope
+static void uncloseLocals(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  bool captured[UINT8_COUNT] = {false};
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t* ip = &chunk->code[offset];
+    if (ip[0] != OP_CLOSURE) continue;
+    ObjFunction* closure = AS_FUNCTION(chunk->constants.values[ip[1]]);
+    for (int i = 0; i < closure->upvalueCount; i++) {
+      if (ip[2 + i * 2]) captured[ip[3 + i * 2]] = true;
+    }
+  }
+
+  int* depths = stackDepths(chunk, function->arity + 1);
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (chunk->code[offset] == OP_CLOSE_UPVALUE &&
+        !captured[depths[offset] - 1]) {
+      chunk->code[offset] = OP_POP;
+    }
+  }
+  free(depths);
+}
+
+static void eliminateIn(ObjFunction* function, CallSites* sites) {
+  Chunk* chunk = &function->chunk;
+  if (hasWide(chunk)) return;
+  int* depths = stackDepths(chunk, function->arity + 1);
+  int* calls = malloc(sizeof(int) * (chunk->count + 1));
+  bool* dropped = calloc(chunk->count + 1, sizeof(bool));
+  if (calls == NULL || dropped == NULL) exit(1);
+  for (int i = 0; i <= chunk->count; i++) calls[i] = -1;
+
+  // Calls whose callee is a local read, by the offset of that read.
+  for (int i = 0; i < sites->count; i++) {
+    CallSite* site = &sites->sites[i];
+    if (site->caller != function) continue;
+    uint8_t* load = &chunk->code[site->load];
+    uint8_t* call = &chunk->code[site->call];
+    if (load[0] != OP_GET_LOCAL) continue;
+    if (call[0] != OP_CALL && call[0] != OP_TAIL_CALL) continue;
+    if (depths[site->call] - call[1] - 1 != depths[site->load]) continue;
+    calls[site->load] = site->call;
+  }
+
+  // The kept counts are set by compact(), once it has read the old code.
+  ObjFunction* shrunk[UINT8_COUNT];
+  int counts[UINT8_COUNT];
+  int shrunkCount = 0;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t* ip = &chunk->code[offset];
+    if (ip[0] != OP_CLOSURE) continue;
+    ObjFunction* closure = AS_FUNCTION(chunk->constants.values[ip[1]]);
+    if (closure->upvalueCount == 0 || hasWide(&closure->chunk)) continue;
+
+    int end = scopeEnd(chunk, depths, calls, offset);
+    bool keep[UINT8_COUNT];
+    int kept = end < 0 ? -1 : convert(closure, &ip[2], keep);
+    if (kept < 0) continue;
+
+    for (int i = 0; i < closure->upvalueCount; i++) {
+      if (keep[i]) continue;
+      dropped[offset + 2 + i * 2] = dropped[offset + 3 + i * 2] = true;
+    }
+    shrunk[shrunkCount] = closure;
+    counts[shrunkCount++] = kept;
+
+    // A tail call would put the callee where this frame was.
+    int slot = depths[offset];
+    for (int i = offset; i < end; i += instructionLength(chunk, i)) {
+      if (chunk->code[i] == OP_GET_LOCAL && chunk->code[i + 1] == slot) {
+        chunk->code[calls[i]] = OP_CALL;
+      }
+    }
+  }
+
+  if (shrunkCount > 0) {
+    compact(function, dropped, shrunk, counts, shrunkCount, sites);
+    uncloseLocals(function);
+  }
+
+  free(depths);
+  free(calls);
+  free(dropped);
+}
+
+void eliminateUpvalues(ObjFunction* function, CallSites* sites) {
+  // Nested functions first, so a closure's code is final before the
+  // function creating it rewrites its upvalue instructions.
+  ValueArray* constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (isFunction(constants->values[i])) {
+      eliminateUpvalues(AS_FUNCTION(constants->values[i]), sites);
+    }
+  }
+  eliminateIn(function, sites);
+}
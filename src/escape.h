@@ -0,0 +1,13 @@
+#ifndef _ESCAPE_H_
+#define _ESCAPE_H_
+
+#include "inliner.h"
+
+// Give closures that never leave the function defining them direct access
+// to its frame instead of heap upvalues. Such a closure sits in a local that
+// is only ever called, so while it runs the frame below it is the one whose
+// locals it captured. The sites' offsets point into the code as parsed, and
+// still point at the same instructions afterwards.
+void eliminateUpvalues(ObjFunction* function, CallSites* sites);
+
+#endif
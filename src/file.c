@@ -0,0 +1,56 @@
+#include "file.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+uint64_t hashBytes(uint64_t hash, const uint8_t* bytes, size_t size) {
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, bytes + i, sizeof(word));
+    hash = (hash ^ word) * 1099511628211u;
+  }
+  for (; i < size; i++) hash = (hash ^ bytes[i]) * 1099511628211u;
+  return hash;
+}
+
+uint8_t* mapFile(const char* path, size_t minimum, size_t* size) {
+  int descriptor = open(path, O_RDONLY);
+  if (descriptor < 0) return NULL;
+
+  struct stat status;
+  void* mapping = MAP_FAILED;
+  if (fstat(descriptor, &status) == 0 &&
+      (uint64_t)status.st_size >= minimum) {
+    *size = (size_t)status.st_size;
+    mapping = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                   descriptor, 0);
+  }
+  close(descriptor);
+  return mapping == MAP_FAILED ? NULL : mapping;
+}
+
+bool writeFile(const char* path, const uint8_t* bytes, size_t size) {
+  bool written = false;
+  size_t length = strlen(path) + 32;
+  char* temporary = malloc(length);
+  if (temporary == NULL) exit(1);
+  snprintf(temporary, length, "%s.%ld.tmp", path, (long)getpid());
+
+  FILE* file = fopen(temporary, "wb");
+  if (file != NULL) {
+    fwrite(bytes, 1, size, file);
+    written = !ferror(file);
+    if (fclose(file) != 0) written = false;
+    if (written && rename(temporary, path) != 0) written = false;
+    if (!written) remove(temporary);
+  }
+
+  free(temporary);
+  return written;
+}
@@ -0,0 +1,37 @@
+#ifndef _FILE_H_
+#define _FILE_H_
+
+#include "common.h"
+
+// Where hashBytes() starts a hash: FNV-1a's offset basis.
+#define HASH_START 14695981039346656037u
+
+// FNV-1a of size bytes, continuing from hash, folding in a word at a time
+// so checking a large file costs little more than reading it. Keys the
+// bytecode cache and checksums cache files, images and snapshots.
+uint64_t hashBytes(uint64_t hash, const uint8_t* bytes, size_t size);
+
+// Map the file at path, or return NULL if it cannot be or is shorter than
+// minimum. Private and writable: pointers are filled in and code is
+// quickened in place, each page copied only once it is written.
+uint8_t* mapFile(const char* path, size_t minimum, size_t* size);
+
+// Write size bytes to path under a name of its own and then move them into
+// place, so another process never reads or maps a file that is half
+// written. Returns false if the file could not be written.
+bool writeFile(const char* path, const uint8_t* bytes, size_t size);
+
+static inline size_t alignTo(size_t offset, size_t alignment) {
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+static inline bool aligned(uint64_t offset, size_t alignment) {
+  return offset % alignment == 0;
+}
+
+// Whether length bytes at offset lie within a file of size bytes.
+static inline bool fits(size_t size, uint64_t offset, uint64_t length) {
+  return offset <= size && length <= size - offset;
+}
+
+#endif
@@ -129,7 +129,7 @@ ObjString* findStringInstance(Table* table, const char* chars, int length,
 void removeWhiteInstance(Table* table) {
   for (int i = 0; i < table->capacity; i++) {
     Entry* entry = &table->entries[i];
-    if (entry->key != NULL && !entry->key->obj.isMarked) {
+    if (entry->key != NULL && !isObjectMarked((Obj*)entry->key)) {
         deleteInstance(table, entry->key);
     }
   }
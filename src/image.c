@@ -0,0 +1,612 @@
+#include "image.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "file.h"
+#include "jit.h"
+#include "memory.h"
+#include "vm.h"
+
+// An image is a header and tables of strings, functions, global names and
+// relocations, followed by the data the tables point into by offset: string
+// bytes, code and line runs, then constants and inline frames. Everything is
+// stored as this build holds it in memory, so a loaded function's chunk
+// points straight into the mapping.
+//
+// Only the constants and inline frames hold pointers. They are written with
+// placeholders and come after a page boundary, so filling in the pointers on
+// loading copies those pages alone; the rest stay shared between processes
+// that map the same image, until the VM quickens an instruction on one.
+//
+// Like the executable, an image is trusted: its layout is checked, but not
+// its code.
+//
+// Bump the version whenever this layout or the meaning of any instruction
+// changes; the last opcode only catches instructions being added.
+#define IMAGE_VERSION 1
+#define NO_NAME 0xffffffffu
+
+// The largest page size in common use.
+#define IMAGE_PAGE 16384
+
+static const uint8_t magic[4] = {'E', 'C', 'I', '\n'};
+
+typedef struct {
+  uint8_t magic[4];
+  uint32_t version;
+  uint32_t lastOpcode;
+  uint32_t layout;
+  uint32_t byteOrder;
+  uint32_t stringCount;
+  uint32_t functionCount;  // The first is the script.
+  uint32_t globalCount;
+  uint32_t relocationCount;
+  uint32_t relocated;  // Offset of the page the constants start on.
+  uint64_t size;
+} ImageHeader;
+
+typedef struct {
+  uint32_t chars;  // Followed by a NUL, as the VM's strings are.
+  uint32_t length;
+  uint32_t hash;
+} ImageString;
+
+typedef struct {
+  uint32_t name;  // Index of a string, or NO_NAME for the script.
+  uint32_t arity;
+  uint32_t upvalueCount;
+  uint32_t maxSlots;
+  uint32_t code;
+  uint32_t count;
+  uint32_t lines;
+  uint32_t lineCount;
+  uint32_t constants;
+  uint32_t constantCount;
+  uint32_t inlines;
+  uint32_t inlineCount;
+} ImageFunction;
+
+typedef enum {
+  RELOCATE_STRING,    // A constant holding a string.
+  RELOCATE_FUNCTION,  // A constant holding a function.
+  RELOCATE_NAME,      // The name of an inline frame.
+} RelocationKind;
+
+typedef struct {
+  uint32_t offset;  // Of the constant or name to fill in.
+  uint32_t kind;
+  uint32_t index;  // Of the string or function it refers to.
+} ImageRelocation;
+
+// A loaded image. Its object headers are allocated outside the heap and
+// marked for good, so the collector neither traces nor sweeps them.
+typedef struct Image {
+  struct Image* next;
+  uint8_t* bytes;
+  size_t size;
+  ObjString* strings;  // Headers for the strings that were not interned yet.
+  ObjFunction* functions;
+  int functionCount;
+  ObjString** roots;  // Strings from the heap its constants refer to.
+  int rootCount;
+} Image;
+
+static Image* images = NULL;
+
+static int* findSlot(Numbering* numbering, Obj* object) {
+  size_t mask = (size_t)numbering->slotCount - 1;
+  size_t index = ((uintptr_t)object >> 4) & mask;
+  for (;;) {
+    int* slot = &numbering->slots[index];
+    if (*slot == 0 || numbering->objects[*slot - 1] == object) return slot;
+    index = (index + 1) & mask;
+  }
+}
+
+int numberOf(Numbering* numbering, Obj* object) {
+  if (numbering->slotCount < (numbering->count + 1) * 2) {
+    int* slots = numbering->slots;
+    int slotCount = numbering->slotCount;
+    numbering->slotCount = slotCount < 16 ? 16 : slotCount * 2;
+    numbering->slots = calloc(numbering->slotCount, sizeof(int));
+    numbering->objects = realloc(numbering->objects,
+                                 numbering->slotCount / 2 * sizeof(Obj*));
+    if (numbering->slots == NULL || numbering->objects == NULL) exit(1);
+    for (int i = 0; i < slotCount; i++) {
+      if (slots[i] != 0) {
+        *findSlot(numbering, numbering->objects[slots[i] - 1]) = slots[i];
+      }
+    }
+    free(slots);
+  }
+
+  int* slot = findSlot(numbering, object);
+  if (*slot == 0) {
+    numbering->objects[numbering->count] = object;
+    *slot = ++numbering->count;
+  }
+  return *slot - 1;
+}
+
+void freeNumbering(Numbering* numbering) {
+  free(numbering->objects);
+  free(numbering->slots);
+}
+
+typedef struct {
+  Numbering strings;
+  Numbering functions;
+  int relocationCount;
+  bool failed;  // Something in the graph has no place in an image.
+} Collector;
+
+static void collectFunction(Collector* collector, ObjFunction* function) {
+  int count = collector->functions.count;
+  numberOf(&collector->functions, (Obj*)function);
+  if (collector->functions.count == count) return;
+
+  Chunk* chunk = &function->chunk;
+  if (function->name != NULL) {
+    numberOf(&collector->strings, (Obj*)function->name);
+  }
+  for (int i = 0; i < chunk->inlineCount; i++) {
+    if (chunk->inlines[i].name == NULL) continue;
+    numberOf(&collector->strings, (Obj*)chunk->inlines[i].name);
+    collector->relocationCount++;
+  }
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value value = chunk->constants.values[i];
+    if (IS_STRING(value)) {
+      numberOf(&collector->strings, AS_OBJ(value));
+      collector->relocationCount++;
+    } else if (IS_OBJ(value) && OBJ_TYPE(value) == OBJ_FUNCTION) {
+      collectFunction(collector, AS_FUNCTION(value));
+      collector->relocationCount++;
+    } else if (IS_OBJ(value)) {
+      collector->failed = true;
+    }
+  }
+}
+
+static void addRelocation(ImageRelocation** relocation, size_t offset,
+                          RelocationKind kind, int index) {
+  (*relocation)->offset = (uint32_t)offset;
+  (*relocation)->kind = kind;
+  (*relocation)->index = (uint32_t)index;
+  (*relocation)++;
+}
+
+// Lay the image out in a buffer of its own, or return NULL if it would not
+// fit the 32-bit offsets
+static uint8_t* buildImage(Collector* collector, size_t* size) {
+  int stringCount = collector->strings.count;
+  int functionCount = collector->functions.count;
+  int globalCount = vm.globalNames.count;
+  ImageString* strings = calloc(stringCount + 1, sizeof(ImageString));
+  ImageFunction* functions = calloc(functionCount, sizeof(ImageFunction));
+  if (strings == NULL || functions == NULL) exit(1);
+
+  size_t position = sizeof(ImageHeader) +
+                    stringCount * sizeof(ImageString) +
+                    functionCount * sizeof(ImageFunction) +
+                    globalCount * sizeof(uint32_t) +
+                    collector->relocationCount * sizeof(ImageRelocation);
+  for (int i = 0; i < stringCount; i++) {
+    ObjString* string = (ObjString*)collector->strings.objects[i];
+    strings[i].chars = (uint32_t)position;
+    strings[i].length = (uint32_t)string->length;
+    strings[i].hash = string->hash;
+    position += string->length + 1;
+  }
+  for (int i = 0; i < functionCount; i++) {
+    functions[i].code = (uint32_t)position;
+    position += ((ObjFunction*)collector->functions.objects[i])->chunk.count;
+  }
+  position = alignTo(position, _Alignof(LineRun));
+  for (int i = 0; i < functionCount; i++) {
+    functions[i].lines = (uint32_t)position;
+    position += ((ObjFunction*)collector->functions.objects[i])
+                    ->chunk.lineCount * sizeof(LineRun);
+  }
+
+  size_t relocated = alignTo(position, IMAGE_PAGE);
+  position = alignTo(relocated, _Alignof(Value));
+  for (int i = 0; i < functionCount; i++) {
+    functions[i].constants = (uint32_t)position;
+    position += ((ObjFunction*)collector->functions.objects[i])
+                    ->chunk.constants.count * sizeof(Value);
+  }
+  position = alignTo(position, _Alignof(InlineFrame));
+  for (int i = 0; i < functionCount; i++) {
+    functions[i].inlines = (uint32_t)position;
+    position += ((ObjFunction*)collector->functions.objects[i])
+                    ->chunk.inlineCount * sizeof(InlineFrame);
+  }
+
+  uint8_t* bytes = NULL;
+  if (position <= UINT32_MAX) {
+    bytes = calloc(position, 1);
+    if (bytes == NULL) exit(1);
+  }
+  if (bytes == NULL) {
+    free(strings);
+    free(functions);
+    return NULL;
+  }
+
+  ImageHeader* header = (ImageHeader*)bytes;
+  memcpy(header->magic, magic, sizeof(magic));
+  header->version = IMAGE_VERSION;
+  header->lastOpcode = OP_CALL_NATIVE;
+  header->layout = IMAGE_LAYOUT;
+  header->byteOrder = BYTE_ORDER_MARK;
+  header->stringCount = (uint32_t)stringCount;
+  header->functionCount = (uint32_t)functionCount;
+  header->globalCount = (uint32_t)globalCount;
+  header->relocationCount = (uint32_t)collector->relocationCount;
+  header->relocated = (uint32_t)relocated;
+  header->size = position;
+
+  uint8_t* table = bytes + sizeof(ImageHeader);
+  uint32_t* globals = (uint32_t*)(table + stringCount * sizeof(ImageString) +
+                                  functionCount * sizeof(ImageFunction));
+  for (int i = 0; i < globalCount; i++) {
+    globals[i] = (uint32_t)numberOf(&collector->strings,
+                                    AS_OBJ(vm.globalNames.values[i]));
+  }
+
+  for (int i = 0; i < stringCount; i++) {
+    ObjString* string = (ObjString*)collector->strings.objects[i];
+    memcpy(bytes + strings[i].chars, string->chars, string->length);
+  }
+
+  ImageRelocation* relocation = (ImageRelocation*)(globals + globalCount);
+  for (int i = 0; i < functionCount; i++) {
+    ObjFunction* function = (ObjFunction*)collector->functions.objects[i];
+    Chunk* chunk = &function->chunk;
+    ImageFunction* entry = &functions[i];
+    entry->name = function->name == NULL
+                      ? NO_NAME
+                      : (uint32_t)numberOf(&collector->strings,
+                                           (Obj*)function->name);
+    entry->arity = (uint32_t)function->arity;
+    entry->upvalueCount = (uint32_t)function->upvalueCount;
+    entry->maxSlots = (uint32_t)function->maxSlots;
+    entry->count = (uint32_t)chunk->count;
+    entry->lineCount = (uint32_t)chunk->lineCount;
+    entry->constantCount = (uint32_t)chunk->constants.count;
+    entry->inlineCount = (uint32_t)chunk->inlineCount;
+
+    memcpy(bytes + entry->code, chunk->code, chunk->count);
+    memcpy(bytes + entry->lines, chunk->lines,
+           chunk->lineCount * sizeof(LineRun));
+
+    Value* constants = (Value*)(bytes + entry->constants);
+    for (int j = 0; j < chunk->constants.count; j++) {
+      Value value = chunk->constants.values[j];
+      size_t offset = entry->constants + j * sizeof(Value);
+      constants[j] = IS_OBJ(value) ? NIL_VAL : value;
+      if (IS_STRING(value)) {
+        addRelocation(&relocation, offset, RELOCATE_STRING,
+                      numberOf(&collector->strings, AS_OBJ(value)));
+      } else if (IS_OBJ(value)) {
+        addRelocation(&relocation, offset, RELOCATE_FUNCTION,
+                      numberOf(&collector->functions, AS_OBJ(value)));
+      }
+    }
+
+    InlineFrame* inlines = (InlineFrame*)(bytes + entry->inlines);
+    for (int j = 0; j < chunk->inlineCount; j++) {
+      inlines[j].line = chunk->inlines[j].line;
+      inlines[j].caller = chunk->inlines[j].caller;
+      if (chunk->inlines[j].name == NULL) continue;
+      addRelocation(&relocation,
+                    entry->inlines + j * sizeof(InlineFrame) +
+                        offsetof(InlineFrame, name),
+                    RELOCATE_NAME,
+                    numberOf(&collector->strings,
+                             (Obj*)chunk->inlines[j].name));
+    }
+  }
+
+  memcpy(table, strings, stringCount * sizeof(ImageString));
+  memcpy(table + stringCount * sizeof(ImageString), functions,
+         functionCount * sizeof(ImageFunction));
+  free(strings);
+  free(functions);
+  *size = position;
+  return bytes;
+}
+
+bool writeImage(ObjFunction* function, const char* path) {
+  Collector collector = {{NULL, 0, NULL, 0}, {NULL, 0, NULL, 0}, 0, false};
+  collectFunction(&collector, function);
+  for (int i = 0; i < vm.globalNames.count; i++) {
+    numberOf(&collector.strings, AS_OBJ(vm.globalNames.values[i]));
+  }
+
+  size_t size = 0;
+  uint8_t* bytes = collector.failed ? NULL : buildImage(&collector, &size);
+  freeNumbering(&collector.strings);
+  freeNumbering(&collector.functions);
+  if (bytes == NULL) return false;
+
+  bool written = writeFile(path, bytes, size);
+  free(bytes);
+  return written;
+}
+
+// Check everything the loader will follow lies inside the file
+static bool validImage(const uint8_t* bytes, size_t size) {
+  const ImageHeader* header = (const ImageHeader*)bytes;
+  if (memcmp(header->magic, magic, sizeof(magic)) != 0 ||
+      header->version != IMAGE_VERSION ||
+      header->lastOpcode != OP_CALL_NATIVE ||
+      header->layout != IMAGE_LAYOUT ||
+      header->byteOrder != BYTE_ORDER_MARK || header->size != size ||
+      header->functionCount == 0 || header->stringCount > INT32_MAX ||
+      header->functionCount > INT32_MAX) {
+    return false;
+  }
+
+  uint64_t tables =
+      sizeof(ImageHeader) +
+      (uint64_t)header->stringCount * sizeof(ImageString) +
+      (uint64_t)header->functionCount * sizeof(ImageFunction) +
+      (uint64_t)header->globalCount * sizeof(uint32_t) +
+      (uint64_t)header->relocationCount * sizeof(ImageRelocation);
+  if (tables > header->relocated || header->relocated > size) return false;
+
+  const ImageString* strings =
+      (const ImageString*)(bytes + sizeof(ImageHeader));
+  for (uint32_t i = 0; i < header->stringCount; i++) {
+    const ImageString* string = &strings[i];
+    if (string->length > INT32_MAX ||
+        !fits(size, string->chars, (uint64_t)string->length + 1) ||
+        bytes[string->chars + string->length] != '\0') {
+      return false;
+    }
+  }
+
+  const ImageFunction* functions =
+      (const ImageFunction*)(strings + header->stringCount);
+  for (uint32_t i = 0; i < header->functionCount; i++) {
+    const ImageFunction* function = &functions[i];
+    if ((function->name != NO_NAME && function->name >= header->stringCount) ||
+        function->arity > INT32_MAX || function->upvalueCount > INT32_MAX ||
+        function->maxSlots > INT32_MAX || function->count > INT32_MAX ||
+        function->lineCount > INT32_MAX ||
+        function->constantCount > INT32_MAX ||
+        function->inlineCount > INT32_MAX ||
+        !fits(size, function->code, function->count) ||
+        !aligned(function->lines, _Alignof(LineRun)) ||
+        !fits(size, function->lines,
+              (uint64_t)function->lineCount * sizeof(LineRun)) ||
+        !aligned(function->constants, _Alignof(Value)) ||
+        !fits(size, function->constants,
+              (uint64_t)function->constantCount * sizeof(Value)) ||
+        !aligned(function->inlines, _Alignof(InlineFrame)) ||
+        !fits(size, function->inlines,
+              (uint64_t)function->inlineCount * sizeof(InlineFrame))) {
+      return false;
+    }
+  }
+
+  const uint32_t* globals = (const uint32_t*)(functions +
+                                              header->functionCount);
+  for (uint32_t i = 0; i < header->globalCount; i++) {
+    if (globals[i] >= header->stringCount) return false;
+  }
+
+  const ImageRelocation* relocations =
+      (const ImageRelocation*)(globals + header->globalCount);
+  for (uint32_t i = 0; i < header->relocationCount; i++) {
+    const ImageRelocation* relocation = &relocations[i];
+    uint32_t limit = relocation->kind == RELOCATE_FUNCTION
+                         ? header->functionCount
+                         : header->stringCount;
+    if (relocation->kind > RELOCATE_NAME || relocation->index >= limit ||
+        relocation->offset < header->relocated ||
+        !aligned(relocation->offset, _Alignof(Value)) ||
+        !aligned(relocation->offset, _Alignof(ObjString*)) ||
+        !fits(size, relocation->offset, sizeof(Value)) ||
+        !fits(size, relocation->offset, sizeof(ObjString*))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The code refers to globals by slot, so each must land where it was when
+// the image was written: in a slot with that name already, or a new one.
+static bool globalsFit(const uint8_t* bytes) {
+  const ImageHeader* header = (const ImageHeader*)bytes;
+  const ImageString* strings =
+      (const ImageString*)(bytes + sizeof(ImageHeader));
+  const uint32_t* globals =
+      (const uint32_t*)((const ImageFunction*)(strings +
+                                               header->stringCount) +
+                        header->functionCount);
+
+  for (uint32_t i = 0; i < header->globalCount; i++) {
+    const ImageString* name = &strings[globals[i]];
+    ObjString* interned =
+        findStringInstance(&vm.strings, (const char*)bytes + name->chars,
+                           (int)name->length, name->hash);
+    Value slot;
+    bool taken =
+        interned != NULL && getInstance(&vm.globalSlots, interned, &slot);
+    if (i < (uint32_t)vm.globalNames.count
+            ? !taken || AS_NUMBER(slot) != i
+            : taken) {
+      return false;
+    }
+  }
+  return true;
+}
+
+ObjFunction* loadImage(const char* path) {
+  size_t size = 0;
+  uint8_t* bytes = mapFile(path, sizeof(ImageHeader), &size);
+  if (bytes == NULL) return NULL;
+
+  if (!validImage(bytes, size) || !globalsFit(bytes)) {
+    munmap(bytes, size);
+    return NULL;
+  }
+
+  const ImageHeader* header = (const ImageHeader*)bytes;
+  const ImageString* strings =
+      (const ImageString*)(bytes + sizeof(ImageHeader));
+  const ImageFunction* functions =
+      (const ImageFunction*)(strings + header->stringCount);
+  const uint32_t* globals =
+      (const uint32_t*)(functions + header->functionCount);
+  const ImageRelocation* relocations =
+      (const ImageRelocation*)(globals + header->globalCount);
+
+  Image* image = malloc(sizeof(Image));
+  ObjString** interned = malloc((header->stringCount + 1) *
+                                sizeof(ObjString*));
+  if (image == NULL || interned == NULL) exit(1);
+  image->bytes = bytes;
+  image->size = size;
+  image->strings = calloc(header->stringCount + 1, sizeof(ObjString));
+  image->functions = calloc(header->functionCount, sizeof(ObjFunction));
+  image->functionCount = 0;
+  image->roots = malloc((header->stringCount + 1) * sizeof(ObjString*));
+  image->rootCount = 0;
+  if (image->strings == NULL || image->functions == NULL ||
+      image->roots == NULL) {
+    exit(1);
+  }
+  // Linked in first, so the heap strings it takes up stay rooted while
+  // interning the rest collects garbage.
+  image->next = images;
+  images = image;
+
+  // A string the VM has already interned must be used in its place, or the
+  // two would not compare equal.
+  for (uint32_t i = 0; i < header->stringCount; i++) {
+    char* chars = (char*)bytes + strings[i].chars;
+    int length = (int)strings[i].length;
+    ObjString* string =
+        findStringInstance(&vm.strings, chars, length, strings[i].hash);
+    if (string != NULL) {
+      image->roots[image->rootCount++] = string;
+    } else {
+      string = &image->strings[i];
+      string->obj.type = OBJ_STRING;
+      string->obj.isMarked = true;
+      string->length = length;
+      string->chars = chars;
+      string->hash = strings[i].hash;
+      setInstance(&vm.strings, string, NIL_VAL);
+    }
+    interned[i] = string;
+  }
+
+  // The chunks are never written through writeChunk() or freed, but with
+  // capacities matching their counts nothing would grow them in place.
+  for (uint32_t i = 0; i < header->functionCount; i++) {
+    const ImageFunction* entry = &functions[i];
+    ObjFunction* function = &image->functions[i];
+    function->Obj.type = OBJ_FUNCTION;
+    function->Obj.isMarked = true;
+    function->arity = (int)entry->arity;
+    function->upvalueCount = (int)entry->upvalueCount;
+    function->maxSlots = (int)entry->maxSlots;
+    function->name = entry->name == NO_NAME ? NULL : interned[entry->name];
+    function->callCount = 0;
+    function->jitCode = NULL;
+    function->traces = NULL;
+    function->aotCode = NULL;
+    function->closure = NULL;
+
+    Chunk* chunk = &function->chunk;
+    chunk->code = bytes + entry->code;
+    chunk->count = chunk->capacity = (int)entry->count;
+    chunk->lines = (LineRun*)(bytes + entry->lines);
+    chunk->lineCount = chunk->lineCapacity = (int)entry->lineCount;
+    chunk->constants.values = (Value*)(bytes + entry->constants);
+    chunk->constants.count = (int)entry->constantCount;
+    chunk->constants.capacity = (int)entry->constantCount;
+    chunk->inlines = (InlineFrame*)(bytes + entry->inlines);
+    chunk->inlineCount = chunk->inlineCapacity = (int)entry->inlineCount;
+  }
+  image->functionCount = (int)header->functionCount;
+
+  for (uint32_t i = 0; i < header->relocationCount; i++) {
+    const ImageRelocation* relocation = &relocations[i];
+    uint8_t* slot = bytes + relocation->offset;
+    switch (relocation->kind) {
+      case RELOCATE_STRING:
+        *(Value*)slot = OBJ_VAL(interned[relocation->index]);
+        break;
+      case RELOCATE_FUNCTION:
+        *(Value*)slot = OBJ_VAL(&image->functions[relocation->index]);
+        break;
+      case RELOCATE_NAME:
+        *(ObjString**)slot = interned[relocation->index];
+        break;
+    }
+  }
+
+  // globalsFit() has checked the slots are free, unless the image names a
+  // global twice.
+  ObjFunction* script = &image->functions[0];
+  for (uint32_t i = 0; i < header->globalCount; i++) {
+    if (globalSlot(interned[globals[i]]) != (int)i) script = NULL;
+  }
+
+  free(interned);
+  return script;
+}
+
+bool isImageFile(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) return false;
+  uint8_t bytes[sizeof(magic)];
+  bool matches = fread(bytes, 1, sizeof(magic), file) == sizeof(magic) &&
+                 memcmp(bytes, magic, sizeof(magic)) == 0;
+  fclose(file);
+  return matches;
+}
+
+bool imagesLoaded() {
+  return images != NULL;
+}
+
+void markImageRoots() {
+  for (Image* image = images; image != NULL; image = image->next) {
+    for (int i = 0; i < image->rootCount; i++) {
+      markObject((Obj*)image->roots[i]);
+    }
+    // The closure shared by a function without upvalues is on the heap.
+    for (int i = 0; i < image->functionCount; i++) {
+      markObject((Obj*)image->functions[i].closure);
+    }
+  }
+}
+
+void freeImages() {
+  while (images != NULL) {
+    Image* image = images;
+    images = image->next;
+#ifdef BASELINE_JIT
+    for (int i = 0; i < image->functionCount; i++) {
+      jitFree(&image->functions[i]);
+    }
+#endif
+    munmap(image->bytes, image->size);
+    free(image->strings);
+    free(image->functions);
+    free(image->roots);
+    free(image);
+  }
+
+}
@@ -0,0 +1,53 @@
+#ifndef _IMAGE_H_
+#define _IMAGE_H_
+
+#include "object.h"
+
+// Reads back differently on a machine of the other byte order.
+#define BYTE_ORDER_MARK 0x01020304u
+
+// The sizes of what is stored as it is in memory, packed into one word.
+#define IMAGE_LAYOUT                                                     \
+  ((uint32_t)sizeof(Value) | (uint32_t)sizeof(void*) << 8 |              \
+   (uint32_t)sizeof(LineRun) << 16 | (uint32_t)sizeof(InlineFrame) << 24)
+
+// The objects an image or snapshot holds, numbered in the order they were
+// reached.
+typedef struct {
+  Obj** objects;
+  int count;
+  int* slots;  // Open-addressed: one more than an object's number, or 0.
+  int slotCount;
+} Numbering;
+
+// The number of object, which is numbered next if it has no number yet.
+int numberOf(Numbering* numbering, Obj* object);
+
+void freeNumbering(Numbering* numbering);
+
+// Write a compiled script, and every function nested in it, to path as an
+// image: bytecode laid out the way the VM holds it in memory, so it can be
+// mapped and run without being copied. Returns false if the file could not
+// be written.
+bool writeImage(ObjFunction* function, const char* path);
+
+// Map an image written by writeImage() and return its script. Its code,
+// line runs, constants and string bytes are used where they lie in the
+// mapping, and its functions and strings are never collected. Returns NULL
+// if the file is missing or malformed, was written by a different build, or
+// puts its globals in slots already taken by others.
+ObjFunction* loadImage(const char* path);
+
+// Whether the file at path is an image.
+bool isImageFile(const char* path);
+
+// Whether any image has been loaded.
+bool imagesLoaded();
+
+// Mark what the loaded images refer to on the heap.
+void markImageRoots();
+
+// Unmap every image. Only for when the VM is done with all its objects.
+void freeImages();
+
+#endif
@@ -0,0 +1,641 @@
+#include "inliner.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "vm.h"
+
+// Longest body, in bytes up to its return, worth copying into a caller.
+#define INLINE_MAX 32
+// Locations remembered while copying one body.
+#define LOCATIONS_MAX 64
+
+typedef struct {
+  ObjFunction* function;
+  int created;      // Script offset of the closure it comes from, or -1.
+  bool measured;
+  int length;       // Bytes before its return, or -1 if it cannot be inlined.
+  int returnDepth;  // Values on its stack at that return, callee included.
+  int maxDepth;     // Deepest its stack gets before it returns.
+  // It makes no calls and only reads its parameters with OP_GET_LOCAL, so
+  // arguments that are plain locals or constants can stand in for them.
+  bool substitutable;
+  int sharedWith;  // Caller its constants were last added to, or -1.
+  uint8_t constants[UINT8_COUNT];  // Their indexes in that caller.
+} Action;
+
+typedef struct {
+  Action* actions;  // Post-order, so the script comes last.
+  int count;
+  int capacity;
+  int globalCount;
+  int* bound;    // Global slot -> the action it is bound to for good, or -1.
+  int* boundAt;  // Global slot -> script offset of that binding.
+  ObjNative** natives;  // Global slot -> pure native it always holds, or NULL.
+} Inliner;
+
+typedef struct {
+  uint8_t* code;
+  int* lines;
+  int count;
+  int capacity;
+} Buffer;
+
+// Callee locations already translated into the caller's line table
+typedef struct {
+  int from[LOCATIONS_MAX];
+  int to[LOCATIONS_MAX];
+  int count;
+} Locations;
+
+void initCallSites(CallSites* sites) {
+  sites->sites = NULL;
+  sites->count = 0;
+  sites->capacity = 0;
+}
+
+void freeCallSites(CallSites* sites) {
+  free(sites->sites);
+  initCallSites(sites);
+}
+
+void writeCallSite(CallSites* sites, ObjFunction* caller, int load, int call) {
+  if (sites->capacity < sites->count + 1) {
+    sites->capacity = INCREASE_CAPACITY(sites->capacity);
+    sites->sites = realloc(sites->sites, sizeof(CallSite) * sites->capacity);
+    if (sites->sites == NULL) exit(1);
+  }
+
+  CallSite* site = &sites->sites[sites->count++];
+  site->caller = caller;
+  site->load = load;
+  site->call = call;
+}
+
+static void emit(Buffer* buffer, uint8_t byte, int line) {
+  if (buffer->capacity < buffer->count + 1) {
+    buffer->capacity = INCREASE_CAPACITY(buffer->capacity);
+    buffer->code = realloc(buffer->code, buffer->capacity);
+    buffer->lines = realloc(buffer->lines, sizeof(int) * buffer->capacity);
+    if (buffer->code == NULL || buffer->lines == NULL) exit(1);
+  }
+
+  buffer->code[buffer->count] = byte;
+  buffer->lines[buffer->count] = line;
+  buffer->count++;
+}
+
+static bool isFunction(Value value) {
+  return IS_OBJ(value) && OBJ_TYPE(value) == OBJ_FUNCTION;
+}
+
+static void collect(Inliner* inliner, ObjFunction* function) {
+  ValueArray* constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (isFunction(constants->values[i])) {
+      collect(inliner, AS_FUNCTION(constants->values[i]));
+    }
+  }
+
+  if (inliner->capacity < inliner->count + 1) {
+    inliner->capacity = INCREASE_CAPACITY(inliner->capacity);
+    inliner->actions =
+        realloc(inliner->actions, sizeof(Action) * inliner->capacity);
+    if (inliner->actions == NULL) exit(1);
+  }
+
+  Action* action = &inliner->actions[inliner->count++];
+  action->function = function;
+  action->created = -1;
+  action->measured = false;
+  action->length = -1;
+  action->sharedWith = -1;
+}
+
+static int actionIndex(Inliner* inliner, ObjFunction* function) {
+  for (int i = 0; i < inliner->count; i++) {
+    if (inliner->actions[i].function == function) return i;
+  }
+  return -1;
+}
+
+// Record that the function, and everything nested in it, can only run once
+// the script has reached offset
+static void markCreated(Inliner* inliner, ObjFunction* function, int offset) {
+  inliner->actions[actionIndex(inliner, function)].created = offset;
+  ValueArray* constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (isFunction(constants->values[i])) {
+      markCreated(inliner, AS_FUNCTION(constants->values[i]), offset);
+    }
+  }
+}
+
+// Find the globals that are written exactly once, by the script defining
+// them straight from a closure with no upvalues. Globals are only defined
+// at the top level, outside any loop, so the binding holds from there on.
+// Natives are defined before the script runs, so one it never writes to
+// holds its native throughout.
+static void findBindings(Inliner* inliner, ObjFunction* script) {
+  int globalCount = vm.globalValues.count;
+  int* writes = calloc(globalCount + 1, sizeof(int));
+  inliner->globalCount = globalCount;
+  inliner->bound = malloc(sizeof(int) * (globalCount + 1));
+  inliner->boundAt = malloc(sizeof(int) * (globalCount + 1));
+  inliner->natives = calloc(globalCount + 1, sizeof(ObjNative*));
+  if (writes == NULL || inliner->bound == NULL || inliner->boundAt == NULL ||
+      inliner->natives == NULL) {
+    exit(1);
+  }
+  for (int i = 0; i < globalCount; i++) inliner->bound[i] = -1;
+
+  for (int i = 0; i < inliner->count; i++) {
+    Chunk* chunk = &inliner->actions[i].function->chunk;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+      uint8_t* code = &chunk->code[offset];
+      switch (code[0]) {
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+          writes[indexOperand(code)]++;
+          break;
+      }
+    }
+  }
+
+  Chunk* chunk = &script->chunk;
+  int previous = -1;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t* code = &chunk->code[offset];
+    if (code[0] == OP_CLOSURE || code[0] == OP_CLOSURE_LONG) {
+      markCreated(inliner,
+                  AS_FUNCTION(chunk->constants.values[indexOperand(code)]),
+                  offset);
+    } else if (code[0] == OP_DEFINE_GLOBAL && writes[code[1]] == 1 &&
+               previous >= 0 && chunk->code[previous] == OP_CLOSURE) {
+      ObjFunction* function = AS_FUNCTION(
+          chunk->constants.values[chunk->code[previous + 1]]);
+      if (function->upvalueCount == 0) {
+        inliner->bound[code[1]] = actionIndex(inliner, function);
+        inliner->boundAt[code[1]] = offset;
+      }
+    }
+    previous = offset;
+  }
+
+  for (int i = 0; i < globalCount; i++) {
+    Value value = vm.globalValues.values[i];
+    if (writes[i] == 0 && IS_NATIVE(value) && AS_NATIVE(value)->pure) {
+      inliner->natives[i] = AS_NATIVE(value);
+    }
+  }
+  free(writes);
+}
+
+// Instructions a body may use and still be copied: no upvalues, closures,
+// classes or properties, whose meaning depends on more than the stack.
+static bool inlinable(uint8_t op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_PRINT:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_RETURN:
+      return true;
+    default:
+      return op >= OP_MOVE && op <= OP_DIVIDE_RRK;
+  }
+}
+
+// How many of the instruction's leading operands are stack slots
+static int slotOperands(uint8_t op) {
+  switch (op) {
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_LOADK:
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RK:
+    case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RK:
+    case OP_GREATER_RK:
+    case OP_LESS_RK:
+      return 1;
+    case OP_MOVE:
+    case OP_ADD_RR:
+    case OP_SUBTRACT_RR:
+    case OP_MULTIPLY_RR:
+    case OP_DIVIDE_RR:
+    case OP_GREATER_RR:
+    case OP_LESS_RR:
+    case OP_ADD_RRK:
+    case OP_SUBTRACT_RRK:
+    case OP_MULTIPLY_RRK:
+    case OP_DIVIDE_RRK:
+      return 2;
+    case OP_ADD_RRR:
+    case OP_SUBTRACT_RRR:
+    case OP_MULTIPLY_RRR:
+    case OP_DIVIDE_RRR:
+      return 3;
+    default:
+      return 0;
+  }
+}
+
+// Which operand indexes the constant table, or 0 for none
+static int constantOperand(uint8_t op) {
+  switch (op) {
+    case OP_CONSTANT:
+      return 1;
+    case OP_LOADK:
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RK:
+    case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RK:
+    case OP_GREATER_RK:
+    case OP_LESS_RK:
+      return 2;
+    case OP_ADD_RRK:
+    case OP_SUBTRACT_RRK:
+    case OP_MULTIPLY_RRK:
+    case OP_DIVIDE_RRK:
+      return 3;
+    default:
+      return 0;
+  }
+}
+
+// Decide whether an action can be copied into its callers: a short body
+// that never refers to itself and whose first return is the only way out
+static void measure(Action* action, int self) {
+  ObjFunction* function = action->function;
+  Chunk* chunk = &function->chunk;
+  action->measured = true;
+  action->length = -1;
+  if (function->upvalueCount > 0) return;
+
+  int* depths = stackDepths(&function->chunk, function->arity + 1);
+  int reach = 0;  // Furthest a jump goes.
+  int maxDepth = function->arity + 1;
+  bool substitutable = true;
+  for (int offset = 0; offset < chunk->count && offset <= INLINE_MAX;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t* code = &chunk->code[offset];
+    if (!inlinable(code[0])) break;
+    if (code[0] == OP_GET_GLOBAL && code[1] == self) break;
+
+    if (code[0] == OP_RETURN) {
+      if (reach <= offset) {
+        action->length = offset;
+        action->returnDepth = depths[offset];
+        action->maxDepth = maxDepth;
+        action->substitutable = substitutable;
+      }
+      break;
+    }
+
+    // Slot 0 holds the callee, which an inlined body does not keep.
+    int slots = slotOperands(code[0]);
+    bool slotZero = false;
+    for (int i = 1; i <= slots; i++) {
+      if (code[i] == 0) slotZero = true;
+      if (code[i] <= function->arity && code[0] != OP_GET_LOCAL) {
+        substitutable = false;
+      }
+    }
+    if (slotZero) break;
+    if (code[0] == OP_CALL || code[0] == OP_TAIL_CALL) substitutable = false;
+
+    if (code[0] == OP_JUMP || code[0] == OP_JUMP_IF_FALSE) {
+      int target = offset + 3 + ((code[1] << 8) | code[2]);
+      if (target > reach) reach = target;
+    }
+    int depth = depths[offset] + stackEffect(chunk, offset);
+    if (depth > maxDepth) maxDepth = depth;
+  }
+  free(depths);
+}
+
+// Give the caller every constant the callee's body uses, or return false
+// if its table has no room for them
+static bool shareConstants(Chunk* caller, int index, Action* callee) {
+  if (callee->sharedWith == index) return true;
+
+  Chunk* body = &callee->function->chunk;
+  for (int offset = 0; offset < callee->length;
+       offset += instructionLength(body, offset)) {
+    int operand = constantOperand(body->code[offset]);
+    if (operand == 0) continue;
+
+    int constant = body->code[offset + operand];
+    Value value = body->constants.values[constant];
+    int shared = findConstant(caller, value);
+    if (shared < 0) {
+      if (caller->constants.count == UINT8_COUNT) return false;
+      shared = addConstant(caller, value);
+    }
+    callee->constants[constant] = (uint8_t)shared;
+  }
+  callee->sharedWith = index;
+  return true;
+}
+
+// Translate a location in the callee's line table into the caller's
+static int relocate(Chunk* caller, Chunk* callee, ObjString* name,
+                    int location, int callerLocation, Locations* seen) {
+  for (int i = 0; i < seen->count; i++) {
+    if (seen->from[i] == location) return seen->to[i];
+  }
+
+  int relocated;
+  if (location >= 0) {
+    relocated = addInlineFrame(caller, location, name, callerLocation);
+  } else {
+    InlineFrame frame = callee->inlines[-1 - location];
+    int outer =
+        relocate(caller, callee, name, frame.caller, callerLocation, seen);
+    relocated = addInlineFrame(caller, frame.line, frame.name, outer);
+  }
+
+  if (seen->count < LOCATIONS_MAX) {
+    seen->from[seen->count] = location;
+    seen->to[seen->count++] = relocated;
+  }
+  return relocated;
+}
+
+// Copy the callee's body with its slots moved down to base, where the
+// callee itself was, then slide the result down over the arguments as
+// OP_RETURN would. When args is not NULL it holds the instruction pushing
+// each argument, which stands in for reading the parameter instead.
+static void inlineBody(Buffer* out, Chunk* caller, Action* callee, int base,
+                       uint8_t (*args)[2], int callerLocation) {
+  Chunk* body = &callee->function->chunk;
+  int arity = callee->function->arity;
+  int shift = base - 1 - (args != NULL ? arity : 0);
+  Locations seen;
+  seen.count = 0;
+  // Where each instruction of the body went, for its jumps' targets.
+  int starts[INLINE_MAX + 1];
+  for (int offset = 0; offset < callee->length;) {
+    int length = instructionLength(body, offset);
+    int location = relocate(caller, body, callee->function->name,
+                            locationAt(body, offset), callerLocation, &seen);
+    starts[offset] = out->count;
+    if (isJump(body->code[offset])) {
+      emit(out, wideJump(body->code[offset]), location);
+      for (int i = 0; i < 4; i++) emit(out, 0, location);
+      offset += length;
+      continue;
+    }
+
+    uint8_t code[4];
+    memcpy(code, &body->code[offset], length);
+
+    if (args != NULL && code[0] == OP_GET_LOCAL && code[1] <= arity) {
+      memcpy(code, args[code[1] - 1], 2);
+    } else {
+      // Its frame is now the caller's, so a tail call would replace that.
+      if (code[0] == OP_TAIL_CALL) code[0] = OP_CALL;
+      int slots = slotOperands(code[0]);
+      for (int i = 1; i <= slots; i++) code[i] += shift;
+      int operand = constantOperand(code[0]);
+      if (operand != 0) code[operand] = callee->constants[code[operand]];
+    }
+    for (int i = 0; i < length; i++) emit(out, code[i], location);
+    offset += length;
+  }
+  starts[callee->length] = out->count;
+
+  for (int offset = 0; offset < callee->length;
+       offset += instructionLength(body, offset)) {
+    if (!isJump(body->code[offset])) continue;
+    setJumpTarget(&out->code[starts[offset]],
+                  starts[jumpTarget(body, offset)]);
+  }
+
+  int left = callee->returnDepth - 1 - (args != NULL ? arity : 0);
+  if (left > 1) {
+    emit(out, OP_SET_LOCAL, callerLocation);
+    emit(out, (uint8_t)base, callerLocation);
+    for (int i = 1; i < left; i++) emit(out, OP_POP, callerLocation);
+  }
+}
+
+// Whether the arguments between the callee's load and the call are each a
+// single local or constant, and if so collect them
+static bool simpleArguments(Chunk* chunk, CallSite* site, int arity,
+                            uint8_t (*args)[2]) {
+  int offset = site->load + 2;
+  for (int i = 0; i < arity; i++) {
+    uint8_t op = chunk->code[offset];
+    if (op != OP_GET_LOCAL && op != OP_CONSTANT) return false;
+    memcpy(args[i], &chunk->code[offset], 2);
+    offset += 2;
+  }
+  return offset == site->call;
+}
+
+// Call a pure native whose arguments are all constants, and return where its
+// result is in the caller's constants, or -1 if it cannot be folded
+static int foldNative(Chunk* chunk, CallSite* site, ObjNative* native) {
+  int argCount = chunk->code[site->call + 1];
+  if (native->arity >= 0 && argCount != native->arity) return -1;
+
+  Value args[UINT8_COUNT];
+  int offset = site->load + 2;
+  for (int i = 0; i < argCount; i++) {
+    if (chunk->code[offset] != OP_CONSTANT) return -1;
+    args[i] = chunk->constants.values[chunk->code[offset + 1]];
+    offset += 2;
+  }
+  if (offset != site->call) return -1;
+
+  // An error is left for the call to raise when it runs, and a result that
+  // would need allocating is left to it as well.
+  Value result;
+  if (!native->function(argCount, args, &result) || IS_OBJ(result)) return -1;
+  int constant = findConstant(chunk, result);
+  if (constant < 0) {
+    if (chunk->constants.count == UINT8_COUNT) return -1;
+    constant = addConstant(chunk, result);
+  }
+  return constant;
+}
+
+// Rewrite the action with its eligible call sites inlined: the callee's
+// load goes, along with arguments substituted into the body, and the call
+// becomes the body. Calls folded to a constant lose their arguments too.
+static void inlineInto(Inliner* inliner, int index, CallSites* sites) {
+  Action* action = &inliner->actions[index];
+  ObjFunction* function = action->function;
+  Chunk* chunk = &function->chunk;
+  bool isScript = index == inliner->count - 1;
+
+  int* depths = stackDepths(&function->chunk, function->arity + 1);
+  bool* dropped = calloc(chunk->count + 1, sizeof(bool));
+  int* loads = malloc(sizeof(int) * (chunk->count + 1));
+  int* calls = malloc(sizeof(int) * (chunk->count + 1));
+  bool* substituted = calloc(sites->count + 1, sizeof(bool));
+  int* bases = malloc(sizeof(int) * (sites->count + 1));
+  int* offsets = malloc(sizeof(int) * (chunk->count + 1));
+  int* folds = malloc(sizeof(int) * (chunk->count + 1));
+  if (dropped == NULL || loads == NULL || calls == NULL ||
+      substituted == NULL || bases == NULL || offsets == NULL ||
+      folds == NULL) {
+    exit(1);
+  }
+  for (int i = 0; i <= chunk->count; i++) loads[i] = calls[i] = folds[i] = -1;
+  uint8_t args[UINT8_COUNT][2];
+
+  bool any = false;
+  for (int i = 0; i < sites->count; i++) {
+    CallSite* site = &sites->sites[i];
+    if (site->caller != function) continue;
+    uint8_t* load = &chunk->code[site->load];
+    uint8_t* call = &chunk->code[site->call];
+    if (load[0] != OP_GET_GLOBAL || load[1] >= inliner->globalCount) continue;
+    if (call[0] != OP_CALL && call[0] != OP_TAIL_CALL) continue;
+
+    int global = load[1];
+    if (inliner->natives[global] != NULL) {
+      int constant = foldNative(chunk, site, inliner->natives[global]);
+      if (constant < 0) continue;
+      dropped[site->load] = true;
+      for (int a = 0; a < call[1]; a++) dropped[site->load + 2 + 2 * a] = true;
+      folds[site->call] = constant;
+      any = true;
+      continue;
+    }
+
+    int bound = inliner->bound[global];
+    if (bound < 0 || bound == index) continue;
+    // A call that may run before the binding would see the old value.
+    int time = isScript ? site->load : action->created;
+    if (time <= inliner->boundAt[global]) continue;
+
+    Action* callee = &inliner->actions[bound];
+    if (!callee->measured) measure(callee, global);
+    if (callee->length < 0 || call[1] != callee->function->arity) continue;
+    int base = depths[site->load];
+    if (base < 1 || base + callee->maxDepth - 1 > UINT8_COUNT) continue;
+    if (!shareConstants(chunk, index, callee)) continue;
+
+    dropped[site->load] = true;
+    loads[site->load] = i;
+    calls[site->call] = i;
+    if (callee->substitutable &&
+        simpleArguments(chunk, site, call[1], args)) {
+      substituted[i] = true;
+      for (int a = 0; a < call[1]; a++) dropped[site->load + 2 + 2 * a] = true;
+    }
+    any = true;
+  }
+
+  // Each inlined call inside another's arguments sits one slot lower for
+  // the enclosing callee's load that is gone.
+  int open = 0;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (loads[offset] >= 0) bases[loads[offset]] = depths[offset] - open++;
+    if (calls[offset] >= 0) open--;
+  }
+
+  Buffer out = {NULL, NULL, 0, 0};
+  if (any) {
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+      offsets[offset] = out.count;
+      if (dropped[offset]) continue;
+      if (folds[offset] >= 0) {
+        emit(&out, OP_CONSTANT, locationAt(chunk, offset));
+        emit(&out, (uint8_t)folds[offset], locationAt(chunk, offset));
+      } else if (calls[offset] >= 0) {
+        CallSite* site = &sites->sites[calls[offset]];
+        Action* callee =
+            &inliner->actions[inliner->bound[chunk->code[site->load + 1]]];
+        bool substitute = substituted[calls[offset]];
+        if (substitute) {
+          simpleArguments(chunk, site, callee->function->arity, args);
+        }
+        inlineBody(&out, chunk, callee, bases[calls[offset]],
+                   substitute ? args : NULL, locationAt(chunk, offset));
+      } else if (isJump(chunk->code[offset])) {
+        // The caller's own jumps now span different distances, so they
+        // are left for rewriteCode() to encode.
+        emit(&out, wideJump(chunk->code[offset]), locationAt(chunk, offset));
+        for (int i = 0; i < 4; i++) emit(&out, 0, locationAt(chunk, offset));
+      } else {
+        for (int i = 0; i < instructionLength(chunk, offset); i++) {
+          emit(&out, chunk->code[offset + i], locationAt(chunk, offset + i));
+        }
+      }
+    }
+    offsets[chunk->count] = out.count;
+
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+      if (dropped[offset] || !isJump(chunk->code[offset])) continue;
+      setJumpTarget(&out.code[offsets[offset]],
+                    offsets[jumpTarget(chunk, offset)]);
+    }
+
+    rewriteCode(chunk, out.code, out.lines, out.count, NULL);
+    // Its body changed, so it has to be looked at again as a callee.
+    action->measured = false;
+    action->sharedWith = -1;
+  }
+
+  free(out.code);
+  free(out.lines);
+  free(depths);
+  free(dropped);
+  free(loads);
+  free(calls);
+  free(substituted);
+  free(bases);
+  free(offsets);
+  free(folds);
+}
+
+void inlineCalls(ObjFunction* script, CallSites* sites) {
+  Inliner inliner;
+  inliner.actions = NULL;
+  inliner.count = 0;
+  inliner.capacity = 0;
+  collect(&inliner, script);
+  findBindings(&inliner, script);
+
+  // Callees usually come before their callers, so their bodies already
+  // have their own calls inlined when they are copied.
+  for (int i = 0; i < inliner.count; i++) inlineInto(&inliner, i, sites);
+
+  free(inliner.actions);
+  free(inliner.bound);
+  free(inliner.boundAt);
+  free(inliner.natives);
+}
@@ -0,0 +1,31 @@
+#ifndef _INLINER_H_
+#define _INLINER_H_
+
+#include "object.h"
+
+// A call whose callee is a global or local read just before its arguments
+typedef struct {
+  ObjFunction* caller;
+  int load;  // Offset of the OP_GET_GLOBAL or OP_GET_LOCAL pushing the callee.
+  int call;  // Offset of the OP_CALL or OP_TAIL_CALL.
+} CallSite;
+
+typedef struct {
+  CallSite* sites;
+  int count;
+  int capacity;
+} CallSites;
+
+void initCallSites(CallSites* sites);
+void freeCallSites(CallSites* sites);
+void writeCallSite(CallSites* sites, ObjFunction* caller, int load, int call);
+
+// Replace calls to small actions with a copy of their bodies, where the
+// callee is a global the script binds once to an action and never assigns
+// again, and the call cannot run before that binding. Calls with constant
+// arguments to pure natives the script never reassigns are replaced by their
+// result. The script must be the whole program and still unoptimized, since
+// the sites' offsets point into the code as parsed.
+void inlineCalls(ObjFunction* script, CallSites* sites);
+
+#endif
@@ -0,0 +1,2177 @@
+#include "ir.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "memory.h"
+
+// Instructions that only exist in the IR. The rest reuse their OpCode:
+// OP_JUMP and OP_JUMP_IF_FALSE end blocks, jumping to the block's successors,
+// and OP_TAIL_CALL stands for the call together with the return after it.
+#define IR_PARAM 256  // The callee or an argument, in the slot it arrived in.
+#define IR_PHI 257
+
+#define NONE -1
+
+typedef struct {
+  int* items;
+  int count;
+  int capacity;
+} IntArray;
+
+typedef struct {
+  int op;       // An OpCode, IR_PARAM or IR_PHI.
+  int operand;  // Constant, global, upvalue or parameter index; call arity.
+  int offset;   // Where an OP_CLOSURE was, to copy its capture operands.
+  int line;
+  int block;
+  IntArray args;
+  int forward;  // The value this one was found equal to, or NONE.
+
+  int uses;
+  int user;      // The last instruction found using it.
+  bool phiUse;   // A phi uses it, so it must end up in a slot.
+  bool live;
+  bool number;   // Known to be a number whenever it produces a value at all.
+  bool stacked;  // Left on the stack for its only user instead of a slot.
+  int slot;
+  int share;     // A phi whose slot it can be computed straight into.
+  int position;  // Index in the linear order, for live intervals.
+  int start;
+  int end;
+} IrValue;
+
+typedef struct {
+  int first;  // Bytecode it was lifted from, or NONE for a synthetic block.
+  int last;
+  int end;
+  IntArray preds;
+  int succs[2];  // After a branch, the truthy side comes first.
+  int succCount;
+  IntArray phis;
+  IntArray code;  // Ends with its terminator.
+
+  int* defs;        // Current value of each stack position while lifting.
+  int* incomplete;  // Phis waiting for the block to be sealed.
+  bool sealed;
+  bool filled;
+
+  int idom;
+  int rpo;  // Index in reverse postorder.
+  IntArray children;
+  int from;   // Linear position where its phis are defined.
+  int to;     // Linear position of the moves on its way out.
+  int label;  // Offset of its lowered code.
+} IrBlock;
+
+typedef struct {
+  int header;
+  int preheader;
+  bool* body;
+  int size;
+} Loop;
+
+typedef struct {
+  Chunk* chunk;
+  int arity;
+
+  IrValue* values;
+  int valueCount;
+  int valueCapacity;
+  IrBlock* blocks;
+  int blockCount;
+  int blockCapacity;
+
+  int* depths;     // Stack depth before each reachable instruction, or NONE.
+  bool* leaders;   // Offsets that must start a block.
+  int* blockAt;    // Block starting at each offset, or NONE.
+  int positions;   // Stack positions, each a variable while lifting.
+  IntArray order;  // Blocks in layout order.
+  IntArray rpo;
+  Loop* loops;
+  int loopCount;
+  int changes;  // Rewrites that make lowering the result worthwhile.
+  int hoisted;  // Instructions moved out of loops.
+
+  // Scratch for value numbering: an open-addressed table whose insertions
+  // are undone in reverse when leaving a dominator subtree, and the last
+  // known value of each global and upvalue in the current block.
+  int* table;
+  int tableSize;
+  IntArray inserted;
+  int globals[UINT8_COUNT];
+  int upvalues[UINT8_COUNT];
+
+  // The lowered code.
+  uint8_t* code;
+  int* lines;
+  int count;
+  int capacity;
+  IntArray patches;  // Pairs of (jump offset, target block).
+  IntArray stubs;    // (jump offset, block, successor, line) for false edges.
+} Ir;
+
+static void initIntArray(IntArray* array) {
+  array->items = NULL;
+  array->count = 0;
+  array->capacity = 0;
+}
+
+static void appendInt(IntArray* array, int item) {
+  if (array->capacity < array->count + 1) {
+    array->capacity = array->capacity < 4 ? 4 : array->capacity * 2;
+    array->items = realloc(array->items, sizeof(int) * array->capacity);
+    if (array->items == NULL) exit(1);
+  }
+  array->items[array->count++] = item;
+}
+
+static void freeIntArray(IntArray* array) {
+  free(array->items);
+  initIntArray(array);
+}
+
+static void* allocate(size_t size) {
+  void* memory = calloc(1, size == 0 ? 1 : size);
+  if (memory == NULL) exit(1);
+  return memory;
+}
+
+static int newValue(Ir* ir, int op, int operand, int block, int line) {
+  if (ir->valueCapacity < ir->valueCount + 1) {
+    ir->valueCapacity = ir->valueCapacity < 64 ? 64 : ir->valueCapacity * 2;
+    ir->values = realloc(ir->values, sizeof(IrValue) * ir->valueCapacity);
+    if (ir->values == NULL) exit(1);
+  }
+  IrValue* value = &ir->values[ir->valueCount];
+  memset(value, 0, sizeof(IrValue));
+  value->op = op;
+  value->operand = operand;
+  value->offset = NONE;
+  value->line = line;
+  value->block = block;
+  initIntArray(&value->args);
+  value->forward = NONE;
+  value->user = NONE;
+  value->slot = NONE;
+  value->share = NONE;
+  return ir->valueCount++;
+}
+
+static int find(Ir* ir, int value) {
+  while (ir->values[value].forward != NONE) {
+    value = ir->values[value].forward;
+  }
+  return value;
+}
+
+// Append an instruction to a block
+static int emitValue(Ir* ir, int block, int op, int operand, int line) {
+  int value = newValue(ir, op, operand, block, line);
+  appendInt(&ir->blocks[block].code, value);
+  return value;
+}
+
+static int emitUnary(Ir* ir, int block, int op, int operand, int line,
+                     int a) {
+  int value = emitValue(ir, block, op, operand, line);
+  appendInt(&ir->values[value].args, a);
+  return value;
+}
+
+static int emitBinary(Ir* ir, int block, int op, int line, int a, int b) {
+  int value = emitUnary(ir, block, op, 0, line, a);
+  appendInt(&ir->values[value].args, b);
+  return value;
+}
+
+static int newBlock(Ir* ir, int first) {
+  if (ir->blockCapacity < ir->blockCount + 1) {
+    ir->blockCapacity = ir->blockCapacity < 16 ? 16 : ir->blockCapacity * 2;
+    ir->blocks = realloc(ir->blocks, sizeof(IrBlock) * ir->blockCapacity);
+    if (ir->blocks == NULL) exit(1);
+  }
+  IrBlock* block = &ir->blocks[ir->blockCount];
+  memset(block, 0, sizeof(IrBlock));
+  block->first = first;
+  block->last = first;
+  block->end = first;
+  block->defs = allocate(sizeof(int) * ir->positions);
+  block->incomplete = allocate(sizeof(int) * ir->positions);
+  for (int i = 0; i < ir->positions; i++) {
+    block->defs[i] = NONE;
+    block->incomplete[i] = NONE;
+  }
+  block->idom = NONE;
+  block->rpo = NONE;
+  block->label = NONE;
+  return ir->blockCount++;
+}
+
+static void addEdge(Ir* ir, int from, int to) {
+  IrBlock* block = &ir->blocks[from];
+  block->succs[block->succCount++] = to;
+  appendInt(&ir->blocks[to].preds, from);
+}
+
+static int predIndex(Ir* ir, int block, int pred) {
+  IntArray* preds = &ir->blocks[block].preds;
+  for (int i = 0; i < preds->count; i++) {
+    if (preds->items[i] == pred) return i;
+  }
+  return NONE;
+}
+
+static bool endsBlock(uint8_t op) {
+  return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP ||
+         op == OP_RETURN;
+}
+
+// Whether the IR can model an instruction. Locals captured by closures can
+// change behind the function's back, so any capture rules the function out.
+static bool liftable(Chunk* chunk, int offset) {
+  uint8_t* ip = &chunk->code[offset];
+  switch (ip[0]) {
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_INHERIT:
+    case OP_METHOD:
+    case OP_CLOSE_UPVALUE:
+      return false;
+    case OP_CLOSURE: {
+      ObjFunction* function = AS_FUNCTION(chunk->constants.values[ip[1]]);
+      for (int i = 0; i < function->upvalueCount; i++) {
+        if (ip[2 + i * 2]) return false;
+      }
+      // Nor can one whose body reaches into this frame's slots.
+      Chunk* body = &function->chunk;
+      for (int i = 0; i < body->count; i += instructionLength(body, i)) {
+        if (body->code[i] == OP_GET_ENCLOSING ||
+            body->code[i] == OP_SET_ENCLOSING) {
+          return false;
+        }
+      }
+      return true;
+    }
+    default:
+      // Its tables of globals and upvalues are indexed by a byte, so
+      // functions needing the wide forms are left as they are. Quickened
+      // forms only appear once the code has run.
+      return !isWide(ip[0]) && ip[0] < OP_ADD_NUM;
+  }
+}
+
+// Find the stack depth before each reachable instruction, and which of them
+// start blocks
+static bool analyze(Ir* ir) {
+  Chunk* chunk = ir->chunk;
+  ir->depths = allocate(sizeof(int) * (chunk->count + 1));
+  ir->leaders = allocate(sizeof(bool) * (chunk->count + 1));
+  for (int i = 0; i <= chunk->count; i++) ir->depths[i] = NONE;
+
+  IntArray pending;
+  initIntArray(&pending);
+  ir->positions = ir->arity + 1;
+  ir->depths[0] = ir->positions;
+  ir->leaders[0] = true;
+  appendInt(&pending, 0);
+
+  bool ok = true;
+  while (ok && pending.count > 0) {
+    int offset = pending.items[--pending.count];
+    uint8_t op = chunk->code[offset];
+    if (!liftable(chunk, offset)) {
+      ok = false;
+      break;
+    }
+
+    int depth = ir->depths[offset] + stackEffect(chunk, offset);
+    if (depth > ir->positions) ir->positions = depth;
+    int next = offset + instructionLength(chunk, offset);
+    int successors[2];
+    int count = 0;
+    switch (op) {
+      case OP_JUMP:
+      case OP_LOOP:
+        successors[count++] = jumpTarget(chunk, offset);
+        ir->leaders[next] = true;
+        break;
+      case OP_JUMP_IF_FALSE:
+        successors[count++] = next;
+        successors[count++] = jumpTarget(chunk, offset);
+        ir->leaders[next] = true;
+        break;
+      case OP_RETURN:
+        ir->leaders[next] = true;
+        break;
+      case OP_TAIL_CALL:
+        if (next >= chunk->count || chunk->code[next] != OP_RETURN) ok = false;
+        successors[count++] = next;
+        break;
+      default:
+        successors[count++] = next;
+        break;
+    }
+
+    for (int i = 0; ok && i < count; i++) {
+      int successor = successors[i];
+      if (successor < 0 || successor >= chunk->count) {
+        ok = false;
+        break;
+      }
+      if (op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP) {
+        ir->leaders[successor] = true;
+      }
+      if (ir->depths[successor] == NONE) {
+        ir->depths[successor] = depth;
+        appendInt(&pending, successor);
+      } else if (ir->depths[successor] != depth) {
+        ok = false;
+      }
+    }
+  }
+
+  freeIntArray(&pending);
+  return ok;
+}
+
+static void buildBlocks(Ir* ir) {
+  Chunk* chunk = ir->chunk;
+  ir->blockAt = allocate(sizeof(int) * (chunk->count + 1));
+  for (int i = 0; i <= chunk->count; i++) ir->blockAt[i] = NONE;
+
+  newBlock(ir, NONE);  // The entry, which defines the parameters.
+  appendInt(&ir->order, 0);
+  int current = NONE;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (ir->depths[offset] == NONE) {
+      current = NONE;
+      continue;
+    }
+    if (current == NONE || ir->leaders[offset]) {
+      current = newBlock(ir, offset);
+      ir->blockAt[offset] = current;
+      appendInt(&ir->order, current);
+    }
+    ir->blocks[current].last = offset;
+    ir->blocks[current].end = offset + instructionLength(chunk, offset);
+    if (endsBlock(chunk->code[offset])) current = NONE;
+  }
+
+  addEdge(ir, 0, ir->blockAt[0]);
+  for (int b = 1; b < ir->blockCount; b++) {
+    IrBlock* block = &ir->blocks[b];
+    int last = block->last;
+    switch (chunk->code[last]) {
+      case OP_JUMP:
+      case OP_LOOP:
+        addEdge(ir, b, ir->blockAt[jumpTarget(chunk, last)]);
+        break;
+      case OP_JUMP_IF_FALSE: {
+        int truthy = ir->blockAt[block->end];
+        int falsy = ir->blockAt[jumpTarget(chunk, last)];
+        addEdge(ir, b, truthy);
+        if (falsy != truthy) addEdge(ir, b, falsy);
+        break;
+      }
+      case OP_RETURN:
+        break;
+      default:
+        addEdge(ir, b, ir->blockAt[block->end]);
+        break;
+    }
+  }
+}
+
+// SSA construction after Braun et al., "Simple and Efficient Construction of
+// Static Single Assignment Form", with stack positions as the variables.
+
+static int readVariable(Ir* ir, int block, int position);
+
+// A phi whose operands are all one value, or itself, is that value
+static int tryRemoveTrivialPhi(Ir* ir, int phi) {
+  int same = NONE;
+  for (int i = 0; i < ir->values[phi].args.count; i++) {
+    int arg = find(ir, ir->values[phi].args.items[i]);
+    if (arg == same || arg == phi) continue;
+    if (same != NONE) return phi;
+    same = arg;
+  }
+  if (same == NONE) return phi;
+  ir->values[phi].forward = same;
+  return same;
+}
+
+static int newPhi(Ir* ir, int block) {
+  int phi = newValue(ir, IR_PHI, 0, block, 0);
+  appendInt(&ir->blocks[block].phis, phi);
+  return phi;
+}
+
+static int addPhiOperands(Ir* ir, int block, int position, int phi) {
+  for (int i = 0; i < ir->blocks[block].preds.count; i++) {
+    int arg = readVariable(ir, ir->blocks[block].preds.items[i], position);
+    appendInt(&ir->values[phi].args, arg);
+  }
+  return tryRemoveTrivialPhi(ir, phi);
+}
+
+static int readVariable(Ir* ir, int block, int position) {
+  IrBlock* b = &ir->blocks[block];
+  if (b->defs[position] != NONE) return find(ir, b->defs[position]);
+
+  int value;
+  if (!b->sealed) {
+    value = newPhi(ir, block);
+    ir->blocks[block].incomplete[position] = value;
+  } else if (b->preds.count == 1) {
+    value = readVariable(ir, b->preds.items[0], position);
+  } else {
+    // Define the phi before looking at the predecessors to break cycles.
+    value = newPhi(ir, block);
+    ir->blocks[block].defs[position] = value;
+    value = addPhiOperands(ir, block, position, value);
+  }
+  ir->blocks[block].defs[position] = value;
+  return value;
+}
+
+static void sealBlock(Ir* ir, int block) {
+  for (int position = 0; position < ir->positions; position++) {
+    int phi = ir->blocks[block].incomplete[position];
+    if (phi != NONE) addPhiOperands(ir, block, position, phi);
+  }
+  ir->blocks[block].sealed = true;
+}
+
+static int use(Ir* ir, int block, int position) {
+  return readVariable(ir, block, position);
+}
+
+static void define(Ir* ir, int block, int position, int value) {
+  ir->blocks[block].defs[position] = value;
+}
+
+// The stack instruction a register form does the work of
+static uint8_t genericOp(uint8_t op) {
+  switch (op) {
+    case OP_ADD_RR:
+    case OP_ADD_RK:
+    case OP_ADD_RRR:
+    case OP_ADD_RRK:
+      return OP_ADD;
+    case OP_SUBTRACT_RR:
+    case OP_SUBTRACT_RK:
+    case OP_SUBTRACT_RRR:
+    case OP_SUBTRACT_RRK:
+      return OP_SUBTRACT;
+    case OP_MULTIPLY_RR:
+    case OP_MULTIPLY_RK:
+    case OP_MULTIPLY_RRR:
+    case OP_MULTIPLY_RRK:
+      return OP_MULTIPLY;
+    case OP_DIVIDE_RR:
+    case OP_DIVIDE_RK:
+    case OP_DIVIDE_RRR:
+    case OP_DIVIDE_RRK:
+      return OP_DIVIDE;
+    case OP_GREATER_RR:
+    case OP_GREATER_RK:
+      return OP_GREATER;
+    default:
+      return OP_LESS;
+  }
+}
+
+static bool constantOperand(uint8_t op) {
+  switch (op) {
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RK:
+    case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RK:
+    case OP_GREATER_RK:
+    case OP_LESS_RK:
+    case OP_ADD_RRK:
+    case OP_SUBTRACT_RRK:
+    case OP_MULTIPLY_RRK:
+    case OP_DIVIDE_RRK:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static void liftInstruction(Ir* ir, int block, int offset, int* depth) {
+  Chunk* chunk = ir->chunk;
+  uint8_t* ip = &chunk->code[offset];
+  int line = locationAt(chunk, offset);
+  int d = *depth;
+
+  switch (ip[0]) {
+    case OP_CONSTANT:
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_GET_ENCLOSING:
+      define(ir, block, d++, emitValue(ir, block, ip[0], ip[1], line));
+      break;
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      define(ir, block, d++, emitValue(ir, block, ip[0], 0, line));
+      break;
+    case OP_POP:
+      d--;
+      break;
+    case OP_GET_LOCAL:
+      define(ir, block, d, use(ir, block, ip[1]));
+      d++;
+      break;
+    case OP_SET_LOCAL:
+      define(ir, block, ip[1], use(ir, block, d - 1));
+      break;
+    case OP_DEFINE_GLOBAL:
+      emitUnary(ir, block, ip[0], ip[1], line, use(ir, block, d - 1));
+      d--;
+      break;
+    case OP_SET_GLOBAL:
+    case OP_SET_UPVALUE:
+    case OP_SET_ENCLOSING:
+      emitUnary(ir, block, ip[0], ip[1], line, use(ir, block, d - 1));
+      break;
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE: {
+      int a = use(ir, block, d - 2);
+      int b = use(ir, block, d - 1);
+      d--;
+      define(ir, block, d - 1, emitBinary(ir, block, ip[0], line, a, b));
+      break;
+    }
+    case OP_NOT:
+    case OP_NEGATE:
+      define(ir, block, d - 1,
+             emitUnary(ir, block, ip[0], 0, line, use(ir, block, d - 1)));
+      break;
+    case OP_PRINT:
+      emitUnary(ir, block, OP_PRINT, 0, line, use(ir, block, d - 1));
+      d--;
+      break;
+    case OP_JUMP:
+    case OP_LOOP:
+      emitValue(ir, block, OP_JUMP, 0, line);
+      break;
+    case OP_JUMP_IF_FALSE:
+      if (ir->blocks[block].succCount == 2) {
+        emitUnary(ir, block, OP_JUMP_IF_FALSE, 0, line, use(ir, block, d - 1));
+      } else {
+        emitValue(ir, block, OP_JUMP, 0, line);
+      }
+      break;
+    case OP_CALL:
+    case OP_TAIL_CALL: {
+      int argCount = ip[1];
+      int call = emitValue(ir, block, ip[0], argCount, line);
+      for (int i = d - 1 - argCount; i < d; i++) {
+        int arg = use(ir, block, i);
+        appendInt(&ir->values[call].args, arg);
+      }
+      d -= argCount;
+      if (ip[0] == OP_CALL) define(ir, block, d - 1, call);
+      break;
+    }
+    case OP_CLOSURE: {
+      int closure = emitValue(ir, block, OP_CLOSURE, ip[1], line);
+      ir->values[closure].offset = offset;
+      define(ir, block, d++, closure);
+      break;
+    }
+    case OP_RETURN:
+      emitUnary(ir, block, OP_RETURN, 0, line, use(ir, block, d - 1));
+      d--;
+      break;
+    case OP_MOVE:
+      define(ir, block, ip[1], use(ir, block, ip[2]));
+      break;
+    case OP_LOADK:
+      define(ir, block, ip[1], emitValue(ir, block, OP_CONSTANT, ip[2], line));
+      break;
+    default: {
+      // A register form, which either pushes its result or stores it.
+      bool store = instructionLength(chunk, offset) == 4;
+      uint8_t* operands = store ? ip + 2 : ip + 1;
+      int a = use(ir, block, operands[0]);
+      int b = constantOperand(ip[0])
+                  ? emitValue(ir, block, OP_CONSTANT, operands[1], line)
+                  : use(ir, block, operands[1]);
+      int value = emitBinary(ir, block, genericOp(ip[0]), line, a, b);
+      if (store) {
+        define(ir, block, ip[1], value);
+      } else {
+        define(ir, block, d++, value);
+      }
+      break;
+    }
+  }
+
+  *depth = d;
+}
+
+static void fillBlock(Ir* ir, int block) {
+  IrBlock* b = &ir->blocks[block];
+  if (block == 0) {
+    for (int i = 0; i <= ir->arity; i++) {
+      define(ir, block, i, emitValue(ir, block, IR_PARAM, i, 0));
+    }
+    emitValue(ir, block, OP_JUMP, 0, 0);
+  } else {
+    Chunk* chunk = ir->chunk;
+    int depth = ir->depths[b->first];
+    for (int offset = b->first; offset < b->end;
+         offset += instructionLength(chunk, offset)) {
+      liftInstruction(ir, block, offset, &depth);
+      // The return after a tail call is part of it.
+      if (chunk->code[offset] == OP_TAIL_CALL) break;
+    }
+    uint8_t last = chunk->code[ir->blocks[block].last];
+    if (!endsBlock(last)) {
+      emitValue(ir, block, OP_JUMP, 0, locationAt(chunk, ir->blocks[block].last));
+    }
+  }
+  ir->blocks[block].filled = true;
+}
+
+// Blocks are filled in order and each is sealed once its last predecessor
+// has been filled
+static void lift(Ir* ir) {
+  int* unfilled = allocate(sizeof(int) * ir->blockCount);
+  for (int b = 0; b < ir->blockCount; b++) {
+    unfilled[b] = ir->blocks[b].preds.count;
+    if (unfilled[b] == 0) sealBlock(ir, b);
+  }
+  for (int b = 0; b < ir->blockCount; b++) {
+    fillBlock(ir, b);
+    for (int s = 0; s < ir->blocks[b].succCount; s++) {
+      int succ = ir->blocks[b].succs[s];
+      if (--unfilled[succ] == 0) sealBlock(ir, succ);
+    }
+  }
+  free(unfilled);
+}
+
+// Phis can become trivial once the phis they use are resolved
+static void removeTrivialPhis(Ir* ir) {
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int b = 0; b < ir->blockCount; b++) {
+      IntArray* phis = &ir->blocks[b].phis;
+      for (int i = 0; i < phis->count; i++) {
+        int phi = phis->items[i];
+        if (ir->values[phi].forward != NONE) continue;
+        if (tryRemoveTrivialPhi(ir, phi) != phi) changed = true;
+      }
+    }
+  }
+}
+
+// Drop forwarded values, values moved elsewhere and, after dead code
+// elimination, dead ones from a block's lists
+static void compactBlock(Ir* ir, int b, bool liveOnly) {
+  IntArray* lists[2] = {&ir->blocks[b].phis, &ir->blocks[b].code};
+  for (int l = 0; l < 2; l++) {
+    IntArray* list = lists[l];
+    int count = 0;
+    for (int i = 0; i < list->count; i++) {
+      IrValue* value = &ir->values[list->items[i]];
+      if (value->forward != NONE || value->block != b) continue;
+      if (liveOnly && !value->live) continue;
+      list->items[count++] = list->items[i];
+    }
+    list->count = count;
+  }
+}
+
+static void compact(Ir* ir, bool liveOnly) {
+  for (int b = 0; b < ir->blockCount; b++) compactBlock(ir, b, liveOnly);
+}
+
+// Dominators after Cooper, Harvey and Kennedy, "A Simple, Fast Dominance
+// Algorithm".
+
+static void computeOrder(Ir* ir) {
+  bool* visited = allocate(sizeof(bool) * ir->blockCount);
+  int* next = allocate(sizeof(int) * ir->blockCount);
+  IntArray stack;
+  IntArray postorder;
+  initIntArray(&stack);
+  initIntArray(&postorder);
+
+  appendInt(&stack, 0);
+  visited[0] = true;
+  while (stack.count > 0) {
+    int block = stack.items[stack.count - 1];
+    IrBlock* b = &ir->blocks[block];
+    if (next[block] < b->succCount) {
+      int succ = b->succs[next[block]++];
+      if (!visited[succ]) {
+        visited[succ] = true;
+        appendInt(&stack, succ);
+      }
+    } else {
+      stack.count--;
+      appendInt(&postorder, block);
+    }
+  }
+
+  ir->rpo.count = 0;
+  for (int b = 0; b < ir->blockCount; b++) ir->blocks[b].rpo = NONE;
+  for (int i = postorder.count - 1; i >= 0; i--) {
+    ir->blocks[postorder.items[i]].rpo = ir->rpo.count;
+    appendInt(&ir->rpo, postorder.items[i]);
+  }
+
+  free(visited);
+  free(next);
+  freeIntArray(&stack);
+  freeIntArray(&postorder);
+}
+
+static int intersect(Ir* ir, int a, int b) {
+  while (a != b) {
+    while (ir->blocks[a].rpo > ir->blocks[b].rpo) a = ir->blocks[a].idom;
+    while (ir->blocks[b].rpo > ir->blocks[a].rpo) b = ir->blocks[b].idom;
+  }
+  return a;
+}
+
+static void computeDominators(Ir* ir) {
+  computeOrder(ir);
+  for (int b = 0; b < ir->blockCount; b++) {
+    ir->blocks[b].idom = NONE;
+    ir->blocks[b].children.count = 0;
+  }
+  ir->blocks[0].idom = 0;
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 1; i < ir->rpo.count; i++) {
+      int block = ir->rpo.items[i];
+      IntArray* preds = &ir->blocks[block].preds;
+      int idom = NONE;
+      for (int p = 0; p < preds->count; p++) {
+        int pred = preds->items[p];
+        if (ir->blocks[pred].idom == NONE) continue;
+        idom = idom == NONE ? pred : intersect(ir, pred, idom);
+      }
+      if (ir->blocks[block].idom != idom) {
+        ir->blocks[block].idom = idom;
+        changed = true;
+      }
+    }
+  }
+
+  for (int i = 1; i < ir->rpo.count; i++) {
+    int block = ir->rpo.items[i];
+    appendInt(&ir->blocks[ir->blocks[block].idom].children, block);
+  }
+}
+
+static bool dominates(Ir* ir, int a, int b) {
+  while (a != b) {
+    if (b == 0) return false;
+    b = ir->blocks[b].idom;
+  }
+  return true;
+}
+
+// The blocks of the natural loop headed by header, or NULL if no back edge
+// reaches it
+static bool* loopBody(Ir* ir, int header, int* size) {
+  bool* body = NULL;
+  IntArray pending;
+  initIntArray(&pending);
+  IntArray* preds = &ir->blocks[header].preds;
+  for (int i = 0; i < preds->count; i++) {
+    int pred = preds->items[i];
+    // A dominator comes first in reverse postorder.
+    if (ir->blocks[pred].rpo < ir->blocks[header].rpo ||
+        !dominates(ir, header, pred)) {
+      continue;
+    }
+    if (body == NULL) {
+      body = allocate(sizeof(bool) * ir->blockCount);
+      body[header] = true;
+      *size = 1;
+    }
+    if (!body[pred]) {
+      body[pred] = true;
+      (*size)++;
+      appendInt(&pending, pred);
+    }
+  }
+
+  while (pending.count > 0) {
+    int block = pending.items[--pending.count];
+    IntArray* blockPreds = &ir->blocks[block].preds;
+    for (int i = 0; i < blockPreds->count; i++) {
+      int pred = blockPreds->items[i];
+      if (body[pred] || ir->blocks[pred].rpo == NONE) continue;
+      body[pred] = true;
+      (*size)++;
+      appendInt(&pending, pred);
+    }
+  }
+
+  freeIntArray(&pending);
+  return body;
+}
+
+// Give a loop a single block that enters it, for invariant code to move to.
+// The header's phis split into the part that merges entries from outside,
+// which moves to the new block, and the part that merges back edges.
+static void insertPreheader(Ir* ir, int header, bool* body) {
+  IntArray outside;
+  IntArray inside;
+  initIntArray(&outside);
+  initIntArray(&inside);
+  IntArray* preds = &ir->blocks[header].preds;
+  for (int i = 0; i < preds->count; i++) {
+    appendInt(body[preds->items[i]] ? &inside : &outside, i);
+  }
+
+  if (outside.count != 1 ||
+      ir->blocks[preds->items[outside.items[0]]].succCount != 1) {
+    int preheader = newBlock(ir, NONE);
+    int line = ir->values[ir->blocks[header].code.items[0]].line;
+    emitValue(ir, preheader, OP_JUMP, 0, line);
+    ir->blocks[preheader].succs[0] = header;
+    ir->blocks[preheader].succCount = 1;
+
+    IntArray oldPreds = ir->blocks[header].preds;
+    for (int i = 0; i < outside.count; i++) {
+      int pred = oldPreds.items[outside.items[i]];
+      IrBlock* p = &ir->blocks[pred];
+      for (int s = 0; s < p->succCount; s++) {
+        if (p->succs[s] == header) p->succs[s] = preheader;
+      }
+      appendInt(&ir->blocks[preheader].preds, pred);
+    }
+
+    IntArray* phis = &ir->blocks[header].phis;
+    for (int i = 0; i < phis->count; i++) {
+      int phi = phis->items[i];
+      if (ir->values[phi].forward != NONE) continue;
+      int incoming;
+      if (outside.count == 1) {
+        incoming = ir->values[phi].args.items[outside.items[0]];
+      } else {
+        incoming = newPhi(ir, preheader);
+        for (int o = 0; o < outside.count; o++) {
+          int arg = ir->values[phi].args.items[outside.items[o]];
+          appendInt(&ir->values[incoming].args, arg);
+        }
+        incoming = tryRemoveTrivialPhi(ir, incoming);
+      }
+
+      IntArray args;
+      initIntArray(&args);
+      appendInt(&args, incoming);
+      for (int n = 0; n < inside.count; n++) {
+        appendInt(&args, ir->values[phi].args.items[inside.items[n]]);
+      }
+      freeIntArray(&ir->values[phi].args);
+      ir->values[phi].args = args;
+    }
+
+    IntArray newPreds;
+    initIntArray(&newPreds);
+    appendInt(&newPreds, preheader);
+    for (int n = 0; n < inside.count; n++) {
+      appendInt(&newPreds, oldPreds.items[inside.items[n]]);
+    }
+    freeIntArray(&ir->blocks[header].preds);
+    ir->blocks[header].preds = newPreds;
+
+    // Lay it out just before the header.
+    appendInt(&ir->order, NONE);
+    int at = ir->order.count - 1;
+    while (ir->order.items[at - 1] != header) {
+      ir->order.items[at] = ir->order.items[at - 1];
+      at--;
+    }
+    ir->order.items[at] = ir->order.items[at - 1];
+    ir->order.items[at - 1] = preheader;
+  }
+
+  freeIntArray(&outside);
+  freeIntArray(&inside);
+}
+
+// Give each loop whose header tests its condition and leaves a copy of the
+// test on the way in, after Muchnick's loop inversion: the body is entered
+// only when it is to run at least once, and its first block becomes the
+// header. The code the body starts with then runs whenever the loop is
+// entered, so what is invariant there can be hoisted, even if it can fail,
+// without changing what fails first. This runs before lifting, so the copy
+// is lifted like any other block and SSA construction merges the two tests.
+static void rotateLoops(Ir* ir) {
+  computeDominators(ir);
+  int blockCount = ir->blockCount;
+  for (int h = 1; h < blockCount; h++) {
+    int size = 0;
+    bool* body = loopBody(ir, h, &size);
+    if (body == NULL) continue;
+
+    IrBlock* header = &ir->blocks[h];
+    int entry = NONE;
+    int entries = 0;
+    for (int i = 0; i < header->preds.count; i++) {
+      if (!body[header->preds.items[i]]) {
+        entry = header->preds.items[i];
+        entries++;
+      }
+    }
+    bool rotate = entries == 1 && header->succCount == 2 &&
+                  ir->chunk->code[header->last] == OP_JUMP_IF_FALSE &&
+                  body[header->succs[0]] != body[header->succs[1]];
+    for (int s = 0; rotate && s < 2; s++) {
+      int succ = header->succs[s];
+      if (body[succ] && ir->blocks[succ].preds.count != 1) rotate = false;
+    }
+    free(body);
+    if (!rotate) continue;
+
+    int copy = newBlock(ir, ir->blocks[h].first);
+    header = &ir->blocks[h];
+    ir->blocks[copy].last = header->last;
+    ir->blocks[copy].end = header->end;
+
+    IrBlock* from = &ir->blocks[entry];
+    for (int s = 0; s < from->succCount; s++) {
+      if (from->succs[s] == h) from->succs[s] = copy;
+    }
+    appendInt(&ir->blocks[copy].preds, entry);
+    IntArray* preds = &header->preds;
+    int count = 0;
+    for (int i = 0; i < preds->count; i++) {
+      if (preds->items[i] != entry) preds->items[count++] = preds->items[i];
+    }
+    preds->count = count;
+    addEdge(ir, copy, header->succs[0]);
+    addEdge(ir, copy, header->succs[1]);
+
+    // Lay it out where the header was, for the entry to fall into.
+    appendInt(&ir->order, NONE);
+    int at = ir->order.count - 1;
+    while (ir->order.items[at - 1] != h) {
+      ir->order.items[at] = ir->order.items[at - 1];
+      at--;
+    }
+    ir->order.items[at] = h;
+    ir->order.items[at - 1] = copy;
+
+    computeDominators(ir);
+  }
+}
+
+static int compareLoops(const void* a, const void* b) {
+  return ((const Loop*)a)->size - ((const Loop*)b)->size;
+}
+
+// Find the loops, innermost first, giving each a preheader
+static void findLoops(Ir* ir) {
+  computeDominators(ir);
+  int blockCount = ir->blockCount;
+  for (int b = 0; b < blockCount; b++) {
+    int size = 0;
+    bool* body = loopBody(ir, b, &size);
+    if (body == NULL) continue;
+    int count = ir->blockCount;
+    insertPreheader(ir, b, body);
+    free(body);
+    // Later loops are found through the new edges.
+    if (ir->blockCount != count) computeDominators(ir);
+  }
+
+  ir->loops = allocate(sizeof(Loop) * ir->blockCount);
+  for (int b = 0; b < ir->blockCount; b++) {
+    int size = 0;
+    bool* body = loopBody(ir, b, &size);
+    if (body == NULL) continue;
+    Loop* loop = &ir->loops[ir->loopCount++];
+    loop->header = b;
+    loop->body = body;
+    loop->size = size;
+    loop->preheader = NONE;
+    IntArray* preds = &ir->blocks[b].preds;
+    for (int i = 0; i < preds->count; i++) {
+      if (!body[preds->items[i]]) loop->preheader = preds->items[i];
+    }
+  }
+  qsort(ir->loops, ir->loopCount, sizeof(Loop), compareLoops);
+}
+
+static bool isLiteral(int op) {
+  return op == OP_CONSTANT || op == OP_NIL || op == OP_TRUE || op == OP_FALSE;
+}
+
+// Instructions whose result depends only on their operands
+static bool isComputation(int op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_NOT:
+    case OP_NEGATE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool hasEffect(int op) {
+  switch (op) {
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_UPVALUE:
+    case OP_SET_ENCLOSING:
+    case OP_PRINT:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_RETURN:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool producesValue(int op) {
+  return op == IR_PARAM || op == IR_PHI || op == OP_GET_GLOBAL ||
+         op == OP_GET_UPVALUE || op == OP_GET_ENCLOSING || op == OP_CALL ||
+         op == OP_CLOSURE || isComputation(op);
+}
+
+static bool isNumber(Ir* ir, int value) {
+  return ir->values[find(ir, value)].number;
+}
+
+// Whether an instruction can raise a runtime error
+static bool mayThrow(Ir* ir, int v) {
+  IrValue* value = &ir->values[v];
+  switch (value->op) {
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      return !isNumber(ir, value->args.items[0]) ||
+             !isNumber(ir, value->args.items[1]);
+    case OP_NEGATE:
+      return !isNumber(ir, value->args.items[0]);
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Find the values known to be numbers. Everything starts out assumed to be
+// one and is only ever demoted, so a loop counter that only has numbers
+// added to it stays one, and the iteration ends.
+static void inferNumbers(Ir* ir) {
+  for (int i = 0; i < ir->valueCount; i++) ir->values[i].number = true;
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 0; i < ir->valueCount; i++) {
+      IrValue* value = &ir->values[i];
+      if (value->forward != NONE || !value->number) continue;
+      bool number;
+      switch (value->op) {
+        case OP_CONSTANT:
+          number = IS_NUMBER(ir->chunk->constants.values[value->operand]);
+          break;
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NEGATE:
+          number = true;
+          break;
+        case OP_ADD:
+        case IR_PHI:
+          number = true;
+          for (int a = 0; a < value->args.count; a++) {
+            if (!isNumber(ir, value->args.items[a])) number = false;
+          }
+          break;
+        default:
+          number = false;
+          break;
+      }
+      if (!number) {
+        value->number = false;
+        changed = true;
+      }
+    }
+  }
+}
+
+// Global value numbering over the dominator tree
+
+static uint32_t hashValue(Ir* ir, int v) {
+  IrValue* value = &ir->values[v];
+  uint32_t hash = (uint32_t)value->op * 31u + (uint32_t)value->operand;
+  for (int i = 0; i < value->args.count; i++) {
+    hash = hash * 31u + (uint32_t)find(ir, value->args.items[i]);
+  }
+  return hash;
+}
+
+static bool sameValue(Ir* ir, int a, int b) {
+  IrValue* x = &ir->values[a];
+  IrValue* y = &ir->values[b];
+  if (x->op != y->op || x->operand != y->operand ||
+      x->args.count != y->args.count) {
+    return false;
+  }
+  for (int i = 0; i < x->args.count; i++) {
+    if (find(ir, x->args.items[i]) != find(ir, y->args.items[i])) return false;
+  }
+  return true;
+}
+
+// The equal value already in the table, or NONE after inserting this one
+static int lookup(Ir* ir, int v) {
+  uint32_t index = hashValue(ir, v) & (ir->tableSize - 1);
+  while (ir->table[index] != NONE) {
+    if (sameValue(ir, ir->table[index], v)) return ir->table[index];
+    index = (index + 1) & (ir->tableSize - 1);
+  }
+  ir->table[index] = v;
+  appendInt(&ir->inserted, (int)index);
+  return NONE;
+}
+
+static void replace(Ir* ir, int v, int with) {
+  ir->values[v].forward = with;
+  if (!isLiteral(ir->values[v].op)) ir->changes++;
+}
+
+static void forgetMemory(Ir* ir) {
+  for (int i = 0; i < UINT8_COUNT; i++) {
+    ir->globals[i] = NONE;
+    ir->upvalues[i] = NONE;
+  }
+}
+
+static void numberBlock(Ir* ir, int block) {
+  int mark = ir->inserted.count;
+
+  // Reads of globals and upvalues are only reused within the block, and
+  // only until a call might have changed them.
+  forgetMemory(ir);
+  IntArray* code = &ir->blocks[block].code;
+  for (int i = 0; i < code->count; i++) {
+    int v = code->items[i];
+    IrValue* value = &ir->values[v];
+    if (value->forward != NONE) continue;
+    int operand = value->operand;
+    switch (value->op) {
+      case OP_GET_GLOBAL:
+        if (ir->globals[operand] != NONE) {
+          replace(ir, v, ir->globals[operand]);
+        } else {
+          ir->globals[operand] = v;
+        }
+        break;
+      case OP_DEFINE_GLOBAL:
+      case OP_SET_GLOBAL:
+        ir->globals[operand] = find(ir, value->args.items[0]);
+        break;
+      case OP_GET_UPVALUE:
+        if (ir->upvalues[operand] != NONE) {
+          replace(ir, v, ir->upvalues[operand]);
+        } else {
+          ir->upvalues[operand] = v;
+        }
+        break;
+      case OP_SET_UPVALUE:
+        ir->upvalues[operand] = find(ir, value->args.items[0]);
+        break;
+      case OP_CALL:
+      case OP_TAIL_CALL:
+        forgetMemory(ir);
+        break;
+      default:
+        if (isComputation(value->op)) {
+          int same = lookup(ir, v);
+          if (same != NONE) replace(ir, v, same);
+        }
+        break;
+    }
+  }
+
+  IntArray* children = &ir->blocks[block].children;
+  for (int i = 0; i < children->count; i++) {
+    numberBlock(ir, children->items[i]);
+  }
+
+  // Undo this subtree's insertions newest first, which leaves the probe
+  // sequences of older entries intact.
+  while (ir->inserted.count > mark) {
+    ir->table[ir->inserted.items[--ir->inserted.count]] = NONE;
+  }
+}
+
+static void numberValues(Ir* ir) {
+  free(ir->table);
+  ir->tableSize = 16;
+  while (ir->tableSize < ir->valueCount * 2) ir->tableSize *= 2;
+  ir->table = allocate(sizeof(int) * ir->tableSize);
+  for (int i = 0; i < ir->tableSize; i++) ir->table[i] = NONE;
+  numberBlock(ir, 0);
+  removeTrivialPhis(ir);
+  compact(ir, false);
+}
+
+// Loop-invariant code motion
+
+// Whether a dominating instruction already read or wrote the global, so
+// reading it cannot fail
+static bool knownDefined(Ir* ir, int block, int global) {
+  for (;;) {
+    IntArray* code = &ir->blocks[block].code;
+    for (int i = 0; i < code->count; i++) {
+      IrValue* value = &ir->values[code->items[i]];
+      if (value->forward != NONE || value->operand != global) continue;
+      if (value->op == OP_GET_GLOBAL || value->op == OP_SET_GLOBAL ||
+          value->op == OP_DEFINE_GLOBAL) {
+        return true;
+      }
+    }
+    if (block == 0) return false;
+    block = ir->blocks[block].idom;
+  }
+}
+
+static bool invariant(Ir* ir, Loop* loop, int v) {
+  IrValue* value = &ir->values[v];
+  for (int i = 0; i < value->args.count; i++) {
+    IrValue* arg = &ir->values[find(ir, value->args.items[i])];
+    if (isLiteral(arg->op)) continue;
+    if (loop->body[arg->block]) return false;
+  }
+  return true;
+}
+
+static void hoistLoop(Ir* ir, Loop* loop) {
+  bool hasCall = false;
+  bool* writesGlobal = allocate(sizeof(bool) * UINT8_COUNT);
+  bool* writesUpvalue = allocate(sizeof(bool) * UINT8_COUNT);
+  for (int b = 0; b < ir->blockCount; b++) {
+    if (!loop->body[b]) continue;
+    IntArray* code = &ir->blocks[b].code;
+    for (int i = 0; i < code->count; i++) {
+      IrValue* value = &ir->values[code->items[i]];
+      if (value->op == OP_CALL || value->op == OP_TAIL_CALL) hasCall = true;
+      if (value->op == OP_SET_GLOBAL || value->op == OP_DEFINE_GLOBAL) {
+        writesGlobal[value->operand] = true;
+      }
+      if (value->op == OP_SET_UPVALUE) writesUpvalue[value->operand] = true;
+    }
+  }
+
+  // The header runs whenever the loop is entered, and so does each block
+  // after it that only the block before can jump to. Until something with
+  // an effect runs in that chain, hoisting its instructions cannot add an
+  // error. The rest of the body follows in reverse postorder.
+  IntArray blocks;
+  initIntArray(&blocks);
+  bool* listed = allocate(sizeof(bool) * ir->blockCount);
+  int block = loop->header;
+  for (;;) {
+    appendInt(&blocks, block);
+    listed[block] = true;
+    IrBlock* b = &ir->blocks[block];
+    if (b->succCount != 1) break;
+    block = b->succs[0];
+    if (!loop->body[block] || listed[block] ||
+        ir->blocks[block].preds.count != 1) {
+      break;
+    }
+  }
+  int chain = blocks.count;
+  for (int r = 0; r < ir->rpo.count; r++) {
+    block = ir->rpo.items[r];
+    if (loop->body[block] && !listed[block]) appendInt(&blocks, block);
+  }
+
+  // Globals read by instructions already hoisted to the preheader.
+  bool* readGlobal = allocate(sizeof(bool) * UINT8_COUNT);
+  IntArray hoisted;
+  initIntArray(&hoisted);
+  bool prefix = true;
+  for (int n = 0; n < blocks.count; n++) {
+    block = blocks.items[n];
+    if (n == chain) prefix = false;
+    IntArray* code = &ir->blocks[block].code;
+    for (int i = 0; i < code->count; i++) {
+      int v = code->items[i];
+      IrValue* value = &ir->values[v];
+      bool hoist = false;
+      if (!isLiteral(value->op) && invariant(ir, loop, v)) {
+        switch (value->op) {
+          case OP_GET_GLOBAL:
+            hoist = !hasCall && !writesGlobal[value->operand] &&
+                    (prefix || readGlobal[value->operand] ||
+                     knownDefined(ir, loop->preheader, value->operand));
+            break;
+          case OP_GET_UPVALUE:
+            hoist = !hasCall && !writesUpvalue[value->operand];
+            break;
+          default:
+            hoist = isComputation(value->op) && (prefix || !mayThrow(ir, v));
+            break;
+        }
+      }
+
+      if (hoist) {
+        if (value->op == OP_GET_GLOBAL) readGlobal[value->operand] = true;
+        value->block = loop->preheader;
+        appendInt(&hoisted, v);
+        ir->changes++;
+        ir->hoisted++;
+      } else if ((hasEffect(value->op) && value->op != OP_JUMP) ||
+                 mayThrow(ir, v)) {
+        prefix = false;
+      }
+    }
+  }
+
+  if (hoisted.count > 0) {
+    // Ahead of the preheader's jump into the loop.
+    IntArray* code = &ir->blocks[loop->preheader].code;
+    int terminator = code->items[--code->count];
+    for (int i = 0; i < hoisted.count; i++) appendInt(code, hoisted.items[i]);
+    appendInt(code, terminator);
+    for (int b = 0; b < ir->blockCount; b++) {
+      if (loop->body[b]) compactBlock(ir, b, false);
+    }
+  }
+
+  freeIntArray(&blocks);
+  freeIntArray(&hoisted);
+  free(listed);
+  free(readGlobal);
+  free(writesGlobal);
+  free(writesUpvalue);
+}
+
+static void hoistInvariants(Ir* ir) {
+  for (int i = 0; i < ir->loopCount; i++) {
+    if (ir->loops[i].preheader == NONE) continue;
+    hoistLoop(ir, &ir->loops[i]);
+  }
+}
+
+static void eliminateDeadCode(Ir* ir) {
+  IntArray pending;
+  initIntArray(&pending);
+  for (int i = 0; i < ir->valueCount; i++) ir->values[i].live = false;
+  for (int b = 0; b < ir->blockCount; b++) {
+    IntArray* code = &ir->blocks[b].code;
+    for (int i = 0; i < code->count; i++) {
+      int v = code->items[i];
+      if (hasEffect(ir->values[v].op) || mayThrow(ir, v)) {
+        ir->values[v].live = true;
+        appendInt(&pending, v);
+      }
+    }
+  }
+
+  while (pending.count > 0) {
+    int v = pending.items[--pending.count];
+    for (int i = 0; i < ir->values[v].args.count; i++) {
+      int arg = find(ir, ir->values[v].args.items[i]);
+      if (ir->values[arg].live) continue;
+      ir->values[arg].live = true;
+      appendInt(&pending, arg);
+    }
+  }
+
+  for (int b = 0; b < ir->blockCount; b++) {
+    IntArray* code = &ir->blocks[b].code;
+    for (int i = 0; i < code->count; i++) {
+      IrValue* value = &ir->values[code->items[i]];
+      if (!value->live && value->op != IR_PARAM && !isLiteral(value->op)) {
+        ir->changes++;
+      }
+    }
+  }
+  compact(ir, true);
+  freeIntArray(&pending);
+}
+
+// Lowering back to bytecode
+
+static void countUses(Ir* ir) {
+  for (int i = 0; i < ir->valueCount; i++) {
+    ir->values[i].uses = 0;
+    ir->values[i].user = NONE;
+    ir->values[i].phiUse = false;
+  }
+  for (int b = 0; b < ir->blockCount; b++) {
+    IntArray* lists[2] = {&ir->blocks[b].phis, &ir->blocks[b].code};
+    for (int l = 0; l < 2; l++) {
+      for (int i = 0; i < lists[l]->count; i++) {
+        int v = lists[l]->items[i];
+        IntArray* args = &ir->values[v].args;
+        for (int a = 0; a < args->count; a++) {
+          int arg = find(ir, args->items[a]);
+          args->items[a] = arg;
+          ir->values[arg].uses++;
+          ir->values[arg].user = v;
+          if (l == 0) ir->values[arg].phiUse = true;
+        }
+      }
+    }
+  }
+}
+
+// Leave a value on the stack when its only user, later in the block, takes
+// it as one of a run of leading operands that ends up on top of the stack
+// in order. Everything else is kept in a slot.
+static void stackify(Ir* ir) {
+  IntArray pending;
+  initIntArray(&pending);
+  for (int b = 0; b < ir->blockCount; b++) {
+    pending.count = 0;
+    IntArray* code = &ir->blocks[b].code;
+    for (int i = 0; i < code->count; i++) {
+      int v = code->items[i];
+      IrValue* value = &ir->values[v];
+      int argCount = value->args.count;
+
+      int matched = 0;
+      int most = argCount < pending.count ? argCount : pending.count;
+      for (int m = most; m > 0 && matched == 0; m--) {
+        bool match = true;
+        for (int a = 0; a < m; a++) {
+          if (pending.items[pending.count - m + a] != value->args.items[a]) {
+            match = false;
+          }
+        }
+        if (match) matched = m;
+      }
+      pending.count -= matched;
+
+      for (int a = matched; a < argCount; a++) {
+        int arg = value->args.items[a];
+        for (int p = 0; p < pending.count; p++) {
+          if (pending.items[p] != arg) continue;
+          memmove(&pending.items[p], &pending.items[p + 1],
+                  sizeof(int) * (pending.count - p - 1));
+          pending.count--;
+          ir->values[arg].stacked = false;
+          break;
+        }
+      }
+
+      if (producesValue(value->op) && value->op != IR_PARAM &&
+          value->uses == 1 && !value->phiUse &&
+          ir->values[value->user].block == b) {
+        value->stacked = true;
+        appendInt(&pending, v);
+      }
+    }
+    for (int p = 0; p < pending.count; p++) {
+      ir->values[pending.items[p]].stacked = false;
+    }
+  }
+  freeIntArray(&pending);
+}
+
+static bool needsSlot(IrValue* value) {
+  return producesValue(value->op) && value->op != IR_PARAM &&
+         !isLiteral(value->op) && !value->stacked &&
+         (value->uses > 0 || value->op == IR_PHI);
+}
+
+// Whether the value is read from a slot
+static bool inSlot(IrValue* value) {
+  return value->op == IR_PARAM || needsSlot(value);
+}
+
+static int slotOf(IrValue* value) {
+  return value->op == IR_PARAM ? value->operand : value->slot;
+}
+
+typedef struct {
+  int start;
+  int value;
+} Interval;
+
+static int compareIntervals(const void* a, const void* b) {
+  const Interval* x = a;
+  const Interval* y = b;
+  if (x->start != y->start) return x->start - y->start;
+  return x->value - y->value;
+}
+
+static void extend(IrValue* value, int position) {
+  if (position < value->start) value->start = position;
+  if (position > value->end) value->end = position;
+}
+
+// Give every value that needs one a slot above the parameters, by linear
+// scan over one interval per value that covers everywhere it is live
+static int allocateSlots(Ir* ir) {
+  int position = 1;
+  for (int o = 0; o < ir->order.count; o++) {
+    IrBlock* block = &ir->blocks[ir->order.items[o]];
+    block->from = position++;
+    for (int i = 0; i < block->code.count; i++) {
+      ir->values[block->code.items[i]].position = position++;
+    }
+    block->to = position++;
+  }
+
+  int words = (ir->valueCount + 63) / 64;
+  uint64_t* liveIn = allocate(sizeof(uint64_t) * words * ir->blockCount);
+  uint64_t* liveOut = allocate(sizeof(uint64_t) * words * ir->blockCount);
+  uint64_t* defined = allocate(sizeof(uint64_t) * words * ir->blockCount);
+#define SET_BIT(set, v) ((set)[(v) / 64] |= (uint64_t)1 << ((v) % 64))
+
+  // Values are live into a block when something in it reads them, and out
+  // of it when a successor needs them or a successor's phi reads them on
+  // the edge.
+  for (int v = 0; v < ir->valueCount; v++) {
+    SET_BIT(&defined[ir->values[v].block * words], v);
+  }
+  for (int b = 0; b < ir->blockCount; b++) {
+    IrBlock* block = &ir->blocks[b];
+    uint64_t* in = &liveIn[b * words];
+    for (int i = 0; i < block->code.count; i++) {
+      IntArray* args = &ir->values[block->code.items[i]].args;
+      for (int a = 0; a < args->count; a++) {
+        int arg = args->items[a];
+        if (inSlot(&ir->values[arg]) && ir->values[arg].block != b) {
+          SET_BIT(in, arg);
+        }
+      }
+    }
+    for (int s = 0; s < block->succCount; s++) {
+      int succ = block->succs[s];
+      int index = predIndex(ir, succ, b);
+      IntArray* phis = &ir->blocks[succ].phis;
+      for (int p = 0; p < phis->count; p++) {
+        int arg = ir->values[phis->items[p]].args.items[index];
+        if (inSlot(&ir->values[arg])) SET_BIT(&liveOut[b * words], arg);
+      }
+    }
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int o = ir->order.count - 1; o >= 0; o--) {
+      int b = ir->order.items[o];
+      IrBlock* block = &ir->blocks[b];
+      uint64_t* out = &liveOut[b * words];
+      uint64_t* in = &liveIn[b * words];
+      for (int s = 0; s < block->succCount; s++) {
+        uint64_t* succIn = &liveIn[block->succs[s] * words];
+        for (int w = 0; w < words; w++) out[w] |= succIn[w];
+      }
+      for (int w = 0; w < words; w++) {
+        uint64_t bits = in[w] | (out[w] & ~defined[b * words + w]);
+        if (bits != in[w]) {
+          in[w] = bits;
+          changed = true;
+        }
+      }
+    }
+  }
+#undef SET_BIT
+
+  for (int v = 0; v < ir->valueCount; v++) {
+    IrValue* value = &ir->values[v];
+    int at = value->op == IR_PHI ? ir->blocks[value->block].from
+                                 : value->position;
+    value->start = at;
+    value->end = at;
+  }
+  for (int o = 0; o < ir->order.count; o++) {
+    int b = ir->order.items[o];
+    IrBlock* block = &ir->blocks[b];
+    for (int i = 0; i < block->code.count; i++) {
+      IrValue* user = &ir->values[block->code.items[i]];
+      for (int a = 0; a < user->args.count; a++) {
+        extend(&ir->values[user->args.items[a]], user->position);
+      }
+    }
+    // Phis are written, and their operands read, on the way out of each
+    // predecessor.
+    for (int p = 0; p < block->phis.count; p++) {
+      IrValue* phi = &ir->values[block->phis.items[p]];
+      for (int a = 0; a < phi->args.count; a++) {
+        int pred = block->preds.items[a];
+        extend(phi, ir->blocks[pred].to);
+        extend(&ir->values[phi->args.items[a]], ir->blocks[pred].to);
+      }
+    }
+    for (int w = 0; w < words; w++) {
+      uint64_t in = liveIn[b * words + w];
+      uint64_t out = liveOut[b * words + w];
+      for (int bit = 0; bit < 64 && (in | out) != 0; bit++) {
+        uint64_t mask = (uint64_t)1 << bit;
+        if (in & mask) extend(&ir->values[w * 64 + bit], block->from);
+        if (out & mask) extend(&ir->values[w * 64 + bit], block->to);
+        in &= ~mask;
+        out &= ~mask;
+      }
+    }
+  }
+
+  // A value computed only to become a phi's next value on the way out of a
+  // block can be computed straight into the phi's slot, if the phi is dead
+  // by then. This keeps a loop counter in one slot instead of copying it
+  // back every time around.
+  for (int b = 0; b < ir->blockCount; b++) {
+    IntArray* phis = &ir->blocks[b].phis;
+    for (int p = 0; p < phis->count; p++) {
+      int phi = phis->items[p];
+      for (int a = 0; a < ir->values[phi].args.count; a++) {
+        int pred = ir->blocks[b].preds.items[a];
+        IrValue* value = &ir->values[ir->values[phi].args.items[a]];
+        if (value->block != pred || !needsSlot(value) || value->uses != 1 ||
+            value->share != NONE || value->op == IR_PHI ||
+            value->position < ir->values[phi].start ||
+            ((liveOut[pred * words + phi / 64] >> (phi % 64)) & 1)) {
+          continue;
+        }
+        bool dead = true;
+        IntArray* code = &ir->blocks[pred].code;
+        for (int i = 0; i < code->count; i++) {
+          IrValue* user = &ir->values[code->items[i]];
+          if (user->position <= value->position) continue;
+          for (int u = 0; u < user->args.count; u++) {
+            if (user->args.items[u] == phi) dead = false;
+          }
+        }
+        if (dead) value->share = phi;
+      }
+    }
+  }
+
+  free(liveIn);
+  free(liveOut);
+  free(defined);
+
+  Interval* intervals = allocate(sizeof(Interval) * ir->valueCount);
+  int count = 0;
+  for (int b = 0; b < ir->blockCount; b++) {
+    IntArray* lists[2] = {&ir->blocks[b].phis, &ir->blocks[b].code};
+    for (int l = 0; l < 2; l++) {
+      for (int i = 0; i < lists[l]->count; i++) {
+        int v = lists[l]->items[i];
+        if (!needsSlot(&ir->values[v]) || ir->values[v].share != NONE) {
+          continue;
+        }
+        intervals[count].start = ir->values[v].start;
+        intervals[count].value = v;
+        count++;
+      }
+    }
+  }
+  qsort(intervals, count, sizeof(Interval), compareIntervals);
+
+  int top = ir->arity + 1;
+  int* holder = allocate(sizeof(int) * UINT8_COUNT);
+  for (int s = 0; s < UINT8_COUNT; s++) holder[s] = NONE;
+  for (int i = 0; i < count; i++) {
+    IrValue* value = &ir->values[intervals[i].value];
+    int slot = NONE;
+    for (int s = ir->arity + 1; s < UINT8_COUNT; s++) {
+      if (holder[s] != NONE && ir->values[holder[s]].end < value->start) {
+        holder[s] = NONE;
+      }
+      if (holder[s] == NONE && slot == NONE) slot = s;
+    }
+    if (slot == NONE) {
+      top = NONE;
+      break;
+    }
+    holder[slot] = intervals[i].value;
+    value->slot = slot;
+    if (slot + 1 > top) top = slot + 1;
+  }
+
+  for (int v = 0; top != NONE && v < ir->valueCount; v++) {
+    IrValue* value = &ir->values[v];
+    if (value->share != NONE) value->slot = ir->values[value->share].slot;
+  }
+
+  free(holder);
+  free(intervals);
+  return top;
+}
+
+static void emitByte(Ir* ir, uint8_t byte, int line) {
+  if (ir->capacity < ir->count + 1) {
+    ir->capacity = ir->capacity < 64 ? 64 : ir->capacity * 2;
+    ir->code = realloc(ir->code, ir->capacity);
+    ir->lines = realloc(ir->lines, sizeof(int) * ir->capacity);
+    if (ir->code == NULL || ir->lines == NULL) exit(1);
+  }
+  ir->code[ir->count] = byte;
+  ir->lines[ir->count] = line;
+  ir->count++;
+}
+
+static void emitBytes(Ir* ir, uint8_t a, uint8_t b, int line) {
+  emitByte(ir, a, line);
+  emitByte(ir, b, line);
+}
+
+// Jumps are emitted wide and hold their target, for rewriteCode() to
+// encode once the code is installed
+static int emitJump(Ir* ir, uint8_t op, int line) {
+  emitByte(ir, wideJump(op), line);
+  for (int i = 0; i < 4; i++) emitByte(ir, 0xff, line);
+  return ir->count - 5;
+}
+
+static void patchJump(Ir* ir, int offset, int target) {
+  setJumpTarget(&ir->code[offset], target);
+}
+
+static void pushValue(Ir* ir, int v, int line) {
+  IrValue* value = &ir->values[v];
+  switch (value->op) {
+    case OP_CONSTANT:
+      emitBytes(ir, OP_CONSTANT, value->operand, line);
+      break;
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      emitByte(ir, value->op, line);
+      break;
+    default:
+      emitBytes(ir, OP_GET_LOCAL, slotOf(value), line);
+      break;
+  }
+}
+
+// Push the operands that are not already on the stack
+static void pushOperands(Ir* ir, IrValue* value) {
+  for (int a = 0; a < value->args.count; a++) {
+    IrValue* arg = &ir->values[value->args.items[a]];
+    if (arg->stacked) continue;
+    pushValue(ir, value->args.items[a], value->line);
+  }
+}
+
+// Deal with the result an instruction just pushed
+static void storeResult(Ir* ir, IrValue* value) {
+  if (value->stacked) return;
+  if (needsSlot(value)) emitBytes(ir, OP_SET_LOCAL, value->slot, value->line);
+  emitByte(ir, OP_POP, value->line);
+}
+
+static void emitGoto(Ir* ir, int block, int line) {
+  int label = ir->blocks[block].label;
+  if (label != NONE) {
+    patchJump(ir, emitJump(ir, OP_LOOP, line), label);
+  } else {
+    appendInt(&ir->patches, emitJump(ir, OP_JUMP, line));
+    appendInt(&ir->patches, block);
+  }
+}
+
+typedef struct {
+  int slot;
+  int source;
+  bool saved;  // The source's slot was overwritten; its value is on the stack.
+} Move;
+
+static bool readsSlot(Ir* ir, Move* move, int slot) {
+  IrValue* source = &ir->values[move->source];
+  return !move->saved && inSlot(source) && slotOf(source) == slot;
+}
+
+// Set the successor's phis on the edge from block, as one parallel copy
+static void emitMoves(Ir* ir, int block, int succ, int line) {
+  int index = predIndex(ir, succ, block);
+  IntArray* phis = &ir->blocks[succ].phis;
+  Move* moves = allocate(sizeof(Move) * phis->count);
+  int count = 0;
+  for (int p = 0; p < phis->count; p++) {
+    IrValue* phi = &ir->values[phis->items[p]];
+    int source = phi->args.items[index];
+    IrValue* value = &ir->values[source];
+    if (inSlot(value) && slotOf(value) == phi->slot) continue;
+    moves[count].slot = phi->slot;
+    moves[count].source = source;
+    moves[count].saved = false;
+    count++;
+  }
+
+  while (count > 0) {
+    int ready = NONE;
+    for (int m = 0; m < count && ready == NONE; m++) {
+      bool blocked = false;
+      for (int n = 0; n < count; n++) {
+        if (n != m && readsSlot(ir, &moves[n], moves[m].slot)) blocked = true;
+      }
+      if (!blocked) ready = m;
+    }
+
+    if (ready == NONE) {
+      // Every move waits on another: a cycle. Push the first one's old
+      // value so the move reading it can take it from the stack.
+      int slot = moves[0].slot;
+      emitBytes(ir, OP_GET_LOCAL, slot, line);
+      for (int n = 0; n < count; n++) {
+        if (readsSlot(ir, &moves[n], slot)) moves[n].saved = true;
+      }
+      continue;
+    }
+
+    Move move = moves[ready];
+    moves[ready] = moves[--count];
+    IrValue* source = &ir->values[move.source];
+    if (!move.saved && source->op == OP_CONSTANT) {
+      emitBytes(ir, OP_LOADK, move.slot, line);
+      emitByte(ir, source->operand, line);
+      continue;
+    }
+    if (!move.saved && inSlot(source)) {
+      emitBytes(ir, OP_MOVE, move.slot, line);
+      emitByte(ir, slotOf(source), line);
+      continue;
+    }
+    if (!move.saved) {
+      pushValue(ir, move.source, line);
+      emitBytes(ir, OP_SET_LOCAL, move.slot, line);
+      emitByte(ir, OP_POP, line);
+      continue;
+    }
+
+    // Several moves may read the saved value; the last one pops it.
+    bool more = false;
+    for (int n = 0; n < count; n++) {
+      if (moves[n].saved) more = true;
+    }
+    emitBytes(ir, OP_SET_LOCAL, move.slot, line);
+    if (!more) emitByte(ir, OP_POP, line);
+  }
+  free(moves);
+}
+
+static uint8_t registerForm(int op, bool store, bool constant) {
+  switch (op) {
+    case OP_ADD:
+      return store ? (constant ? OP_ADD_RRK : OP_ADD_RRR)
+                   : (constant ? OP_ADD_RK : OP_ADD_RR);
+    case OP_SUBTRACT:
+      return store ? (constant ? OP_SUBTRACT_RRK : OP_SUBTRACT_RRR)
+                   : (constant ? OP_SUBTRACT_RK : OP_SUBTRACT_RR);
+    case OP_MULTIPLY:
+      return store ? (constant ? OP_MULTIPLY_RRK : OP_MULTIPLY_RRR)
+                   : (constant ? OP_MULTIPLY_RK : OP_MULTIPLY_RR);
+    case OP_DIVIDE:
+      return store ? (constant ? OP_DIVIDE_RRK : OP_DIVIDE_RRR)
+                   : (constant ? OP_DIVIDE_RK : OP_DIVIDE_RR);
+    case OP_GREATER:
+      return store ? 0 : (constant ? OP_GREATER_RK : OP_GREATER_RR);
+    case OP_LESS:
+      return store ? 0 : (constant ? OP_LESS_RK : OP_LESS_RR);
+    default:
+      return 0;
+  }
+}
+
+// Arithmetic on operands in slots reads them in place, and stores straight
+// into the result's slot where a three-address form exists
+static bool lowerRegisterForm(Ir* ir, IrValue* value) {
+  IrValue* a = &ir->values[value->args.items[0]];
+  IrValue* b = &ir->values[value->args.items[1]];
+  if (a->stacked || !inSlot(a)) return false;
+  bool constant = b->op == OP_CONSTANT;
+  if (!constant && !inSlot(b)) return false;
+  uint8_t operand = constant ? b->operand : slotOf(b);
+
+  uint8_t op = registerForm(value->op, true, constant);
+  if (op != 0 && needsSlot(value)) {
+    emitByte(ir, op, value->line);
+    emitBytes(ir, value->slot, slotOf(a), value->line);
+    emitByte(ir, operand, value->line);
+    return true;
+  }
+  op = registerForm(value->op, false, constant);
+  if (op == 0) return false;
+  emitByte(ir, op, value->line);
+  emitBytes(ir, slotOf(a), operand, value->line);
+  storeResult(ir, value);
+  return true;
+}
+
+static void lowerValue(Ir* ir, int block, int next, int v) {
+  IrValue* value = &ir->values[v];
+  int line = value->line;
+  switch (value->op) {
+    case IR_PARAM:
+      break;
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      // Otherwise pushed again wherever it is used.
+      if (value->stacked) pushValue(ir, v, line);
+      break;
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_GET_ENCLOSING:
+      emitBytes(ir, value->op, value->operand, line);
+      storeResult(ir, value);
+      break;
+    case OP_DEFINE_GLOBAL:
+      pushOperands(ir, value);
+      emitBytes(ir, value->op, value->operand, line);
+      break;
+    case OP_SET_GLOBAL:
+    case OP_SET_UPVALUE:
+    case OP_SET_ENCLOSING:
+      pushOperands(ir, value);
+      emitBytes(ir, value->op, value->operand, line);
+      emitByte(ir, OP_POP, line);
+      break;
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      if (lowerRegisterForm(ir, value)) break;
+      // Fall through.
+    case OP_EQUAL:
+    case OP_NOT:
+    case OP_NEGATE:
+      pushOperands(ir, value);
+      emitByte(ir, value->op, line);
+      storeResult(ir, value);
+      break;
+    case OP_PRINT:
+      pushOperands(ir, value);
+      emitByte(ir, OP_PRINT, line);
+      break;
+    case OP_CALL:
+      pushOperands(ir, value);
+      emitBytes(ir, OP_CALL, value->operand, line);
+      storeResult(ir, value);
+      break;
+    case OP_TAIL_CALL:
+      pushOperands(ir, value);
+      emitBytes(ir, OP_TAIL_CALL, value->operand, line);
+      emitByte(ir, OP_RETURN, line);
+      break;
+    case OP_CLOSURE: {
+      int length = instructionLength(ir->chunk, value->offset);
+      for (int i = 0; i < length; i++) {
+        emitByte(ir, ir->chunk->code[value->offset + i], line);
+      }
+      storeResult(ir, value);
+      break;
+    }
+    case OP_RETURN:
+      pushOperands(ir, value);
+      emitByte(ir, OP_RETURN, line);
+      break;
+    case OP_JUMP: {
+      int succ = ir->blocks[block].succs[0];
+      emitMoves(ir, block, succ, line);
+      emitGoto(ir, succ, line);
+      break;
+    }
+    case OP_JUMP_IF_FALSE: {
+      IrBlock* b = &ir->blocks[block];
+      int truthy = b->succs[0];
+      int falsy = b->succs[1];
+      pushOperands(ir, value);
+      int jump = emitJump(ir, OP_JUMP_IF_FALSE, line);
+      emitByte(ir, OP_POP, line);
+      emitMoves(ir, block, truthy, line);
+      emitGoto(ir, truthy, line);
+      if (falsy != next) {
+        // Let the truthy side fall through into the next block, and pop
+        // the condition on the falsy side after the function's code.
+        appendInt(&ir->stubs, jump);
+        appendInt(&ir->stubs, block);
+        appendInt(&ir->stubs, falsy);
+        appendInt(&ir->stubs, line);
+        break;
+      }
+      patchJump(ir, jump, ir->count);
+      emitByte(ir, OP_POP, line);
+      emitMoves(ir, block, falsy, line);
+      emitGoto(ir, falsy, line);
+      break;
+    }
+  }
+}
+
+static bool lower(Ir* ir) {
+  countUses(ir);
+  stackify(ir);
+  int top = allocateSlots(ir);
+  if (top == NONE) return false;
+
+  // Reserve the slots up front, so every block starts at the same depth.
+  int line = ir->values[ir->blocks[ir->order.items[1]].code.items[0]].line;
+  for (int slot = ir->arity + 1; slot < top; slot++) {
+    emitByte(ir, OP_NIL, line);
+  }
+
+  for (int o = 0; o < ir->order.count; o++) {
+    int block = ir->order.items[o];
+    ir->blocks[block].label = ir->count;
+    int next = o + 1 < ir->order.count ? ir->order.items[o + 1] : NONE;
+    IntArray* code = &ir->blocks[block].code;
+    for (int i = 0; i < code->count; i++) {
+      lowerValue(ir, block, next, code->items[i]);
+    }
+  }
+
+  for (int i = 0; i < ir->stubs.count; i += 4) {
+    int line = ir->stubs.items[i + 3];
+    patchJump(ir, ir->stubs.items[i], ir->count);
+    emitByte(ir, OP_POP, line);
+    emitMoves(ir, ir->stubs.items[i + 1], ir->stubs.items[i + 2], line);
+    emitGoto(ir, ir->stubs.items[i + 2], line);
+  }
+
+  for (int i = 0; i < ir->patches.count; i += 2) {
+    int target = ir->blocks[ir->patches.items[i + 1]].label;
+    patchJump(ir, ir->patches.items[i], target);
+  }
+  return true;
+}
+
+// Instructions that do work, leaving out the jumps the peephole pass is
+// likely to remove again
+static int countWork(Chunk* chunk) {
+  int work = 0;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (narrowJump(chunk->code[offset]) != OP_JUMP) work++;
+  }
+  return work;
+}
+
+static void setCode(Chunk* chunk, uint8_t* code, int* lines, int count) {
+  resetCode(chunk);
+  for (int i = 0; i < count; i++) writeChunk(chunk, code[i], lines[i]);
+}
+
+// Replace the chunk's code with the lowered code, the constants staying
+// as they are. Without a loop to gain from, it has to be shorter as well.
+static bool install(Ir* ir) {
+  Chunk* chunk = ir->chunk;
+  int count = chunk->count;
+  uint8_t* code = allocate(count);
+  int* lines = chunkLocations(chunk);
+  memcpy(code, chunk->code, count);
+  int work = countWork(chunk);
+
+  rewriteCode(chunk, ir->code, ir->lines, ir->count, NULL);
+  bool kept = ir->hoisted > 0 || countWork(chunk) < work;
+  if (!kept) setCode(chunk, code, lines, count);
+
+  free(code);
+  free(lines);
+  return kept;
+}
+
+static void freeIr(Ir* ir) {
+  for (int i = 0; i < ir->valueCount; i++) freeIntArray(&ir->values[i].args);
+  for (int b = 0; b < ir->blockCount; b++) {
+    IrBlock* block = &ir->blocks[b];
+    freeIntArray(&block->preds);
+    freeIntArray(&block->phis);
+    freeIntArray(&block->code);
+    freeIntArray(&block->children);
+    free(block->defs);
+    free(block->incomplete);
+  }
+  for (int i = 0; i < ir->loopCount; i++) free(ir->loops[i].body);
+  free(ir->loops);
+  free(ir->values);
+  free(ir->blocks);
+  free(ir->depths);
+  free(ir->leaders);
+  free(ir->blockAt);
+  free(ir->table);
+  free(ir->code);
+  free(ir->lines);
+  freeIntArray(&ir->order);
+  freeIntArray(&ir->rpo);
+  freeIntArray(&ir->inserted);
+  freeIntArray(&ir->patches);
+  freeIntArray(&ir->stubs);
+}
+
+bool optimizeFunction(ObjFunction* function) {
+  Ir ir;
+  memset(&ir, 0, sizeof(Ir));
+  ir.chunk = &function->chunk;
+  ir.arity = function->arity;
+
+  bool optimized = false;
+  if (ir.chunk->count > 0 && analyze(&ir)) {
+    buildBlocks(&ir);
+    rotateLoops(&ir);
+    lift(&ir);
+    removeTrivialPhis(&ir);
+    compact(&ir, false);
+    findLoops(&ir);
+
+    numberValues(&ir);
+    inferNumbers(&ir);
+    hoistInvariants(&ir);
+    // Hoisting can leave copies of what the preheader already computed.
+    numberValues(&ir);
+    inferNumbers(&ir);
+    eliminateDeadCode(&ir);
+
+    optimized = ir.changes > 0 && lower(&ir) && install(&ir);
+  }
+
+  freeIr(&ir);
+  return optimized;
+}
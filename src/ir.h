@@ -0,0 +1,13 @@
+#ifndef _IR_H_
+#define _IR_H_
+
+#include "object.h"
+
+// Lift a finished function's bytecode into SSA form, remove redundant and
+// dead computations and hoist loop-invariant ones, including reads of
+// globals the loop never writes, then lower it back to ordinary opcodes.
+// Returns false, leaving the chunk untouched, when the function uses
+// something the IR does not model or nothing was worth rewriting.
+bool optimizeFunction(ObjFunction* function);
+
+#endif
@@ -0,0 +1,1538 @@
+#include "jit.h"
+
+#ifdef BASELINE_JIT
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "memory.h"
+
+JitOptions jitOptions = {100, 50};
+
+#define JIT_OK 0
+#define JIT_ERROR 1
+#define JIT_TAIL_CALL 2  // The frame now belongs to a tail-called closure.
+
+// Jump targets that are not bytecode offsets
+#define TARGET_ERROR -1
+
+typedef int (*JitEntry)(CallFrame* frame);
+
+// A loop recorded and compiled by the tracing JIT. Traces are keyed by the
+// OP_LOOP instruction closing the loop and hang off the function owning it.
+typedef struct Trace {
+  struct Trace* next;
+  uint8_t* anchor;
+  int hotness;
+  int attempts;  // Recordings that had to be abandoned.
+  bool recording;
+  void* code;
+} Trace;
+
+enum {
+  RAX = 0,
+  RCX = 1,
+  RDX = 2,
+  RBX = 3,
+  RSP = 4,
+  RBP = 5,
+  RSI = 6,
+  RDI = 7,
+  R12 = 12,
+  R13 = 13,
+  R14 = 14,
+  R15 = 15,
+};
+
+// Register roles inside compiled code. All of them are callee-saved, so
+// they survive calls into the helpers below.
+#define STACK_TOP RBX
+#define SLOTS R12
+#define CONSTANTS R13
+#define FRAME R14
+
+#define CC_EQUAL 0x4
+#define CC_NOT_EQUAL 0x5
+#define CC_ABOVE 0x7
+
+typedef struct {
+  int at;      // Offset of a rel32 field in the code buffer.
+  int target;  // Bytecode offset it jumps to, or TARGET_ERROR.
+} Fixup;
+
+typedef struct {
+  uint8_t* code;
+  int count;
+  int capacity;
+
+  Fixup* fixups;
+  int fixupCount;
+  int fixupCapacity;
+} Assembler;
+
+// Helpers called from compiled code. Each receives the address of the
+// instruction it implements, records the following instruction in the frame
+// so runtime errors report the right line, and returns JIT_OK or JIT_ERROR.
+
+static CallFrame* currentFrame(uint8_t* next) {
+  CallFrame* frame = vm.frames[vm.frameCount - 1];
+  frame->ip = next;
+  return frame;
+}
+
+static uint8_t genericOp(uint8_t instruction) {
+  switch (instruction) {
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+      return OP_ADD;
+    case OP_SUBTRACT_NUM:
+      return OP_SUBTRACT;
+    case OP_MULTIPLY_NUM:
+      return OP_MULTIPLY;
+    case OP_DIVIDE_NUM:
+      return OP_DIVIDE;
+    case OP_GREATER_NUM:
+      return OP_GREATER;
+    case OP_LESS_NUM:
+      return OP_LESS;
+    default:
+      return instruction;
+  }
+}
+
+// Apply a generic arithmetic or comparison opcode to the top two values
+static int binaryOperation(uint8_t op) {
+  Value b = vm.stackTop[-1];
+  Value a = vm.stackTop[-2];
+  if (op == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+    concatenate();
+    return JIT_OK;
+  }
+
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+    runtimeError(op == OP_ADD ? "Operands must be two numbers or two strings."
+                              : "Operands must be numbers.");
+    return JIT_ERROR;
+  }
+
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+  Value result;
+  switch (op) {
+    case OP_ADD:
+      result = NUMBER_VAL(x + y);
+      break;
+    case OP_SUBTRACT:
+      result = NUMBER_VAL(x - y);
+      break;
+    case OP_MULTIPLY:
+      result = NUMBER_VAL(x * y);
+      break;
+    case OP_DIVIDE:
+      result = NUMBER_VAL(x / y);
+      break;
+    case OP_GREATER:
+      result = BOOL_VAL(x > y);
+      break;
+    default:
+      result = BOOL_VAL(x < y);
+      break;
+  }
+
+  vm.stackTop--;
+  vm.stackTop[-1] = result;
+  return JIT_OK;
+}
+
+static int jitBinary(uint8_t* ip) {
+  currentFrame(ip + 1);
+  return binaryOperation(genericOp(ip[0]));
+}
+
+// Map a register-form instruction to its stack equivalent, noting whether
+// its second operand is a constant rather than a slot
+static uint8_t registerForm(uint8_t instruction, bool* constant) {
+  switch (instruction) {
+    case OP_ADD_RR:
+    case OP_ADD_RRR:
+      *constant = false;
+      return OP_ADD;
+    case OP_ADD_RK:
+    case OP_ADD_RRK:
+      *constant = true;
+      return OP_ADD;
+    case OP_SUBTRACT_RR:
+    case OP_SUBTRACT_RRR:
+      *constant = false;
+      return OP_SUBTRACT;
+    case OP_SUBTRACT_RK:
+    case OP_SUBTRACT_RRK:
+      *constant = true;
+      return OP_SUBTRACT;
+    case OP_MULTIPLY_RR:
+    case OP_MULTIPLY_RRR:
+      *constant = false;
+      return OP_MULTIPLY;
+    case OP_MULTIPLY_RK:
+    case OP_MULTIPLY_RRK:
+      *constant = true;
+      return OP_MULTIPLY;
+    case OP_DIVIDE_RR:
+    case OP_DIVIDE_RRR:
+      *constant = false;
+      return OP_DIVIDE;
+    case OP_DIVIDE_RK:
+    case OP_DIVIDE_RRK:
+      *constant = true;
+      return OP_DIVIDE;
+    case OP_GREATER_RR:
+      *constant = false;
+      return OP_GREATER;
+    case OP_GREATER_RK:
+      *constant = true;
+      return OP_GREATER;
+    case OP_LESS_RR:
+      *constant = false;
+      return OP_LESS;
+    case OP_LESS_RK:
+      *constant = true;
+      return OP_LESS;
+    default:
+      assert(!"not a register-form arithmetic instruction");
+      *constant = false;
+      return OP_LESS;
+  }
+}
+
+static int jitRegister(uint8_t* ip) {
+  CallFrame* frame = vm.frames[vm.frameCount - 1];
+  int length = instructionLength(&frame->closure->function->chunk,
+                                 (int)(ip - frame->closure->function->chunk.code));
+  currentFrame(ip + length);
+  Value* slots = frame->slots;
+  Value* constants = frame->closure->function->chunk.constants.values;
+
+  switch (ip[0]) {
+    case OP_MOVE:
+      slots[ip[1]] = slots[ip[2]];
+      return JIT_OK;
+    case OP_LOADK:
+      slots[ip[1]] = constants[ip[2]];
+      return JIT_OK;
+  }
+
+  bool constant;
+  uint8_t op = registerForm(ip[0], &constant);
+  bool store = length == 4;
+  uint8_t* operands = store ? ip + 2 : ip + 1;
+  push(slots[operands[0]]);
+  push(constant ? constants[operands[1]] : slots[operands[1]]);
+  if (binaryOperation(op) != JIT_OK) return JIT_ERROR;
+  if (store) slots[ip[1]] = pop();
+  return JIT_OK;
+}
+
+static int jitEqual(uint8_t* ip) {
+  (void)ip;
+  Value b = pop();
+  Value a = pop();
+  push(BOOL_VAL(valuesEqual(a, b)));
+  return JIT_OK;
+}
+
+static int jitNegate(uint8_t* ip) {
+  currentFrame(ip + 1);
+  if (!IS_NUMBER(vm.stackTop[-1])) {
+    runtimeError("Operand must be a number.");
+    return JIT_ERROR;
+  }
+  vm.stackTop[-1] = NUMBER_VAL(-AS_NUMBER(vm.stackTop[-1]));
+  return JIT_OK;
+}
+
+static int jitPrint(uint8_t* ip) {
+  (void)ip;
+  printValue(pop());
+  printf("\n");
+  return JIT_OK;
+}
+
+// Where an instruction with a single index operand, of either width, ends
+static uint8_t* afterIndex(uint8_t* ip) {
+  return ip + (isWide(ip[0]) ? 3 : 2);
+}
+
+static int jitUndefinedGlobal(uint8_t* ip) {
+  currentFrame(afterIndex(ip));
+  runtimeError("Undefined variable '%s'.",
+               AS_CSTRING(vm.globalNames.values[indexOperand(ip)]));
+  return JIT_ERROR;
+}
+
+static int jitGlobalBarrier(uint8_t* ip) {
+  snapshotBarrier(vm.globalValues.values[indexOperand(ip)]);
+  return JIT_OK;
+}
+
+static int jitGetUpvalue(uint8_t* ip) {
+  CallFrame* frame = currentFrame(afterIndex(ip));
+  push(*frame->closure->upvalues[indexOperand(ip)]->location);
+  return JIT_OK;
+}
+
+static int jitSetUpvalue(uint8_t* ip) {
+  CallFrame* frame = currentFrame(afterIndex(ip));
+  ObjUpvalue* upvalue = frame->closure->upvalues[indexOperand(ip)];
+  snapshotBarrier(*upvalue->location);
+  STORE_FIELD(*upvalue->location, vm.stackTop[-1]);
+  writeBarrier((Obj*)upvalue, vm.stackTop[-1]);
+  return JIT_OK;
+}
+
+static int jitGetEnclosing(uint8_t* ip) {
+  push(vm.frames[vm.frameCount - 2]->slots[ip[1]]);
+  return JIT_OK;
+}
+
+static int jitSetEnclosing(uint8_t* ip) {
+  vm.frames[vm.frameCount - 2]->slots[ip[1]] = vm.stackTop[-1];
+  return JIT_OK;
+}
+
+// Run the frame just pushed by a call to completion
+static bool runCallee() {
+  CallFrame* frame = vm.frames[vm.frameCount - 1];
+  if (frame->closure->function->jitCode != NULL && jitCanNest()) {
+    return jitExecute(frame);
+  }
+  return run(vm.frameCount - 1) == INTERPRET_OK;
+}
+
+static int jitCall(uint8_t* ip) {
+  int argCount = ip[1];
+  currentFrame(ip + 2);
+  int frameCount = vm.frameCount;
+  if (!callValue(vm.stackTop[-1 - argCount], argCount)) return JIT_ERROR;
+  if (vm.frameCount == frameCount) return JIT_OK;
+  return runCallee() ? JIT_OK : JIT_ERROR;
+}
+
+static int jitCallNative(uint8_t* ip) {
+  Value callee = vm.stackTop[-1 - ip[1]];
+  if (!IS_NATIVE(callee)) return jitCall(ip);
+  currentFrame(ip + 2);
+  return callNative(AS_NATIVE(callee), ip[1]) ? JIT_OK : JIT_ERROR;
+}
+
+static int jitTailCall(uint8_t* ip) {
+  int argCount = ip[1];
+  currentFrame(ip + 2);
+  Value callee = vm.stackTop[-1 - argCount];
+  if (!tailCallValue(callee, argCount)) return JIT_ERROR;
+  return IS_CLOSURE(callee) ? JIT_TAIL_CALL : JIT_OK;
+}
+
+static int jitClosure(uint8_t* ip) {
+  CallFrame* frame = vm.frames[vm.frameCount - 1];
+  Chunk* chunk = &frame->closure->function->chunk;
+  ObjFunction* function = AS_FUNCTION(chunk->constants.values[indexOperand(ip)]);
+  bool wide = isWide(ip[0]);
+  int width = wide ? 3 : 2;  // Of each capture's operands.
+  uint8_t* captures = afterIndex(ip);
+  currentFrame(captures + function->upvalueCount * width);
+
+  ObjClosure* closure = closureFor(function);
+  push(OBJ_VAL(closure));
+  for (int i = 0; i < closure->upvalueCount; i++) {
+    uint8_t* capture = &captures[i * width];
+    uint8_t isLocal = capture[0];
+    int index = wide ? (capture[1] << 8) | capture[2] : capture[1];
+    if (isLocal) {
+      STORE_FIELD(closure->upvalues[i],
+                  captureUpvalue(frame->slots + index));
+    } else {
+      STORE_FIELD(closure->upvalues[i], frame->closure->upvalues[index]);
+    }
+    writeBarrier((Obj*)closure, OBJ_VAL(closure->upvalues[i]));
+  }
+  return JIT_OK;
+}
+
+static int jitCloseUpvalue(uint8_t* ip) {
+  (void)ip;
+  closeUpvalues(vm.stackTop - 1);
+  pop();
+  return JIT_OK;
+}
+
+static int jitReturn(uint8_t* ip) {
+  CallFrame* frame = currentFrame(ip + 1);
+  Value result = pop();
+  closeUpvalues(frame->slots);
+  vm.frameCount--;
+  vm.stackTop = frame->slots;
+  push(result);
+  return JIT_OK;
+}
+
+// Code buffer
+
+static void emitByte(Assembler* as, uint8_t byte) {
+  if (as->capacity < as->count + 1) {
+    as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+    as->code = realloc(as->code, as->capacity);
+    if (as->code == NULL) exit(1);
+  }
+  as->code[as->count++] = byte;
+}
+
+static void emitInt32(Assembler* as, int32_t value) {
+  for (int i = 0; i < 4; i++) emitByte(as, (uint8_t)(value >> (i * 8)));
+}
+
+static void emitInt64(Assembler* as, uint64_t value) {
+  for (int i = 0; i < 8; i++) emitByte(as, (uint8_t)(value >> (i * 8)));
+}
+
+static void addFixup(Assembler* as, int at, int target) {
+  if (as->fixupCapacity < as->fixupCount + 1) {
+    as->fixupCapacity = as->fixupCapacity < 16 ? 16 : as->fixupCapacity * 2;
+    as->fixups = realloc(as->fixups, sizeof(Fixup) * as->fixupCapacity);
+    if (as->fixups == NULL) exit(1);
+  }
+  as->fixups[as->fixupCount].at = at;
+  as->fixups[as->fixupCount].target = target;
+  as->fixupCount++;
+}
+
+static void patchRel32(Assembler* as, int at, int destination) {
+  int32_t rel = destination - (at + 4);
+  memcpy(as->code + at, &rel, sizeof(rel));
+}
+
+// x86-64 encoding
+
+static void rex(Assembler* as, int reg, int rm) {
+  emitByte(as, 0x48 | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0));
+}
+
+static void modrmRegister(Assembler* as, int reg, int rm) {
+  emitByte(as, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void modrmMemory(Assembler* as, int reg, int base, int32_t disp) {
+  emitByte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) emitByte(as, 0x24);
+  emitInt32(as, disp);
+}
+
+static void pushRegister(Assembler* as, int reg) {
+  if (reg & 8) emitByte(as, 0x41);
+  emitByte(as, 0x50 | (reg & 7));
+}
+
+static void popRegister(Assembler* as, int reg) {
+  if (reg & 8) emitByte(as, 0x41);
+  emitByte(as, 0x58 | (reg & 7));
+}
+
+static void moveImmediate(Assembler* as, int reg, uint64_t value) {
+  emitByte(as, 0x48 | ((reg & 8) ? 1 : 0));
+  emitByte(as, 0xb8 | (reg & 7));
+  emitInt64(as, value);
+}
+
+static void moveRegister(Assembler* as, int dest, int src) {
+  rex(as, src, dest);
+  emitByte(as, 0x89);
+  modrmRegister(as, src, dest);
+}
+
+static void load(Assembler* as, int reg, int base, int32_t disp) {
+  rex(as, reg, base);
+  emitByte(as, 0x8b);
+  modrmMemory(as, reg, base, disp);
+}
+
+static void store(Assembler* as, int base, int32_t disp, int reg) {
+  rex(as, reg, base);
+  emitByte(as, 0x89);
+  modrmMemory(as, reg, base, disp);
+}
+
+static void addImmediate(Assembler* as, int reg, int32_t value) {
+  rex(as, 0, reg);
+  emitByte(as, 0x81);
+  modrmRegister(as, 0, reg);
+  emitInt32(as, value);
+}
+
+static void compareRegisters(Assembler* as, int a, int b) {
+  rex(as, b, a);
+  emitByte(as, 0x39);
+  modrmRegister(as, b, a);
+}
+
+static void andRegisters(Assembler* as, int dest, int src) {
+  rex(as, src, dest);
+  emitByte(as, 0x21);
+  modrmRegister(as, src, dest);
+}
+
+static void testEax(Assembler* as) {
+  emitByte(as, 0x85);
+  emitByte(as, 0xc0);
+}
+
+// movq xmm, r64
+static void moveToXmm(Assembler* as, int xmm, int reg) {
+  emitByte(as, 0x66);
+  rex(as, xmm, reg);
+  emitByte(as, 0x0f);
+  emitByte(as, 0x6e);
+  modrmRegister(as, xmm, reg);
+}
+
+// movq r64, xmm
+static void moveFromXmm(Assembler* as, int reg, int xmm) {
+  emitByte(as, 0x66);
+  rex(as, xmm, reg);
+  emitByte(as, 0x0f);
+  emitByte(as, 0x7e);
+  modrmRegister(as, xmm, reg);
+}
+
+// addsd, subsd, mulsd and divsd share this encoding
+static void scalarDouble(Assembler* as, uint8_t opcode, int dest, int src) {
+  emitByte(as, 0xf2);
+  emitByte(as, 0x0f);
+  emitByte(as, opcode);
+  modrmRegister(as, dest, src);
+}
+
+static void compareDoubles(Assembler* as, int a, int b) {
+  emitByte(as, 0x66);
+  emitByte(as, 0x0f);
+  emitByte(as, 0x2e);
+  modrmRegister(as, a, b);
+}
+
+// setcc al; movzx eax, al
+static void setCondition(Assembler* as, uint8_t condition) {
+  emitByte(as, 0x0f);
+  emitByte(as, 0x90 | condition);
+  emitByte(as, 0xc0);
+  emitByte(as, 0x0f);
+  emitByte(as, 0xb6);
+  emitByte(as, 0xc0);
+}
+
+// Emit a jump with an unresolved rel32 and return the field's offset
+static int jump(Assembler* as) {
+  emitByte(as, 0xe9);
+  emitInt32(as, 0);
+  return as->count - 4;
+}
+
+static int jumpIf(Assembler* as, uint8_t condition) {
+  emitByte(as, 0x0f);
+  emitByte(as, 0x80 | condition);
+  emitInt32(as, 0);
+  return as->count - 4;
+}
+
+static void callAbsolute(Assembler* as, void* function) {
+  moveImmediate(as, RAX, (uint64_t)(uintptr_t)function);
+  emitByte(as, 0xff);
+  emitByte(as, 0xd0);
+}
+
+// Code generation
+
+static void emitPushRax(Assembler* as) {
+  store(as, STACK_TOP, 0, RAX);
+  addImmediate(as, STACK_TOP, 8);
+}
+
+// Compiled code is entered as int (*)(CallFrame*)
+static void emitPrologue(Assembler* as, Chunk* chunk) {
+  pushRegister(as, RBX);
+  pushRegister(as, R12);
+  pushRegister(as, R13);
+  pushRegister(as, R14);
+  pushRegister(as, R15);
+  moveRegister(as, FRAME, RDI);
+  load(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+  moveImmediate(as, CONSTANTS, (uint64_t)(uintptr_t)chunk->constants.values);
+  moveImmediate(as, RAX, (uint64_t)(uintptr_t)&vm.stackTop);
+  load(as, STACK_TOP, RAX, 0);
+}
+
+static void emitEpilogue(Assembler* as) {
+  popRegister(as, R15);
+  popRegister(as, R14);
+  popRegister(as, R13);
+  popRegister(as, R12);
+  popRegister(as, RBX);
+  emitByte(as, 0xc3);
+}
+
+// Call a helper with the instruction's address. The cached stack top is
+// written back first and, because helpers may push, pop or call, the stack
+// top and slot base are reloaded afterwards.
+static void emitHelper(Assembler* as, int (*helper)(uint8_t*), uint8_t* ip) {
+  moveImmediate(as, RAX, (uint64_t)(uintptr_t)&vm.stackTop);
+  store(as, RAX, 0, STACK_TOP);
+  moveImmediate(as, RDI, (uint64_t)(uintptr_t)ip);
+  callAbsolute(as, (void*)helper);
+  testEax(as);
+  addFixup(as, jumpIf(as, CC_NOT_EQUAL), TARGET_ERROR);
+  moveImmediate(as, RAX, (uint64_t)(uintptr_t)&vm.stackTop);
+  load(as, STACK_TOP, RAX, 0);
+  load(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+}
+
+// Before a store to the global ip names, call jitGlobalBarrier() if the old
+// generation is being marked
+static void emitGlobalBarrier(Assembler* as, uint8_t* ip) {
+  moveImmediate(as, RAX, (uint64_t)(uintptr_t)&vm.gcPhase);
+  emitByte(as, 0x83);  // cmp dword [rax], GC_MARK
+  modrmMemory(as, 7, RAX, 0);
+  emitByte(as, GC_MARK);
+  int idle = jumpIf(as, CC_NOT_EQUAL);
+  emitHelper(as, jitGlobalBarrier, ip);
+  patchRel32(as, idle, as->count);
+}
+
+// A tail call returns JIT_TAIL_CALL straight to jitExecute, which runs
+// whatever now owns the frame. Otherwise it continues like any helper.
+static void emitTailCall(Assembler* as, uint8_t* ip) {
+  moveImmediate(as, RAX, (uint64_t)(uintptr_t)&vm.stackTop);
+  store(as, RAX, 0, STACK_TOP);
+  moveImmediate(as, RDI, (uint64_t)(uintptr_t)ip);
+  callAbsolute(as, (void*)jitTailCall);
+  emitByte(as, 0x83);  // cmp eax, JIT_TAIL_CALL
+  emitByte(as, 0xf8);
+  emitByte(as, JIT_TAIL_CALL);
+  int notTail = jumpIf(as, CC_NOT_EQUAL);
+  emitEpilogue(as);
+  patchRel32(as, notTail, as->count);
+  testEax(as);
+  addFixup(as, jumpIf(as, CC_NOT_EQUAL), TARGET_ERROR);
+  moveImmediate(as, RAX, (uint64_t)(uintptr_t)&vm.stackTop);
+  load(as, STACK_TOP, RAX, 0);
+  load(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+}
+
+// Jump to notNumber unless the value in reg is a number. Clobbers RSI.
+static int emitNumberGuard(Assembler* as, int reg) {
+  moveRegister(as, RSI, reg);
+  andRegisters(as, RSI, RCX);
+  compareRegisters(as, RSI, RCX);
+  return jumpIf(as, CC_EQUAL);
+}
+
+// Turn the 0 or 1 in RAX into FALSE_VAL or TRUE_VAL. Clobbers RCX.
+static void emitBoolFromRax(Assembler* as) {
+  moveImmediate(as, RCX, FALSE_VAL);
+  rex(as, RCX, RAX);
+  emitByte(as, 0x01);  // add rax, rcx
+  modrmRegister(as, RCX, RAX);
+}
+
+// Apply a generic number opcode to XMM0 and XMM1, leaving the boxed result
+// in RAX
+static void emitNumberOp(Assembler* as, uint8_t op) {
+  switch (op) {
+    case OP_ADD:
+      scalarDouble(as, 0x58, 0, 1);
+      moveFromXmm(as, RAX, 0);
+      break;
+    case OP_SUBTRACT:
+      scalarDouble(as, 0x5c, 0, 1);
+      moveFromXmm(as, RAX, 0);
+      break;
+    case OP_MULTIPLY:
+      scalarDouble(as, 0x59, 0, 1);
+      moveFromXmm(as, RAX, 0);
+      break;
+    case OP_DIVIDE:
+      scalarDouble(as, 0x5e, 0, 1);
+      moveFromXmm(as, RAX, 0);
+      break;
+    case OP_GREATER:
+      compareDoubles(as, 0, 1);
+      setCondition(as, CC_ABOVE);
+      emitBoolFromRax(as);
+      break;
+    case OP_LESS:
+      compareDoubles(as, 1, 0);
+      setCondition(as, CC_ABOVE);
+      emitBoolFromRax(as);
+      break;
+  }
+}
+
+// Inline number fast path for arithmetic and comparisons, falling back to
+// jitBinary for strings and type errors
+static void emitBinary(Assembler* as, uint8_t* ip) {
+  load(as, RAX, STACK_TOP, -16);
+  load(as, RDX, STACK_TOP, -8);
+  moveImmediate(as, RCX, QNAN);
+  int notNumberA = emitNumberGuard(as, RAX);
+  int notNumberB = emitNumberGuard(as, RDX);
+  moveToXmm(as, 0, RAX);
+  moveToXmm(as, 1, RDX);
+  emitNumberOp(as, genericOp(ip[0]));
+  store(as, STACK_TOP, -16, RAX);
+  addImmediate(as, STACK_TOP, -8);
+  int done = jump(as);
+
+  patchRel32(as, notNumberA, as->count);
+  patchRel32(as, notNumberB, as->count);
+  emitHelper(as, jitBinary, ip);
+  patchRel32(as, done, as->count);
+}
+
+// Set ZF when the value in RAX is falsey. Clobbers RCX.
+static void emitFalsyTest(Assembler* as) {
+  moveImmediate(as, RCX, NIL_VAL);
+  compareRegisters(as, RAX, RCX);
+  int isNil = jumpIf(as, CC_EQUAL);
+  moveImmediate(as, RCX, FALSE_VAL);
+  compareRegisters(as, RAX, RCX);
+  patchRel32(as, isNil, as->count);
+}
+
+static bool emitInstruction(Assembler* as, Chunk* chunk, int offset) {
+  uint8_t* ip = &chunk->code[offset];
+  switch (ip[0]) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG: {
+      Value constant = chunk->constants.values[indexOperand(ip)];
+      if (IS_OBJ(constant)) {
+        load(as, RAX, CONSTANTS, indexOperand(ip) * (int)sizeof(Value));
+      } else {
+        moveImmediate(as, RAX, constant);
+      }
+      emitPushRax(as);
+      return true;
+    }
+    case OP_NIL:
+      moveImmediate(as, RAX, NIL_VAL);
+      emitPushRax(as);
+      return true;
+    case OP_TRUE:
+      moveImmediate(as, RAX, TRUE_VAL);
+      emitPushRax(as);
+      return true;
+    case OP_FALSE:
+      moveImmediate(as, RAX, FALSE_VAL);
+      emitPushRax(as);
+      return true;
+    case OP_POP:
+      addImmediate(as, STACK_TOP, -8);
+      return true;
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_LONG:
+      load(as, RAX, SLOTS, indexOperand(ip) * (int)sizeof(Value));
+      emitPushRax(as);
+      return true;
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_LONG:
+      load(as, RAX, STACK_TOP, -8);
+      store(as, SLOTS, indexOperand(ip) * (int)sizeof(Value), RAX);
+      return true;
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG: {
+      moveImmediate(as, RAX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+      load(as, RAX, RAX, 0);
+      load(as, RAX, RAX, indexOperand(ip) * (int)sizeof(Value));
+      moveImmediate(as, RCX, UNDEFINED_VAL);
+      compareRegisters(as, RAX, RCX);
+      int defined = jumpIf(as, CC_NOT_EQUAL);
+      emitHelper(as, jitUndefinedGlobal, ip);
+      patchRel32(as, defined, as->count);
+      emitPushRax(as);
+      return true;
+    }
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG:
+      emitGlobalBarrier(as, ip);
+      moveImmediate(as, RCX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+      load(as, RCX, RCX, 0);
+      load(as, RAX, STACK_TOP, -8);
+      store(as, RCX, indexOperand(ip) * (int)sizeof(Value), RAX);
+      addImmediate(as, STACK_TOP, -8);
+      return true;
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG: {
+      moveImmediate(as, RDX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+      load(as, RDX, RDX, 0);
+      load(as, RAX, RDX, indexOperand(ip) * (int)sizeof(Value));
+      moveImmediate(as, RCX, UNDEFINED_VAL);
+      compareRegisters(as, RAX, RCX);
+      int defined = jumpIf(as, CC_NOT_EQUAL);
+      emitHelper(as, jitUndefinedGlobal, ip);
+      patchRel32(as, defined, as->count);
+      emitGlobalBarrier(as, ip);
+      moveImmediate(as, RDX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+      load(as, RDX, RDX, 0);
+      load(as, RAX, STACK_TOP, -8);
+      store(as, RDX, indexOperand(ip) * (int)sizeof(Value), RAX);
+      return true;
+    }
+    case OP_GET_UPVALUE:
+    case OP_GET_UPVALUE_LONG:
+      emitHelper(as, jitGetUpvalue, ip);
+      return true;
+    case OP_SET_UPVALUE:
+    case OP_SET_UPVALUE_LONG:
+      emitHelper(as, jitSetUpvalue, ip);
+      return true;
+    case OP_GET_ENCLOSING:
+      emitHelper(as, jitGetEnclosing, ip);
+      return true;
+    case OP_SET_ENCLOSING:
+      emitHelper(as, jitSetEnclosing, ip);
+      return true;
+    case OP_EQUAL:
+      emitHelper(as, jitEqual, ip);
+      return true;
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD_NUM:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY_NUM:
+    case OP_DIVIDE_NUM:
+    case OP_GREATER_NUM:
+    case OP_LESS_NUM:
+      emitBinary(as, ip);
+      return true;
+    case OP_ADD_STR:
+      emitHelper(as, jitBinary, ip);
+      return true;
+    case OP_NOT: {
+      load(as, RAX, STACK_TOP, -8);
+      emitFalsyTest(as);
+      int falsy = jumpIf(as, CC_EQUAL);
+      moveImmediate(as, RAX, FALSE_VAL);
+      int done = jump(as);
+      patchRel32(as, falsy, as->count);
+      moveImmediate(as, RAX, TRUE_VAL);
+      patchRel32(as, done, as->count);
+      store(as, STACK_TOP, -8, RAX);
+      return true;
+    }
+    case OP_NEGATE:
+      emitHelper(as, jitNegate, ip);
+      return true;
+    case OP_PRINT:
+      emitHelper(as, jitPrint, ip);
+      return true;
+    case OP_JUMP:
+    case OP_JUMP_LONG:
+    case OP_LOOP:
+    case OP_LOOP_LONG:
+      addFixup(as, jump(as), jumpTarget(chunk, offset));
+      return true;
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_LONG:
+      load(as, RAX, STACK_TOP, -8);
+      emitFalsyTest(as);
+      addFixup(as, jumpIf(as, CC_EQUAL), jumpTarget(chunk, offset));
+      return true;
+    case OP_CALL:
+      emitHelper(as, jitCall, ip);
+      return true;
+    case OP_CALL_NATIVE:
+      emitHelper(as, jitCallNative, ip);
+      return true;
+    case OP_TAIL_CALL:
+      emitTailCall(as, ip);
+      return true;
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:
+      emitHelper(as, jitClosure, ip);
+      return true;
+    case OP_CLOSE_UPVALUE:
+      emitHelper(as, jitCloseUpvalue, ip);
+      return true;
+    case OP_RETURN:
+      emitHelper(as, jitReturn, ip);
+      emitByte(as, 0x31);  // xor eax, eax
+      emitByte(as, 0xc0);
+      emitEpilogue(as);
+      return true;
+    case OP_MOVE:
+    case OP_LOADK:
+    case OP_ADD_RR:
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RR:
+    case OP_SUBTRACT_RK:
+    case OP_MULTIPLY_RR:
+    case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RR:
+    case OP_DIVIDE_RK:
+    case OP_GREATER_RR:
+    case OP_GREATER_RK:
+    case OP_LESS_RR:
+    case OP_LESS_RK:
+    case OP_ADD_RRR:
+    case OP_ADD_RRK:
+    case OP_SUBTRACT_RRR:
+    case OP_SUBTRACT_RRK:
+    case OP_MULTIPLY_RRR:
+    case OP_MULTIPLY_RRK:
+    case OP_DIVIDE_RRR:
+    case OP_DIVIDE_RRK:
+      emitHelper(as, jitRegister, ip);
+      return true;
+    default:
+      return false;  // Leave the function to the interpreter.
+  }
+}
+
+// Copy finished code into an executable mapping. The mapping starts with a
+// header recording its size so jitFree can unmap it.
+static void* install(Assembler* as) {
+  size_t size = 16 + (size_t)as->count;
+  uint8_t* memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) return NULL;
+
+  memcpy(memory, &size, sizeof(size));
+  memcpy(memory + 16, as->code, as->count);
+  if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, size);
+    return NULL;
+  }
+  return memory + 16;
+}
+
+void jitCompile(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  Assembler as = {NULL, 0, 0, NULL, 0, 0};
+  int* nativeOffsets = malloc(sizeof(int) * chunk->count);
+  if (nativeOffsets == NULL) exit(1);
+  for (int i = 0; i < chunk->count; i++) nativeOffsets[i] = -1;
+
+  emitPrologue(&as, chunk);
+
+  bool supported = true;
+  for (int offset = 0; supported && offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    nativeOffsets[offset] = as.count;
+    supported = emitInstruction(&as, chunk, offset);
+  }
+
+  int errorExit = as.count;
+  moveImmediate(&as, RAX, JIT_ERROR);
+  emitEpilogue(&as);
+
+  for (int i = 0; supported && i < as.fixupCount; i++) {
+    Fixup* fixup = &as.fixups[i];
+    int destination = errorExit;
+    if (fixup->target != TARGET_ERROR) {
+      if (fixup->target < 0 || fixup->target >= chunk->count ||
+          nativeOffsets[fixup->target] == -1) {
+        supported = false;
+        break;
+      }
+      destination = nativeOffsets[fixup->target];
+    }
+    patchRel32(&as, fixup->at, destination);
+  }
+
+  if (supported) function->jitCode = install(&as);
+
+  free(nativeOffsets);
+  free(as.code);
+  free(as.fixups);
+}
+
+static void uninstall(void* code) {
+  uint8_t* memory = (uint8_t*)code - 16;
+  size_t size;
+  memcpy(&size, memory, sizeof(size));
+  munmap(memory, size);
+}
+
+void jitFree(ObjFunction* function) {
+  if (function->jitCode != NULL) uninstall(function->jitCode);
+  function->jitCode = NULL;
+
+  Trace* trace = function->traces;
+  while (trace != NULL) {
+    Trace* next = trace->next;
+    if (trace->code != NULL) uninstall(trace->code);
+    free(trace);
+    trace = next;
+  }
+  function->traces = NULL;
+}
+
+bool jitCanNest() { return nativeStackHasRoom(); }
+
+// Run a frame to completion. Tail calls come back here rather than nesting,
+// so a chain of them runs in constant C stack.
+bool jitExecute(CallFrame* frame) {
+  for (;;) {
+    JitEntry entry = (JitEntry)frame->closure->function->jitCode;
+    int status = entry(frame);
+    if (status != JIT_TAIL_CALL) return status == JIT_OK;
+    if (frame->closure->function->jitCode == NULL) {
+      return run(vm.frameCount - 1) == INTERPRET_OK;
+    }
+  }
+}
+
+// Tracing JIT
+//
+// Back-edges executed by the interpreter are counted per loop. Once a loop
+// is hot, one iteration is run by the recorder below, which notes each
+// instruction it executes along with the types of its operands. The trace
+// is then compiled to straight-line code that guards those types and the
+// direction of every branch taken, and jumps back to its start at the end
+// of the iteration. A failed guard is a side exit: since the compiled code
+// keeps the value stack in memory and guards run before an instruction has
+// any effect, rebuilding the interpreter's state only takes writing back
+// the stack top and the ip of the instruction that failed.
+
+#define TRACE_MAX 1024
+#define TRACE_DEPTH_MAX 512
+#define TRACE_ATTEMPTS 3
+
+typedef enum {
+  KIND_UNKNOWN,
+  KIND_NUMBER,
+  KIND_BOOL,
+  KIND_NIL,
+  KIND_STRING,
+  KIND_OBJ,
+} Kind;
+
+typedef struct {
+  uint8_t* ip;
+  int depth;  // Stack slots in use above frame->slots before it ran.
+  Kind a;     // Observed operand types, where the instruction has them.
+  Kind b;
+  bool taken;  // Whether an OP_JUMP_IF_FALSE jumped.
+} TraceStep;
+
+typedef enum {
+  RECORD_OK,
+  RECORD_ABORT,
+  RECORD_ERROR,
+} RecordResult;
+
+static Kind kindOf(Value value) {
+  if (IS_NUMBER(value)) return KIND_NUMBER;
+  if (IS_BOOL(value)) return KIND_BOOL;
+  if (IS_NIL(value)) return KIND_NIL;
+  if (IS_STRING(value)) return KIND_STRING;
+  return KIND_OBJ;
+}
+
+static bool isRegisterOp(uint8_t instruction) {
+  return instruction >= OP_ADD_RR && instruction <= OP_DIVIDE_RRK;
+}
+
+// Whether the interpreter would complete op on these operands without error
+static bool binaryFits(uint8_t op, Kind a, Kind b) {
+  if (a == KIND_NUMBER && b == KIND_NUMBER) return true;
+  return op == OP_ADD && a == KIND_STRING && b == KIND_STRING;
+}
+
+// Read the operands of a register-form arithmetic instruction
+static void registerOperands(CallFrame* frame, uint8_t* ip, Value* a,
+                             Value* b) {
+  bool constant;
+  registerForm(ip[0], &constant);
+  Chunk* chunk = &frame->closure->function->chunk;
+  uint8_t* operands =
+      instructionLength(chunk, (int)(ip - chunk->code)) == 4 ? ip + 2 : ip + 1;
+  *a = frame->slots[operands[0]];
+  *b = constant ? chunk->constants.values[operands[1]]
+                : frame->slots[operands[1]];
+}
+
+// Execute one iteration of the loop ending at the trace's anchor, starting
+// at frame->ip, recording each step. Instructions the tracer does not handle
+// or that are about to fail abort the recording before they run, leaving
+// frame->ip on them for the interpreter.
+static RecordResult recordTrace(CallFrame* frame, Trace* trace,
+                                TraceStep* steps, int* count) {
+  Chunk* chunk = &frame->closure->function->chunk;
+  Value* constants = chunk->constants.values;
+  uint8_t* ip = frame->ip;
+  *count = 0;
+
+  for (;;) {
+    int depth = (int)(vm.stackTop - frame->slots);
+    if (*count == TRACE_MAX || depth >= TRACE_DEPTH_MAX) break;
+
+    TraceStep* step = &steps[*count];
+    step->ip = ip;
+    step->depth = depth;
+    step->a = KIND_UNKNOWN;
+    step->b = KIND_UNKNOWN;
+    step->taken = false;
+    uint8_t* next = ip + instructionLength(chunk, (int)(ip - chunk->code));
+    int status = JIT_OK;
+
+    switch (ip[0]) {
+      case OP_CONSTANT:
+        push(constants[ip[1]]);
+        break;
+      case OP_NIL:
+        push(NIL_VAL);
+        break;
+      case OP_TRUE:
+        push(TRUE_VAL);
+        break;
+      case OP_FALSE:
+        push(FALSE_VAL);
+        break;
+      case OP_POP:
+        pop();
+        break;
+      case OP_GET_LOCAL:
+        push(frame->slots[ip[1]]);
+        break;
+      case OP_SET_LOCAL:
+        frame->slots[ip[1]] = vm.stackTop[-1];
+        break;
+      case OP_GET_GLOBAL:
+        if (IS_UNDEFINED(vm.globalValues.values[ip[1]])) goto abort;
+        push(vm.globalValues.values[ip[1]]);
+        break;
+      case OP_SET_GLOBAL:
+        if (IS_UNDEFINED(vm.globalValues.values[ip[1]])) goto abort;
+        snapshotBarrier(vm.globalValues.values[ip[1]]);
+        vm.globalValues.values[ip[1]] = vm.stackTop[-1];
+        break;
+      case OP_GET_UPVALUE:
+        status = jitGetUpvalue(ip);
+        break;
+      case OP_SET_UPVALUE:
+        status = jitSetUpvalue(ip);
+        break;
+      case OP_GET_ENCLOSING:
+        status = jitGetEnclosing(ip);
+        break;
+      case OP_SET_ENCLOSING:
+        status = jitSetEnclosing(ip);
+        break;
+      case OP_EQUAL:
+        step->a = kindOf(vm.stackTop[-2]);
+        step->b = kindOf(vm.stackTop[-1]);
+        status = jitEqual(ip);
+        break;
+      case OP_ADD:
+      case OP_SUBTRACT:
+      case OP_MULTIPLY:
+      case OP_DIVIDE:
+      case OP_GREATER:
+      case OP_LESS:
+      case OP_ADD_NUM:
+      case OP_ADD_STR:
+      case OP_SUBTRACT_NUM:
+      case OP_MULTIPLY_NUM:
+      case OP_DIVIDE_NUM:
+      case OP_GREATER_NUM:
+      case OP_LESS_NUM:
+        step->a = kindOf(vm.stackTop[-2]);
+        step->b = kindOf(vm.stackTop[-1]);
+        if (!binaryFits(genericOp(ip[0]), step->a, step->b)) goto abort;
+        status = jitBinary(ip);
+        break;
+      case OP_MOVE:
+      case OP_LOADK:
+        status = jitRegister(ip);
+        break;
+      case OP_NOT:
+        vm.stackTop[-1] = BOOL_VAL(isFalsy(vm.stackTop[-1]));
+        break;
+      case OP_NEGATE:
+        if (!IS_NUMBER(vm.stackTop[-1])) goto abort;
+        status = jitNegate(ip);
+        break;
+      case OP_PRINT:
+        status = jitPrint(ip);
+        break;
+      case OP_JUMP:
+        next += (ip[1] << 8) | ip[2];
+        break;
+      case OP_JUMP_IF_FALSE:
+        step->taken = isFalsy(vm.stackTop[-1]);
+        if (step->taken) next += (ip[1] << 8) | ip[2];
+        break;
+      case OP_LOOP:
+        next -= (ip[1] << 8) | ip[2];
+        if (ip == trace->anchor) {
+          (*count)++;
+          frame->ip = next;
+          return RECORD_OK;
+        }
+        break;
+      case OP_CALL:
+        status = jitCall(ip);
+        break;
+      case OP_CALL_NATIVE:
+        status = jitCallNative(ip);
+        break;
+      case OP_CLOSE_UPVALUE:
+        status = jitCloseUpvalue(ip);
+        break;
+      default:
+        if (!isRegisterOp(ip[0])) goto abort;
+
+        bool constant;
+        Value a, b;
+        registerOperands(frame, ip, &a, &b);
+        step->a = kindOf(a);
+        step->b = kindOf(b);
+        if (!binaryFits(registerForm(ip[0], &constant), step->a, step->b)) {
+          goto abort;
+        }
+        status = jitRegister(ip);
+        break;
+    }
+
+    if (status != JIT_OK) return RECORD_ERROR;
+    (*count)++;
+    ip = next;
+  }
+
+abort:
+  frame->ip = ip;
+  return RECORD_ABORT;
+}
+
+// Leave the trace for the interpreter at the instruction at offset unless
+// the value in reg is a number. Expects QNAN in RCX.
+static void emitNumberExit(Assembler* as, int reg, int offset) {
+  addFixup(as, emitNumberGuard(as, reg), offset);
+}
+
+// Guard the operands in RAX and RDX, then apply op to them as numbers
+static void emitTraceNumberOp(Assembler* as, uint8_t op, Kind a, Kind b,
+                              int offset) {
+  if (a != KIND_NUMBER || b != KIND_NUMBER) {
+    moveImmediate(as, RCX, QNAN);
+    if (a != KIND_NUMBER) emitNumberExit(as, RAX, offset);
+    if (b != KIND_NUMBER) emitNumberExit(as, RDX, offset);
+  }
+  moveToXmm(as, 0, RAX);
+  moveToXmm(as, 1, RDX);
+  emitNumberOp(as, op);
+}
+
+static Kind resultKind(uint8_t op) {
+  return op == OP_GREATER || op == OP_LESS ? KIND_BOOL : KIND_NUMBER;
+}
+
+static void forgetKinds(Kind* kinds) {
+  for (int i = 0; i < TRACE_DEPTH_MAX; i++) kinds[i] = KIND_UNKNOWN;
+}
+
+// Compile one recorded step. Kinds tracks what is already known about each
+// slot of the frame so guards are not repeated within an iteration.
+static void emitTraceStep(Assembler* as, Chunk* chunk, TraceStep* step,
+                          Kind* kinds) {
+  uint8_t* ip = step->ip;
+  int offset = (int)(ip - chunk->code);
+  int depth = step->depth;
+
+  switch (ip[0]) {
+    case OP_JUMP:
+    case OP_LOOP:
+      return;
+    case OP_JUMP_IF_FALSE:
+      load(as, RAX, STACK_TOP, -8);
+      emitFalsyTest(as);
+      addFixup(as, jumpIf(as, step->taken ? CC_NOT_EQUAL : CC_EQUAL), offset);
+      return;
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+      // A global that became undefined leaves the trace so the interpreter
+      // reports it.
+      moveImmediate(as, RDX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+      load(as, RDX, RDX, 0);
+      load(as, RAX, RDX, ip[1] * (int)sizeof(Value));
+      moveImmediate(as, RCX, UNDEFINED_VAL);
+      compareRegisters(as, RAX, RCX);
+      addFixup(as, jumpIf(as, CC_EQUAL), offset);
+      if (ip[0] == OP_GET_GLOBAL) {
+        emitPushRax(as);
+        kinds[depth] = KIND_UNKNOWN;
+      } else {
+        emitGlobalBarrier(as, ip);
+        moveImmediate(as, RDX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+        load(as, RDX, RDX, 0);
+        load(as, RAX, STACK_TOP, -8);
+        store(as, RDX, ip[1] * (int)sizeof(Value), RAX);
+      }
+      return;
+    case OP_EQUAL:
+      if (step->a == KIND_NUMBER && step->b == KIND_NUMBER) {
+        load(as, RAX, STACK_TOP, -16);
+        load(as, RDX, STACK_TOP, -8);
+        moveImmediate(as, RCX, QNAN);
+        if (kinds[depth - 2] != KIND_NUMBER) emitNumberExit(as, RAX, offset);
+        if (kinds[depth - 1] != KIND_NUMBER) emitNumberExit(as, RDX, offset);
+        moveToXmm(as, 0, RAX);
+        moveToXmm(as, 1, RDX);
+        compareDoubles(as, 0, 1);
+        emitByte(as, 0x0f);  // sete al
+        emitByte(as, 0x94);
+        emitByte(as, 0xc0);
+        emitByte(as, 0x0f);  // setnp cl
+        emitByte(as, 0x9b);
+        emitByte(as, 0xc1);
+        emitByte(as, 0x20);  // and al, cl
+        emitByte(as, 0xc8);
+        emitByte(as, 0x0f);  // movzx eax, al
+        emitByte(as, 0xb6);
+        emitByte(as, 0xc0);
+        emitBoolFromRax(as);
+        store(as, STACK_TOP, -16, RAX);
+        addImmediate(as, STACK_TOP, -8);
+      } else {
+        emitHelper(as, jitEqual, ip);
+      }
+      kinds[depth - 2] = KIND_BOOL;
+      return;
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY_NUM:
+    case OP_DIVIDE_NUM:
+    case OP_GREATER_NUM:
+    case OP_LESS_NUM: {
+      uint8_t op = genericOp(ip[0]);
+      if (step->a == KIND_STRING) {
+        emitHelper(as, jitBinary, ip);
+        kinds[depth - 2] = KIND_STRING;
+        return;
+      }
+      load(as, RAX, STACK_TOP, -16);
+      load(as, RDX, STACK_TOP, -8);
+      emitTraceNumberOp(as, op, kinds[depth - 2], kinds[depth - 1], offset);
+      store(as, STACK_TOP, -16, RAX);
+      addImmediate(as, STACK_TOP, -8);
+      kinds[depth - 2] = resultKind(op);
+      return;
+    }
+    case OP_NEGATE:
+      load(as, RAX, STACK_TOP, -8);
+      if (kinds[depth - 1] != KIND_NUMBER) {
+        moveImmediate(as, RCX, QNAN);
+        emitNumberExit(as, RAX, offset);
+      }
+      moveImmediate(as, RCX, SIGN_BIT);
+      rex(as, RCX, RAX);
+      emitByte(as, 0x31);  // xor rax, rcx
+      modrmRegister(as, RCX, RAX);
+      store(as, STACK_TOP, -8, RAX);
+      kinds[depth - 1] = KIND_NUMBER;
+      return;
+    case OP_MOVE:
+      load(as, RAX, SLOTS, ip[2] * (int)sizeof(Value));
+      store(as, SLOTS, ip[1] * (int)sizeof(Value), RAX);
+      kinds[ip[1]] = kinds[ip[2]];
+      return;
+    case OP_LOADK:
+      load(as, RAX, CONSTANTS, ip[2] * (int)sizeof(Value));
+      store(as, SLOTS, ip[1] * (int)sizeof(Value), RAX);
+      kinds[ip[1]] = kindOf(chunk->constants.values[ip[2]]);
+      return;
+    case OP_CONSTANT:
+      emitInstruction(as, chunk, offset);
+      kinds[depth] = kindOf(chunk->constants.values[ip[1]]);
+      return;
+    case OP_NIL:
+      emitInstruction(as, chunk, offset);
+      kinds[depth] = KIND_NIL;
+      return;
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NOT:
+      emitInstruction(as, chunk, offset);
+      kinds[ip[0] == OP_NOT ? depth - 1 : depth] = KIND_BOOL;
+      return;
+    case OP_GET_LOCAL:
+      emitInstruction(as, chunk, offset);
+      kinds[depth] = kinds[ip[1]];
+      return;
+    case OP_SET_LOCAL:
+      emitInstruction(as, chunk, offset);
+      kinds[ip[1]] = kinds[depth - 1];
+      return;
+    case OP_GET_UPVALUE:
+    case OP_GET_ENCLOSING:
+      emitInstruction(as, chunk, offset);
+      kinds[depth] = KIND_UNKNOWN;
+      return;
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+    case OP_CALL_NATIVE:
+      // Any of these can write to this frame's slots through an open
+      // upvalue, a native call once its callee is no longer a native.
+      emitInstruction(as, chunk, offset);
+      forgetKinds(kinds);
+      return;
+    case OP_POP:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_SET_ENCLOSING:  // Writes the frame below, not this one.
+      emitInstruction(as, chunk, offset);
+      return;
+  }
+
+  // Register-form arithmetic
+  bool constant;
+  uint8_t op = registerForm(ip[0], &constant);
+  bool storesResult = instructionLength(chunk, offset) == 4;
+  uint8_t* operands = storesResult ? ip + 2 : ip + 1;
+  if (step->a == KIND_STRING) {
+    emitHelper(as, jitRegister, ip);
+    if (storesResult) {
+      kinds[ip[1]] = KIND_STRING;
+    } else {
+      kinds[depth] = KIND_STRING;
+    }
+    return;
+  }
+
+  Kind b;
+  load(as, RAX, SLOTS, operands[0] * (int)sizeof(Value));
+  if (constant) {
+    load(as, RDX, CONSTANTS, operands[1] * (int)sizeof(Value));
+    b = kindOf(chunk->constants.values[operands[1]]);
+  } else {
+    load(as, RDX, SLOTS, operands[1] * (int)sizeof(Value));
+    b = kinds[operands[1]];
+  }
+  emitTraceNumberOp(as, op, kinds[operands[0]], b, offset);
+  if (storesResult) {
+    store(as, SLOTS, ip[1] * (int)sizeof(Value), RAX);
+    kinds[ip[1]] = resultKind(op);
+  } else {
+    emitPushRax(as);
+    kinds[depth] = resultKind(op);
+  }
+}
+
+static void* compileTrace(Chunk* chunk, TraceStep* steps, int count) {
+  Assembler as = {NULL, 0, 0, NULL, 0, 0};
+  Kind kinds[TRACE_DEPTH_MAX];
+
+  emitPrologue(&as, chunk);
+  int loopStart = as.count;
+  forgetKinds(kinds);
+  for (int i = 0; i < count; i++) {
+    emitTraceStep(&as, chunk, &steps[i], kinds);
+  }
+  patchRel32(&as, jump(&as), loopStart);
+
+  int errorExit = as.count;
+  moveImmediate(&as, RAX, JIT_ERROR);
+  emitEpilogue(&as);
+
+  // Side exits, one per distinct resume point
+  int* exits = malloc(sizeof(int) * chunk->count);
+  if (exits == NULL) exit(1);
+  for (int i = 0; i < chunk->count; i++) exits[i] = -1;
+
+  for (int i = 0; i < as.fixupCount; i++) {
+    Fixup* fixup = &as.fixups[i];
+    if (fixup->target == TARGET_ERROR) {
+      patchRel32(&as, fixup->at, errorExit);
+      continue;
+    }
+
+    if (exits[fixup->target] == -1) {
+      exits[fixup->target] = as.count;
+      moveImmediate(&as, RAX, (uint64_t)(uintptr_t)&vm.stackTop);
+      store(&as, RAX, 0, STACK_TOP);
+      moveImmediate(&as, RAX,
+                    (uint64_t)(uintptr_t)(chunk->code + fixup->target));
+      store(&as, FRAME, offsetof(CallFrame, ip), RAX);
+      emitByte(&as, 0x31);  // xor eax, eax
+      emitByte(&as, 0xc0);
+      emitEpilogue(&as);
+    }
+    patchRel32(&as, fixup->at, exits[fixup->target]);
+  }
+
+  void* code = install(&as);
+  free(exits);
+  free(as.code);
+  free(as.fixups);
+  return code;
+}
+
+static Trace* findTrace(ObjFunction* function, uint8_t* anchor) {
+  for (Trace* trace = function->traces; trace != NULL; trace = trace->next) {
+    if (trace->anchor == anchor) return trace;
+  }
+
+  Trace* trace = malloc(sizeof(Trace));
+  if (trace == NULL) exit(1);
+  trace->next = function->traces;
+  trace->anchor = anchor;
+  trace->hotness = 0;
+  trace->attempts = 0;
+  trace->recording = false;
+  trace->code = NULL;
+  function->traces = trace;
+  return trace;
+}
+
+bool traceLoop(CallFrame* frame, uint8_t* anchor) {
+  Trace* trace = findTrace(frame->closure->function, anchor);
+  if (trace->code == NULL) {
+    if (trace->recording || trace->attempts == TRACE_ATTEMPTS) return true;
+    if (++trace->hotness < jitOptions.traceThreshold) return true;
+    trace->hotness = 0;
+
+    TraceStep* steps = malloc(sizeof(TraceStep) * TRACE_MAX);
+    if (steps == NULL) exit(1);
+    int count;
+    trace->recording = true;
+    RecordResult result = recordTrace(frame, trace, steps, &count);
+    trace->recording = false;
+
+    if (result == RECORD_OK) {
+      trace->code = compileTrace(&frame->closure->function->chunk, steps,
+                                 count);
+    }
+    free(steps);
+
+    if (result == RECORD_ERROR) return false;
+    if (trace->code == NULL) {
+      trace->attempts++;
+      return true;
+    }
+  }
+
+  return ((JitEntry)trace->code)(frame) == JIT_OK;
+}
+
+#endif
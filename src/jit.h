@@ -0,0 +1,31 @@
+#ifndef _JIT_H_
+#define _JIT_H_
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef BASELINE_JIT
+
+typedef struct {
+  int threshold;  // Calls before a function is compiled; 0 disables the JIT.
+  int traceThreshold;  // Back-edges before a loop is traced; 0 disables it.
+} JitOptions;
+
+extern JitOptions jitOptions;
+
+void jitCompile(ObjFunction* function);
+void jitFree(ObjFunction* function);
+bool jitExecute(CallFrame* frame);
+// Whether jitExecute may be entered without nesting compiled frames too
+// deeply on the C stack.
+bool jitCanNest();
+
+// Count a back-edge of the loop closed by the OP_LOOP at anchor, whose
+// header frame->ip now points to, and run its trace if it has one. Returns
+// false on a runtime error; otherwise the interpreter resumes at frame->ip.
+bool traceLoop(CallFrame* frame, uint8_t* anchor);
+
+#endif
+
+#endif
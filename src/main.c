@@ -1,13 +1,23 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "cache.h"
 #include "chunk.h"
+#include "compiler.h"
+#include "emitc.h"
+#include "image.h"
+#include "jit.h"
+#include "snapshot.h"
 #include "vm.h"
 
 #define BUFFER_SIZE 1024
 
+static bool useCache = true;
+
 static void repl() {
     char line[BUFFER_SIZE];
+    compilerOptions.inlining = false;
     while (printf("> "), fgets(line, sizeof(line), stdin)) {
         interpret(line);
     }
@@ -45,25 +55,221 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
-static void runFile(const char* path) {
+// Where what is compiled from the script at path goes: script.ecc (or
+// whichever extension) next to script.ec, or path with it added for any
+// other name
+static char* compiledPath(const char* path, const char* extension) {
+    size_t length = strlen(path);
+    if (length >= 3 && strcmp(path + length - 3, ".ec") == 0) length -= 3;
+    char* compiled = malloc(length + strlen(extension) + 1);
+    if (!compiled) exit(74);
+    memcpy(compiled, path, length);
+    strcpy(compiled + length, extension);
+    return compiled;
+}
+
+// Compile the script at path, or load it from the bytecode cached for its
+// source when that was compiled with the same options
+static ObjFunction* loadScript(const char* path) {
+    if (isImageFile(path)) {
+        ObjFunction* function = loadImage(path);
+        if (!function) {
+            fprintf(stderr, "Could not load image file \"%s\".\n", path);
+            exit(65);
+        }
+        return function;
+    }
+
+    if (isBytecodeFile(path)) {
+        ObjFunction* function = readBytecode(path, NULL);
+        if (!function) {
+            fprintf(stderr, "Could not load bytecode file \"%s\".\n", path);
+            exit(65);
+        }
+        return function;
+    }
+
     char* source = readFile(path);
-    InterpretResult result = interpret(source);
+    char* bytecode = useCache ? cachePath(source) : NULL;
+    ObjFunction* function = bytecode ? readBytecode(bytecode, source) : NULL;
+    if (!function) {
+        function = compile(source);
+        // A cache that cannot be written is only a missed speedup, so the
+        // script runs without one.
+        if (function && bytecode) writeBytecode(function, source, bytecode);
+    }
+    free(bytecode);
     free(source);
+    return function;
+}
+
+static void runFile(const char* path) {
+    ObjFunction* function = loadScript(path);
+    if (!function) exit(65);
 
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
+    InterpretResult result = interpretFunction(function);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+static void compileFile(const char* path) {
+    char* source = readFile(path);
+    char* bytecode = compiledPath(path, ".ecc");
+    ObjFunction* function = compile(source);
+    if (!function) exit(65);
+
+    if (!writeBytecode(function, source, bytecode)) {
+        fprintf(stderr, "Could not write \"%s\".\n", bytecode);
+        exit(74);
+    }
+    free(bytecode);
+    free(source);
+}
+
+// Images are compiled without inlining, like lines at the REPL: the scripts
+// run after one may bind its globals to something else.
+static void imageFile(const char* path) {
+    char* source = readFile(path);
+    char* image = compiledPath(path, ".eci");
+    compilerOptions.inlining = false;
+    ObjFunction* function = compile(source);
+    if (!function) exit(65);
+
+    if (!writeImage(function, image)) {
+        fprintf(stderr, "Could not write \"%s\".\n", image);
+        exit(74);
+    }
+    free(image);
+    free(source);
+}
+
+// Map the image at path and, unless only compiling, run it
+static void loadPrelude(const char* path, bool run) {
+    ObjFunction* function = loadImage(path);
+    if (!function) {
+        fprintf(stderr, "Could not load image file \"%s\".\n", path);
+        exit(65);
+    }
+
+    if (run && interpretFunction(function) == INTERPRET_RUNTIME_ERROR) exit(70);
+}
+
+static void emitFile(const char* path) {
+    char* source = readFile(path);
+    bool compiled = emitC(source, path, stdout);
+    free(source);
+
+    if (!compiled) exit(65);
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: eclang [--emit-c|--compile|--image] [--snapshot=FILE] [--save-snapshot=FILE] [--prelude=IMAGE] [--no-cache] [--print-code] [--registers] [--jit-threshold=N] [--trace-threshold=N] [--no-jit] [--max-depth=N] [--nursery=KB] [--gc-work=N] [--gc-time=US] [--gc-thread] [--huge-pages] [-O0|-O1|-O2] [path]\n");
+    exit(64);
+}
+
 int main(int argc, const char* argv[]) {
+    const char* path = NULL;
+    bool emit = false;
+    bool compileOnly = false;
+    bool imageOnly = false;
+    const char* prelude = NULL;
+    const char* snapshot = NULL;
+    const char* saveSnapshot = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--emit-c") == 0) {
+            emit = true;
+        } else if (strcmp(argv[i], "--compile") == 0) {
+            compileOnly = true;
+        } else if (strcmp(argv[i], "--image") == 0) {
+            imageOnly = true;
+        } else if (strncmp(argv[i], "--snapshot=", 11) == 0) {
+            snapshot = argv[i] + 11;
+        } else if (strncmp(argv[i], "--save-snapshot=", 16) == 0) {
+            saveSnapshot = argv[i] + 16;
+        } else if (strncmp(argv[i], "--prelude=", 10) == 0) {
+            prelude = argv[i] + 10;
+        } else if (strcmp(argv[i], "--no-cache") == 0) {
+            useCache = false;
+        } else if (strcmp(argv[i], "--print-code") == 0) {
+            compilerOptions.printCode = true;
+            useCache = false;
+        } else if (strcmp(argv[i], "--registers") == 0) {
+            compilerOptions.registerOps = true;
+        } else if (strncmp(argv[i], "--jit-threshold=", 16) == 0) {
+#ifdef BASELINE_JIT
+            jitOptions.threshold = atoi(argv[i] + 16);
+#endif
+        } else if (strncmp(argv[i], "--trace-threshold=", 18) == 0) {
+#ifdef BASELINE_JIT
+            jitOptions.traceThreshold = atoi(argv[i] + 18);
+#endif
+        } else if (strcmp(argv[i], "--no-jit") == 0) {
+#ifdef BASELINE_JIT
+            jitOptions.threshold = 0;
+            jitOptions.traceThreshold = 0;
+#endif
+        } else if (strncmp(argv[i], "--max-depth=", 12) == 0) {
+            vmOptions.maxDepth = atoi(argv[i] + 12);
+            if (vmOptions.maxDepth < 1) usage();
+        } else if (strncmp(argv[i], "--nursery=", 10) == 0) {
+            int kilobytes = atoi(argv[i] + 10);
+            if (kilobytes < 0) usage();
+            vmOptions.nurserySize = (size_t)kilobytes * 1024;
+        } else if (strncmp(argv[i], "--gc-work=", 10) == 0) {
+            vmOptions.gcStepWork = atoi(argv[i] + 10);
+            if (vmOptions.gcStepWork < 0) usage();
+        } else if (strncmp(argv[i], "--gc-time=", 10) == 0) {
+            vmOptions.gcStepMicros = atoi(argv[i] + 10);
+            if (vmOptions.gcStepMicros < 0) usage();
+        } else if (strcmp(argv[i], "--gc-thread") == 0) {
+            vmOptions.gcThread = true;
+        } else if (strcmp(argv[i], "--huge-pages") == 0) {
+            vmOptions.hugePages = true;
+        } else if (strcmp(argv[i], "-O0") == 0 || strcmp(argv[i], "-O1") == 0 ||
+                   strcmp(argv[i], "-O2") == 0) {
+            compilerOptions.optimizationLevel = argv[i][2] - '0';
+        } else if (argv[i][0] == '-' || path != NULL) {
+            usage();
+        } else {
+            path = argv[i];
+        }
+    }
+
+    if ((emit || compileOnly || imageOnly) && path == NULL) usage();
+    if (emit + compileOnly + imageOnly > 1) usage();
+    if (emit && (prelude != NULL || snapshot != NULL)) usage();
+    if (saveSnapshot != NULL && (emit || compileOnly || imageOnly)) usage();
+    if (saveSnapshot != NULL && path == NULL && prelude == NULL) usage();
+
+    // The actions of a prelude or snapshot can assign the script's globals,
+    // which the inliner cannot see, so calls through them are left as calls.
+    if (prelude != NULL || snapshot != NULL) compilerOptions.inlining = false;
+
     initVM();
 
-    if (argc == 1) {
-        repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    if (snapshot != NULL && !restoreSnapshot(snapshot)) {
+        fprintf(stderr, "Could not restore snapshot \"%s\".\n", snapshot);
+        exit(65);
+    }
+
+    // Its globals take their slots before anything that refers to them by
+    // number is compiled.
+    if (prelude != NULL) loadPrelude(prelude, !compileOnly && !imageOnly);
+
+    if (emit) {
+        emitFile(path);
+    } else if (compileOnly) {
+        compileFile(path);
+    } else if (imageOnly) {
+        imageFile(path);
+    } else if (path == NULL) {
+        if (saveSnapshot == NULL) repl();
     } else {
-        fprintf(stderr, "Usage: kids [path]\n");
-        exit(64);
+        runFile(path);
+    }
+
+    if (saveSnapshot != NULL && !writeSnapshot(saveSnapshot)) {
+        fprintf(stderr, "Could not write \"%s\".\n", saveSnapshot);
+        exit(74);
     }
 
     freeVM();
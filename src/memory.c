@@ -1,8 +1,17 @@
 #include "memory.h"
 
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 
 #include "compiler.h"
+#include "image.h"
+#include "jit.h"
+#include "snapshot.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
@@ -11,16 +20,204 @@
 #include "debug.h"
 #endif
 
+#if defined(__SANITIZE_ADDRESS__)
+#define ADDRESS_SANITIZER
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define ADDRESS_SANITIZER
+#endif
+#endif
+#ifdef ADDRESS_SANITIZER
+#include <sanitizer/asan_interface.h>
+#include <sanitizer/lsan_interface.h>
+#else
+#define ASAN_POISON_MEMORY_REGION(address, size) ((void)(address), (void)(size))
+#define ASAN_UNPOISON_MEMORY_REGION(address, size) \
+  ((void)(address), (void)(size))
+#endif
+
 #define GC_HEAP_GROW_FACTOR 2
+// Bytes the old generation grows by between steps of a collection.
+#define GC_STEP_SIZE (8 * 1024)
+
+// Objects live in pages aligned to their size, so the page holding one is
+// found by masking its address. A page is cut into slots of one size class.
+// Beside them, it keeps a bit for each granule an object starts at and one
+// for each of them marked live, so sweeping it only reads the headers of
+// the dead, and clearing its marks is a memset. Objects are never moved:
+// the survivors of a minor collection are promoted where they lie, with the
+// pages holding them.
+#define PAGE_SIZE (32 * 1024)
+#define GRANULE 8
+#define BITMAP_WORDS (PAGE_SIZE / GRANULE / 64)
+#define PAGE_HEADER ((sizeof(Page) + 15) & ~(size_t)15)
+
+// Pages are cut from arenas aligned to their size, so that with
+// vmOptions.hugePages each can be backed by a single huge page.
+#define ARENA_SIZE (2 * 1024 * 1024)
+
+// Every object fits the largest slot. Buffers bigger than it are not pooled.
+#define SIZE_CLASSES 16
+#define SLOT_LARGEST 512
+
+static const size_t slotSizes[SIZE_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512};
+
+typedef struct Page {
+  struct Page* next;
+  struct Page* prev;  // In a list of buffer pages with free slots.
+  void* free;   // Free slots below used, each holding the next.
+  size_t used;  // Bytes of slots bumped so far, the header included.
+  int sizeClass;
+  int live;  // Buffers handed out and not yet freed, in a page of them.
+  uint64_t starts[BITMAP_WORDS];
+  uint64_t marks[BITMAP_WORDS];
+} Page;
+
+static Page* nursery = NULL;  // The young pages.
+static Page* youngPages[SIZE_CLASSES];  // Those being filled.
+static size_t nurseryBytes = 0;
+static Page* sparePages = NULL;  // Emptied by a collection, for reuse.
+static bool youngOnly = false;   // Whether this is a minor collection.
+
+// The old pages. Old objects go in one page of their class at a time, to
+// the free slots the sweep threads together and then past the slots used
+// so far. The pages are swept lazily: once marking is done they are all set
+// aside unswept, and each is swept either by a step of the collection or
+// when allocating wants a page of its class to fill.
+static Page* oldPages[SIZE_CLASSES];      // Being filled.
+static Page* partialPages[SIZE_CLASSES];  // Swept, with room left in them.
+static Page* unsweptPages[SIZE_CLASSES];
+static int unsweptCount = 0;
+static Page* fullPages = NULL;
+static size_t cycleStart;  // Bytes allocated when the cycle began.
+static size_t cycleFreed;  // Bytes the sweep has freed so far.
+
+// The pools of the small buffers objects own: the characters of strings and
+// the upvalues of closures. They are freed with their objects, so their
+// pages keep count of the slots in use rather than marks.
+static Page* bufferPages[SIZE_CLASSES];      // Being filled.
+static Page* freeBufferPages[SIZE_CLASSES];  // The rest with room in them.
+
+static char* arenaNext = NULL;  // The pages of the newest arena left to use.
+static char* arenaEnd = NULL;
+static char** arenas = NULL;
+static int arenaCount = 0;
+static int arenaCapacity = 0;
+
+// With vmOptions.gcThread, marking runs on a thread of its own. While it is
+// active, the gray stack and the marks of old objects are the marker's, and
+// the interpreter only touches them with the marker paused between two
+// objects: to collect the nursery, to hand over what its barriers have
+// shaded, or to finish marking. The marker still reads headers and fields
+// the script may be storing to, through LOAD_FIELD() against the script's
+// STORE_FIELD(), so it sees the value from before the store or after, and
+// the barrier shaded the one from before.
+#define MARKER_BATCH 256
+#define SHADED_MAX 512
+
+static pthread_t marker;
+static bool markerStarted = false;
+static bool markerActive = false;  // Marking is left to the marker.
+static bool markerExit = false;
+static bool markerPaused = false;
+static atomic_bool pauseRequested;
+static pthread_mutex_t markerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t markerWake = PTHREAD_COND_INITIALIZER;
+// Objects the barriers have shaded since the marker was last paused.
+static Obj* shaded[SHADED_MAX];
+static int shadedCount = 0;
+
+static Page* pageOf(void* slot) {
+  return (Page*)((uintptr_t)slot & ~(uintptr_t)(PAGE_SIZE - 1));
+}
+
+static size_t granuleOf(Page* page, Obj* object) {
+  return (size_t)((char*)object - (char*)page) / GRANULE;
+}
+
+static Obj* objectAt(Page* page, int word, int bit) {
+  return (Obj*)((char*)page + ((size_t)word * 64 + bit) * GRANULE);
+}
+
+// The marks of objects in a page share words, which the marker and an
+// interpreter allocating black may both be setting bits of, so each word
+// is read and set atomically. Objects outside any page, those of images and
+// snapshots, are marked in their headers.
+bool isObjectMarked(Obj* object) {
+  if (!LOAD_FIELD(object->inPage)) return LOAD_FIELD(object->isMarked);
+  Page* page = pageOf(object);
+  size_t granule = granuleOf(page, object);
+  uint64_t word = __atomic_load_n(&page->marks[granule / 64], __ATOMIC_RELAXED);
+  return (word >> (granule % 64)) & 1;
+}
+
+static void setPageMark(Page* page, Obj* object) {
+  size_t granule = granuleOf(page, object);
+  __atomic_fetch_or(&page->marks[granule / 64], (uint64_t)1 << (granule % 64),
+                    __ATOMIC_RELAXED);
+}
+
+static void setMarked(Obj* object) {
+  if (object->inPage) {
+    setPageMark(pageOf(object), object);
+  } else {
+    STORE_FIELD(object->isMarked, true);
+  }
+}
+
+static void setStart(Page* page, Obj* object) {
+  size_t granule = granuleOf(page, object);
+  page->starts[granule / 64] |= (uint64_t)1 << (granule % 64);
+}
+
+// The smallest class with slots of at least size bytes
+static int classOf(size_t size) {
+  if (size <= 128) return size <= 16 ? 0 : (int)((size + 15) / 16) - 1;
+  if (size <= 256) return 8 + (int)((size - 129) / 32);
+  return 12 + (int)((size - 257) / 64);
+}
+
+static bool hasRoom(Page* page) {
+  return page->free != NULL ||
+         page->used + slotSizes[page->sizeClass] <= PAGE_SIZE;
+}
+
+// Free slots are poisoned, so the address sanitizer catches what is still
+// used after it is freed.
+static void* takeSlot(Page* page) {
+  void* slot = page->free;
+  if (slot != NULL) {
+    ASAN_UNPOISON_MEMORY_REGION(slot, slotSizes[page->sizeClass]);
+    page->free = *(void**)slot;
+  } else {
+    slot = (char*)page + page->used;
+    page->used += slotSizes[page->sizeClass];
+  }
+  return slot;
+}
+
+static void freeSlot(Page* page, void* slot) {
+  *(void**)slot = page->free;
+  page->free = slot;
+  ASAN_POISON_MEMORY_REGION(slot, slotSizes[page->sizeClass]);
+}
+
+static void pushPage(Page** list, Page* page) {
+  page->next = *list;
+  *list = page;
+}
+
+static void paceCollection();
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     vm.bytesAllocated += newSize - oldSize;
     if (newSize > oldSize) {
 #ifdef DEBUG_STRESS_GC
-        collectGarbage();
+        paceCollection();
 #endif
         if (vm.bytesAllocated > vm.nextGC) {
-            collectGarbage();
+            paceCollection();
         }
     }
 
@@ -34,10 +231,121 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     return result;
 }
 
+// Map another arena, aligned by mapping twice its size and trimming it
+static void addArena() {
+  size_t size = 2 * ARENA_SIZE;
+  char* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) exit(1);
+  char* arena = (char*)(((uintptr_t)mapping + ARENA_SIZE - 1) &
+                        ~(uintptr_t)(ARENA_SIZE - 1));
+  if (arena > mapping) munmap(mapping, arena - mapping);
+  munmap(arena + ARENA_SIZE, mapping + size - (arena + ARENA_SIZE));
+#ifdef MADV_HUGEPAGE
+  if (vmOptions.hugePages) madvise(arena, ARENA_SIZE, MADV_HUGEPAGE);
+#endif
+#ifdef ADDRESS_SANITIZER
+  // What objects own is only reachable through them, so the leak checker
+  // has to look in the arenas too.
+  __lsan_register_root_region(arena, ARENA_SIZE);
+#endif
+
+  if (arenaCount == arenaCapacity) {
+    arenaCapacity = INCREASE_CAPACITY(arenaCapacity);
+    arenas = realloc(arenas, sizeof(char*) * arenaCapacity);
+    if (arenas == NULL) exit(1);
+  }
+  arenas[arenaCount++] = arena;
+  arenaNext = arena;
+  arenaEnd = arena + ARENA_SIZE;
+}
+
+// A page of the class with nothing in it, not yet counted as allocated
+static Page* newPage(int sizeClass) {
+  Page* page = sparePages;
+  if (page != NULL) {
+    sparePages = page->next;
+  } else {
+    if (arenaNext == arenaEnd) addArena();
+    page = (Page*)arenaNext;
+    arenaNext += PAGE_SIZE;
+  }
+  ASAN_UNPOISON_MEMORY_REGION(page, PAGE_SIZE);
+  page->next = NULL;
+  page->prev = NULL;
+  page->free = NULL;
+  page->used = PAGE_HEADER;
+  page->sizeClass = sizeClass;
+  page->live = 0;
+  memset(page->starts, 0, sizeof(page->starts));
+  // The marker may look up the marks of an object in the page as soon as
+  // the object is stored where it can see it.
+  for (int word = 0; word < BITMAP_WORDS; word++) {
+    STORE_FIELD(page->marks[word], 0);
+  }
+  return page;
+}
+
+// Give back a page the heap counted as allocated. Its memory goes back to
+// the system too, unless that would break up a huge page.
+static void releasePage(Page* page) {
+  vm.bytesAllocated -= PAGE_SIZE;
+  if (!vmOptions.hugePages) madvise(page, PAGE_SIZE, MADV_DONTNEED);
+  pushPage(&sparePages, page);
+}
+
+static Page* addNurseryPage(int sizeClass) {
+  Page* page = newPage(sizeClass);
+  pushPage(&nursery, page);
+  youngPages[sizeClass] = page;
+  nurseryBytes += PAGE_SIZE;
+  return page;
+}
+
+// Bump size bytes for a young object, or return NULL if it belongs in the
+// old generation: the nursery is off, the object is big, or no script is
+// running. What the compiler and loaders make lives as long as the code
+// using it, and the nursery is for the garbage a running script makes.
+Obj* allocateYoung(size_t size) {
+  if (vmOptions.nurserySize == 0 || vm.frameCount == 0 ||
+      size > SLOT_LARGEST) {
+    return NULL;
+  }
+  int sizeClass = classOf(size);
+
+#ifdef DEBUG_STRESS_GC
+  collectYoung();
+#endif
+  Page* page = youngPages[sizeClass];
+  if (page == NULL || !hasRoom(page)) {
+    if (nurseryBytes >= vmOptions.nurserySize) collectYoung();
+    page = addNurseryPage(sizeClass);
+  }
+
+  Obj* object = takeSlot(page);
+  setStart(page, object);
+  return object;
+}
+
+// Add an old object to the remembered set. Barriers call this between any
+// two instructions, so it must not collect.
+void rememberObject(Obj* object) {
+  if (vm.rememberedCount == vm.rememberedCapacity) {
+    vm.rememberedCapacity = INCREASE_CAPACITY(vm.rememberedCapacity);
+    vm.remembered = realloc(vm.remembered,
+                            sizeof(Obj*) * vm.rememberedCapacity);
+    if (vm.remembered == NULL) exit(1);
+  }
+  object->isRemembered = true;
+  vm.remembered[vm.rememberedCount++] = object;
+}
+
+// The marker grows the gray stack too, so it is not counted through
+// reallocate(), whose bookkeeping belongs to the interpreter's thread.
 void appendToGrayStack(Obj* object) {
     if (vm.grayCapacity < vm.grayCount + 1) {
         vm.grayCapacity = INCREASE_CAPACITY(vm.grayCapacity);
-        vm.grayStack = (Obj**)reallocate(vm.grayStack, sizeof(Obj*) * vm.grayCapacity, sizeof(Obj*) * vm.grayCapacity);
+        vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
         if (!vm.grayStack) exit(1);
     }
 
@@ -45,7 +353,11 @@ void appendToGrayStack(Obj* object) {
 }
 
 void markObject(Obj* object) {
-    if (!object || object->isMarked) return;
+    if (!object || isObjectMarked(object)) return;
+    // A minor collection takes every old object to be live, and marking the
+    // old generation leaves young objects to the minor collection that
+    // finishes it.
+    if (LOAD_FIELD(object->isYoung) != youngOnly) return;
 
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void*)object);
@@ -53,7 +365,7 @@ void markObject(Obj* object) {
     printf("\n");
 #endif
 
-    object->isMarked = true;
+    setMarked(object);
     appendToGrayStack(object);
 
 }
@@ -68,7 +380,7 @@ void markArray(ValueArray* array) {
     }
 }
 
-
+// Free what an object owns. The object itself is left to its page.
 static void freeObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
   printf("%p free type %d\n", (void*)object, object->type);
@@ -78,136 +390,618 @@ static void freeObject(Obj* object) {
   switch (object->type) {
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
-      FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-      FREE(ObjClosure, object);
+      FREE_BUFFER(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
       break;
     }
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
+#ifdef BASELINE_JIT
+      jitFree(function);
+#endif
       freeChunk(&function->chunk);
-      FREE(ObjFunction, object);
       break;
     }
     case OBJ_NATIVE:
-      FREE(ObjNative, object);
       break;
     case OBJ_STRING: {
       ObjString* string = (ObjString*)object;
-      FREE_ARRAY(char, string->chars, string->length + 1);
-      FREE(ObjString, object);
+      // joinStrings() puts the characters of one in the nursery inline.
+      if (string->chars != (char*)(string + 1)) {
+        FREE_BUFFER(char, string->chars, string->length + 1);
+      }
       break;
     }
     case OBJ_UPVALUE:
-      FREE(ObjUpvalue, object);
       break;
   }
 }
 
+// File a swept old page by whether it has room left
+static void fileOldPage(Page* page) {
+  pushPage(hasRoom(page) ? &partialPages[page->sizeClass] : &fullPages, page);
+}
+
+// Free the objects of an old page that were not marked, threading their
+// slots onto its free list, and clear the marks of the rest. Returns how
+// many objects the page held.
+static int sweepPage(Page* page) {
+  int work = 0;
+  bool empty = true;
+  for (int word = 0; word < BITMAP_WORDS; word++) {
+    uint64_t starts = page->starts[word];
+    uint64_t dead = starts & ~page->marks[word];
+    work += __builtin_popcountll(starts);
+    for (; dead != 0; dead &= dead - 1) {
+      Obj* object = objectAt(page, word, __builtin_ctzll(dead));
+      freeObject(object);
+      freeSlot(page, object);
+    }
+    page->starts[word] = starts & page->marks[word];
+    if (page->starts[word] != 0) empty = false;
+  }
+  memset(page->marks, 0, sizeof(page->marks));
+
+  if (empty) {
+    releasePage(page);
+  } else {
+    fileOldPage(page);
+  }
+  return work;
+}
+
+// Sweep the next unswept page of the class, returning how many objects it
+// held
+static int sweepNextPage(int sizeClass) {
+  Page* page = unsweptPages[sizeClass];
+  unsweptPages[sizeClass] = page->next;
+  unsweptCount--;
+  size_t before = vm.bytesAllocated;
+  int work = sweepPage(page);
+  cycleFreed += before - vm.bytesAllocated;
+  return work;
+}
+
+// Sweep unswept pages until budget objects have been looked at, returning
+// how many were
+static int sweepPages(int budget) {
+  int work = 0;
+  for (int i = 0; i < SIZE_CLASSES && work < budget; i++) {
+    while (unsweptPages[i] != NULL && work < budget) work += sweepNextPage(i);
+  }
+  return work;
+}
+
+static void endCollection();
+
+// Make another page the one old objects of the class go in: one swept with
+// room in it, sweeping those of the class first if need be, or else a new
+// one.
+static Page* takeOldPage(int sizeClass) {
+  if (oldPages[sizeClass] != NULL) {
+    pushPage(&fullPages, oldPages[sizeClass]);
+    oldPages[sizeClass] = NULL;
+  }
+  while (partialPages[sizeClass] == NULL && unsweptPages[sizeClass] != NULL) {
+    sweepNextPage(sizeClass);
+    if (unsweptCount == 0) endCollection();
+  }
+
+  Page* page = partialPages[sizeClass];
+  if (page != NULL) {
+    partialPages[sizeClass] = page->next;
+  } else {
+    // Collecting here is done before the page is taken, so it is not among
+    // those a collection finishing its marking sets aside unswept.
+    page = newPage(sizeClass);
+    vm.bytesAllocated += PAGE_SIZE;
+    if (vm.bytesAllocated > vm.nextGC) paceCollection();
+  }
+  oldPages[sizeClass] = page;
+  return page;
+}
+
+// Take a slot for an old object of size bytes. While the old generation is
+// being marked, the object is black, as it was not there to be marked.
+Obj* allocateOld(size_t size) {
+  int sizeClass = classOf(size);
+#ifdef DEBUG_STRESS_GC
+  paceCollection();
+#endif
+  Page* page = oldPages[sizeClass];
+  if (page == NULL || !hasRoom(page)) page = takeOldPage(sizeClass);
+
+  Obj* object = takeSlot(page);
+  setStart(page, object);
+  if (vm.gcPhase == GC_MARK) setPageMark(page, object);
+  return object;
+}
+
+// The buffer pages of a class with room in them, the one being filled
+// aside, are kept in a list they can each be taken out of as they fill or
+// empty.
+static void linkBufferPage(Page* page) {
+  Page** list = &freeBufferPages[page->sizeClass];
+  page->prev = NULL;
+  page->next = *list;
+  if (*list != NULL) (*list)->prev = page;
+  *list = page;
+}
+
+static void unlinkBufferPage(Page* page) {
+  if (page->prev != NULL) {
+    page->prev->next = page->next;
+  } else {
+    freeBufferPages[page->sizeClass] = page->next;
+  }
+  if (page->next != NULL) page->next->prev = page->prev;
+}
+
+// Make another page the one buffers of the class are taken from. The one
+// filled leaves the lists until a buffer in it is freed, which may already
+// have happened if taking a new page collected.
+static Page* takeBufferPage(int sizeClass) {
+  Page* page = freeBufferPages[sizeClass];
+  if (page != NULL) {
+    unlinkBufferPage(page);
+  } else {
+    page = newPage(sizeClass);
+    vm.bytesAllocated += PAGE_SIZE;
+    if (vm.bytesAllocated > vm.nextGC) paceCollection();
+  }
+
+  Page* filled = bufferPages[sizeClass];
+  bufferPages[sizeClass] = page;
+  if (filled != NULL && filled->live == 0) {
+    releasePage(filled);
+  } else if (filled != NULL && hasRoom(filled)) {
+    linkBufferPage(filled);
+  }
+  return page;
+}
+
+void* allocateBuffer(size_t size) {
+  if (size == 0) return NULL;
+  if (size > SLOT_LARGEST) return reallocate(NULL, 0, size);
+  int sizeClass = classOf(size);
+#ifdef DEBUG_STRESS_GC
+  paceCollection();
+#endif
+
+  Page* page = bufferPages[sizeClass];
+  if (page == NULL || !hasRoom(page)) page = takeBufferPage(sizeClass);
+  page->live++;
+  return takeSlot(page);
+}
+
+void freeBuffer(void* buffer, size_t size) {
+  if (size == 0) return;
+  if (size > SLOT_LARGEST) {
+    reallocate(buffer, size, 0);
+    return;
+  }
+
+  Page* page = pageOf(buffer);
+  bool wasFull = !hasRoom(page);
+  freeSlot(page, buffer);
+  page->live--;
+  if (page == bufferPages[page->sizeClass]) return;
+  if (page->live == 0) {
+    if (!wasFull) unlinkBufferPage(page);
+    releasePage(page);
+  } else if (wasFull) {
+    linkBufferPage(page);
+  }
+}
+
 static void blackenObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
   printf("%p blacken ", (void*)object);
   printValue(OBJ_VAL(object));
   printf("\n");
 #endif
-  switch (object->type) {
+  switch (LOAD_FIELD(object->type)) {
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
       markObject((Obj*)closure->function);
       for (int i = 0; i < closure->upvalueCount; i++) {
-        markObject((Obj*)closure->upvalues[i]);
+        markObject((Obj*)LOAD_FIELD(closure->upvalues[i]));
       }
       break;
     }
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
       markObject((Obj*)function->name);
+      markObject((Obj*)LOAD_FIELD(function->closure));
       markArray(&function->chunk.constants);
+      for (int i = 0; i < function->chunk.inlineCount; i++) {
+        markObject((Obj*)function->chunk.inlines[i].name);
+      }
       break;
     }
     case OBJ_UPVALUE:
-      markValue(((ObjUpvalue*)object)->closed);
+      markValue(LOAD_FIELD(((ObjUpvalue*)object)->closed));
       break;
     case OBJ_NATIVE:
+      markObject((Obj*)((ObjNative*)object)->name);
+      break;
     case OBJ_STRING:
       break;
   }
 }
 
-static void markRoots() {
+// Mark the roots that change without barriers
+static void markStackRoots() {
   for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
     markValue(*slot);
   }
 
   for (int i = 0; i < vm.frameCount; i++) {
-    markObject((Obj*)vm.frames[i].closure);
+    markObject((Obj*)vm.frames[i]->closure);
   }
 
   for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL;
        upvalue = upvalue->next) {
     markObject((Obj*)upvalue);
   }
+}
 
-    markInstance(&vm.globals);
+static void markRoots() {
+  markStackRoots();
+
+  // Global slots are roots, so a minor collection scans their values rather
+  // than barriers tracking stores to them. Their names come from the
+  // compiler, which never makes young objects.
+  if (!youngOnly) {
+    markInstance(&vm.globalSlots);
+    markArray(&vm.globalNames);
+  }
+  markArray(&vm.globalValues);
   markCompilerRoots();
+  markImageRoots();
   markObject((Obj*)vm.initString);
 }
 
-static void traceReferences() {
-  while (vm.grayCount > 0) {
+// Blacken gray objects down to the first count of them, or all but those
+// while no more than budget have been blackened
+static int traceReferences(int count, int budget) {
+  int work = 0;
+  while (vm.grayCount > count && work < budget) {
     Obj* object = vm.grayStack[--vm.grayCount];
     blackenObject(object);
+    work++;
   }
+  return work;
 }
 
-static void sweep() {
-  Obj* previous = NULL;
-  Obj* object = vm.objects;
-  while (object != NULL) {
-    if (object->isMarked) {
-      object->isMarked = false;
-      previous = object;
-      object = object->next;
-    } else {
-      Obj* unreached = object;
-      object = object->next;
-      if (previous != NULL) {
-        previous->next = object;
-      } else {
-        vm.objects = object;
+// Free the young objects the collection did not reach, threading their
+// slots onto the free list of their page, and promote the rest to the old
+// generation where they lie, with the pages holding them. While the old
+// generation is being marked, they join it black, as objects allocated
+// since marking began.
+static void sweepYoung() {
+  while (nursery != NULL) {
+    Page* page = nursery;
+    nursery = page->next;
+    bool live = false;
+    for (int word = 0; word < BITMAP_WORDS; word++) {
+      uint64_t starts = page->starts[word];
+      uint64_t marks = page->marks[word];
+      for (uint64_t bits = starts; bits != 0; bits &= bits - 1) {
+        Obj* object = objectAt(page, word, __builtin_ctzll(bits));
+        if (marks & bits & -bits) {
+          STORE_FIELD(object->isYoung, false);
+        } else {
+          if (object->type == OBJ_STRING) {
+            deleteInstance(&vm.strings, (ObjString*)object);
+          }
+          freeObject(object);
+          freeSlot(page, object);
+        }
       }
+      page->starts[word] = starts & marks;
+      if (marks != 0) live = true;
+    }
+    if (vm.gcPhase != GC_MARK) memset(page->marks, 0, sizeof(page->marks));
 
-      freeObject(unreached);
+    if (live) {
+      vm.bytesAllocated += PAGE_SIZE;
+      fileOldPage(page);
+    } else {
+      pushPage(&sparePages, page);
     }
   }
+  memset(youngPages, 0, sizeof(youngPages));
+  nurseryBytes = 0;
 }
 
-void collectGarbage() {
+// Collect the nursery alone, tracing from the roots and the remembered set
+// but no further into the old generation. The gray objects of a marking
+// under way are left where they are on the gray stack.
+static void collectNursery() {
+  if (nursery == NULL) return;
+
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc begin\n");
+  size_t before = vm.bytesAllocated;
+#endif
+
+  int count = vm.grayCount;
+  youngOnly = true;
+  markRoots();
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    vm.remembered[i]->isRemembered = false;
+    blackenObject(vm.remembered[i]);
+  }
+  vm.rememberedCount = 0;
+  traceReferences(count, INT_MAX);
+  youngOnly = false;
+  sweepYoung();
+
 #ifdef DEBUG_LOG_GC
-    printf("-- gc begin\n");
-    size_t before = vm.bytesAllocated;
+  printf("-- minor gc end\n");
+  printf("   old generation from %zu to %zu bytes\n", before,
+         vm.bytesAllocated);
 #endif
+}
+
+// Stop the marker between two objects, if it is marking, and give it what
+// the barriers have shaded. Until resumeMarker(), the interpreter has the
+// gray stack to itself.
+static void pauseMarker() {
+  if (!markerActive) return;
+  atomic_store(&pauseRequested, true);
+  pthread_mutex_lock(&markerLock);
+  markerPaused = true;
+  for (int i = 0; i < shadedCount; i++) markObject(shaded[i]);
+  shadedCount = 0;
+}
 
-    markRoots();
-    traceReferences();
-    removeWhiteInstance(&vm.strings);
-    sweep();
+static void resumeMarker() {
+  if (!markerPaused) return;
+  markerPaused = false;
+  atomic_store(&pauseRequested, false);
+  pthread_cond_signal(&markerWake);
+  pthread_mutex_unlock(&markerLock);
+}
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+// Blacken gray objects a batch at a time, waiting whenever there are none
+// or the interpreter wants the gray stack
+static void* runMarker(void* unused) {
+  (void)unused;
+  pthread_mutex_lock(&markerLock);
+  while (!markerExit) {
+    if (!markerActive || vm.grayCount == 0 ||
+        atomic_load(&pauseRequested)) {
+      pthread_cond_wait(&markerWake, &markerLock);
+      continue;
+    }
+    traceReferences(0, MARKER_BATCH);
+  }
+  pthread_mutex_unlock(&markerLock);
+  return NULL;
+}
+
+static void startMarker() {
+  pthread_mutex_lock(&markerLock);
+  if (!markerStarted) {
+    markerExit = false;
+    if (pthread_create(&marker, NULL, runMarker, NULL) != 0) exit(1);
+    markerStarted = true;
+  }
+  markerActive = true;
+  pthread_cond_signal(&markerWake);
+  pthread_mutex_unlock(&markerLock);
+}
+
+static void stopMarker() {
+  if (!markerStarted) return;
+  pthread_mutex_lock(&markerLock);
+  markerExit = true;
+  pthread_cond_signal(&markerWake);
+  pthread_mutex_unlock(&markerLock);
+  pthread_join(marker, NULL);
+  markerStarted = false;
+}
+
+// Shade an old object a store is about to overwrite, which marking must
+// still reach. Objects allocated since marking began are black already, and
+// the young ones are the nursery's to find.
+void shadeObject(Obj* object) {
+  if (LOAD_FIELD(object->isYoung) || isObjectMarked(object)) return;
+  if (!markerActive) {
+    markObject(object);
+    return;
+  }
+  if (shadedCount == SHADED_MAX) {
+    pauseMarker();
+    resumeMarker();
+  }
+  shaded[shadedCount++] = object;
+}
+
+void collectYoung() {
+  pauseMarker();
+  collectNursery();
+  resumeMarker();
+  if (vm.bytesAllocated > vm.nextGC) paceCollection();
+}
+
+// Begin marking from a snapshot of the heap: collect the nursery first, so
+// every object there is to mark is old, and shade the roots. From here on
+// the barriers shade what stores overwrite, and new objects are black.
+static void beginCollection() {
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin\n");
+#endif
+  collectNursery();
+  vm.gcPhase = GC_MARK;
+  cycleStart = vm.bytesAllocated;
+  cycleFreed = 0;
+  markRoots();
+  if (vmOptions.gcThread && vm.frameCount > 0) startMarker();
+}
+
+// Once the gray stack runs dry, finish marking all at once: collect the
+// nursery, whose survivors join the old generation black, and mark again
+// the roots that change without barriers. Then set the old pages aside to
+// be swept.
+static void finishMarking() {
+  collectNursery();
+  markStackRoots();
+  traceReferences(0, INT_MAX);
+  removeWhiteInstance(&vm.strings);
+  sweepRestored();
+
+  markerActive = false;
+  vm.gcPhase = GC_SWEEP;
+  for (int i = 0; i < SIZE_CLASSES; i++) {
+    if (oldPages[i] != NULL) pushPage(&fullPages, oldPages[i]);
+    oldPages[i] = NULL;
+    while (partialPages[i] != NULL) {
+      Page* page = partialPages[i];
+      partialPages[i] = page->next;
+      pushPage(&fullPages, page);
+    }
+  }
+  while (fullPages != NULL) {
+    Page* page = fullPages;
+    fullPages = page->next;
+    pushPage(&unsweptPages[page->sizeClass], page);
+    unsweptCount++;
+  }
+}
+
+// Let the heap grow by what survived before the next cycle begins. What was
+// allocated while this one ran is not counted as surviving, or a long cycle
+// would put the next one off all the further.
+static void endCollection() {
+  size_t live = cycleStart > cycleFreed ? cycleStart - cycleFreed : 0;
+  vm.gcPhase = GC_IDLE;
+  vm.nextGC = vm.bytesAllocated + live * (GC_HEAP_GROW_FACTOR - 1);
 
 #ifdef DEBUG_LOG_GC
-    printf("-- gc end\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-         before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+  printf("-- gc end\n");
+  printf("   %zu bytes allocated, next at %zu\n", vm.bytesAllocated,
+         vm.nextGC);
 #endif
 }
 
+static uint64_t microseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+// Do up to budget of the work left in the collection under way, finishing
+// it if that is all it has left. Returns how much it did.
+static int stepCollection(int budget) {
+  if (vm.gcPhase == GC_MARK) {
+    // The marker, when there is one, does the tracing; the step only looks
+    // at whether it has run out of gray objects.
+    pauseMarker();
+    int work = markerActive ? 0 : traceReferences(0, budget);
+    if (vm.grayCount == 0) finishMarking();
+    resumeMarker();
+    return work;
+  }
+
+  int work = sweepPages(budget);
+  if (unsweptCount == 0) endCollection();
+  return work;
+}
+
+// Called when the heap has grown past vm.nextGC. While a script runs, the
+// old generation is collected a step at a time between its allocations,
+// and otherwise all at once.
+static void paceCollection() {
+  if (vm.frameCount == 0 ||
+      (vmOptions.gcStepWork == 0 && vmOptions.gcStepMicros == 0)) {
+    collectGarbage();
+    return;
+  }
+
+  // The old generation grows a page at a time, which may be several steps
+  // past vm.nextGC, and each of them gets its share of the work.
+  int steps = 1;
+  if (vm.gcPhase != GC_IDLE && vm.bytesAllocated > vm.nextGC) {
+    steps += (int)((vm.bytesAllocated - vm.nextGC) / GC_STEP_SIZE);
+  }
+
+  if (vm.gcPhase == GC_IDLE) beginCollection();
+  if (markerActive || vmOptions.gcStepMicros == 0) {
+    stepCollection(vmOptions.gcStepWork > INT_MAX / steps
+                       ? INT_MAX
+                       : vmOptions.gcStepWork * steps);
+  } else {
+    uint64_t deadline =
+        microseconds() + (uint64_t)vmOptions.gcStepMicros * steps;
+    while (vm.gcPhase != GC_IDLE && microseconds() < deadline) {
+      stepCollection(64);
+    }
+  }
+  if (vm.gcPhase != GC_IDLE) vm.nextGC = vm.bytesAllocated + GC_STEP_SIZE;
+}
+
+// Finish the collection under way, or do a whole one if there is none
+void collectGarbage() {
+  if (vm.gcPhase == GC_IDLE) beginCollection();
+  if (vm.gcPhase == GC_MARK) {
+    pauseMarker();
+    finishMarking();
+    resumeMarker();
+  }
+  while (vm.gcPhase != GC_IDLE) stepCollection(INT_MAX);
+}
+
+// Free what the objects in the pages own
+static void freePageObjects(Page* page) {
+  for (; page != NULL; page = page->next) {
+    for (int word = 0; word < BITMAP_WORDS; word++) {
+      for (uint64_t bits = page->starts[word]; bits != 0; bits &= bits - 1) {
+        freeObject(objectAt(page, word, __builtin_ctzll(bits)));
+      }
+    }
+  }
+}
+
 void freeObjects() {
-  Obj* object = vm.objects;
-  while (object != NULL) {
-    Obj* next = object->next;
-    freeObject(object);
-    object = next;
+  stopMarker();
+  markerActive = false;
+  shadedCount = 0;
+  vm.gcPhase = GC_IDLE;
+
+  freePageObjects(nursery);
+  freePageObjects(fullPages);
+  for (int i = 0; i < SIZE_CLASSES; i++) {
+    freePageObjects(oldPages[i]);
+    freePageObjects(partialPages[i]);
+    freePageObjects(unsweptPages[i]);
   }
 
+  // Every page goes with its arena.
+  for (int i = 0; i < arenaCount; i++) {
+#ifdef ADDRESS_SANITIZER
+    __lsan_unregister_root_region(arenas[i], ARENA_SIZE);
+#endif
+    ASAN_UNPOISON_MEMORY_REGION(arenas[i], ARENA_SIZE);
+    munmap(arenas[i], ARENA_SIZE);
+  }
+  free(arenas);
+  arenas = NULL;
+  arenaCount = arenaCapacity = 0;
+  arenaNext = arenaEnd = NULL;
+  nursery = NULL;
+  nurseryBytes = 0;
+  fullPages = NULL;
+  sparePages = NULL;
+  unsweptCount = 0;
+  memset(youngPages, 0, sizeof(youngPages));
+  memset(oldPages, 0, sizeof(oldPages));
+  memset(partialPages, 0, sizeof(partialPages));
+  memset(unsweptPages, 0, sizeof(unsweptPages));
+  memset(bufferPages, 0, sizeof(bufferPages));
+  memset(freeBufferPages, 0, sizeof(freeBufferPages));
+
+  free(vm.remembered);
   free(vm.grayStack);
 }
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count) (type*)reallocate(NULL, 0, sizeof(type) * (count))
 
@@ -17,10 +18,53 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
   reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// The buffers objects own and free with them, such as the characters of a
+// string, come from pools of slots by size when they are small.
+#define ALLOCATE_BUFFER(type, count) \
+  (type*)allocateBuffer(sizeof(type) * (count))
+
+#define FREE_BUFFER(type, pointer, count) \
+  freeBuffer(pointer, sizeof(type) * (count))
+
+// With --gc-thread, the marker reads the headers of objects and the fields
+// that point from one to another while the interpreter may be writing them.
+// The marker loads them relaxed, and the interpreter stores them with
+// release wherever the marker can see the store: object headers, the
+// upvalues of a closure, and the values upvalues hold.
+#define LOAD_FIELD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define STORE_FIELD(field, value) \
+  __atomic_store_n(&(field), (value), __ATOMIC_RELEASE)
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+Obj* allocateYoung(size_t size);
+Obj* allocateOld(size_t size);
+void* allocateBuffer(size_t size);
+void freeBuffer(void* buffer, size_t size);
+bool isObjectMarked(Obj* object);
+void rememberObject(Obj* object);
 void markObject(Obj* object);
 void markValue(Value value);
+void collectYoung();
 void collectGarbage();
+void shadeObject(Obj* object);
 void freeObjects();
 
+// Call after storing value in a field of owner. An old object that comes to
+// point at a young one is remembered, so a minor collection, which only
+// traces from the roots, still finds the young one reachable.
+static inline void writeBarrier(Obj* owner, Value value) {
+  if (!IS_OBJ(value)) return;
+  if (AS_OBJ(value)->isYoung && !owner->isYoung && !owner->isRemembered) {
+    rememberObject(owner);
+  }
+}
+
+// Call before overwriting old, in a global or an upvalue. While the old
+// generation is being marked, the value about to be lost is shaded, so
+// everything reachable when marking began is still found: marking works
+// from a snapshot of the heap at the beginning.
+static inline void snapshotBarrier(Value old) {
+  if (vm.gcPhase == GC_MARK && IS_OBJ(old)) shadeObject(AS_OBJ(old));
+}
+
 #endif
@@ -9,13 +9,24 @@
 #define ALLOCATE_OBJ(type, objectType) \
   (type*)allocateObject(sizeof(type), objectType)
 
-static Obj* allocateObject(size_t size, ObjType type) {
-  Obj* object = (Obj*)reallocate(NULL, 0, size);
-  object->type = type;
-  object->isMarked = false;
+// Set up the header of an object bumped into a young or old page. The slot
+// may have held an object the marker is still looking at.
+static Obj* initObject(Obj* object, ObjType type, bool young) {
+  STORE_FIELD(object->type, type);
+  STORE_FIELD(object->isMarked, false);
+  STORE_FIELD(object->isYoung, young);
+  object->isRemembered = false;
+  STORE_FIELD(object->inPage, true);
+  return object;
+}
 
-  object->next = vm.objects;
-  vm.objects = object;
+static Obj* allocateObject(size_t size, ObjType type) {
+  Obj* object = allocateYoung(size);
+  if (object != NULL) {
+    initObject(object, type, true);
+  } else {
+    object = initObject(allocateOld(size), type, false);
+  }
 
 #ifdef DEBUG_LOG_GC
   printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -27,7 +38,8 @@ static Obj* allocateObject(size_t size, ObjType type) {
 
 
 ObjClosure* newClosure(ObjFunction* function) {
-  ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
+  ObjUpvalue** upvalues =
+      ALLOCATE_BUFFER(ObjUpvalue*, function->upvalueCount);
 
   for (int i = 0; i < function->upvalueCount; i++) {
     upvalues[i] = NULL;
@@ -40,18 +52,40 @@ ObjClosure* newClosure(ObjFunction* function) {
   return closure;
 }
 
+// The closure an OP_CLOSURE of the function pushes, with its upvalues still
+// to fill in. One without any is the same every time, so it is made once
+// and lives as long as the function.
+ObjClosure* closureFor(ObjFunction* function) {
+  if (function->upvalueCount > 0) return newClosure(function);
+  if (function->closure == NULL) {
+    STORE_FIELD(function->closure, newClosure(function));
+    writeBarrier((Obj*)function, OBJ_VAL(function->closure));
+  }
+  return function->closure;
+}
+
 ObjFunction* newFunction() {
   ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->upvalueCount = 0;
+  function->maxSlots = 0;
   function->name = NULL;
+  function->callCount = 0;
+  function->jitCode = NULL;
+  function->traces = NULL;
+  function->aotCode = NULL;
+  function->closure = NULL;
   initChunk(&function->chunk);
   return function;
 }
 
-ObjNative* newNative(NativeFn function) {
+ObjNative* newNative(NativeFn function, ObjString* name, int arity,
+                     bool pure) {
   ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
   native->function = function;
+  native->name = name;
+  native->arity = arity;
+  native->pure = pure;
   return native;
 }
 
@@ -75,20 +109,61 @@ static uint32_t hashString(const char* key, int length) {
   return hash;
 }
 
+// The interned string with these characters, if there is one. The table
+// does not keep its strings alive, so marking may not have reached one it
+// hands back out; that one is shaded as a value about to be lost would be.
+static ObjString* findInterned(const char* chars, int length, uint32_t hash) {
+  ObjString* interned = findStringInstance(&vm.strings, chars, length, hash);
+  if (interned != NULL) snapshotBarrier(OBJ_VAL(interned));
+  return interned;
+}
+
 ObjString* copyString(const char* chars, int length) {
   uint32_t hash = hashString(chars, length);
-  ObjString* interned = findStringInstance(&vm.strings, chars, length, hash);
+  ObjString* interned = findInterned(chars, length, hash);
   if (interned != NULL) return interned;
 
-  char* heapChars = ALLOCATE(char, length + 1);
+  char* heapChars = ALLOCATE_BUFFER(char, length + 1);
   memcpy(heapChars, chars, length);
   heapChars[length] = '\0';
   return allocateString(heapChars, length, hash);
 }
 
+// The concatenation of two strings. One made in the nursery holds its
+// characters right after it, so a short-lived result costs a single bump and
+// nothing to free.
+ObjString* joinStrings(ObjString* a, ObjString* b) {
+  int length = a->length + b->length;
+  Obj* object = allocateYoung(sizeof(ObjString) + length + 1);
+  if (object == NULL) {
+    char* chars = ALLOCATE_BUFFER(char, length + 1);
+    memcpy(chars, a->chars, a->length);
+    memcpy(chars + a->length, b->chars, b->length);
+    chars[length] = '\0';
+    return takeString(chars, length);
+  }
+
+  ObjString* string = (ObjString*)initObject(object, OBJ_STRING, true);
+  string->length = length;
+  string->chars = (char*)(string + 1);
+  memcpy(string->chars, a->chars, a->length);
+  memcpy(string->chars + a->length, b->chars, b->length);
+  string->chars[length] = '\0';
+  string->hash = hashString(string->chars, length);
+
+  // A duplicate is left unreferenced for the next minor collection.
+  ObjString* interned = findInterned(string->chars, length, string->hash);
+  if (interned != NULL) return interned;
+
+  push(OBJ_VAL(string));
+  setInstance(&vm.strings, string, NIL_VAL);
+  pop();
+  return string;
+}
+
 ObjUpvalue* newUpvalue(Value* slot) {
   ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
-  upvalue->closed = NIL_VAL;
+  STORE_FIELD(upvalue->closed, NIL_VAL);
   upvalue->location = slot;
   upvalue->next = NULL;
   return upvalue;
@@ -125,9 +200,9 @@ void printObject(Value value) {
 
 ObjString* takeString(char* chars, int length) {
   uint32_t hash = hashString(chars, length);
-  ObjString* interned = findStringInstance(&vm.strings, chars, length, hash);
+  ObjString* interned = findInterned(chars, length, hash);
   if (interned != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
+    FREE_BUFFER(char, chars, length + 1);
     return interned;
   }
 
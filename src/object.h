@@ -8,11 +8,13 @@
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
+#define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
+#define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
-#define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->function)
+#define AS_NATIVE(value) ((ObjNative*)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
 
@@ -26,23 +28,37 @@ typedef enum {
 
 struct Obj {
   ObjType type;
-  bool isMarked;
-  Obj* next;
+  bool isMarked;  // Outside any page; those in one are marked beside it.
+  bool isYoung;  // In the nursery, allocated since the last collection.
+  bool isRemembered;  // Old, and may point at young objects.
+  bool inPage;  // In a page of the heap, not an image or snapshot.
 };
 
 typedef struct {
   Obj Obj;
   int arity;
   int upvalueCount;
+  int maxSlots;  // Deepest its stack window gets, callee and arguments included.
   Chunk chunk;
   ObjString* name;
+  int callCount;
+  void* jitCode;  // Native entry point once the JIT has compiled it.
+  struct Trace* traces;  // Hot loops compiled by the tracing JIT.
+  void* aotCode;  // C body when linked into an --emit-c program.
+  // Shared by every OP_CLOSURE of a function that captures nothing.
+  struct ObjClosure* closure;
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value* args);
+// A native stores its result and returns true, or returns what
+// nativeError() does to raise a runtime error.
+typedef bool (*NativeFn)(int argCount, Value* args, Value* result);
 
 typedef struct {
   Obj obj;
   NativeFn function;
+  ObjString* name;
+  int arity;  // Arguments it takes, or -1 for any number.
+  bool pure;  // No effects, and the same arguments always give the same result.
 } ObjNative;
 
 struct ObjString {
@@ -59,7 +75,7 @@ typedef struct ObjUpvalue {
   struct ObjUpvalue* next;
 } ObjUpvalue;
 
-typedef struct {
+typedef struct ObjClosure {
   Obj obj;
   ObjFunction* function;
   ObjUpvalue** upvalues;
@@ -68,10 +84,13 @@ typedef struct {
 
 
 ObjClosure* newClosure(ObjFunction* function);
+ObjClosure* closureFor(ObjFunction* function);
 ObjFunction* newFunction();
-ObjNative* newNative(NativeFn function);
+ObjNative* newNative(NativeFn function, ObjString* name, int arity,
+                     bool pure);
 ObjString* takeString(char* chars, int length);
 ObjString* copyString(const char* chars, int length);
+ObjString* joinStrings(ObjString* a, ObjString* b);
 ObjUpvalue* newUpvalue(Value* slot);
 void printObject(Value value);
 
@@ -0,0 +1,370 @@
+#include "optimizer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// One instruction of the chunk being optimized. Rewrites change these in
+// place or mark them dead; the chunk itself is only rewritten at the end.
+// Jumps are held in their short form whatever their width, which
+// rewriteCode() picks afresh.
+typedef struct {
+  int offset;       // Where it starts in the original code.
+  int length;
+  uint8_t op;
+  uint8_t operand;  // First operand byte, which rewrites may replace.
+  int target;       // Instruction a jump lands on.
+  int line;
+  bool label;       // A jump lands here, so it cannot merge into the one before.
+  bool live;
+} Instruction;
+
+typedef struct {
+  Chunk* chunk;
+  Instruction* code;
+  int count;
+} Optimizer;
+
+static void decode(Optimizer* optimizer) {
+  Chunk* chunk = optimizer->chunk;
+  int* indexes = malloc(sizeof(int) * (chunk->count + 1));
+  optimizer->code = malloc(sizeof(Instruction) * chunk->count);
+  if (indexes == NULL || optimizer->code == NULL) exit(1);
+
+  optimizer->count = 0;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    Instruction* instruction = &optimizer->code[optimizer->count];
+    indexes[offset] = optimizer->count++;
+    instruction->offset = offset;
+    instruction->length = instructionLength(chunk, offset);
+    instruction->op = narrowJump(chunk->code[offset]);
+    instruction->operand =
+        instruction->length > 1 ? chunk->code[offset + 1] : 0;
+    instruction->target = -1;
+    instruction->line = locationAt(chunk, offset);
+    instruction->label = false;
+    instruction->live = true;
+  }
+  indexes[chunk->count] = optimizer->count;
+
+  for (int i = 0; i < optimizer->count; i++) {
+    Instruction* instruction = &optimizer->code[i];
+    if (!isJump(instruction->op)) continue;
+    instruction->target = indexes[jumpTarget(chunk, instruction->offset)];
+  }
+  free(indexes);
+}
+
+// The first live instruction at or after index
+static int resolve(Optimizer* optimizer, int index) {
+  while (index < optimizer->count && !optimizer->code[index].live) index++;
+  return index;
+}
+
+static int nextLive(Optimizer* optimizer, int index) {
+  return resolve(optimizer, index + 1);
+}
+
+// Flag the instructions live jumps land on
+static void markLabels(Optimizer* optimizer) {
+  for (int i = 0; i < optimizer->count; i++) optimizer->code[i].label = false;
+  for (int i = 0; i < optimizer->count; i++) {
+    Instruction* instruction = &optimizer->code[i];
+    if (!instruction->live || !isJump(instruction->op)) continue;
+    int target = resolve(optimizer, instruction->target);
+    if (target < optimizer->count) optimizer->code[target].label = true;
+  }
+}
+
+// Remove an instruction. Jumps that landed on it now land on whatever
+// follows, which inherits its label.
+static void kill(Optimizer* optimizer, int index) {
+  optimizer->code[index].live = false;
+  if (!optimizer->code[index].label) return;
+  int next = nextLive(optimizer, index);
+  if (next < optimizer->count) optimizer->code[next].label = true;
+}
+
+// Whether index is live, unlabelled and the given instruction
+static bool follows(Optimizer* optimizer, int index, uint8_t op) {
+  return index < optimizer->count && optimizer->code[index].op == op &&
+         !optimizer->code[index].label;
+}
+
+// The value a literal-pushing instruction pushes
+static bool literal(Optimizer* optimizer, int index, Value* value) {
+  if (index >= optimizer->count) return false;
+  Instruction* instruction = &optimizer->code[index];
+  switch (instruction->op) {
+    case OP_CONSTANT: {
+      Value constant = optimizer->chunk->constants.values[instruction->operand];
+      if (!IS_NUMBER(constant) && !IS_STRING(constant)) return false;
+      *value = constant;
+      return true;
+    }
+    case OP_NIL:
+      *value = NIL_VAL;
+      return true;
+    case OP_TRUE:
+      *value = BOOL_VAL(true);
+      return true;
+    case OP_FALSE:
+      *value = BOOL_VAL(false);
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Make the instruction push value instead, if its constant table has room
+static bool setLiteral(Optimizer* optimizer, int index, Value value) {
+  Instruction* instruction = &optimizer->code[index];
+  if (IS_BOOL(value) || IS_NIL(value)) {
+    instruction->op = IS_NIL(value) ? OP_NIL
+                      : AS_BOOL(value) ? OP_TRUE
+                                       : OP_FALSE;
+    instruction->length = 1;
+    return true;
+  }
+
+  int constant = findConstant(optimizer->chunk, value);
+  if (constant < 0) constant = optimizer->chunk->constants.count;
+  if (constant > UINT8_MAX) return false;
+  if (constant == optimizer->chunk->constants.count) {
+    addConstant(optimizer->chunk, value);
+  }
+
+  instruction->op = OP_CONSTANT;
+  instruction->operand = (uint8_t)constant;
+  instruction->length = 2;
+  return true;
+}
+
+// Evaluate a binary operator on two literals the way run() would, or return
+// false if it would be a runtime error or the result is not a literal
+static bool foldBinary(uint8_t op, Value a, Value b, Value* result) {
+  if (op == OP_EQUAL) {
+    *result = BOOL_VAL(valuesEqual(a, b));
+    return true;
+  }
+
+  if (op == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+    ObjString* left = AS_STRING(a);
+    ObjString* right = AS_STRING(b);
+    int length = left->length + right->length;
+    char* chars = ALLOCATE_BUFFER(char, length + 1);
+    memcpy(chars, left->chars, left->length);
+    memcpy(chars + left->length, right->chars, right->length);
+    chars[length] = '\0';
+    *result = OBJ_VAL(takeString(chars, length));
+    return true;
+  }
+
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+  switch (op) {
+    case OP_ADD:      *result = NUMBER_VAL(x + y); return true;
+    case OP_SUBTRACT: *result = NUMBER_VAL(x - y); return true;
+    case OP_MULTIPLY: *result = NUMBER_VAL(x * y); return true;
+    case OP_DIVIDE:   *result = NUMBER_VAL(x / y); return true;
+    case OP_GREATER:  *result = BOOL_VAL(x > y); return true;
+    case OP_LESS:     *result = BOOL_VAL(x < y); return true;
+    default:          return false;
+  }
+}
+
+static bool isBinary(uint8_t op) {
+  switch (op) {
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Instructions that push a value and can have no other effect
+static bool isPure(uint8_t op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_GET_ENCLOSING:
+    case OP_CONSTANT_LONG:
+    case OP_GET_LOCAL_LONG:
+    case OP_GET_UPVALUE_LONG:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Apply the first rewrite that matches at index
+static bool rewrite(Optimizer* optimizer, int index) {
+  Instruction* instruction = &optimizer->code[index];
+  int next = nextLive(optimizer, index);
+  Value a, b, result;
+
+  // A literal and the operator applied to it.
+  if (literal(optimizer, index, &a) && next < optimizer->count &&
+      !optimizer->code[next].label) {
+    uint8_t op = optimizer->code[next].op;
+    int after = nextLive(optimizer, next);
+    if (literal(optimizer, next, &b) && after < optimizer->count &&
+        !optimizer->code[after].label && isBinary(optimizer->code[after].op) &&
+        foldBinary(optimizer->code[after].op, a, b, &result) &&
+        setLiteral(optimizer, index, result)) {
+      kill(optimizer, next);
+      kill(optimizer, after);
+      return true;
+    }
+    if (op == OP_NEGATE && IS_NUMBER(a) &&
+        setLiteral(optimizer, index, NUMBER_VAL(-AS_NUMBER(a)))) {
+      kill(optimizer, next);
+      return true;
+    }
+    if (op == OP_NOT) {
+      setLiteral(optimizer, index, BOOL_VAL(isFalsy(a)));
+      kill(optimizer, next);
+      return true;
+    }
+    // A condition known in advance either always jumps or never does. The
+    // value stays on the stack for the code after the jump to pop.
+    if (op == OP_JUMP_IF_FALSE) {
+      if (isFalsy(a)) {
+        optimizer->code[next].op = OP_JUMP;
+      } else {
+        kill(optimizer, next);
+      }
+      return true;
+    }
+  }
+
+  // A value pushed only to be popped.
+  if (isPure(instruction->op) && follows(optimizer, next, OP_POP)) {
+    kill(optimizer, index);
+    kill(optimizer, next);
+    return true;
+  }
+
+  // A value stored to a local and read straight back is still on the stack.
+  if (instruction->op == OP_SET_LOCAL && follows(optimizer, next, OP_POP)) {
+    int after = nextLive(optimizer, next);
+    if (follows(optimizer, after, OP_GET_LOCAL) &&
+        optimizer->code[after].operand == instruction->operand) {
+      kill(optimizer, next);
+      kill(optimizer, after);
+      return true;
+    }
+  }
+
+  if (instruction->op == OP_JUMP || instruction->op == OP_JUMP_IF_FALSE) {
+    // Jumping to a jump goes straight to its target. So does a conditional
+    // jump landing on another one, which tests the same value.
+    int target = resolve(optimizer, instruction->target);
+    int steps = 0;
+    while (target < optimizer->count && steps++ < optimizer->count &&
+           (optimizer->code[target].op == OP_JUMP ||
+            optimizer->code[target].op == instruction->op)) {
+      target = resolve(optimizer, optimizer->code[target].target);
+    }
+    if (target != instruction->target) {
+      instruction->target = target;
+      if (target < optimizer->count) optimizer->code[target].label = true;
+      return true;
+    }
+
+    // Neither kind pops, so a jump to the next instruction does nothing.
+    if (target == next) {
+      kill(optimizer, index);
+      return true;
+    }
+  }
+
+  // Code after an unconditional transfer that no jump lands on is dead.
+  if ((instruction->op == OP_JUMP || instruction->op == OP_LOOP ||
+       instruction->op == OP_RETURN) &&
+      next < optimizer->count && !optimizer->code[next].label) {
+    kill(optimizer, next);
+    return true;
+  }
+
+  return false;
+}
+
+// Write the live instructions back over the chunk, leaving rewriteCode()
+// to pick each jump's width
+static void encode(Optimizer* optimizer) {
+  Chunk* chunk = optimizer->chunk;
+  int* offsets = malloc(sizeof(int) * (optimizer->count + 1));
+  if (offsets == NULL) exit(1);
+
+  int count = 0;
+  for (int i = 0; i < optimizer->count; i++) {
+    Instruction* instruction = &optimizer->code[i];
+    offsets[i] = count;
+    if (!instruction->live) continue;
+    count += isJump(instruction->op) ? 5 : instruction->length;
+  }
+  offsets[optimizer->count] = count;
+
+  uint8_t* code = malloc(count + 1);
+  int* locations = malloc(sizeof(int) * (count + 1));
+  if (code == NULL || locations == NULL) exit(1);
+  for (int i = 0; i < optimizer->count; i++) {
+    Instruction* instruction = &optimizer->code[i];
+    if (!instruction->live) continue;
+
+    uint8_t* at = &code[offsets[i]];
+    int length = offsets[i + 1] - offsets[i];
+    for (int k = 0; k < length; k++) {
+      locations[offsets[i] + k] = instruction->line;
+    }
+    if (isJump(instruction->op)) {
+      at[0] = wideJump(instruction->op);
+      setJumpTarget(at, offsets[resolve(optimizer, instruction->target)]);
+    } else {
+      at[0] = instruction->op;
+      if (length > 1) at[1] = instruction->operand;
+      for (int k = 2; k < length; k++) {
+        at[k] = chunk->code[instruction->offset + k];
+      }
+    }
+  }
+
+  rewriteCode(chunk, code, locations, count, NULL);
+  free(code);
+  free(locations);
+  free(offsets);
+}
+
+void optimizeChunk(Chunk* chunk) {
+  Optimizer optimizer;
+  optimizer.chunk = chunk;
+  decode(&optimizer);
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    markLabels(&optimizer);
+    for (int i = 0; i < optimizer.count; i++) {
+      if (optimizer.code[i].live && rewrite(&optimizer, i)) changed = true;
+    }
+  }
+
+  encode(&optimizer);
+  free(optimizer.code);
+}
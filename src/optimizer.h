@@ -0,0 +1,11 @@
+#ifndef _OPTIMIZER_H_
+#define _OPTIMIZER_H_
+
+#include "chunk.h"
+
+// Rewrite a finished chunk in place: fold constant expressions, drop values
+// pushed only to be popped and code nothing can reach, and shorten chains of
+// jumps. Jump offsets and the line table are rebuilt to match.
+void optimizeChunk(Chunk* chunk);
+
+#endif
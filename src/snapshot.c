@@ -0,0 +1,625 @@
+#include "snapshot.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "file.h"
+#include "image.h"
+#include "jit.h"
+#include "memory.h"
+#include "vm.h"
+
+// A snapshot is the whole heap of a VM with nothing running, laid out as it
+// is in memory: a header, every object reachable from the globals and the
+// string table with the arrays it owns, the VM's own arrays and tables, and
+// the offsets of every object and of every pointer in all of that. Pointers
+// are stored as offsets into the file, for restoring to add the address it
+// is mapped at. Natives are stored without their C functions, which
+// restoring finds by name among the natives of the VM it restores into.
+#define SNAPSHOT_VERSION 2
+
+// Where an object's address is in a Value holding it.
+#ifdef NAN_BOXING
+#define VALUE_POINTER 0
+#else
+#define VALUE_POINTER offsetof(Value, as.obj)
+#endif
+
+// The sizes of the objects and tables stored as they are in memory.
+#define SNAPSHOT_LAYOUT                                                      \
+  ((uint64_t)sizeof(ObjFunction) | (uint64_t)sizeof(ObjClosure) << 8 |      \
+   (uint64_t)sizeof(ObjUpvalue) << 16 | (uint64_t)sizeof(ObjNative) << 24 | \
+   (uint64_t)sizeof(ObjString) << 32 | (uint64_t)sizeof(Entry) << 40 |      \
+   (uint64_t)sizeof(Chunk) << 48)
+
+static const uint8_t snapshotMagic[4] = {'E', 'C', 'S', '\n'};
+
+typedef struct {
+  uint64_t values;
+  uint64_t count;
+} SnapshotArray;
+
+typedef struct {
+  uint64_t entries;
+  uint32_t count;
+  uint32_t capacity;
+} SnapshotTable;
+
+typedef struct {
+  uint8_t magic[4];
+  uint32_t version;
+  uint32_t lastOpcode;
+  uint32_t layout;
+  uint32_t byteOrder;
+  uint32_t nativeCount;
+  uint64_t objectLayout;
+  uint64_t size;
+  uint64_t objects;  // Offsets of every object.
+  uint64_t objectCount;
+  uint64_t initString;
+  uint64_t natives;  // Offsets of the ObjNatives.
+  uint64_t relocations;
+  uint64_t relocationCount;
+  SnapshotArray globalNames;
+  SnapshotArray globalValues;
+  SnapshotTable globalSlots;
+  SnapshotTable strings;
+  uint64_t checksum;  // Of everything else in the file.
+} SnapshotHeader;
+
+// A restored snapshot. Its objects are marked like any others, in their
+// headers as they are in no page of the heap, but their memory goes only
+// when it is unmapped.
+typedef struct Snapshot {
+  struct Snapshot* next;
+  uint8_t* bytes;
+  size_t size;
+  const uint64_t* objects;
+  uint64_t objectCount;
+} Snapshot;
+
+static Snapshot* snapshots = NULL;
+
+// Of the header up to the checksum and everything after it
+static uint64_t snapshotChecksum(const uint8_t* bytes, size_t size) {
+  uint64_t hash =
+      hashBytes(HASH_START, bytes, offsetof(SnapshotHeader, checksum));
+  return hashBytes(hash, bytes + sizeof(SnapshotHeader),
+                   size - sizeof(SnapshotHeader));
+}
+
+// A snapshot being laid out: once with no bytes to measure it, then again
+// to fill them in.
+typedef struct {
+  uint8_t* bytes;
+  size_t position;
+  Numbering objects;
+  size_t* offsets;  // Of each numbered object.
+  uint64_t* relocations;
+  size_t relocationCount;
+  size_t relocationCapacity;
+} Layout;
+
+static size_t reserve(Layout* layout, size_t size, size_t alignment) {
+  size_t offset = alignTo(layout->position, alignment);
+  layout->position = offset + size;
+  return offset;
+}
+
+// Note that the pointer at slot, in the snapshot, holds an offset for
+// restoring to add the address the snapshot was mapped at to
+static void addPointer(Layout* layout, void* slot) {
+  if (layout->relocationCapacity < layout->relocationCount + 1) {
+    layout->relocationCapacity = INCREASE_CAPACITY(layout->relocationCapacity);
+    layout->relocations = realloc(layout->relocations,
+                                  layout->relocationCapacity *
+                                      sizeof(uint64_t));
+    if (layout->relocations == NULL) exit(1);
+  }
+  layout->relocations[layout->relocationCount++] =
+      (uint64_t)((uint8_t*)slot - layout->bytes);
+}
+
+static void relocate(Layout* layout, void* slot, size_t offset) {
+  *(uintptr_t*)slot = offset;
+  addPointer(layout, slot);
+}
+
+static size_t offsetOf(Layout* layout, Obj* object) {
+  return layout->offsets[numberOf(&layout->objects, object)];
+}
+
+static void pointTo(Layout* layout, void* slot, Obj* object) {
+  if (object == NULL) {
+    *(void**)slot = NULL;
+  } else {
+    relocate(layout, slot, offsetOf(layout, object));
+  }
+}
+
+static void copyValue(Layout* layout, Value* slot, Value value) {
+  if (IS_OBJ(value)) {
+    *slot = OBJ_VAL((Obj*)(uintptr_t)offsetOf(layout, AS_OBJ(value)));
+    addPointer(layout, (uint8_t*)slot + VALUE_POINTER);
+  } else {
+    *slot = value;
+  }
+}
+
+static void numberValue(Numbering* objects, Value value) {
+  if (IS_OBJ(value)) numberOf(objects, AS_OBJ(value));
+}
+
+static void numberObject(Numbering* objects, Obj* object) {
+  if (object != NULL) numberOf(objects, object);
+}
+
+// Number the objects the object refers to
+static void numberChildren(Numbering* objects, Obj* object) {
+  switch (object->type) {
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      numberObject(objects, (Obj*)closure->function);
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        numberObject(objects, (Obj*)closure->upvalues[i]);
+      }
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      numberObject(objects, (Obj*)function->name);
+      numberObject(objects, (Obj*)function->closure);
+      for (int i = 0; i < function->chunk.constants.count; i++) {
+        numberValue(objects, function->chunk.constants.values[i]);
+      }
+      for (int i = 0; i < function->chunk.inlineCount; i++) {
+        numberObject(objects, (Obj*)function->chunk.inlines[i].name);
+      }
+      break;
+    }
+    case OBJ_NATIVE:
+      numberObject(objects, (Obj*)((ObjNative*)object)->name);
+      break;
+    case OBJ_UPVALUE:
+      numberValue(objects, ((ObjUpvalue*)object)->closed);
+      break;
+    case OBJ_STRING:
+      break;
+  }
+}
+
+// Lay out the object with the arrays it owns, returning its offset
+static size_t layOutObject(Layout* layout, Obj* object) {
+  uint8_t* bytes = layout->bytes;
+  switch (object->type) {
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      size_t at = reserve(layout, sizeof(ObjClosure), _Alignof(ObjClosure));
+      size_t upvalues = reserve(layout,
+                                closure->upvalueCount * sizeof(ObjUpvalue*),
+                                _Alignof(ObjUpvalue*));
+      if (bytes == NULL) return at;
+
+      ObjClosure* copy = (ObjClosure*)(bytes + at);
+      copy->upvalueCount = closure->upvalueCount;
+      pointTo(layout, &copy->function, (Obj*)closure->function);
+      relocate(layout, &copy->upvalues, upvalues);
+      ObjUpvalue** slots = (ObjUpvalue**)(bytes + upvalues);
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        pointTo(layout, &slots[i], (Obj*)closure->upvalues[i]);
+      }
+      return at;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      Chunk* chunk = &function->chunk;
+      size_t at = reserve(layout, sizeof(ObjFunction), _Alignof(ObjFunction));
+      size_t code = reserve(layout, chunk->count, 1);
+      size_t lines = reserve(layout, chunk->lineCount * sizeof(LineRun),
+                             _Alignof(LineRun));
+      size_t constants = reserve(layout,
+                                 chunk->constants.count * sizeof(Value),
+                                 _Alignof(Value));
+      size_t inlines = reserve(layout,
+                               chunk->inlineCount * sizeof(InlineFrame),
+                               _Alignof(InlineFrame));
+      if (bytes == NULL) return at;
+
+      // Its call count and what the JIT made of it stay behind.
+      ObjFunction* copy = (ObjFunction*)(bytes + at);
+      copy->arity = function->arity;
+      copy->upvalueCount = function->upvalueCount;
+      copy->maxSlots = function->maxSlots;
+      pointTo(layout, &copy->name, (Obj*)function->name);
+      pointTo(layout, &copy->closure, (Obj*)function->closure);
+
+      Chunk* target = &copy->chunk;
+      target->count = target->capacity = chunk->count;
+      memcpy(bytes + code, chunk->code, chunk->count);
+      relocate(layout, &target->code, code);
+      target->lineCount = target->lineCapacity = chunk->lineCount;
+      memcpy(bytes + lines, chunk->lines, chunk->lineCount * sizeof(LineRun));
+      relocate(layout, &target->lines, lines);
+
+      target->constants.count = chunk->constants.count;
+      target->constants.capacity = chunk->constants.count;
+      Value* values = (Value*)(bytes + constants);
+      for (int i = 0; i < chunk->constants.count; i++) {
+        copyValue(layout, &values[i], chunk->constants.values[i]);
+      }
+      relocate(layout, &target->constants.values, constants);
+
+      target->inlineCount = target->inlineCapacity = chunk->inlineCount;
+      InlineFrame* frames = (InlineFrame*)(bytes + inlines);
+      for (int i = 0; i < chunk->inlineCount; i++) {
+        frames[i].line = chunk->inlines[i].line;
+        frames[i].caller = chunk->inlines[i].caller;
+        pointTo(layout, &frames[i].name, (Obj*)chunk->inlines[i].name);
+      }
+      relocate(layout, &target->inlines, inlines);
+      return at;
+    }
+    case OBJ_NATIVE: {
+      ObjNative* native = (ObjNative*)object;
+      size_t at = reserve(layout, sizeof(ObjNative), _Alignof(ObjNative));
+      if (bytes == NULL) return at;
+
+      ObjNative* copy = (ObjNative*)(bytes + at);
+      copy->arity = native->arity;
+      copy->pure = native->pure;
+      pointTo(layout, &copy->name, (Obj*)native->name);
+      return at;
+    }
+    case OBJ_STRING: {
+      ObjString* string = (ObjString*)object;
+      size_t at = reserve(layout, sizeof(ObjString), _Alignof(ObjString));
+      size_t chars = reserve(layout, string->length + 1, 1);
+      if (bytes == NULL) return at;
+
+      ObjString* copy = (ObjString*)(bytes + at);
+      copy->length = string->length;
+      copy->hash = string->hash;
+      memcpy(bytes + chars, string->chars, string->length + 1);
+      relocate(layout, &copy->chars, chars);
+      return at;
+    }
+    case OBJ_UPVALUE: {
+      // Nothing is running, so every upvalue is closed.
+      ObjUpvalue* upvalue = (ObjUpvalue*)object;
+      size_t at = reserve(layout, sizeof(ObjUpvalue), _Alignof(ObjUpvalue));
+      if (bytes == NULL) return at;
+
+      ObjUpvalue* copy = (ObjUpvalue*)(bytes + at);
+      copyValue(layout, &copy->closed, upvalue->closed);
+      relocate(layout, &copy->location, at + offsetof(ObjUpvalue, closed));
+      return at;
+    }
+  }
+  return 0;
+}
+
+static void layOutArray(Layout* layout, SnapshotArray* array,
+                        ValueArray* values) {
+  size_t at = reserve(layout, values->count * sizeof(Value), _Alignof(Value));
+  if (layout->bytes == NULL) return;
+
+  array->values = at;
+  array->count = (uint64_t)values->count;
+  Value* slots = (Value*)(layout->bytes + at);
+  for (int i = 0; i < values->count; i++) {
+    copyValue(layout, &slots[i], values->values[i]);
+  }
+}
+
+static void layOutTable(Layout* layout, SnapshotTable* table, Table* entries) {
+  size_t at = reserve(layout, entries->capacity * sizeof(Entry),
+                      _Alignof(Entry));
+  if (layout->bytes == NULL) return;
+
+  table->entries = at;
+  table->count = (uint32_t)entries->count;
+  table->capacity = (uint32_t)entries->capacity;
+  Entry* slots = (Entry*)(layout->bytes + at);
+  for (int i = 0; i < entries->capacity; i++) {
+    pointTo(layout, &slots[i].key, (Obj*)entries->entries[i].key);
+    copyValue(layout, &slots[i].value, entries->entries[i].value);
+  }
+}
+
+// Lay out the whole snapshot but the relocations, returning its size
+static size_t layOutSnapshot(Layout* layout) {
+  int count = layout->objects.count;
+  uint8_t* bytes = layout->bytes;
+  SnapshotHeader* header = (SnapshotHeader*)bytes;
+  layout->position = sizeof(SnapshotHeader);
+
+  int nativeCount = 0;
+  for (int i = 0; i < count; i++) {
+    Obj* object = layout->objects.objects[i];
+    layout->offsets[i] = layOutObject(layout, object);
+    if (object->type == OBJ_NATIVE) nativeCount++;
+    if (bytes == NULL) continue;
+
+    // The buffer starts out zeroed, and each field is set by itself so the
+    // padding between them stays that way.
+    ((Obj*)(bytes + layout->offsets[i]))->type = object->type;
+  }
+
+  size_t objects = reserve(layout, count * sizeof(uint64_t),
+                           _Alignof(uint64_t));
+  size_t natives = reserve(layout, nativeCount * sizeof(uint64_t),
+                           _Alignof(uint64_t));
+  SnapshotHeader unused;
+  if (bytes == NULL) header = &unused;
+  layOutArray(layout, &header->globalNames, &vm.globalNames);
+  layOutArray(layout, &header->globalValues, &vm.globalValues);
+  layOutTable(layout, &header->globalSlots, &vm.globalSlots);
+  layOutTable(layout, &header->strings, &vm.strings);
+  if (bytes == NULL) return layout->position;
+
+  uint64_t* objectOffsets = (uint64_t*)(bytes + objects);
+  uint64_t* nativeOffsets = (uint64_t*)(bytes + natives);
+  for (int i = 0; i < count; i++) {
+    objectOffsets[i] = layout->offsets[i];
+    if (layout->objects.objects[i]->type == OBJ_NATIVE) {
+      *nativeOffsets++ = layout->offsets[i];
+    }
+  }
+
+  memcpy(header->magic, snapshotMagic, sizeof(snapshotMagic));
+  header->version = SNAPSHOT_VERSION;
+  header->lastOpcode = OP_CALL_NATIVE;
+  header->layout = IMAGE_LAYOUT;
+  header->byteOrder = BYTE_ORDER_MARK;
+  header->nativeCount = (uint32_t)nativeCount;
+  header->objectLayout = SNAPSHOT_LAYOUT;
+  header->objects = objects;
+  header->objectCount = (uint64_t)count;
+  header->initString = offsetOf(layout, (Obj*)vm.initString);
+  header->natives = natives;
+  return layout->position;
+}
+
+bool writeSnapshot(const char* path) {
+  if (vm.frameCount > 0 || vm.openUpvalues != NULL) return false;
+  collectGarbage();
+
+  Layout layout = {NULL, 0, {NULL, 0, NULL, 0}, NULL, NULL, 0, 0};
+  for (int i = 0; i < vm.strings.capacity; i++) {
+    numberObject(&layout.objects, (Obj*)vm.strings.entries[i].key);
+  }
+  for (int i = 0; i < vm.globalValues.count; i++) {
+    numberValue(&layout.objects, vm.globalNames.values[i]);
+    numberValue(&layout.objects, vm.globalValues.values[i]);
+  }
+  numberObject(&layout.objects, (Obj*)vm.initString);
+  for (int i = 0; i < layout.objects.count; i++) {
+    numberChildren(&layout.objects, layout.objects.objects[i]);
+  }
+
+  layout.offsets = malloc((layout.objects.count + 1) * sizeof(size_t));
+  if (layout.offsets == NULL) exit(1);
+  size_t size = layOutSnapshot(&layout);
+  layout.bytes = calloc(size, 1);
+  if (layout.bytes == NULL) exit(1);
+  layOutSnapshot(&layout);
+
+  // The relocations go last, now there are no more of them.
+  size_t relocations = alignTo(size, _Alignof(uint64_t));
+  size_t total = relocations + layout.relocationCount * sizeof(uint64_t);
+  uint8_t* bytes = realloc(layout.bytes, total);
+  if (bytes == NULL) exit(1);
+  memset(bytes + size, 0, relocations - size);
+  memcpy(bytes + relocations, layout.relocations,
+         layout.relocationCount * sizeof(uint64_t));
+  SnapshotHeader* header = (SnapshotHeader*)bytes;
+  header->relocations = relocations;
+  header->relocationCount = layout.relocationCount;
+  header->size = total;
+  header->checksum = snapshotChecksum(bytes, total);
+
+  bool written = writeFile(path, bytes, total);
+  free(bytes);
+  free(layout.offsets);
+  free(layout.relocations);
+  freeNumbering(&layout.objects);
+  return written;
+}
+
+static bool validArray(const SnapshotArray* array, size_t size) {
+  return aligned(array->values, _Alignof(Value)) &&
+         array->count <= INT32_MAX &&
+         fits(size, array->values, array->count * sizeof(Value));
+}
+
+static bool validTable(const SnapshotTable* table, size_t size) {
+  return aligned(table->entries, _Alignof(Entry)) &&
+         table->capacity <= INT32_MAX &&
+         (table->capacity & (table->capacity - 1)) == 0 &&
+         table->count <= table->capacity &&
+         fits(size, table->entries, (uint64_t)table->capacity * sizeof(Entry));
+}
+
+static bool validObject(uint64_t offset, size_t objectSize, size_t size) {
+  return offset != 0 && aligned(offset, _Alignof(Obj)) &&
+         fits(size, offset, objectSize);
+}
+
+// Check everything restoring will follow lies inside the file
+static bool validSnapshot(const uint8_t* bytes, size_t size) {
+  const SnapshotHeader* header = (const SnapshotHeader*)bytes;
+  if (memcmp(header->magic, snapshotMagic, sizeof(snapshotMagic)) != 0 ||
+      header->version != SNAPSHOT_VERSION ||
+      header->lastOpcode != OP_CALL_NATIVE ||
+      header->layout != IMAGE_LAYOUT ||
+      header->byteOrder != BYTE_ORDER_MARK ||
+      header->objectLayout != SNAPSHOT_LAYOUT || header->size != size ||
+      header->checksum != snapshotChecksum(bytes, size) ||
+      !validObject(header->initString, sizeof(ObjString), size) ||
+      !aligned(header->objects, _Alignof(uint64_t)) ||
+      header->objectCount > size ||
+      !fits(size, header->objects, header->objectCount * sizeof(uint64_t)) ||
+      !aligned(header->natives, _Alignof(uint64_t)) ||
+      !fits(size, header->natives,
+            (uint64_t)header->nativeCount * sizeof(uint64_t)) ||
+      !aligned(header->relocations, _Alignof(uint64_t)) ||
+      header->relocationCount > size ||
+      !fits(size, header->relocations,
+            header->relocationCount * sizeof(uint64_t)) ||
+      !validArray(&header->globalNames, size) ||
+      !validArray(&header->globalValues, size) ||
+      header->globalNames.count != header->globalValues.count ||
+      !validTable(&header->globalSlots, size) ||
+      !validTable(&header->strings, size)) {
+    return false;
+  }
+
+  const uint64_t* objects = (const uint64_t*)(bytes + header->objects);
+  for (uint64_t i = 0; i < header->objectCount; i++) {
+    if (!validObject(objects[i], sizeof(Obj), size)) return false;
+  }
+  const uint64_t* natives = (const uint64_t*)(bytes + header->natives);
+  for (uint32_t i = 0; i < header->nativeCount; i++) {
+    if (!validObject(natives[i], sizeof(ObjNative), size)) return false;
+  }
+
+  // Each pointer must be one that restoring will leave inside the file.
+  const uint64_t* relocations =
+      (const uint64_t*)(bytes + header->relocations);
+  for (uint64_t i = 0; i < header->relocationCount; i++) {
+    uint64_t offset = relocations[i];
+    if (!aligned(offset, _Alignof(uintptr_t)) ||
+        offset < sizeof(SnapshotHeader) ||
+        !fits(header->relocations, offset, sizeof(uintptr_t)) ||
+        (*(const uintptr_t*)(bytes + offset) & 0xffffffffffffu) > size) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Find the native of the fresh VM with the name of one from a snapshot
+static ObjNative* findNative(ObjString* name) {
+  for (int i = 0; i < vm.globalValues.count; i++) {
+    Value value = vm.globalValues.values[i];
+    if (!IS_NATIVE(value)) continue;
+    ObjString* candidate = AS_NATIVE(value)->name;
+    if (candidate->length == name->length &&
+        memcmp(candidate->chars, name->chars, name->length) == 0) {
+      return AS_NATIVE(value);
+    }
+  }
+  return NULL;
+}
+
+static Value* copyValues(const uint8_t* bytes, const SnapshotArray* array,
+                         ValueArray* values) {
+  Value* copy = ALLOCATE(Value, array->count);
+  memcpy(copy, bytes + array->values, array->count * sizeof(Value));
+  values->count = values->capacity = (int)array->count;
+  return copy;
+}
+
+bool restoreSnapshot(const char* path) {
+  if (vm.frameCount > 0 || imagesLoaded() || snapshots != NULL) return false;
+
+  size_t size = 0;
+  uint8_t* bytes = mapFile(path, sizeof(SnapshotHeader), &size);
+  if (bytes == NULL) return false;
+  if (!validSnapshot(bytes, size)) {
+    munmap(bytes, size);
+    return false;
+  }
+
+  const SnapshotHeader* header = (const SnapshotHeader*)bytes;
+  const uint64_t* relocations =
+      (const uint64_t*)(bytes + header->relocations);
+  for (uint64_t i = 0; i < header->relocationCount; i++) {
+    *(uintptr_t*)(bytes + relocations[i]) += (uintptr_t)bytes;
+  }
+
+  // The natives keep what they were saved with but their code, and how this
+  // build declares them.
+  const uint64_t* natives = (const uint64_t*)(bytes + header->natives);
+  for (uint32_t i = 0; i < header->nativeCount; i++) {
+    ObjNative* native = (ObjNative*)(bytes + natives[i]);
+    ObjNative* fresh = findNative(native->name);
+    if (fresh == NULL) {
+      munmap(bytes, size);
+      return false;
+    }
+    native->function = fresh->function;
+    native->arity = fresh->arity;
+    native->pure = fresh->pure;
+  }
+
+  // The VM's own arrays keep growing after this, so they move to the heap.
+  // Allocating them may collect the fresh VM's objects, but nothing of the
+  // snapshot's, which the collector does not know about yet.
+  ValueArray names;
+  ValueArray values;
+  names.values = copyValues(bytes, &header->globalNames, &names);
+  values.values = copyValues(bytes, &header->globalValues, &values);
+  Table tables[2];
+  const SnapshotTable* saved[2] = {&header->globalSlots, &header->strings};
+  for (int i = 0; i < 2; i++) {
+    tables[i].count = (int)saved[i]->count;
+    tables[i].capacity = (int)saved[i]->capacity;
+    tables[i].entries = ALLOCATE(Entry, tables[i].capacity);
+    memcpy(tables[i].entries, bytes + saved[i]->entries,
+           tables[i].capacity * sizeof(Entry));
+  }
+
+  // What initVM() made is left for the collector.
+  freeValueArray(&vm.globalNames);
+  freeValueArray(&vm.globalValues);
+  freeInstance(&vm.globalSlots);
+  freeInstance(&vm.strings);
+  vm.globalNames = names;
+  vm.globalValues = values;
+  vm.globalSlots = tables[0];
+  vm.strings = tables[1];
+  vm.initString = (ObjString*)(bytes + header->initString);
+
+  Snapshot* snapshot = malloc(sizeof(Snapshot));
+  if (snapshot == NULL) exit(1);
+  snapshot->bytes = bytes;
+  snapshot->size = size;
+  snapshot->objects = (const uint64_t*)(bytes + header->objects);
+  snapshot->objectCount = header->objectCount;
+  snapshot->next = snapshots;
+  snapshots = snapshot;
+  return true;
+}
+
+void sweepRestored() {
+  for (Snapshot* snapshot = snapshots; snapshot != NULL;
+       snapshot = snapshot->next) {
+    for (uint64_t i = 0; i < snapshot->objectCount; i++) {
+      Obj* object = (Obj*)(snapshot->bytes + snapshot->objects[i]);
+#ifdef BASELINE_JIT
+      if (!object->isMarked && object->type == OBJ_FUNCTION) {
+        jitFree((ObjFunction*)object);
+      }
+#endif
+      object->isMarked = false;
+    }
+  }
+}
+
+void freeSnapshots() {
+  while (snapshots != NULL) {
+    Snapshot* snapshot = snapshots;
+    snapshots = snapshot->next;
+#ifdef BASELINE_JIT
+    for (uint64_t i = 0; i < snapshot->objectCount; i++) {
+      Obj* object = (Obj*)(snapshot->bytes + snapshot->objects[i]);
+      if (object->type == OBJ_FUNCTION) jitFree((ObjFunction*)object);
+    }
+#endif
+    munmap(snapshot->bytes, snapshot->size);
+    free(snapshot);
+  }
+}
@@ -0,0 +1,28 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include "common.h"
+
+// Write the whole heap of the VM, which must have nothing running, to path
+// as a snapshot: its globals, interned strings and every object they reach.
+// Returns false if it could not be written.
+bool writeSnapshot(const char* path);
+
+// Make the VM, fresh from initVM() and any defineNatives(), the one a
+// snapshot was written from. Its natives are matched to the VM's own by
+// name. Returns false, leaving the VM as it was, if the file is missing or
+// malformed, was written by a different build, or needs a native the VM
+// does not have.
+bool restoreSnapshot(const char* path);
+
+// Clear the marks a collection left on the objects of restored snapshots,
+// which are in no page of the heap, freeing the compiled code of the
+// functions it did not reach. Their memory goes with the snapshot.
+void sweepRestored();
+
+
+// Unmap every restored snapshot. Only for when the VM is done with all its
+// objects.
+void freeSnapshots();
+
+#endif
@@ -2,76 +2,281 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <time.h>
 #include "compiler.h"
+#include "image.h"
+#include "jit.h"
 #include "memory.h"
+#include "snapshot.h"
+
+#ifdef DEBUG_TRACE_EXECUTION
+#include "debug.h"
+#endif
+
 VM vm;
+VMOptions vmOptions = {DEPTH_DEFAULT, NURSERY_DEFAULT, GC_WORK_DEFAULT, 0,
+                        false, false};
+
+// The calls check each native's arity against coreNatives, so the natives
+// themselves have no use for argCount.
+static bool clockNative(int argCount, Value* args, Value* result) {
+  (void)argCount;
+  (void)args;
+  *result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+  return true;
+}
+
+static bool absNative(int argCount, Value* args, Value* result) {
+  (void)argCount;
+  if (!IS_NUMBER(args[0])) return nativeError("Argument must be a number.");
+  double x = AS_NUMBER(args[0]);
+  *result = NUMBER_VAL(x < 0 ? -x : x + 0);  // Adding 0 turns -0 into 0.
+  return true;
+}
+
+static bool minNative(int argCount, Value* args, Value* result) {
+  (void)argCount;
+  if (!IS_NUMBER(args[0]) || !IS_NUMBER(args[1])) {
+    return nativeError("Arguments must be numbers.");
+  }
+  *result = AS_NUMBER(args[1]) < AS_NUMBER(args[0]) ? args[1] : args[0];
+  return true;
+}
 
-static Value clockNative(int argCount, Value* args) {
-  return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+static bool maxNative(int argCount, Value* args, Value* result) {
+  (void)argCount;
+  if (!IS_NUMBER(args[0]) || !IS_NUMBER(args[1])) {
+    return nativeError("Arguments must be numbers.");
+  }
+  *result = AS_NUMBER(args[1]) > AS_NUMBER(args[0]) ? args[1] : args[0];
+  return true;
 }
 
+static const NativeDef coreNatives[] = {
+    {"clock", clockNative, 0, false},
+    {"abs", absNative, 1, true},
+    {"min", minNative, 2, true},
+    {"max", maxNative, 2, true},
+    {NULL, NULL, 0, false},
+};
+
 static void resetStack() {
   vm.stackTop = vm.stack;
   vm.frameCount = 0;
   vm.openUpvalues = NULL;
 }
 
-static void runtimeError(const char* format, ...) {
+static void printFrame(CallFrame* frame) {
+  ObjFunction* function = frame->closure->function;
+  size_t instruction = frame->ip - function->chunk.code - 1;
+  int location = locationAt(&function->chunk, (int)instruction);
+  // Code inlined from other actions reports them as frames of their own.
+  while (location < 0) {
+    InlineFrame* inlined = &function->chunk.inlines[-1 - location];
+    fprintf(stderr, "[line %d] in %s()\n", inlined->line,
+            inlined->name->chars);
+    location = inlined->caller;
+  }
+  fprintf(stderr, "[line %d] in ", location);
+  if (function->name == NULL) {
+    fprintf(stderr, "script\n");
+  } else {
+    fprintf(stderr, "%s()\n", function->name->chars);
+  }
+}
+
+void runtimeError(const char* format, ...) {
   va_list args;
   va_start(args, format);
   vfprintf(stderr, format, args);
   va_end(args);
   fputs("\n", stderr);
 
+  // A deep stack is shown by its innermost and outermost frames.
+  int elided = vm.frameCount - 2 * TRACE_FRAMES;
   for (int i = vm.frameCount - 1; i >= 0; i--) {
-    CallFrame* frame = &vm.frames[i];
-    ObjFunction* function = frame->closure->function;
-    size_t instruction = frame->ip - function->chunk.code - 1;
-    fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
-    if (function->name == NULL) {
-      fprintf(stderr, "script\n");
-    } else {
-      fprintf(stderr, "%s()\n", function->name->chars);
+    if (elided > 0 && i == TRACE_FRAMES - 1) {
+      fprintf(stderr, "... %d more frames ...\n", elided);
+    }
+    if (elided > 0 && i >= TRACE_FRAMES && i < vm.frameCount - TRACE_FRAMES) {
+      continue;
     }
+    printFrame(vm.frames[i]);
   }
 
   resetStack();
 }
 
-static void defineNative(const char* name, NativeFn function) {
-  push(OBJ_VAL(copyString(name, (int)strlen(name))));
-  push(OBJ_VAL(newNative(function)));
-    setInstance(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-  pop();
+// Record why the native being called failed, for the caller to report as a
+// runtime error once the native returns the false this gives back
+bool nativeError(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  vsnprintf(vm.nativeMessage, sizeof(vm.nativeMessage), format, args);
+  va_end(args);
+  return false;
+}
+
+// Return the index of the global named by the string, reserving an undefined
+// slot for it on first use
+int globalSlot(ObjString* name) {
+  Value index;
+  if (getInstance(&vm.globalSlots, name, &index)) return (int)AS_NUMBER(index);
+
+  push(OBJ_VAL(name));
+  int slot = vm.globalValues.count;
+  writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+  writeValueArray(&vm.globalNames, OBJ_VAL(name));
+  setInstance(&vm.globalSlots, name, NUMBER_VAL(slot));
   pop();
+  return slot;
+}
+
+// Bind each native in the table to a global of its name
+void defineNatives(const NativeDef* natives) {
+  for (const NativeDef* def = natives; def->name != NULL; def++) {
+    ObjString* name = copyString(def->name, (int)strlen(def->name));
+    push(OBJ_VAL(name));
+    push(OBJ_VAL(newNative(def->function, name, def->arity, def->pure)));
+    int slot = globalSlot(name);
+    vm.globalValues.values[slot] = vm.stackTop[-1];
+    pop();
+    pop();
+  }
+}
+
+// Where the C stack stood when the VM was made, and how far below that
+// compiled code may nest frames on it
+static uintptr_t nativeStackBase;
+static size_t nativeStackRoom;
+
+// Measure the C stack from the caller of initVM(). Only half the limit is
+// given to nesting, leaving the rest for what lies above the caller and for
+// the frames the last nested call makes before it checks again.
+static void measureNativeStack() {
+  char base;
+  nativeStackBase = (uintptr_t)&base;
+  size_t size = NATIVE_STACK_DEFAULT;
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_STACK, &limit) == 0 &&
+      limit.rlim_cur != RLIM_INFINITY) {
+    size = (size_t)limit.rlim_cur;
+  }
+  nativeStackRoom = size / 2;
+}
+
+bool nativeStackHasRoom() {
+  char here;
+  uintptr_t top = (uintptr_t)&here;
+  size_t used = top < nativeStackBase ? nativeStackBase - top
+                                      : top - nativeStackBase;
+  return used < nativeStackRoom;
+}
+
+// Move the value stack to a bigger block holding at least needed values,
+// repointing the frames and open upvalues that point into it
+static void growStack(int needed) {
+  int capacity = vm.stackCapacity < STACK_INITIAL ? STACK_INITIAL
+                                                  : vm.stackCapacity;
+  while (capacity < needed) capacity *= 2;
+  Value* stack = malloc(sizeof(Value) * capacity);
+  if (stack == NULL) exit(1);
+
+  if (vm.stack != NULL) {
+    memcpy(stack, vm.stack, sizeof(Value) * (vm.stackTop - vm.stack));
+  }
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i]->slots = stack + (vm.frames[i]->slots - vm.stack);
+  }
+  for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->location = stack + (upvalue->location - vm.stack);
+  }
+  vm.stackTop = stack + (vm.stackTop - vm.stack);
+
+  free(vm.stack);
+  vm.stack = stack;
+  vm.stackCapacity = capacity;
+  vm.stackLimit = stack + capacity - STACK_SLACK;
+}
+
+// Make sure a function entered with the given window has room for all of it
+static inline void reserveStack(Value* slots, ObjFunction* function) {
+  if (slots + function->maxSlots > vm.stackLimit) {
+    growStack((int)(slots - vm.stack) + function->maxSlots + STACK_SLACK);
+  }
+}
+
+// Double the frame table up to the maximum depth, backing the new part with
+// one fresh block
+static void growFrames() {
+  int oldCapacity = vm.frameCapacity;
+  vm.frameCapacity = oldCapacity < FRAMES_INITIAL ? FRAMES_INITIAL
+                                                  : oldCapacity * 2;
+  if (vm.frameCapacity > vmOptions.maxDepth) {
+    vm.frameCapacity = vmOptions.maxDepth;
+  }
+  vm.frames = realloc(vm.frames, sizeof(CallFrame*) * vm.frameCapacity);
+  CallFrame* block = malloc(sizeof(CallFrame) * (vm.frameCapacity - oldCapacity));
+  if (vm.frames == NULL || block == NULL) exit(1);
+  for (int i = oldCapacity; i < vm.frameCapacity; i++) {
+    vm.frames[i] = &block[i - oldCapacity];
+  }
 }
 
 void initVM() {
+  measureNativeStack();
+  vm.stack = NULL;
+  vm.stackTop = NULL;
+  vm.stackCapacity = 0;
+  vm.openUpvalues = NULL;
+  growStack(STACK_INITIAL);
+  vm.frames = NULL;
+  vm.frameCapacity = 0;
   resetStack();
-  vm.objects = NULL;
+  vm.remembered = NULL;
+  vm.rememberedCount = 0;
+  vm.rememberedCapacity = 0;
   vm.bytesAllocated = 0;
   vm.nextGC = 1024 * 1024;
+  vm.gcPhase = GC_IDLE;
 
   vm.grayCount = 0;
   vm.grayCapacity = 0;
   vm.grayStack = NULL;
 
-    initInstance(&vm.globals);
+    initInstance(&vm.globalSlots);
     initInstance(&vm.strings);
+  initValueArray(&vm.globalNames);
+  initValueArray(&vm.globalValues);
 
   vm.initString = NULL;
   vm.initString = copyString("init", 4);
 
-  defineNative("clock", clockNative);
+  defineNatives(coreNatives);
 }
 
 void freeVM() {
-    freeInstance(&vm.globals);
+    freeInstance(&vm.globalSlots);
     freeInstance(&vm.strings);
+  freeValueArray(&vm.globalNames);
+  freeValueArray(&vm.globalValues);
   vm.initString = NULL;
   freeObjects();
+  freeImages();
+  freeSnapshots();
+
+  // growFrames() doubled the table each time until it reached the maximum
+  // depth, so its blocks start at index 0 and at every earlier capacity.
+  for (int start = 0; start < vm.frameCapacity;
+       start = start == 0 ? FRAMES_INITIAL : start * 2) {
+    free(vm.frames[start]);
+  }
+  free(vm.frames);
+  free(vm.stack);
 }
 
 void push(Value value) {
@@ -93,30 +298,79 @@ static bool call(ObjClosure* closure, int argCount) {
     return false;
   }
 
-  if (vm.frameCount == FRAMES_MAX) {
-    runtimeError("Stack overflow.");
-    return false;
+  if (vm.frameCount == vm.frameCapacity) {
+    if (vm.frameCount == vmOptions.maxDepth) {
+      runtimeError("Stack overflow.");
+      return false;
+    }
+    growFrames();
   }
 
-  CallFrame* frame = &vm.frames[vm.frameCount++];
+  CallFrame* frame = vm.frames[vm.frameCount++];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
   frame->slots = vm.stackTop - argCount - 1;
+  reserveStack(frame->slots, closure->function);
+
+#ifdef BASELINE_JIT
+  ObjFunction* function = closure->function;
+  if (++function->callCount == jitOptions.threshold) jitCompile(function);
+#endif
+  return true;
+}
+
+// Call a closure in tail position by replacing the current frame: its
+// upvalues are closed and the callee and arguments slide down over its
+// stack window
+static bool tailCall(ObjClosure* closure, int argCount) {
+  if (argCount != closure->function->arity) {
+    runtimeError("Expected %d arguments but got %d.", closure->function->arity,
+                 argCount);
+    return false;
+  }
+
+  CallFrame* frame = vm.frames[vm.frameCount - 1];
+  closeUpvalues(frame->slots);
+  memmove(frame->slots, vm.stackTop - argCount - 1,
+          sizeof(Value) * (argCount + 1));
+  vm.stackTop = frame->slots + argCount + 1;
+  frame->closure = closure;
+  frame->ip = closure->function->chunk.code;
+  reserveStack(frame->slots, closure->function);
+
+#ifdef BASELINE_JIT
+  ObjFunction* function = closure->function;
+  if (++function->callCount == jitOptions.threshold) jitCompile(function);
+#endif
   return true;
 }
 
-static bool callValue(Value callee, int argCount) {
+// Call a native on the arguments at the top of the stack, replacing them
+// and the callee below them with its result
+bool callNative(ObjNative* native, int argCount) {
+  if (native->arity >= 0 && argCount != native->arity) {
+    runtimeError("Expected %d arguments but got %d.", native->arity,
+                 argCount);
+    return false;
+  }
+
+  Value result;
+  if (!native->function(argCount, vm.stackTop - argCount, &result)) {
+    runtimeError("%s", vm.nativeMessage);
+    return false;
+  }
+  vm.stackTop -= argCount + 1;
+  push(result);
+  return true;
+}
+
+bool callValue(Value callee, int argCount) {
   if (IS_OBJ(callee)) {
     switch (OBJ_TYPE(callee)) {
       case OBJ_CLOSURE:
         return call(AS_CLOSURE(callee), argCount);
-      case OBJ_NATIVE: {
-        NativeFn native = AS_NATIVE(callee);
-        Value result = native(argCount, vm.stackTop - argCount);
-        vm.stackTop -= argCount + 1;
-        push(result);
-        return true;
-      }
+      case OBJ_NATIVE:
+        return callNative(AS_NATIVE(callee), argCount);
       default:
         break;  // Non-callable object type.
     }
@@ -125,7 +379,15 @@ static bool callValue(Value callee, int argCount) {
   return false;
 }
 
-static ObjUpvalue* captureUpvalue(Value* local) {
+// Like callValue, except that a closure takes over the caller's frame
+// instead of pushing its own. Other callees leave their result on the stack
+// as usual.
+bool tailCallValue(Value callee, int argCount) {
+  if (IS_CLOSURE(callee)) return tailCall(AS_CLOSURE(callee), argCount);
+  return callValue(callee, argCount);
+}
+
+ObjUpvalue* captureUpvalue(Value* local) {
   ObjUpvalue* prevUpvalue = NULL;
   ObjUpvalue* upvalue = vm.openUpvalues;
   while (upvalue != NULL && upvalue->location > local) {
@@ -149,258 +411,760 @@ static ObjUpvalue* captureUpvalue(Value* local) {
   return createdUpvalue;
 }
 
-static void closeUpvalues(Value* last) {
+void closeUpvalues(Value* last) {
   while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
     ObjUpvalue* upvalue = vm.openUpvalues;
-    upvalue->closed = *upvalue->location;
+    STORE_FIELD(upvalue->closed, *upvalue->location);
     upvalue->location = &upvalue->closed;
+    writeBarrier((Obj*)upvalue, upvalue->closed);
     vm.openUpvalues = upvalue->next;
   }
 }
 
 
-static bool isFalsy(Value value) {
+bool isFalsy(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
+void concatenate() {
   ObjString* b = AS_STRING(peek(0));
   ObjString* a = AS_STRING(peek(1));
-
-  int length = a->length + b->length;
-  char* chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
-
-  ObjString* result = takeString(chars, length);
+  ObjString* result = joinStrings(a, b);
   pop();
   pop();
   push(OBJ_VAL(result));
 }
 
-static InterpretResult run() {
-  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+// Execute frames until the one at index baseFrame returns. The top-level call
+// passes 0; the JIT re-enters with the index of a callee it cannot run natively
+InterpretResult run(int baseFrame) {
+  CallFrame* frame;
+  register uint8_t* ip;
+  register Value* slots;
+  register Value* constants;
+
+#define LOAD_FRAME()                                              \
+  do {                                                            \
+    frame = vm.frames[vm.frameCount - 1];                         \
+    ip = frame->ip;                                               \
+    slots = frame->slots;                                         \
+    constants = frame->closure->function->chunk.constants.values; \
+  } while (false)
+#define STORE_FRAME() (frame->ip = ip)
 
-#define READ_BYTE() (*frame->ip++)
-#define READ_SHORT() \
-  (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() \
-  (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_LONG()                                                 \
+  (ip += 4, ((uint32_t)ip[-4] << 24) | ((uint32_t)ip[-3] << 16) | \
+                ((uint32_t)ip[-2] << 8) | ip[-1])
+#define READ_CONSTANT() (constants[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(valueType, op)                      \
+#define GLOBAL_NAME(slot) AS_CSTRING(vm.globalNames.values[slot])
+#define RUNTIME_ERROR(...)          \
+  do {                              \
+    STORE_FRAME();                  \
+    runtimeError(__VA_ARGS__);      \
+    return INTERPRET_RUNTIME_ERROR; \
+  } while (false)
+#define BINARY_OP(valueType, op, quickened)           \
   do {                                                \
     if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-      runtimeError("Operands must be numbers.");      \
-      return INTERPRET_RUNTIME_ERROR;                 \
+      RUNTIME_ERROR("Operands must be numbers.");     \
     }                                                 \
+    ip[-1] = quickened;                               \
     double b = AS_NUMBER(pop());                      \
     double a = AS_NUMBER(pop());                      \
     push(valueType(a op b));                          \
   } while (false)
+// Fast path of a quickened instruction. When the guard fails the
+// instruction is rewritten back to its generic form and dispatched again.
+#define QUICK_OP(valueType, op, guard, generic)                      \
+  do {                                                               \
+    Value b = peek(0);                                               \
+    Value a = peek(1);                                               \
+    if (guard(a) && guard(b)) {                                      \
+      vm.stackTop[-2] = valueType(AS_NUMBER(a) op AS_NUMBER(b));     \
+      vm.stackTop--;                                                 \
+    } else {                                                         \
+      ip[-1] = generic;                                              \
+      ip--;                                                          \
+    }                                                                \
+  } while (false)
+#define READ_REGISTER() (slots[READ_BYTE()])
+#define STORE_DEST(value) (slots[dest] = (value))
+#define REGISTER_OP(valueType, op, readOperand, store)     \
+  do {                                                     \
+    Value a = READ_REGISTER();                             \
+    Value b = readOperand();                               \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                  \
+      RUNTIME_ERROR("Operands must be numbers.");          \
+    }                                                      \
+    store(valueType(AS_NUMBER(a) op AS_NUMBER(b)));        \
+  } while (false)
+#define REGISTER_ADD(readOperand, store)                                \
+  do {                                                                  \
+    Value a = READ_REGISTER();                                          \
+    Value b = readOperand();                                            \
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {                                 \
+      store(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));                   \
+    } else if (IS_STRING(a) && IS_STRING(b)) {                          \
+      push(a);                                                          \
+      push(b);                                                          \
+      concatenate();                                                    \
+      store(pop());                                                     \
+    } else {                                                            \
+      RUNTIME_ERROR("Operands must be two numbers or two strings.");    \
+    }                                                                   \
+  } while (false)
 
-  for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
-    }
-    printf("\n");
-    disassembleInstruction(
-        &frame->closure->function->chunk,
-        (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION()                                             \
+  do {                                                                  \
+    printf("          ");                                               \
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {          \
+      printf("[ ");                                                     \
+      printValue(*slot);                                                \
+      printf(" ]");                                                     \
+    }                                                                   \
+    printf("\n");                                                       \
+    disassembleInstruction(&frame->closure->function->chunk,            \
+                           (int)(ip - frame->closure->function->chunk.code)); \
+  } while (false)
+#else
+#define TRACE_INSTRUCTION() \
+  do {                      \
+  } while (false)
+#endif
+
+  // With COMPUTED_GOTO every handler ends in its own indirect jump through
+  // the label table, which gives the branch predictor one history per opcode
+  // instead of a single shared one for the switch.
+#ifdef COMPUTED_GOTO
+  // Opcodes without a handler go to op_UNKNOWN, and the entries below then
+  // override that default on purpose.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+  static void* dispatchTable[UINT8_COUNT] = {
+      [0 ... UINT8_MAX] = &&op_UNKNOWN,
+#define OPCODE(name) [name] = &&op_##name,
+      OPCODE(OP_CONSTANT)
+      OPCODE(OP_NIL)
+      OPCODE(OP_TRUE)
+      OPCODE(OP_FALSE)
+      OPCODE(OP_POP)
+      OPCODE(OP_GET_LOCAL)
+      OPCODE(OP_SET_LOCAL)
+      OPCODE(OP_GET_GLOBAL)
+      OPCODE(OP_DEFINE_GLOBAL)
+      OPCODE(OP_SET_GLOBAL)
+      OPCODE(OP_GET_UPVALUE)
+      OPCODE(OP_SET_UPVALUE)
+      OPCODE(OP_GET_ENCLOSING)
+      OPCODE(OP_SET_ENCLOSING)
+      OPCODE(OP_EQUAL)
+      OPCODE(OP_GREATER)
+      OPCODE(OP_LESS)
+      OPCODE(OP_ADD)
+      OPCODE(OP_SUBTRACT)
+      OPCODE(OP_MULTIPLY)
+      OPCODE(OP_DIVIDE)
+      OPCODE(OP_NOT)
+      OPCODE(OP_NEGATE)
+      OPCODE(OP_PRINT)
+      OPCODE(OP_JUMP)
+      OPCODE(OP_JUMP_IF_FALSE)
+      OPCODE(OP_LOOP)
+      OPCODE(OP_CALL)
+      OPCODE(OP_TAIL_CALL)
+      OPCODE(OP_CLOSURE)
+      OPCODE(OP_CLOSE_UPVALUE)
+      OPCODE(OP_RETURN)
+      OPCODE(OP_CONSTANT_LONG)
+      OPCODE(OP_GET_LOCAL_LONG)
+      OPCODE(OP_SET_LOCAL_LONG)
+      OPCODE(OP_GET_GLOBAL_LONG)
+      OPCODE(OP_DEFINE_GLOBAL_LONG)
+      OPCODE(OP_SET_GLOBAL_LONG)
+      OPCODE(OP_GET_UPVALUE_LONG)
+      OPCODE(OP_SET_UPVALUE_LONG)
+      OPCODE(OP_JUMP_LONG)
+      OPCODE(OP_JUMP_IF_FALSE_LONG)
+      OPCODE(OP_LOOP_LONG)
+      OPCODE(OP_CLOSURE_LONG)
+      OPCODE(OP_MOVE)
+      OPCODE(OP_LOADK)
+      OPCODE(OP_ADD_RR)
+      OPCODE(OP_ADD_RK)
+      OPCODE(OP_SUBTRACT_RR)
+      OPCODE(OP_SUBTRACT_RK)
+      OPCODE(OP_MULTIPLY_RR)
+      OPCODE(OP_MULTIPLY_RK)
+      OPCODE(OP_DIVIDE_RR)
+      OPCODE(OP_DIVIDE_RK)
+      OPCODE(OP_GREATER_RR)
+      OPCODE(OP_GREATER_RK)
+      OPCODE(OP_LESS_RR)
+      OPCODE(OP_LESS_RK)
+      OPCODE(OP_ADD_RRR)
+      OPCODE(OP_ADD_RRK)
+      OPCODE(OP_SUBTRACT_RRR)
+      OPCODE(OP_SUBTRACT_RRK)
+      OPCODE(OP_MULTIPLY_RRR)
+      OPCODE(OP_MULTIPLY_RRK)
+      OPCODE(OP_DIVIDE_RRR)
+      OPCODE(OP_DIVIDE_RRK)
+      OPCODE(OP_ADD_NUM)
+      OPCODE(OP_ADD_STR)
+      OPCODE(OP_SUBTRACT_NUM)
+      OPCODE(OP_MULTIPLY_NUM)
+      OPCODE(OP_DIVIDE_NUM)
+      OPCODE(OP_GREATER_NUM)
+      OPCODE(OP_LESS_NUM)
+      OPCODE(OP_CALL_NATIVE)
+#undef OPCODE
+  };
+#pragma GCC diagnostic pop
+
+#define DISPATCH()                                  \
+  do {                                              \
+    TRACE_INSTRUCTION();                            \
+    goto *dispatchTable[instruction = READ_BYTE()]; \
+  } while (false)
+#define CASE(name) op_##name:
+#define CASE_UNKNOWN op_UNKNOWN:
+#define NEXT() DISPATCH()
+#else
+#define CASE(name) case name:
+#define CASE_UNKNOWN default:
+#define NEXT() continue
 #endif
-    uint8_t instruction;
+
+  uint8_t instruction;
+  LOAD_FRAME();
+
+#ifdef COMPUTED_GOTO
+  DISPATCH();
+#else
+  for (;;) {
+    TRACE_INSTRUCTION();
     switch (instruction = READ_BYTE()) {
-      case OP_CONSTANT: {
-        Value constant = READ_CONSTANT();
-        push(constant);
-        break;
+#endif
+    CASE(OP_CONSTANT) {
+      Value constant = READ_CONSTANT();
+      push(constant);
+      NEXT();
+    }
+    CASE(OP_NIL) {
+      push(NIL_VAL);
+      NEXT();
+    }
+    CASE(OP_TRUE) {
+      push(BOOL_VAL(true));
+      NEXT();
+    }
+    CASE(OP_FALSE) {
+      push(BOOL_VAL(false));
+      NEXT();
+    }
+    CASE(OP_POP) {
+      pop();
+      NEXT();
+    }
+    CASE(OP_GET_LOCAL) {
+      uint8_t slot = READ_BYTE();
+      push(slots[slot]);
+      NEXT();
+    }
+    CASE(OP_SET_LOCAL) {
+      uint8_t slot = READ_BYTE();
+      slots[slot] = peek(0);
+      NEXT();
+    }
+    CASE(OP_GET_GLOBAL) {
+      uint8_t slot = READ_BYTE();
+      Value value = vm.globalValues.values[slot];
+      if (IS_UNDEFINED(value)) {
+        RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
       }
-      case OP_NIL:
-        push(NIL_VAL);
-        break;
-      case OP_TRUE:
-        push(BOOL_VAL(true));
-        break;
-      case OP_FALSE:
-        push(BOOL_VAL(false));
-        break;
-      case OP_POP:
-        pop();
-        break;
-      case OP_GET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        push(frame->slots[slot]);
-        break;
+      push(value);
+      NEXT();
+    }
+    CASE(OP_DEFINE_GLOBAL) {
+      uint8_t slot = READ_BYTE();
+      snapshotBarrier(vm.globalValues.values[slot]);
+      vm.globalValues.values[slot] = pop();
+      NEXT();
+    }
+    CASE(OP_SET_GLOBAL) {
+      uint8_t slot = READ_BYTE();
+      if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+        RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
       }
-      case OP_SET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        frame->slots[slot] = peek(0);
-        break;
+      snapshotBarrier(vm.globalValues.values[slot]);
+      vm.globalValues.values[slot] = vm.stackTop[-1];
+      NEXT();
+    }
+    CASE(OP_GET_UPVALUE) {
+      uint8_t slot = READ_BYTE();
+      push(*frame->closure->upvalues[slot]->location);
+      NEXT();
+    }
+    CASE(OP_SET_UPVALUE) {
+      ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+      snapshotBarrier(*upvalue->location);
+      STORE_FIELD(*upvalue->location, peek(0));
+      writeBarrier((Obj*)upvalue, peek(0));
+      NEXT();
+    }
+    CASE(OP_GET_ENCLOSING) {
+      uint8_t slot = READ_BYTE();
+      push(vm.frames[vm.frameCount - 2]->slots[slot]);
+      NEXT();
+    }
+    CASE(OP_SET_ENCLOSING) {
+      uint8_t slot = READ_BYTE();
+      vm.frames[vm.frameCount - 2]->slots[slot] = peek(0);
+      NEXT();
+    }
+    CASE(OP_EQUAL) {
+      Value b = pop();
+      Value a = pop();
+      push(BOOL_VAL(valuesEqual(a, b)));
+      NEXT();
+    }
+    CASE(OP_GREATER) {
+      BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM);
+      NEXT();
+    }
+    CASE(OP_LESS) {
+      BINARY_OP(BOOL_VAL, <, OP_LESS_NUM);
+      NEXT();
+    }
+    CASE(OP_ADD) {
+      if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+        ip[-1] = OP_ADD_STR;
+        concatenate();
+      } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+        ip[-1] = OP_ADD_NUM;
+        double b = AS_NUMBER(pop());
+        double a = AS_NUMBER(pop());
+        push(NUMBER_VAL(a + b));
+      } else {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
       }
-      case OP_GET_GLOBAL: {
-        ObjString* name = READ_STRING();
-        Value value;
-        if (!getInstance(&vm.globals, name, &value)) {
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        push(value);
-        break;
+      NEXT();
+    }
+    CASE(OP_SUBTRACT) {
+      BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM);
+      NEXT();
+    }
+    CASE(OP_MULTIPLY) {
+      BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM);
+      NEXT();
+    }
+    CASE(OP_DIVIDE) {
+      BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM);
+      NEXT();
+    }
+    CASE(OP_NOT) {
+      push(BOOL_VAL(isFalsy(pop())));
+      NEXT();
+    }
+    CASE(OP_NEGATE) {
+      if (!IS_NUMBER(peek(0))) {
+        RUNTIME_ERROR("Operand must be a number.");
       }
-      case OP_DEFINE_GLOBAL: {
-        ObjString* name = READ_STRING();
-          setInstance(&vm.globals, name, peek(0));
-        pop();
-        break;
+      push(NUMBER_VAL(-AS_NUMBER(pop())));
+      NEXT();
+    }
+    CASE(OP_PRINT) {
+      printValue(pop());
+      printf("\n");
+      NEXT();
+    }
+    CASE(OP_JUMP) {
+      uint16_t offset = READ_SHORT();
+      ip += offset;
+      NEXT();
+    }
+    CASE(OP_JUMP_IF_FALSE) {
+      uint16_t offset = READ_SHORT();
+      if (isFalsy(peek(0))) ip += offset;
+      NEXT();
+    }
+    CASE(OP_LOOP) {
+      uint16_t offset = READ_SHORT();
+#ifdef BASELINE_JIT
+      uint8_t* anchor = ip - 3;
+#endif
+      ip -= offset;
+#ifdef BASELINE_JIT
+      if (jitOptions.traceThreshold > 0) {
+        STORE_FRAME();
+        if (!traceLoop(frame, anchor)) return INTERPRET_RUNTIME_ERROR;
+        LOAD_FRAME();
       }
-      case OP_SET_GLOBAL: {
-        ObjString* name = READ_STRING();
-        if (setInstance(&vm.globals, name, peek(0))) {
-            deleteInstance(&vm.globals, name);
-          runtimeError("Undefined variable '%s'.", name->chars);
+#endif
+      NEXT();
+    }
+    CASE(OP_CALL) {
+      int argCount = READ_BYTE();
+      if (IS_NATIVE(peek(argCount))) ip[-2] = OP_CALL_NATIVE;
+      STORE_FRAME();
+#ifdef BASELINE_JIT
+      int frameCount = vm.frameCount;
+#endif
+      if (!callValue(peek(argCount), argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+#ifdef BASELINE_JIT
+      if (vm.frameCount > frameCount &&
+          vm.frames[vm.frameCount - 1]->closure->function->jitCode != NULL &&
+          jitCanNest()) {
+        if (!jitExecute(vm.frames[vm.frameCount - 1])) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        break;
       }
-      case OP_GET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        push(*frame->closure->upvalues[slot]->location);
-        break;
-      }
-      case OP_SET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        *frame->closure->upvalues[slot]->location = peek(0);
-        break;
+#endif
+      LOAD_FRAME();
+      NEXT();
+    }
+    CASE(OP_TAIL_CALL) {
+      int argCount = READ_BYTE();
+      STORE_FRAME();
+      Value callee = peek(argCount);
+      if (!tailCallValue(callee, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_EQUAL: {
-        Value b = pop();
-        Value a = pop();
-        push(BOOL_VAL(valuesEqual(a, b)));
-        break;
+#ifdef BASELINE_JIT
+      if (IS_CLOSURE(callee) && frame->closure->function->jitCode != NULL &&
+          jitCanNest()) {
+        if (!jitExecute(frame)) return INTERPRET_RUNTIME_ERROR;
+        if (vm.frameCount == baseFrame) return INTERPRET_OK;
       }
-      case OP_GREATER:
-        BINARY_OP(BOOL_VAL, >);
-        break;
-      case OP_LESS:
-        BINARY_OP(BOOL_VAL, <);
-        break;
-      case OP_ADD: {
-        if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-          concatenate();
-        } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-          double b = AS_NUMBER(pop());
-          double a = AS_NUMBER(pop());
-          push(NUMBER_VAL(a + b));
+#endif
+      LOAD_FRAME();
+      NEXT();
+    }
+    CASE(OP_CLOSURE) {
+      ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+      ObjClosure* closure = closureFor(function);
+      push(OBJ_VAL(closure));
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = READ_BYTE();
+        uint8_t index = READ_BYTE();
+        if (isLocal) {
+          STORE_FIELD(closure->upvalues[i], captureUpvalue(slots + index));
         } else {
-          runtimeError("Operands must be two numbers or two strings.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
-      }
-      case OP_SUBTRACT:
-        BINARY_OP(NUMBER_VAL, -);
-        break;
-      case OP_MULTIPLY:
-        BINARY_OP(NUMBER_VAL, *);
-        break;
-      case OP_DIVIDE:
-        BINARY_OP(NUMBER_VAL, /);
-        break;
-      case OP_NOT:
-        push(BOOL_VAL(isFalsy(pop())));
-        break;
-      case OP_NEGATE:
-        if (!IS_NUMBER(peek(0))) {
-          runtimeError("Operand must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
+          STORE_FIELD(closure->upvalues[i], frame->closure->upvalues[index]);
         }
-        push(NUMBER_VAL(-AS_NUMBER(pop())));
-        break;
-      case OP_PRINT: {
-        printValue(pop());
-        printf("\n");
-        break;
+        // Capturing can promote the closure before its upvalue.
+        writeBarrier((Obj*)closure, OBJ_VAL(closure->upvalues[i]));
       }
-      case OP_JUMP: {
-        uint16_t offset = READ_SHORT();
-        frame->ip += offset;
-        break;
+      NEXT();
+    }
+    CASE(OP_CLOSE_UPVALUE) {
+      closeUpvalues(vm.stackTop - 1);
+      pop();
+      NEXT();
+    }
+    CASE(OP_RETURN) {
+      Value result = pop();
+      closeUpvalues(slots);
+      vm.frameCount--;
+      if (vm.frameCount == 0) {
+        vm.stackTop = slots;
+        return INTERPRET_OK;
       }
-      case OP_JUMP_IF_FALSE: {
-        uint16_t offset = READ_SHORT();
-        if (isFalsy(peek(0))) frame->ip += offset;
-        break;
+
+      vm.stackTop = slots;
+      push(result);
+      if (vm.frameCount == baseFrame) return INTERPRET_OK;
+      LOAD_FRAME();
+      NEXT();
+    }
+    CASE(OP_CONSTANT_LONG) {
+      push(constants[READ_SHORT()]);
+      NEXT();
+    }
+    CASE(OP_GET_LOCAL_LONG) {
+      uint16_t slot = READ_SHORT();
+      push(slots[slot]);
+      NEXT();
+    }
+    CASE(OP_SET_LOCAL_LONG) {
+      uint16_t slot = READ_SHORT();
+      slots[slot] = peek(0);
+      NEXT();
+    }
+    CASE(OP_GET_GLOBAL_LONG) {
+      uint16_t slot = READ_SHORT();
+      Value value = vm.globalValues.values[slot];
+      if (IS_UNDEFINED(value)) {
+        RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
       }
-      case OP_LOOP: {
-        uint16_t offset = READ_SHORT();
-        frame->ip -= offset;
-        break;
+      push(value);
+      NEXT();
+    }
+    CASE(OP_DEFINE_GLOBAL_LONG) {
+      uint16_t slot = READ_SHORT();
+      snapshotBarrier(vm.globalValues.values[slot]);
+      vm.globalValues.values[slot] = pop();
+      NEXT();
+    }
+    CASE(OP_SET_GLOBAL_LONG) {
+      uint16_t slot = READ_SHORT();
+      if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+        RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
       }
-      case OP_CALL: {
-        int argCount = READ_BYTE();
-        if (!callValue(peek(argCount), argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
+      snapshotBarrier(vm.globalValues.values[slot]);
+      vm.globalValues.values[slot] = vm.stackTop[-1];
+      NEXT();
+    }
+    CASE(OP_GET_UPVALUE_LONG) {
+      uint16_t slot = READ_SHORT();
+      push(*frame->closure->upvalues[slot]->location);
+      NEXT();
+    }
+    CASE(OP_SET_UPVALUE_LONG) {
+      ObjUpvalue* upvalue = frame->closure->upvalues[READ_SHORT()];
+      snapshotBarrier(*upvalue->location);
+      STORE_FIELD(*upvalue->location, peek(0));
+      writeBarrier((Obj*)upvalue, peek(0));
+      NEXT();
+    }
+    CASE(OP_JUMP_LONG) {
+      uint32_t offset = READ_LONG();
+      ip += offset;
+      NEXT();
+    }
+    CASE(OP_JUMP_IF_FALSE_LONG) {
+      uint32_t offset = READ_LONG();
+      if (isFalsy(peek(0))) ip += offset;
+      NEXT();
+    }
+    CASE(OP_LOOP_LONG) {
+      // Only the short form anchors traces.
+      uint32_t offset = READ_LONG();
+      ip -= offset;
+      NEXT();
+    }
+    CASE(OP_CLOSURE_LONG) {
+      ObjFunction* function = AS_FUNCTION(constants[READ_SHORT()]);
+      ObjClosure* closure = closureFor(function);
+      push(OBJ_VAL(closure));
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = READ_BYTE();
+        uint16_t index = READ_SHORT();
+        if (isLocal) {
+          STORE_FIELD(closure->upvalues[i], captureUpvalue(slots + index));
+        } else {
+          STORE_FIELD(closure->upvalues[i], frame->closure->upvalues[index]);
         }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+        // Capturing can promote the closure before its upvalue.
+        writeBarrier((Obj*)closure, OBJ_VAL(closure->upvalues[i]));
       }
-
-      case OP_CLOSURE: {
-        ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-        ObjClosure* closure = newClosure(function);
-        push(OBJ_VAL(closure));
-        for (int i = 0; i < closure->upvalueCount; i++) {
-          uint8_t isLocal = READ_BYTE();
-          uint8_t index = READ_BYTE();
-          if (isLocal) {
-            closure->upvalues[i] = captureUpvalue(frame->slots + index);
-          } else {
-            closure->upvalues[i] = frame->closure->upvalues[index];
-          }
-        }
-        break;
+      NEXT();
+    }
+    CASE(OP_MOVE) {
+      uint8_t dest = READ_BYTE();
+      STORE_DEST(READ_REGISTER());
+      NEXT();
+    }
+    CASE(OP_LOADK) {
+      uint8_t dest = READ_BYTE();
+      STORE_DEST(READ_CONSTANT());
+      NEXT();
+    }
+    CASE(OP_ADD_RR) {
+      REGISTER_ADD(READ_REGISTER, push);
+      NEXT();
+    }
+    CASE(OP_ADD_RK) {
+      REGISTER_ADD(READ_CONSTANT, push);
+      NEXT();
+    }
+    CASE(OP_SUBTRACT_RR) {
+      REGISTER_OP(NUMBER_VAL, -, READ_REGISTER, push);
+      NEXT();
+    }
+    CASE(OP_SUBTRACT_RK) {
+      REGISTER_OP(NUMBER_VAL, -, READ_CONSTANT, push);
+      NEXT();
+    }
+    CASE(OP_MULTIPLY_RR) {
+      REGISTER_OP(NUMBER_VAL, *, READ_REGISTER, push);
+      NEXT();
+    }
+    CASE(OP_MULTIPLY_RK) {
+      REGISTER_OP(NUMBER_VAL, *, READ_CONSTANT, push);
+      NEXT();
+    }
+    CASE(OP_DIVIDE_RR) {
+      REGISTER_OP(NUMBER_VAL, /, READ_REGISTER, push);
+      NEXT();
+    }
+    CASE(OP_DIVIDE_RK) {
+      REGISTER_OP(NUMBER_VAL, /, READ_CONSTANT, push);
+      NEXT();
+    }
+    CASE(OP_GREATER_RR) {
+      REGISTER_OP(BOOL_VAL, >, READ_REGISTER, push);
+      NEXT();
+    }
+    CASE(OP_GREATER_RK) {
+      REGISTER_OP(BOOL_VAL, >, READ_CONSTANT, push);
+      NEXT();
+    }
+    CASE(OP_LESS_RR) {
+      REGISTER_OP(BOOL_VAL, <, READ_REGISTER, push);
+      NEXT();
+    }
+    CASE(OP_LESS_RK) {
+      REGISTER_OP(BOOL_VAL, <, READ_CONSTANT, push);
+      NEXT();
+    }
+    CASE(OP_ADD_RRR) {
+      uint8_t dest = READ_BYTE();
+      REGISTER_ADD(READ_REGISTER, STORE_DEST);
+      NEXT();
+    }
+    CASE(OP_ADD_RRK) {
+      uint8_t dest = READ_BYTE();
+      REGISTER_ADD(READ_CONSTANT, STORE_DEST);
+      NEXT();
+    }
+    CASE(OP_SUBTRACT_RRR) {
+      uint8_t dest = READ_BYTE();
+      REGISTER_OP(NUMBER_VAL, -, READ_REGISTER, STORE_DEST);
+      NEXT();
+    }
+    CASE(OP_SUBTRACT_RRK) {
+      uint8_t dest = READ_BYTE();
+      REGISTER_OP(NUMBER_VAL, -, READ_CONSTANT, STORE_DEST);
+      NEXT();
+    }
+    CASE(OP_MULTIPLY_RRR) {
+      uint8_t dest = READ_BYTE();
+      REGISTER_OP(NUMBER_VAL, *, READ_REGISTER, STORE_DEST);
+      NEXT();
+    }
+    CASE(OP_MULTIPLY_RRK) {
+      uint8_t dest = READ_BYTE();
+      REGISTER_OP(NUMBER_VAL, *, READ_CONSTANT, STORE_DEST);
+      NEXT();
+    }
+    CASE(OP_DIVIDE_RRR) {
+      uint8_t dest = READ_BYTE();
+      REGISTER_OP(NUMBER_VAL, /, READ_REGISTER, STORE_DEST);
+      NEXT();
+    }
+    CASE(OP_DIVIDE_RRK) {
+      uint8_t dest = READ_BYTE();
+      REGISTER_OP(NUMBER_VAL, /, READ_CONSTANT, STORE_DEST);
+      NEXT();
+    }
+    CASE(OP_ADD_NUM) {
+      QUICK_OP(NUMBER_VAL, +, IS_NUMBER, OP_ADD);
+      NEXT();
+    }
+    CASE(OP_ADD_STR) {
+      if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+        concatenate();
+      } else {
+        ip[-1] = OP_ADD;
+        ip--;
       }
-      case OP_CLOSE_UPVALUE:
-        closeUpvalues(vm.stackTop - 1);
-        pop();
-        break;
-      case OP_RETURN: {
-        Value result = pop();
-        closeUpvalues(frame->slots);
-        vm.frameCount--;
-        if (vm.frameCount == 0) {
-          pop();
-          return INTERPRET_OK;
-        }
-
-        vm.stackTop = frame->slots;
-        push(result);
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+      NEXT();
+    }
+    CASE(OP_SUBTRACT_NUM) {
+      QUICK_OP(NUMBER_VAL, -, IS_NUMBER, OP_SUBTRACT);
+      NEXT();
+    }
+    CASE(OP_MULTIPLY_NUM) {
+      QUICK_OP(NUMBER_VAL, *, IS_NUMBER, OP_MULTIPLY);
+      NEXT();
+    }
+    CASE(OP_DIVIDE_NUM) {
+      QUICK_OP(NUMBER_VAL, /, IS_NUMBER, OP_DIVIDE);
+      NEXT();
+    }
+    CASE(OP_GREATER_NUM) {
+      QUICK_OP(BOOL_VAL, >, IS_NUMBER, OP_GREATER);
+      NEXT();
+    }
+    CASE(OP_LESS_NUM) {
+      QUICK_OP(BOOL_VAL, <, IS_NUMBER, OP_LESS);
+      NEXT();
+    }
+    CASE(OP_CALL_NATIVE) {
+      // A native runs no bytecode, so there is no frame to enter or JIT
+      // code to look for.
+      int argCount = READ_BYTE();
+      Value callee = peek(argCount);
+      if (!IS_NATIVE(callee)) {
+        ip[-2] = OP_CALL;
+        ip -= 2;
+        NEXT();
       }
+      STORE_FRAME();
+      if (!callNative(AS_NATIVE(callee), argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      NEXT();
+    }
+    CASE_UNKNOWN {
+      RUNTIME_ERROR("Unknown opcode %d.", instruction);
+    }
+#ifndef COMPUTED_GOTO
     }
   }
+#endif
 
+#undef LOAD_FRAME
+#undef STORE_FRAME
 #undef READ_BYTE
 #undef READ_SHORT
+#undef READ_LONG
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef GLOBAL_NAME
+#undef RUNTIME_ERROR
 #undef BINARY_OP
+#undef QUICK_OP
+#undef READ_REGISTER
+#undef STORE_DEST
+#undef REGISTER_OP
+#undef REGISTER_ADD
+#undef TRACE_INSTRUCTION
+#ifdef COMPUTED_GOTO
+#undef DISPATCH
+#endif
+#undef CASE
+#undef CASE_UNKNOWN
+#undef NEXT
 }
 
 InterpretResult interpret(const char* source) {
   ObjFunction* function = compile(source);
   if (function == NULL) return INTERPRET_COMPILE_ERROR;
+  return interpretFunction(function);
+}
 
+// Run a script that has already been compiled, or loaded from a bytecode
+// file
+InterpretResult interpretFunction(ObjFunction* function) {
   push(OBJ_VAL(function));
   ObjClosure* closure = newClosure(function);
   pop();
   push(OBJ_VAL(closure));
   call(closure, 0);
 
-  return run();
+  InterpretResult result = run(0);
+  // The compiler and loaders allocate straight into the old generation
+  // without barriers, so nothing they see may still be young or half-way
+  // through a collection.
+  collectYoung();
+  if (vm.gcPhase != GC_IDLE) collectGarbage();
+  return result;
 }
@@ -6,8 +6,19 @@
 #include "helper.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+#define FRAMES_INITIAL 8
+#define STACK_INITIAL 256
+#define DEPTH_DEFAULT 10000
+// Frames a runtime error shows at each end of the stack before leaving out
+// the ones between
+#define TRACE_FRAMES 20
+#define NURSERY_DEFAULT (512 * 1024)
+#define GC_WORK_DEFAULT 1024
+// The C stack size assumed when it has no limit
+#define NATIVE_STACK_DEFAULT (8 * 1024 * 1024)
+// Values the runtime may push above a function's own stack window: operands
+// of register-form instructions and strings it is interning.
+#define STACK_SLACK 4
 
 typedef struct {
   ObjClosure* closure;
@@ -16,19 +27,65 @@ typedef struct {
 } CallFrame;
 
 typedef struct {
-  CallFrame frames[FRAMES_MAX];
+  int maxDepth;  // Frames a call may push before it is a stack overflow.
+  // Bytes of young objects to allocate between minor collections, or 0 to
+  // allocate everything in the old generation.
+  size_t nurserySize;
+  // How much of a collection of the old generation to do each time the
+  // heap grows by a step: objects marked or swept, or if gcStepMicros is
+  // not 0, microseconds. With both 0 it is collected all at once.
+  int gcStepWork;
+  int gcStepMicros;
+  // Whether a collection stepped this way leaves its marking to a thread of
+  // its own, running alongside the script. Sweeping is still stepped.
+  bool gcThread;
+  // Whether the arenas the heap's pages are cut from ask for huge pages.
+  bool hugePages;
+} VMOptions;
+
+typedef enum {
+  GC_IDLE,
+  GC_MARK,   // Objects reached are gray or black, and barriers shade what
+             // stores overwrite.
+  GC_SWEEP,  // Unmarked objects are being freed.
+} GcPhase;
+
+// One entry in a table of natives for defineNatives(), which ends at the
+// first entry without a name
+typedef struct {
+  const char* name;
+  NativeFn function;
+  int arity;  // Arguments it takes, or -1 for any number.
+  // Its result depends only on its arguments and it has no effects, so a
+  // call with constant arguments can be made once, at compile time.
+  bool pure;
+} NativeDef;
+
+typedef struct {
+  // Frames are allocated in blocks that never move, so a CallFrame* stays
+  // valid while deeper calls grow the table; the value stack moves instead.
+  CallFrame** frames;
   int frameCount;
+  int frameCapacity;
 
-  Value stack[STACK_MAX];
+  Value* stack;
   Value* stackTop;
-  Table globals;
+  int stackCapacity;
+  Value* stackLimit;  // Highest top a function's window may reach.
+  Table globalSlots;         // Global name -> index into globalValues.
+  ValueArray globalNames;    // Index -> name, for errors and the disassembler.
+  ValueArray globalValues;   // UNDEFINED_VAL until the global is defined.
   Table strings;
   ObjString* initString;
   ObjUpvalue* openUpvalues;
+  char nativeMessage[256];  // The error nativeError() was last given.
 
   size_t bytesAllocated;
-  size_t nextGC;
-  Obj* objects;
+  size_t nextGC;  // While a collection is under way, when to do more of it.
+  GcPhase gcPhase;
+  Obj** remembered;  // Old objects a barrier saw store a young one.
+  int rememberedCount;
+  int rememberedCapacity;
   int grayCount;
   int grayCapacity;
   Obj** grayStack;
@@ -41,10 +98,28 @@ typedef enum {
 } InterpretResult;
 
 extern VM vm;
+extern VMOptions vmOptions;
 
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* source);
+InterpretResult interpretFunction(ObjFunction* function);
+int globalSlot(ObjString* name);
+void defineNatives(const NativeDef* natives);
+void runtimeError(const char* format, ...);
+bool nativeError(const char* format, ...);
+bool callNative(ObjNative* native, int argCount);
+bool callValue(Value callee, int argCount);
+bool tailCallValue(Value callee, int argCount);
+ObjUpvalue* captureUpvalue(Value* local);
+void closeUpvalues(Value* last);
+bool isFalsy(Value value);
+void concatenate();
+InterpretResult run(int baseFrame);
+// Whether code compiled to native, which nests a C frame for each call it
+// makes, may nest another before the C stack runs out. When it may not, it
+// leaves the call to run(), which calls without recursing.
+bool nativeStackHasRoom();
 void push(Value value);
 Value pop();
 